@@ -18,6 +18,12 @@ namespace PcmHacking
         private readonly Protocol protocol;
         private readonly ILogger logger;
 
+        /// <summary>
+        /// How many blocks the kernel may send past the last one that we
+        /// acknowledged, during a streaming read.
+        /// </summary>
+        private const int ReadStreamWindow = 4;
+
         public CKernelReader(Vehicle vehicle, PcmInfo pcmInfo, ILogger logger)
         {
             this.vehicle = vehicle;
@@ -130,10 +136,22 @@ namespace PcmHacking
                     logger.AddUserMessage("Flash chip: " + flashChip.ToString());
                 }
 
+                // Erased chunks don't need to be read.
+                UInt32 kernelVersion = await this.vehicle.GetKernelVersion();
+                KernelFeatures features = await this.vehicle.GetKernelFeatures(kernelVersion, cancellationToken);
+                bool[] blankChunks = null;
+                if (Protocol.SupportsBlankScan(kernelVersion) && ((features & KernelFeatures.BlankScan) != 0))
+                {
+                    blankChunks = await this.vehicle.QueryBlankChunks(pcmInfo.ImageSize, cancellationToken);
+                }
+
+                bool streaming = Protocol.SupportsStreamingRead(kernelVersion) && ((features & KernelFeatures.StreamingRead) != 0);
+
                 await this.vehicle.SetDeviceTimeout(TimeoutScenario.ReadMemoryBlock);
 
                 byte[] image = new byte[pcmInfo.ImageSize];
                 int retryCount = 0;
+                int skippedBytes = 0;
                 int startAddress = 0;
                 int bytesRemaining = pcmInfo.ImageSize;
                 int blockSize = this.vehicle.DeviceMaxReceiveSize - 10 - 2; // allow space for the header and block checksum
@@ -150,6 +168,20 @@ namespace PcmHacking
                         return Response.Create(ResponseStatus.Cancelled, (Stream)null);
                     }
 
+                    int chunk = startAddress / Protocol.BlankScanChunkSize;
+                    if ((blankChunks != null) && (chunk < blankChunks.Length) && blankChunks[chunk])
+                    {
+                        int chunkEnd = Math.Min((chunk + 1) * Protocol.BlankScanChunkSize, pcmInfo.ImageSize);
+                        for (int index = startAddress; index < chunkEnd; index++)
+                        {
+                            image[index] = 0xFF;
+                        }
+
+                        skippedBytes += chunkEnd - startAddress;
+                        startAddress = chunkEnd;
+                        continue;
+                    }
+
                     // The read kernel needs a short message here for reasons unknown. Without it, it will RX 2 messages then drop one.
                     await this.vehicle.ForceSendToolPresentNotification();
 
@@ -169,9 +201,57 @@ namespace PcmHacking
                         startTime = DateTime.Now;
                     }
 
+                    if (streaming)
+                    {
+                        // Everything up to the next blank chunk, with one request.
+                        int streamEnd = pcmInfo.ImageSize;
+                        for (int next = chunk + 1; (blankChunks != null) && (next < blankChunks.Length); next++)
+                        {
+                            if (blankChunks[next])
+                            {
+                                streamEnd = Math.Min(next * Protocol.BlankScanChunkSize, streamEnd);
+                                break;
+                            }
+                        }
+
+                        Response<int> streamResponse = await TryReadStream(
+                            image,
+                            startAddress,
+                            streamEnd - startAddress,
+                            blockSize,
+                            startTime,
+                            cancellationToken);
+                        if (streamResponse.Status == ResponseStatus.Cancelled)
+                        {
+                            return Response.Create(ResponseStatus.Cancelled, (Stream)null);
+                        }
+
+                        startAddress += streamResponse.Value;
+                        retryCount += streamResponse.RetryCount;
+
+                        if (streamResponse.Status != ResponseStatus.Success)
+                        {
+                            // Read the rest of the image one block at a time.
+                            this.logger.AddDebugMessage("Streaming read stopped: " + streamResponse.Status);
+                            this.vehicle.ClearDeviceMessageQueue();
+                            streaming = false;
+                        }
+
+                        logger.StatusUpdateRetryCount((retryCount > 0) ? retryCount.ToString() + ((retryCount > 1) ? " Retries" : " Retry") : string.Empty);
+                        continue;
+                    }
+
+                    // Stop short of the next chunk if it's blank.
+                    int readSize = blockSize;
+                    int nextChunk = chunk + 1;
+                    if ((blankChunks != null) && (nextChunk < blankChunks.Length) && blankChunks[nextChunk])
+                    {
+                        readSize = Math.Min(readSize, (nextChunk * Protocol.BlankScanChunkSize) - startAddress);
+                    }
+
                     Response<bool> readResponse = await TryReadBlock(
                         image, 
-                        blockSize, 
+                        readSize, 
                         startAddress,
                         startTime,
                         cancellationToken);
@@ -181,17 +261,21 @@ namespace PcmHacking
                             string.Format(
                                 "Unable to read block from {0} to {1}",
                                 startAddress,
-                                (startAddress + blockSize) - 1));
+                                (startAddress + readSize) - 1));
                         return new Response<Stream>(ResponseStatus.Error, null);
                     }
 
-                    startAddress += blockSize;
+                    startAddress += readSize;
                     retryCount += readResponse.RetryCount;
 
                     logger.StatusUpdateRetryCount((retryCount > 0) ? retryCount.ToString() + ((retryCount > 1) ? " Retries" : " Retry") : string.Empty);
                 }
 
                 logger.AddUserMessage("Read complete.");
+                if (skippedBytes > 0)
+                {
+                    logger.AddUserMessage(string.Format("Skipped {0:n0} bytes of erased flash.", skippedBytes));
+                }
                 Utility.ReportRetryCount("Read", retryCount, pcmInfo.ImageSize, this.logger);
 
                 if (this.pcmInfo.FlashCRCSupport && this.pcmInfo.FlashIDSupport)
@@ -204,6 +288,7 @@ namespace PcmHacking
                         this.vehicle,
                         this.protocol,
                         this.pcmInfo,
+                        features,
                         this.logger);
 
                     logger.StatusUpdateReset();
@@ -223,6 +308,11 @@ namespace PcmHacking
                     }
                 }
 
+                if ((features & KernelFeatures.Statistics) != 0)
+                {
+                    await this.vehicle.ReportKernelStatistics(cancellationToken);
+                }
+
                 await this.vehicle.Cleanup(); // Not sure why this does not get called in the finally block on successfull read?
 
                 MemoryStream stream = new MemoryStream(image);
@@ -263,7 +353,7 @@ namespace PcmHacking
                 }
 
                 Response<byte[]> readResponse = await this.vehicle.ReadMemory(
-                    () => this.protocol.CreateReadRequest(startAddress, length),
+                    () => this.protocol.CreateReadRequest(startAddress, length, true),
                     (payloadMessage) => this.protocol.ParsePayload(payloadMessage, length, startAddress),
                     cancellationToken);
 
@@ -286,33 +376,145 @@ namespace PcmHacking
                 }
 
                 Buffer.BlockCopy(payload, 0, image, startAddress, payload.Length);
+                ReportProgress(image, startAddress, payload.Length, startTime);
 
-                TimeSpan elapsed = DateTime.Now - startTime;
-                string timeRemaining = string.Empty;
+                return Response.Create(ResponseStatus.Success, true, retryCount);
+            }
+
+            return Response.Create(ResponseStatus.Error, false, retryCount);
+        }
+
+        /// <summary>
+        /// Read a range with one streaming request. Blocks that arrive damaged,
+        /// or not at all, are requested again.
+        /// </summary>
+        /// <returns>How many bytes from the start of the range were read.</returns>
+        private async Task<Response<int>> TryReadStream(
+            byte[] image,
+            int startAddress,
+            int length,
+            int blockSize,
+            DateTime startTime,
+            CancellationToken cancellationToken)
+        {
+            this.logger.AddDebugMessage(string.Format("Streaming from {0} / 0x{0:X}, length {1} / 0x{1:X}", startAddress, length));
 
-                UInt32 bytesPerSecond = 0;
-                UInt32 bytesRemaining = 0;
+            int blocks = (length + blockSize - 1) / blockSize;
+            bool[] received = new bool[blocks];
+            bool[] requested = new bool[blocks];
+            int acknowledged = 0;
+            int retryCount = 0;
+            int timeouts = 0;
 
-                bytesPerSecond = (UInt32)(startAddress / elapsed.TotalSeconds);
-                bytesRemaining = (UInt32)(image.Length - startAddress);
+            if (!await this.vehicle.SendMessage(this.protocol.CreateReadStreamRequest(startAddress, length, blockSize, ReadStreamWindow)))
+            {
+                return Response.Create(ResponseStatus.Error, 0);
+            }
 
-                // Don't divide by zero.
-                if (bytesPerSecond > 0)
+            while (acknowledged < blocks)
+            {
+                int bytesRead = Math.Min(acknowledged * blockSize, length);
+                if (cancellationToken.IsCancellationRequested)
                 {
-                    UInt32 secondsRemaining = (UInt32)(bytesRemaining / bytesPerSecond);
-                    timeRemaining = TimeSpan.FromSeconds(secondsRemaining).ToString("mm\\:ss");
+                    return Response.Create(ResponseStatus.Cancelled, bytesRead, retryCount);
                 }
 
-                logger.StatusUpdateActivity($"Reading {payload.Length} bytes from 0x{startAddress:X6}");
-                logger.StatusUpdatePercentDone((startAddress * 100 / image.Length > 0) ? $"{startAddress * 100 / image.Length}%" : string.Empty);
-                logger.StatusUpdateTimeRemaining($"T-{timeRemaining}");
-                logger.StatusUpdateKbps((bytesPerSecond > 0) ? $"{(double)bytesPerSecond * 8.00 / 1000.00:0.00} Kbps" : string.Empty);
-                logger.StatusUpdateProgressBar((double)(startAddress + payload.Length) / image.Length, true);
+                Message message = await this.vehicle.ReceiveMessage();
+                if (message == null)
+                {
+                    // Either the next block or our last message got lost.
+                    if (++timeouts > Vehicle.MaxSendAttempts)
+                    {
+                        return Response.Create(ResponseStatus.Timeout, bytesRead, retryCount);
+                    }
 
-                return Response.Create(ResponseStatus.Success, true, retryCount);
+                    retryCount++;
+                    await this.vehicle.SendMessage(this.protocol.CreateReadStreamResend(acknowledged));
+                    continue;
+                }
+
+                Response<byte[]> payload = this.protocol.ParseReadStreamPayload(message, startAddress, length, blockSize, out int sequence);
+                if (payload.Status == ResponseStatus.Refused)
+                {
+                    return Response.Create(ResponseStatus.Refused, bytesRead, retryCount);
+                }
+
+                if (sequence < 0)
+                {
+                    // Not part of the stream.
+                    continue;
+                }
+
+                if (payload.Status != ResponseStatus.Success)
+                {
+                    this.logger.AddDebugMessage("Unable to process block " + sequence + ": " + payload.Status);
+                    retryCount++;
+                    await this.vehicle.SendMessage(this.protocol.CreateReadStreamResend(sequence));
+                    continue;
+                }
+
+                timeouts = 0;
+                if (!received[sequence])
+                {
+                    Buffer.BlockCopy(payload.Value, 0, image, startAddress + (sequence * blockSize), payload.Value.Length);
+                    received[sequence] = true;
+                }
+
+                // Blocks are sent in order, so any gap before this one was lost.
+                for (int missing = acknowledged; missing < sequence; missing++)
+                {
+                    if (!received[missing] && !requested[missing])
+                    {
+                        retryCount++;
+                        requested[missing] = true;
+                        await this.vehicle.SendMessage(this.protocol.CreateReadStreamResend(missing));
+                    }
+                }
+
+                int previous = acknowledged;
+                while ((acknowledged < blocks) && received[acknowledged])
+                {
+                    acknowledged++;
+                }
+
+                if (acknowledged > previous)
+                {
+                    await this.vehicle.SendMessage(this.protocol.CreateReadStreamAcknowledge(acknowledged));
+
+                    int start = startAddress + (previous * blockSize);
+                    ReportProgress(image, start, Math.Min(acknowledged * blockSize, length) - (previous * blockSize), startTime);
+                }
             }
 
-            return Response.Create(ResponseStatus.Error, false, retryCount);
+            return Response.Create(ResponseStatus.Success, length, retryCount);
+        }
+
+        /// <summary>
+        /// Update the progress display after a read.
+        /// </summary>
+        private void ReportProgress(byte[] image, int startAddress, int length, DateTime startTime)
+        {
+            TimeSpan elapsed = DateTime.Now - startTime;
+            string timeRemaining = string.Empty;
+
+            UInt32 bytesPerSecond = 0;
+            UInt32 bytesRemaining = 0;
+
+            bytesPerSecond = (UInt32)(startAddress / elapsed.TotalSeconds);
+            bytesRemaining = (UInt32)(image.Length - startAddress);
+
+            // Don't divide by zero.
+            if (bytesPerSecond > 0)
+            {
+                UInt32 secondsRemaining = (UInt32)(bytesRemaining / bytesPerSecond);
+                timeRemaining = TimeSpan.FromSeconds(secondsRemaining).ToString("mm\\:ss");
+            }
+
+            logger.StatusUpdateActivity($"Reading {length} bytes from 0x{startAddress:X6}");
+            logger.StatusUpdatePercentDone((startAddress * 100 / image.Length > 0) ? $"{startAddress * 100 / image.Length}%" : string.Empty);
+            logger.StatusUpdateTimeRemaining($"T-{timeRemaining}");
+            logger.StatusUpdateKbps((bytesPerSecond > 0) ? $"{(double)bytesPerSecond * 8.00 / 1000.00:0.00} Kbps" : string.Empty);
+            logger.StatusUpdateProgressBar((double)(startAddress + length) / image.Length, true);
         }
     }
 }
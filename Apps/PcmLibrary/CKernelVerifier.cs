@@ -15,6 +15,7 @@ namespace PcmHacking
         private readonly Vehicle vehicle;
         private readonly Protocol protocol;
         private readonly PcmInfo pcmInfo;
+        private readonly KernelFeatures features;
         private readonly ILogger logger;
 
         public CKernelVerifier(
@@ -23,6 +24,7 @@ namespace PcmHacking
             Vehicle vehicle, 
             Protocol protocol, 
             PcmInfo pcmInfo,
+            KernelFeatures features,
             ILogger logger)
         {
             this.image = image;
@@ -30,6 +32,7 @@ namespace PcmHacking
             this.vehicle = vehicle;
             this.protocol = protocol;
             this.pcmInfo = pcmInfo;
+            this.features = features;
             this.logger = logger;
         }
 
@@ -48,6 +51,85 @@ namespace PcmHacking
             }
         }
 
+        /// <summary>
+        /// Get the CRCs for the relevant ranges from the PCM, with as few queries as possible.
+        /// Returns the ranges that the kernel provided CRCs for. If the kernel doesn't support
+        /// batch queries, that will be none of them.
+        /// </summary>
+        private async Task<HashSet<MemoryRange>> GetCrcBatches(BlockType blockTypes, CancellationToken cancellationToken)
+        {
+            // The kernel doesn't reply until it has the CRC for every range in the batch, and
+            // it processes at least 8kb per single-range CRC query in less than one ReadCrc
+            // timeout. So limiting each batch to this size and allowing this many timeouts
+            // keeps each batch within the time the single-range queries would have needed.
+            const UInt32 maxBatchBytes = 128 * 1024;
+            const int maxTimeouts = 20;
+            int maxBatchRanges = Protocol.GetCrcBatchRangeLimit(this.vehicle.DeviceMaxFlashWriteSendSize, this.vehicle.DeviceMaxReceiveSize);
+
+            HashSet<MemoryRange> completed = new HashSet<MemoryRange>();
+            List<MemoryRange> batch = new List<MemoryRange>();
+            UInt32 batchBytes = 0;
+
+            foreach (MemoryRange range in this.ranges)
+            {
+                if (((range.Type & blockTypes) == 0) || (range.Address >= this.pcmInfo.ImageSize))
+                {
+                    continue;
+                }
+
+                if ((batch.Count > 0) && ((batch.Count == maxBatchRanges) || (batchBytes + range.Size > maxBatchBytes)))
+                {
+                    if (!await this.GetCrcBatch(batch, maxTimeouts, completed, cancellationToken))
+                    {
+                        return completed;
+                    }
+
+                    batch.Clear();
+                    batchBytes = 0;
+                }
+
+                batch.Add(range);
+                batchBytes += range.Size;
+            }
+
+            if (batch.Count > 0)
+            {
+                await this.GetCrcBatch(batch, maxTimeouts, completed, cancellationToken);
+            }
+
+            return completed;
+        }
+
+        /// <summary>
+        /// Send one CRC batch query, and record the results.
+        /// </summary>
+        private async Task<bool> GetCrcBatch(List<MemoryRange> batch, int maxTimeouts, HashSet<MemoryRange> completed, CancellationToken cancellationToken)
+        {
+            logger.StatusUpdateActivity($"Processing CRC for range {batch[0].Address:X6}-{batch[batch.Count - 1].Address + (batch[batch.Count - 1].Size - 1):X6}");
+
+            await this.vehicle.SendToolPresentNotification();
+            Query<UInt32[]> query = this.vehicle.CreateQuery<UInt32[]>(
+                () => this.protocol.CreateCrcBatchQuery(batch),
+                (message) => this.protocol.ParseCrcBatch(message, batch),
+                cancellationToken);
+            query.MaxTimeouts = maxTimeouts;
+
+            Response<UInt32[]> response = await query.Execute();
+            if (response.Status != ResponseStatus.Success)
+            {
+                this.logger.AddDebugMessage("CRC batch query failed: " + response.Status.ToString() + ". Querying one range at a time.");
+                return false;
+            }
+
+            for (int index = 0; index < batch.Count; index++)
+            {
+                batch[index].ActualCrc = response.Value[index];
+                completed.Add(batch[index]);
+            }
+
+            return true;
+        }
+
         /// <summary>
         /// Compare CRCs from the file to CRCs from the PCM.
         /// </summary>
@@ -175,6 +257,14 @@ namespace PcmHacking
 
                 await this.vehicle.SetDeviceTimeout(TimeoutScenario.ReadCrc);
 
+                // Get as many CRCs as possible with batch queries, if the kernel has
+                // them. Anything left over is queried one range at a time below.
+                HashSet<MemoryRange> batchResults = new HashSet<MemoryRange>();
+                if ((this.features & KernelFeatures.CrcBatch) != 0)
+                {
+                    batchResults = await this.GetCrcBatches(blockTypes, cancellationToken);
+                }
+
                 logger.AddUserMessage("\tRange\t\tFile CRC\t\tPCM CRC\tVerdict\tPurpose");
                 foreach (MemoryRange range in this.ranges)
                 {
@@ -197,15 +287,16 @@ namespace PcmHacking
 
                     await this.vehicle.SendToolPresentNotification();
                     this.vehicle.ClearDeviceMessageQueue();
-                    bool success = false;
-                    UInt32 crc = 0;
+                    bool success = batchResults.Contains(range);
+                    UInt32 crc = range.ActualCrc;
 
-                    // Each poll of the pcm causes it to CRC 16kb of segment data.
+                    // Each poll of the pcm causes it to CRC 16kb of segment data, and the
+                    // kernel keeps working on the CRC while it waits for the next poll.
                     // When the segment sum is available it is returned.
                     int retryDelay = 50;
                     int maxAttempts = 50; // Logged highs of 38 on 1m P12, the rest are a good deal lower.
                     Message query = this.protocol.CreateCrcQuery(range.Address, range.Size);
-                    for (int segment = 0; segment < maxAttempts; segment++)
+                    for (int segment = 0; !success && (segment < maxAttempts); segment++)
                     {
                         logger.StatusUpdateActivity($"Processing CRC for range {range.Address:X6}-{range.Address + (range.Size - 1):X6}");
                         logger.StatusUpdateProgressBar((double)segment / maxAttempts, true);
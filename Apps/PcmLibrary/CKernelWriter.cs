@@ -30,6 +30,69 @@ namespace PcmHacking
         private readonly WriteType writeType;
         private readonly ILogger logger;
 
+        /// <summary>
+        /// Set when the running kernel can expand compressed writes.
+        /// </summary>
+        private bool compressWrites;
+
+        /// <summary>
+        /// Set when the running kernel can erase in the background.
+        /// </summary>
+        private bool backgroundErase;
+
+        /// <summary>
+        /// Set after a background erase starts, until WaitForErase confirms
+        /// that it finished.
+        /// </summary>
+        private bool eraseInProgress;
+
+        /// <summary>
+        /// When to give up on the background erase.
+        /// </summary>
+        private DateTime eraseDeadline;
+
+        /// <summary>
+        /// Set when the running kernel can erase a list of blocks at once.
+        /// </summary>
+        private bool batchErase;
+
+        /// <summary>
+        /// Set when the running kernel can erase the whole chip with one request.
+        /// </summary>
+        private bool fullErase;
+
+        /// <summary>
+        /// Set when the running kernel sends progress frames during long flash
+        /// operations, so they can use the short FlashProgress timeout.
+        /// </summary>
+        private bool progressFrames;
+
+        /// <summary>
+        /// Set when the running kernel can program patch lists without erasing.
+        /// </summary>
+        private bool patchWrites;
+
+        /// <summary>
+        /// Set when the running kernel can rewrite a block from RAM, given only the changes.
+        /// </summary>
+        private bool sectorRewrites;
+
+        /// <summary>
+        /// Optional features that the running kernel was built with.
+        /// </summary>
+        private KernelFeatures features;
+
+        /// <summary>
+        /// Size of the pieces that UpdateMemoryRange compares, using CRCs from the PCM.
+        /// </summary>
+        private const UInt32 PatchChunkSize = 1024;
+
+        /// <summary>
+        /// How long to wait for a background erase. Block erases typically take
+        /// about a second, but the data sheets allow much longer.
+        /// </summary>
+        private static readonly TimeSpan MaxEraseTime = TimeSpan.FromSeconds(20);
+
         public CKernelWriter(Vehicle vehicle, PcmInfo pcmInfo, Protocol protocol, WriteType writeType, ILogger logger)
         {
             this.vehicle = vehicle;
@@ -146,6 +209,30 @@ namespace PcmHacking
                     return false;
                 }
 
+                // Only newer C kernels can expand compressed blocks or erase in
+                // the background, and the P01 and P10 kernels may be built
+                // without those features. The version passed in is zero if we
+                // just uploaded the kernel, so ask again.
+                UInt32 runningVersion = await this.vehicle.GetKernelVersion();
+                this.features = await this.vehicle.GetKernelFeatures(runningVersion, cancellationToken);
+                this.compressWrites = Protocol.SupportsCompressedWrite(runningVersion) && ((this.features & KernelFeatures.CompressedWrite) != 0);
+                if (this.compressWrites)
+                {
+                    this.logger.AddDebugMessage("Kernel supports compressed writes.");
+                }
+
+                this.backgroundErase = Protocol.SupportsBackgroundErase(runningVersion) && ((this.features & KernelFeatures.BackgroundErase) != 0);
+                if (this.backgroundErase)
+                {
+                    this.logger.AddDebugMessage("Kernel supports background erase.");
+                }
+
+                this.batchErase = Protocol.SupportsBatchErase(runningVersion) && ((this.features & KernelFeatures.BatchErase) != 0);
+                this.fullErase = Protocol.SupportsFullErase(runningVersion) && ((this.features & KernelFeatures.FullErase) != 0);
+                this.patchWrites = Protocol.SupportsPatchWrite(runningVersion) && ((this.features & KernelFeatures.PatchWrite) != 0);
+                this.sectorRewrites = Protocol.SupportsSectorRewrite(runningVersion) && ((this.features & KernelFeatures.SectorRewrite) != 0);
+                this.progressFrames = Protocol.SupportsProgressFrames(runningVersion) && ((this.features & KernelFeatures.ProgressFrames) != 0) && await this.EnableProgressFrames(cancellationToken);
+
                 success = await this.Write(cancellationToken, image);
 
                 // We only do cleanup after a successful write.
@@ -154,6 +241,11 @@ namespace PcmHacking
                 // TODO: app should check kernel version (not just "is present") and reload only if version is lower than version in kernel file.
                 if (success)
                 {
+                    if ((this.features & KernelFeatures.Statistics) != 0)
+                    {
+                        await this.vehicle.ReportKernelStatistics(cancellationToken);
+                    }
+
                     await this.vehicle.Cleanup();
                 }
 
@@ -260,6 +352,7 @@ namespace PcmHacking
                 this.vehicle,
                 this.protocol,
                 this.pcmInfo,
+                this.features,
                 this.logger);
 
             bool allRangesMatch = false;
@@ -303,26 +396,67 @@ namespace PcmHacking
                     return true;
                 }
 
+                WritePlan plan = new WritePlan(
+                    flashChip.MemoryRanges,
+                    relevantBlocks,
+                    this.pcmInfo.ImageSize,
+                    this.writeType == WriteType.TestWrite);
+
                 // Stop now if the user only requested a comparison.
                 if (this.writeType == WriteType.Compare)
                 {
+                    // A comparison doubles as a dry run for a full write.
+                    this.logger.AddUserMessage("Dry run, nothing will be written.");
+                    plan.Report(this.logger, this.EstimateWriteBytesPerSecond());
                     this.logger.AddUserMessage("Note that mismatched Parameter blocks are to be expected.");
                     this.logger.AddUserMessage("Parameter data can change every time the PCM is used.");
                     return true;
                 }
 
                 // Erase and rewrite the required memory ranges.
-                DateTime startTime = DateTime.Now;
-                UInt32 totalSize = this.GetTotalSize(flashChip, relevantBlocks);
-                UInt32 bytesRemaining = totalSize;
-                foreach (MemoryRange range in flashChip.MemoryRanges)
+                if (this.writeType != WriteType.TestWrite)
                 {
-                    // We'll send a tool-present message during the erase request.
-                    if (!this.ShouldProcess(range, relevantBlocks))
+                    plan.Report(this.logger, this.EstimateWriteBytesPerSecond());
+                }
+
+                // A range that only changed in a few places may not need to be sent in full.
+                if ((this.patchWrites || this.sectorRewrites) && (this.writeType != WriteType.TestWrite))
+                {
+                    foreach (MemoryRange range in plan.RangesToWrite.ToList())
                     {
-                        continue;
+                        if (await this.UpdateMemoryRange(range, image, cancellationToken))
+                        {
+                            plan.MarkPatched(range);
+                        }
                     }
+                }
 
+                // Erasing every range with one request saves a round trip per
+                // range, and AMD chips erase them all in about the time of one.
+                // If that's the whole chip, the kernel can choose the blocks.
+                bool rangesErased = false;
+                if (this.fullErase &&
+                    (this.writeType != WriteType.TestWrite) &&
+                    plan.CoversChip(flashChip.MemoryRanges, this.pcmInfo.ImageSize, out bool includeBoot, out bool includeParameters))
+                {
+                    rangesErased = await this.EraseChip(plan.RangesToWrite.Count, includeBoot, includeParameters, cancellationToken);
+                }
+
+                if (!rangesErased &&
+                    this.batchErase &&
+                    (this.writeType != WriteType.TestWrite) &&
+                    (plan.RangesToWrite.Count > 1) &&
+                    (plan.RangesToWrite.Count <= Protocol.MaxEraseBatchRanges))
+                {
+                    rangesErased = await this.EraseMemoryRanges(plan.RangesToWrite, cancellationToken);
+                }
+
+                DateTime startTime = DateTime.Now;
+                UInt32 totalSize = plan.BytesToWrite;
+                UInt32 bytesRemaining = totalSize;
+                foreach (MemoryRange range in plan.RangesToWrite)
+                {
+                    // We'll send a tool-present message during the erase request.
                     this.logger.AddUserMessage(
                         string.Format(
                             "Processing range {0:X6}-{1:X6}",
@@ -333,9 +467,9 @@ namespace PcmHacking
                     {
                         this.logger.AddUserMessage("Pretending to erase.");
                     }
-                    else
+                    else if (!rangesErased)
                     {
-                        if (!await this.EraseMemoryRange(range, cancellationToken))
+                        if (!await this.EraseMemoryRange(range, this.backgroundErase, cancellationToken))
                         {
                             return false;
                         }
@@ -398,7 +532,7 @@ namespace PcmHacking
                 {
                     if (range.Type == BlockType.Calibration)
                     {
-                        await this.EraseMemoryRange(range, cancellationToken);
+                        await this.EraseMemoryRange(range, false, cancellationToken);
                     }
                 }
             }
@@ -423,38 +557,312 @@ namespace PcmHacking
             return false;
         }
 
-        private UInt32 GetTotalSize(FlashChip chip, BlockType relevantBlocks)
+        /// <summary>
+        /// Rough flash write throughput, for the write plan's time estimates.
+        /// </summary>
+        private double EstimateWriteBytesPerSecond()
+        {
+            // Assume 9 bits per byte on the wire, like the device timeout estimates.
+            double bitsPerSecond = this.vehicle.Enable4xReadWrite ? 41600 : 10400;
+            int payloadSize = this.vehicle.DeviceMaxFlashWriteSendSize - 12; // Headers use 10 bytes, sum uses 2 bytes.
+            return (bitsPerSecond / 9) * payloadSize / (payloadSize + 12);
+        }
+
+        /// <summary>
+        /// Erase a block in the flash memory.
+        /// </summary>
+        /// <param name="background">
+        /// Just start the erase. The kernel writes the first block of the range
+        /// once the erase finishes, and WriteMemoryRange waits for it.
+        /// </param>
+        private async Task<bool> EraseMemoryRange(MemoryRange range, bool background, CancellationToken cancellationToken)
+        {
+            this.logger.AddUserMessage("Erasing.");
+            this.eraseInProgress = false;
+
+            if (background)
+            {
+                await this.vehicle.SetDeviceTimeout(TimeoutScenario.ReadProperty);
+                Query<byte> startRequest = this.vehicle.CreateQuery<byte>(
+                     () => this.protocol.CreateFlashEraseStartRequest(range.Address),
+                     this.protocol.ParseFlashEraseStart,
+                     cancellationToken);
+
+                startRequest.MaxTimeouts = 3;
+                Response<byte> startResponse = await startRequest.Execute();
+                if (startResponse.Status == ResponseStatus.Success)
+                {
+                    this.eraseInProgress = true;
+                    this.eraseDeadline = DateTime.Now + MaxEraseTime;
+                    return true;
+                }
+
+                this.logger.AddDebugMessage("Unable to start background erase: " + startResponse.Status.ToString());
+            }
+
+            await this.vehicle.SetDeviceTimeout(this.progressFrames ? TimeoutScenario.FlashProgress : TimeoutScenario.EraseMemoryBlock);
+            Query<byte> eraseRequest = this.vehicle.CreateQuery<byte>(
+                 () => this.protocol.CreateFlashEraseBlockRequest(range.Address),
+                 this.protocol.ParseFlashEraseBlock,
+                 cancellationToken);
+
+            eraseRequest.MaxTimeouts = 3;
+            eraseRequest.Progress = this.ReportProgress;
+            Response<byte> eraseResponse = await eraseRequest.Execute();
+
+            if (eraseResponse.Status != ResponseStatus.Success)
+            {
+                this.logger.AddUserMessage("Unable to erase flash memory: " + eraseResponse.Status.ToString());
+                this.RequestDebugLogs(cancellationToken);
+                return false;
+            }
+
+            if (eraseResponse.Value != 0x00)
+            {
+                this.logger.AddUserMessage("Unable to erase flash memory. Code: " + eraseResponse.Value.ToString("X2"));
+                this.RequestDebugLogs(cancellationToken);
+                return false;
+            }
+
+            return true;
+        }
+
+        /// <summary>
+        /// Try to bring a range up to date by sending only the chunks that
+        /// differ from the file. If the file only clears bits in those chunks,
+        /// which is common when a change just fills in blank space, they're
+        /// programmed without an erase. Otherwise the kernel may be able to
+        /// erase and reprogram the range from its own copy, with the chunks
+        /// applied.
+        /// </summary>
+        /// <returns>True if the range now matches the file.</returns>
+        private async Task<bool> UpdateMemoryRange(MemoryRange range, byte[] image, CancellationToken cancellationToken)
+        {
+            List<MemoryRange> changed = await this.GetChangedChunks(range, image, cancellationToken);
+            if ((changed == null) || (changed.Count == 0))
+            {
+                return false;
+            }
+
+            // If most of the range changed, the patches are unlikely to work,
+            // and sending them would cost about as much as the rewrite. The
+            // patches are only sent once the PCM's data shows they'll work.
+            if (this.patchWrites &&
+                (changed.Count * PatchChunkSize * 2 <= range.Size) &&
+                await this.ChunksOnlyClearBits(changed, image, cancellationToken) &&
+                await this.PatchChunks(changed, image, cancellationToken))
+            {
+                this.logger.AddUserMessage(
+                    string.Format(
+                        "Patched range {0:X6}-{1:X6} without erasing.",
+                        range.Address,
+                        range.Address + (range.Size - 1)));
+                return true;
+            }
+
+            if (this.sectorRewrites && await this.RewriteMemoryRange(range, image, changed, cancellationToken))
+            {
+                this.logger.AddUserMessage(
+                    string.Format(
+                        "Rewrote range {0:X6}-{1:X6} in the PCM, sending {2} changed chunks.",
+                        range.Address,
+                        range.Address + (range.Size - 1),
+                        changed.Count));
+                return true;
+            }
+
+            return false;
+        }
+
+        /// <summary>
+        /// Find the chunks of a range that differ from the file, using CRCs from the PCM.
+        /// </summary>
+        /// <returns>Null if the PCM didn't provide the CRCs.</returns>
+        private async Task<List<MemoryRange>> GetChangedChunks(MemoryRange range, byte[] image, CancellationToken cancellationToken)
+        {
+            List<MemoryRange> chunks = new List<MemoryRange>();
+            for (UInt32 offset = 0; offset < range.Size; offset += PatchChunkSize)
+            {
+                chunks.Add(new MemoryRange(range.Address + offset, Math.Min(PatchChunkSize, range.Size - offset), range.Type));
+            }
+
+            Crc crc = new Crc();
+            List<MemoryRange> changed = new List<MemoryRange>();
+            int maxBatchRanges = Protocol.GetCrcBatchRangeLimit(this.vehicle.DeviceMaxFlashWriteSendSize, this.vehicle.DeviceMaxReceiveSize);
+            await this.vehicle.SetDeviceTimeout(TimeoutScenario.ReadCrc);
+            for (int first = 0; first < chunks.Count; first += maxBatchRanges)
+            {
+                List<MemoryRange> batch = chunks.GetRange(first, Math.Min(maxBatchRanges, chunks.Count - first));
+
+                await this.vehicle.SendToolPresentNotification();
+                Query<UInt32[]> query = this.vehicle.CreateQuery<UInt32[]>(
+                    () => this.protocol.CreateCrcBatchQuery(batch),
+                    (message) => this.protocol.ParseCrcBatch(message, batch),
+                    cancellationToken);
+                query.MaxTimeouts = 5;
+
+                Response<UInt32[]> response = await query.Execute();
+                if (response.Status != ResponseStatus.Success)
+                {
+                    this.logger.AddDebugMessage("Unable to get chunk CRCs: " + response.Status.ToString());
+                    return null;
+                }
+
+                for (int index = 0; index < batch.Count; index++)
+                {
+                    if (response.Value[index] != crc.GetCrc(image, batch[index].Address, batch[index].Size))
+                    {
+                        changed.Add(batch[index]);
+                    }
+                }
+            }
+
+            this.logger.AddDebugMessage(string.Format("{0} of {1} chunks differ from the file.", changed.Count, chunks.Count));
+            return changed;
+        }
+
+        /// <summary>
+        /// Read chunks back from the PCM, and check that the file only clears
+        /// bits in them. The kernel skips any patch that would set a bit, so
+        /// sending it would just waste the traffic. Blank chunks compress to
+        /// almost nothing, so when a change fills in blank space the check
+        /// costs far less than the patches.
+        /// </summary>
+        /// <returns>True if every chunk can be programmed without an erase.</returns>
+        private async Task<bool> ChunksOnlyClearBits(List<MemoryRange> changed, byte[] image, CancellationToken cancellationToken)
+        {
+            UInt32 maxReadSize = (UInt32)(this.vehicle.DeviceMaxReceiveSize - 12); // Headers use 10 bytes, sum uses 2 bytes.
+            await this.vehicle.SetDeviceTimeout(TimeoutScenario.ReadMemoryBlock);
+            foreach (MemoryRange chunk in changed)
+            {
+                for (UInt32 offset = 0; offset < chunk.Size; offset += maxReadSize)
+                {
+                    int address = (int)(chunk.Address + offset);
+                    int length = (int)Math.Min(maxReadSize, chunk.Size - offset);
+
+                    await this.vehicle.SendToolPresentNotification();
+                    Response<byte[]> response = await this.vehicle.ReadMemory(
+                        () => this.protocol.CreateReadRequest(address, length, true),
+                        (message) => this.protocol.ParsePayload(message, length, address),
+                        cancellationToken);
+
+                    if ((response.Status != ResponseStatus.Success) || (response.Value.Length != length))
+                    {
+                        this.logger.AddDebugMessage("Unable to read chunk before patching: " + response.Status.ToString());
+                        return false;
+                    }
+
+                    if (!WritePlan.OnlyClearsBits(response.Value, image, (UInt32)address))
+                    {
+                        this.logger.AddDebugMessage(string.Format("The file sets bits near {0:X6}, so the range can't be patched.", address));
+                        return false;
+                    }
+                }
+            }
+
+            return true;
+        }
+
+        /// <summary>
+        /// Send chunks of the file as patch lists.
+        /// </summary>
+        /// <returns>True if every chunk was programmed.</returns>
+        private async Task<bool> PatchChunks(List<MemoryRange> changed, byte[] image, CancellationToken cancellationToken)
         {
-            UInt32 result = 0;
-            foreach(MemoryRange range in chip.MemoryRanges)
+            // Split the chunks into patches that fit in the device's messages.
+            int payloadSize = this.vehicle.DeviceMaxFlashWriteSendSize - 12; // Headers use 10 bytes, sum uses 2 bytes.
+            UInt32 maxPatchSize = (UInt32)Math.Min((int)PatchChunkSize, (payloadSize - Protocol.PatchListHeaderSize) & ~1);
+            List<MemoryRange> patches = new List<MemoryRange>();
+            int listSize = 0;
+            foreach (MemoryRange chunk in changed)
             {
-                if (this.ShouldProcess(range, relevantBlocks))
+                for (UInt32 offset = 0; offset < chunk.Size; offset += maxPatchSize)
                 {
-                    result += range.Size;
+                    MemoryRange patch = new MemoryRange(chunk.Address + offset, Math.Min(maxPatchSize, chunk.Size - offset), chunk.Type);
+                    int patchSize = Protocol.PatchListHeaderSize + (int)patch.Size;
+                    if ((listSize + patchSize > payloadSize) || (patches.Count == Protocol.MaxPatchListPatches))
+                    {
+                        if (!await this.WritePatchList(image, patches, cancellationToken))
+                        {
+                            return false;
+                        }
+
+                        patches.Clear();
+                        listSize = 0;
+                    }
+
+                    patches.Add(patch);
+                    listSize += patchSize;
                 }
             }
 
-            return result;
+            return await this.WritePatchList(image, patches, cancellationToken);
         }
 
-        private bool ShouldProcess(MemoryRange range, BlockType relevantBlocks)
+        /// <summary>
+        /// Have the kernel copy a range to RAM, apply the changed chunks from
+        /// the file, and erase and reprogram the range, so that the unchanged
+        /// data doesn't have to be sent. Kernel RAM is small, so this only works
+        /// for ranges that are mostly blank or padding.
+        /// </summary>
+        /// <returns>True if the range now matches the file.</returns>
+        private async Task<bool> RewriteMemoryRange(MemoryRange range, byte[] image, List<MemoryRange> changed, CancellationToken cancellationToken)
         {
-            if ((range.ActualCrc == range.DesiredCrc) && (this.writeType != WriteType.TestWrite))
+            int payloadSize = this.vehicle.DeviceMaxFlashWriteSendSize - 12; // Headers use 10 bytes, sum uses 2 bytes.
+            int rewriteSize = Protocol.SectorRewriteHeaderSize;
+            foreach (MemoryRange chunk in changed)
+            {
+                rewriteSize += Protocol.PatchListHeaderSize + (int)chunk.Size;
+            }
+
+            if ((range.Size > Protocol.MaxSectorRewriteSize) || (rewriteSize > payloadSize))
+            {
+                return false;
+            }
+
+            // Patches may have changed the range since CompareRanges, so ask again.
+            List<MemoryRange> wholeRange = new List<MemoryRange>() { range };
+            await this.vehicle.SendToolPresentNotification();
+            await this.vehicle.SetDeviceTimeout(TimeoutScenario.ReadCrc);
+            Query<UInt32[]> crcQuery = this.vehicle.CreateQuery<UInt32[]>(
+                () => this.protocol.CreateCrcBatchQuery(wholeRange),
+                (message) => this.protocol.ParseCrcBatch(message, wholeRange),
+                cancellationToken);
+            crcQuery.MaxTimeouts = 20;
+
+            Response<UInt32[]> crcResponse = await crcQuery.Execute();
+            if (crcResponse.Status != ResponseStatus.Success)
             {
+                this.logger.AddDebugMessage("Unable to get range CRC: " + crcResponse.Status.ToString());
                 return false;
             }
 
-            // The P10 has the same flash chip as the P59, but the high bit of the address bus
-            // isn't connected, so there will be hardware errors talking to the top 512kb.
-            // So, we skip ranges that are beyond the size of the usable image.
-            if (range.Address >= this.pcmInfo.ImageSize)
+            UInt32 crcAfter = new Crc().GetCrc(image, range.Address, range.Size);
+
+            logger.StatusUpdateActivity($"Rewriting range 0x{range.Address:X6} in the PCM");
+            await this.vehicle.SendToolPresentNotification();
+
+            // Progress frames only come from the erase and program loops. The
+            // CRC checks and the staging before them send nothing, so this
+            // can't use the FlashProgress timeout.
+            await this.vehicle.SetDeviceTimeout(TimeoutScenario.EraseMemoryBlock);
+            Query<byte> query = this.vehicle.CreateQuery<byte>(
+                () => this.protocol.CreateSectorRewriteMessage(image, range, crcResponse.Value[0], crcAfter, changed),
+                this.protocol.ParseSectorRewriteResponse,
+                cancellationToken);
+            query.MaxTimeouts = 3;
+            query.Progress = this.ReportProgress;
+
+            Response<byte> response = await query.Execute();
+            if (response.Status != ResponseStatus.Success)
             {
+                this.logger.AddDebugMessage("Sector rewrite failed: " + response.Status.ToString());
                 return false;
             }
 
-            // Skip irrelevant blocks.
-            if ((range.Type & relevantBlocks) == 0)
+            if (response.Value != 0)
             {
+                this.logger.AddDebugMessage("Kernel didn't rewrite the range, code " + response.Value.ToString("X2") + ". It will be erased and written as usual.");
                 return false;
             }
 
@@ -462,35 +870,96 @@ namespace PcmHacking
         }
 
         /// <summary>
-        /// Erase a block in the flash memory.
+        /// Send one patch list.
         /// </summary>
-        private async Task<bool> EraseMemoryRange(MemoryRange range, CancellationToken cancellationToken)
+        /// <returns>False if the kernel skipped any of the patches, or didn't answer.</returns>
+        private async Task<bool> WritePatchList(byte[] image, List<MemoryRange> patches, CancellationToken cancellationToken)
         {
-            this.logger.AddUserMessage("Erasing.");
+            logger.StatusUpdateActivity($"Patching {patches.Count} ranges from 0x{patches[0].Address:X6}");
 
-            await this.vehicle.SetDeviceTimeout(TimeoutScenario.EraseMemoryBlock);
-            Query<byte> eraseRequest = this.vehicle.CreateQuery<byte>(
-                 () => this.protocol.CreateFlashEraseBlockRequest(range.Address),
-                 this.protocol.ParseFlashEraseBlock,
-                 cancellationToken);
+            await this.vehicle.SendToolPresentNotification();
+            await this.vehicle.SetDeviceTimeout(TimeoutScenario.WriteMemoryBlock);
+            Query<IList<int>> query = this.vehicle.CreateQuery<IList<int>>(
+                () => this.protocol.CreatePatchListMessage(image, patches),
+                this.protocol.ParsePatchListResponse,
+                cancellationToken);
+            query.Progress = this.ReportProgress;
+
+            Response<IList<int>> response = await query.Execute();
+            if (response.Status != ResponseStatus.Success)
+            {
+                this.logger.AddDebugMessage("Patch list failed: " + response.Status.ToString());
+                return false;
+            }
 
-            eraseRequest.MaxTimeouts = 3;
-            Response<byte> eraseResponse = await eraseRequest.Execute();
+            if (response.Value.Count > 0)
+            {
+                this.logger.AddDebugMessage(string.Format("Kernel skipped {0} of {1} patches, so the range will be erased.", response.Value.Count, patches.Count));
+                return false;
+            }
 
-            if (eraseResponse.Status != ResponseStatus.Success)
+            return true;
+        }
+
+        /// <summary>
+        /// Start erasing several ranges with one request. WriteMemoryRange
+        /// waits for them after sending the first block.
+        /// </summary>
+        /// <returns>False if the kernel didn't start the erase, in which case each range should be erased separately.</returns>
+        private async Task<bool> EraseMemoryRanges(IList<MemoryRange> ranges, CancellationToken cancellationToken)
+        {
+            this.logger.AddUserMessage(string.Format("Erasing {0} ranges.", ranges.Count));
+
+            await this.vehicle.SetDeviceTimeout(TimeoutScenario.ReadProperty);
+            Query<byte> startRequest = this.vehicle.CreateQuery<byte>(
+                 () => this.protocol.CreateFlashEraseBatchRequest(ranges),
+                 this.protocol.ParseFlashEraseBatch,
+                 cancellationToken);
+
+            startRequest.MaxTimeouts = 3;
+            Response<byte> startResponse = await startRequest.Execute();
+            if ((startResponse.Status != ResponseStatus.Success) || (startResponse.Value != ranges.Count))
             {
-                this.logger.AddUserMessage("Unable to erase flash memory: " + eraseResponse.Status.ToString());
-                this.RequestDebugLogs(cancellationToken);
+                this.logger.AddDebugMessage("Unable to start batch erase: " + startResponse.Status.ToString());
                 return false;
             }
 
-            if (eraseResponse.Value != 0x00)
+            // Intel chips still erase the blocks one at a time.
+            this.eraseInProgress = true;
+            this.eraseDeadline = DateTime.Now + TimeSpan.FromTicks(MaxEraseTime.Ticks * ranges.Count);
+            return true;
+        }
+
+        /// <summary>
+        /// Start erasing the whole chip, apart from the boot and parameter
+        /// blocks unless they're included. WriteMemoryRange waits for it after
+        /// sending the first block.
+        /// </summary>
+        /// <param name="rangeCount">Number of ranges that the erase should cover.</param>
+        /// <returns>False if the ranges weren't erased, in which case each range should be erased separately.</returns>
+        private async Task<bool> EraseChip(int rangeCount, bool includeBoot, bool includeParameters, CancellationToken cancellationToken)
+        {
+            this.logger.AddUserMessage(string.Format("Erasing {0} ranges.", rangeCount));
+
+            await this.vehicle.SetDeviceTimeout(TimeoutScenario.ReadProperty);
+            Query<byte> startRequest = this.vehicle.CreateQuery<byte>(
+                 () => this.protocol.CreateFlashEraseChipRequest(includeBoot, includeParameters, rangeCount),
+                 this.protocol.ParseFlashEraseChip,
+                 cancellationToken);
+
+            startRequest.MaxTimeouts = 3;
+            Response<byte> startResponse = await startRequest.Execute();
+
+            // The kernel refuses if its idea of the chip differs from
+            // FlashChip, in which case the ranges are erased one by one.
+            if (startResponse.Status != ResponseStatus.Success)
             {
-                this.logger.AddUserMessage("Unable to erase flash memory. Code: " + eraseResponse.Value.ToString("X2"));
-                this.RequestDebugLogs(cancellationToken);
+                this.logger.AddDebugMessage("Unable to start chip erase: " + startResponse.Status.ToString());
                 return false;
             }
 
+            this.eraseInProgress = true;
+            this.eraseDeadline = DateTime.Now + TimeSpan.FromTicks(MaxEraseTime.Ticks * rangeCount);
             return true;
         }
 
@@ -508,7 +977,8 @@ namespace PcmHacking
         {
             int retryCount = 0;
             int devicePayloadSize = vehicle.DeviceMaxFlashWriteSendSize - 12; // Headers use 10 bytes, sum uses 2 bytes.
-            for (int index = 0; index < range.Size; index += devicePayloadSize)
+            int index = 0;
+            while (index < range.Size)
             {
                 if (cancellationToken.IsCancellationRequested)
                 {
@@ -519,6 +989,29 @@ namespace PcmHacking
 
                 int startAddress = (int)(range.Address + index);
                 UInt32 thisPayloadSize = (UInt32) Math.Min(devicePayloadSize, (int)range.Size - index);
+                Message payloadMessage = null;
+
+                if (this.compressWrites && !justTestWrite)
+                {
+                    // A compressed message can cover more of the range than a plain
+                    // one of the same size, up to the kernel's staging buffer.
+                    int compressedLength;
+                    int maxLength = Math.Min(Protocol.MaxCompressedBlockSize, (int)range.Size - index);
+                    byte[] encoded = Protocol.CompressRunLength(image, startAddress, maxLength, devicePayloadSize, out compressedLength);
+                    if (compressedLength > thisPayloadSize)
+                    {
+                        thisPayloadSize = (UInt32)compressedLength;
+                        payloadMessage = protocol.CreateCompressedBlockMessage(
+                            image,
+                            startAddress,
+                            compressedLength,
+                            encoded,
+                            startAddress,
+                            this.IsPipelined(range, index, compressedLength) ? BlockCopyType.CompressedPipelinedDifferentialWrite : BlockCopyType.CompressedDifferentialWrite);
+
+                        logger.AddDebugMessage(string.Format("Compressed 0x{0:X4} bytes to 0x{1:X4}.", compressedLength, encoded.Length));
+                    }
+                }
 
                 logger.AddDebugMessage(
                     string.Format(
@@ -527,12 +1020,21 @@ namespace PcmHacking
                         startAddress,
                         thisPayloadSize));
 
-                Message payloadMessage = protocol.CreateBlockMessage(
-                    image,
-                    startAddress,
-                    (int)thisPayloadSize,
-                    startAddress,
-                    justTestWrite ? BlockCopyType.TestWrite : BlockCopyType.Copy);
+                if (payloadMessage == null)
+                {
+                    BlockCopyType copyType = BlockCopyType.TestWrite;
+                    if (!justTestWrite)
+                    {
+                        copyType = this.IsPipelined(range, index, (int)thisPayloadSize) ? BlockCopyType.PipelinedDifferentialWrite : BlockCopyType.DifferentialWrite;
+                    }
+
+                    payloadMessage = protocol.CreateBlockMessage(
+                        image,
+                        startAddress,
+                        (int)thisPayloadSize,
+                        startAddress,
+                        copyType);
+                }
 
                 string timeRemaining = string.Empty;
 
@@ -566,11 +1068,132 @@ namespace PcmHacking
 
                 bytesRemaining -= thisPayloadSize;
                 retryCount += response.RetryCount;
+                index += (int)thisPayloadSize;
+
+                // The kernel only writes the first block after the erase is done,
+                // but the erase might still have failed.
+                if (this.eraseInProgress && !await this.WaitForErase(cancellationToken))
+                {
+                    return Response.Create(ResponseStatus.Error, false, retryCount);
+                }
             }
 
             return Response.Create(ResponseStatus.Success, true, retryCount);
         }
 
+        /// <summary>
+        /// The last block of a range isn't pipelined, so the kernel reports any
+        /// programming failure in the range before the range is done. A block
+        /// that has to wait for a background erase is always pipelined, since
+        /// the kernel would otherwise not reply until the erase is finished.
+        /// </summary>
+        private bool IsPipelined(MemoryRange range, int index, int payloadSize)
+        {
+            return (index + payloadSize < range.Size) || this.eraseInProgress;
+        }
+
+        /// <summary>
+        /// Ask the kernel to send progress frames during blocking erases and
+        /// flash writes, so a stuck PCM is noticed after a second or so,
+        /// rather than after the worst-case erase time.
+        /// </summary>
+        private async Task<bool> EnableProgressFrames(CancellationToken cancellationToken)
+        {
+            await this.vehicle.SetDeviceTimeout(TimeoutScenario.ReadProperty);
+            Query<byte> query = this.vehicle.CreateQuery<byte>(
+                () => this.protocol.CreateProgressFramesRequest(Protocol.ProgressFrameInterval),
+                this.protocol.ParseProgressFramesResponse,
+                cancellationToken);
+
+            query.MaxTimeouts = 3;
+            Response<byte> response = await query.Execute();
+            if (response.Status != ResponseStatus.Success)
+            {
+                this.logger.AddDebugMessage("Unable to enable progress frames: " + response.Status.ToString());
+                return false;
+            }
+
+            this.logger.AddDebugMessage("Kernel will send progress frames.");
+            return true;
+        }
+
+        /// <summary>
+        /// Show a progress frame from the kernel. Returns false for any other message.
+        /// </summary>
+        private bool ReportProgress(Message message)
+        {
+            if (!this.protocol.TryParseProgressFrame(message, out byte operation, out UInt32 polls, out byte status))
+            {
+                return false;
+            }
+
+            this.logger.StatusUpdateActivity(
+                string.Format(
+                    "{0}, {1:n0} status polls, status {2:X2}",
+                    operation == 0x05 ? "Erasing" : "Writing",
+                    polls,
+                    status));
+            return true;
+        }
+
+        /// <summary>
+        /// Poll the kernel until the background erase finishes.
+        /// </summary>
+        private async Task<bool> WaitForErase(CancellationToken cancellationToken)
+        {
+            this.eraseInProgress = false;
+
+            await this.vehicle.SetDeviceTimeout(TimeoutScenario.ReadProperty);
+            while (true)
+            {
+                int finished = 0;
+                int total = 0;
+                Query<int> statusQuery = this.vehicle.CreateQuery<int>(
+                    this.protocol.CreateFlashEraseStatusQuery,
+                    message =>
+                    {
+                        this.protocol.TryParseFlashEraseProgress(message, out finished, out total);
+                        return this.protocol.ParseFlashEraseStatus(message);
+                    },
+                    cancellationToken);
+
+                statusQuery.MaxTimeouts = 3;
+                Response<int> statusResponse = await statusQuery.Execute();
+                if (statusResponse.Status != ResponseStatus.Success)
+                {
+                    this.logger.AddUserMessage("Unable to erase flash memory: " + statusResponse.Status.ToString());
+                    this.RequestDebugLogs(cancellationToken);
+                    return false;
+                }
+
+                if (statusResponse.Value == 0)
+                {
+                    return true;
+                }
+
+                if (total > 1)
+                {
+                    this.logger.StatusUpdateActivity(string.Format("Erasing, {0} of {1} blocks done", finished, total));
+                }
+
+                if (statusResponse.Value > 0)
+                {
+                    this.logger.AddUserMessage("Unable to erase flash memory. Code: " + statusResponse.Value.ToString("X2"));
+                    this.RequestDebugLogs(cancellationToken);
+                    return false;
+                }
+
+                if (DateTime.Now > this.eraseDeadline)
+                {
+                    this.logger.AddUserMessage("Unable to erase flash memory: the erase did not finish.");
+                    this.RequestDebugLogs(cancellationToken);
+                    return false;
+                }
+
+                await Task.Delay(50);
+            }
+        }
+
         /// <summary>
         /// Ask the user for diagnostic information, unless they cancelled.
         private void RequestDebugLogs(CancellationToken cancellationToken)
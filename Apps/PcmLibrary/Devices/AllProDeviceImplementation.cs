@@ -122,6 +122,10 @@ namespace PcmHacking
                         milliseconds = 250;
                         break;
 
+                    case TimeoutScenario.FlashProgress:
+                        milliseconds = 1000;
+                        break;
+
                     case TimeoutScenario.SendKernel:
                         milliseconds = 50;
                         break;
@@ -182,6 +186,10 @@ namespace PcmHacking
                         milliseconds = 170;
                         break;
 
+                    case TimeoutScenario.FlashProgress:
+                        milliseconds = 1000;
+                        break;
+
                     case TimeoutScenario.SendKernel:
                         milliseconds = 10;
                         break;
@@ -17,6 +17,7 @@ namespace PcmHacking
         ReadMemoryBlock,
         EraseMemoryBlock,
         WriteMemoryBlock,
+        FlashProgress,
         DataLogging1,
         DataLogging2,
         DataLogging3,
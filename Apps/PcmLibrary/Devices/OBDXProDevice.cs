@@ -982,6 +982,10 @@ namespace PcmHacking
                         result = 1200;
                         break;
 
+                    case TimeoutScenario.FlashProgress:
+                        result = 1000;
+                        break;
+
                     case TimeoutScenario.SendKernel:
                         result = 4000;
                         break;
@@ -1042,6 +1046,10 @@ namespace PcmHacking
                         result = 600;
                         break;
 
+                    case TimeoutScenario.FlashProgress:
+                        result = 1000;
+                        break;
+
                     case TimeoutScenario.SendKernel:
                         result = 2000;
                         break;
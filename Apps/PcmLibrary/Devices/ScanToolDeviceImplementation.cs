@@ -146,6 +146,10 @@ namespace PcmHacking
                         milliseconds = 140; // 125 works, added some for safety
                         break;
 
+                    case TimeoutScenario.FlashProgress:
+                        milliseconds = 1000;
+                        break;
+
                     case TimeoutScenario.SendKernel:
                         milliseconds = 50;
                         break;
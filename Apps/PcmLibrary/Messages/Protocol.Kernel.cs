@@ -23,6 +23,134 @@ namespace PcmHacking
             return ParseUInt32(responseMessage, 0x3D, 0x00);
         }
 
+        /// <summary>
+        /// Can this kernel expand compressed mode-36 writes? Older kernels
+        /// would write the encoded bytes as-is.
+        /// </summary>
+        public static bool SupportsCompressedWrite(UInt32 kernelVersion)
+        {
+            return IsCKernelVersion(kernelVersion, 0x0306);
+        }
+
+        /// <summary>
+        /// Can this kernel answer blank scan queries?
+        /// </summary>
+        public static bool SupportsBlankScan(UInt32 kernelVersion)
+        {
+            return IsCKernelVersion(kernelVersion, 0x0307);
+        }
+
+        /// <summary>
+        /// Can this kernel erase in the background, while the first block of
+        /// the range is being sent?
+        /// </summary>
+        public static bool SupportsBackgroundErase(UInt32 kernelVersion)
+        {
+            return IsCKernelVersion(kernelVersion, 0x0308);
+        }
+
+        /// <summary>
+        /// Can this kernel erase a list of blocks with one request?
+        /// </summary>
+        public static bool SupportsBatchErase(UInt32 kernelVersion)
+        {
+            return IsCKernelVersion(kernelVersion, 0x0309);
+        }
+
+        /// <summary>
+        /// Can this kernel stream a whole range, rather than one block per request?
+        /// </summary>
+        public static bool SupportsStreamingRead(UInt32 kernelVersion)
+        {
+            return IsCKernelVersion(kernelVersion, 0x030A);
+        }
+
+        /// <summary>
+        /// Can this kernel program patch lists without erasing?
+        /// </summary>
+        public static bool SupportsPatchWrite(UInt32 kernelVersion)
+        {
+            return IsCKernelVersion(kernelVersion, 0x030B);
+        }
+
+        /// <summary>
+        /// Can this kernel rewrite a block from RAM, given only the changes?
+        /// </summary>
+        public static bool SupportsSectorRewrite(UInt32 kernelVersion)
+        {
+            return IsCKernelVersion(kernelVersion, 0x030C);
+        }
+
+        /// <summary>
+        /// Can this kernel erase the whole chip with one request?
+        /// </summary>
+        public static bool SupportsFullErase(UInt32 kernelVersion)
+        {
+            return IsCKernelVersion(kernelVersion, 0x030D);
+        }
+
+        /// <summary>
+        /// Can this kernel send progress frames during long flash operations?
+        /// </summary>
+        public static bool SupportsProgressFrames(UInt32 kernelVersion)
+        {
+            return IsCKernelVersion(kernelVersion, 0x030E);
+        }
+
+        /// <summary>
+        /// Can this kernel say which optional features it was built with?
+        /// Older kernels have every feature that their version supports.
+        /// </summary>
+        public static bool SupportsFeatureQuery(UInt32 kernelVersion)
+        {
+            return IsCKernelVersion(kernelVersion, 0x030F);
+        }
+
+        /// <summary>
+        /// Create a request for the optional features the kernel was built with.
+        /// </summary>
+        public Message CreateKernelFeaturesQuery()
+        {
+            return new Message(new byte[] { Priority.Physical0, DeviceId.Pcm, DeviceId.Tool, 0x3D, 0x0F });
+        }
+
+        /// <summary>
+        /// Parse the kernel's optional features: 7D 0F, then 2 bytes of flags.
+        /// </summary>
+        public Response<KernelFeatures> ParseKernelFeatures(Message responseMessage)
+        {
+            ResponseStatus status;
+            byte[] expected = new byte[] { Priority.Physical0, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x0F };
+            if (!TryVerifyInitialBytes(responseMessage, expected, out status))
+            {
+                return Response.Create(status, KernelFeatures.None);
+            }
+
+            byte[] responseBytes = responseMessage.GetBytes();
+            if (responseBytes.Length < 7)
+            {
+                return Response.Create(ResponseStatus.Truncated, KernelFeatures.None);
+            }
+
+            return Response.Create(ResponseStatus.Success, (KernelFeatures)((responseBytes[5] << 8) | responseBytes[6]));
+        }
+
+        /// <summary>
+        /// The C kernels report major, minor, patch, and then the PCM type
+        /// (01, 0A or 0C). Other kernels report different numbers.
+        /// </summary>
+        /// <param name="minimum">Minor and patch version, for 1.x kernels.</param>
+        private static bool IsCKernelVersion(UInt32 kernelVersion, UInt32 minimum)
+        {
+            UInt32 pcmType = kernelVersion & 0xFF;
+            if ((pcmType != 0x01) && (pcmType != 0x0A) && (pcmType != 0x0C))
+            {
+                return false;
+            }
+
+            return (kernelVersion >> 24 == 0x01) && ((kernelVersion >> 8) & 0xFFFF) >= minimum;
+        }
+
         /// <summary>
         /// Create a request to get the operating system ID from the kernel.
         /// </summary>
@@ -127,6 +255,207 @@ namespace PcmHacking
             return Response.Create(ResponseStatus.Success, (UInt32)crc);
         }
 
+        /// <summary>
+        /// Most ranges that the kernel will accept in one CRC batch query.
+        /// </summary>
+        public const int MaxCrcBatchRanges = 32;
+
+        /// <summary>
+        /// Most ranges per CRC batch query that keep the request and the reply within the device's message sizes.
+        /// </summary>
+        public static int GetCrcBatchRangeLimit(int maxSendSize, int maxReceiveSize)
+        {
+            // Both messages start with 6 bytes of header and count. Each range then takes
+            // 6 bytes in the request (size and address) and 10 bytes in the reply (plus the CRC).
+            int limit = Math.Min((maxSendSize - 6) / 6, (maxReceiveSize - 6) / 10);
+            return Math.Max(1, Math.Min(MaxCrcBatchRanges, limit));
+        }
+
+        /// <summary>
+        /// Create a request to get the CRCs of several byte ranges with one reply.
+        /// </summary>
+        public Message CreateCrcBatchQuery(IList<MemoryRange> ranges)
+        {
+            if ((ranges.Count == 0) || (ranges.Count > MaxCrcBatchRanges))
+            {
+                throw new ArgumentOutOfRangeException(nameof(ranges));
+            }
+
+            byte[] requestBytes = new byte[6 + (ranges.Count * 6)];
+            requestBytes[0] = Priority.Physical0;
+            requestBytes[1] = DeviceId.Pcm;
+            requestBytes[2] = DeviceId.Tool;
+            requestBytes[3] = 0x3D;
+            requestBytes[4] = 0x07;
+            requestBytes[5] = (byte)ranges.Count;
+
+            for (int index = 0; index < ranges.Count; index++)
+            {
+                int offset = 6 + (index * 6);
+                requestBytes[offset + 0] = unchecked((byte)(ranges[index].Size >> 16));
+                requestBytes[offset + 1] = unchecked((byte)(ranges[index].Size >> 8));
+                requestBytes[offset + 2] = unchecked((byte)ranges[index].Size);
+                requestBytes[offset + 3] = unchecked((byte)(ranges[index].Address >> 16));
+                requestBytes[offset + 4] = unchecked((byte)(ranges[index].Address >> 8));
+                requestBytes[offset + 5] = unchecked((byte)ranges[index].Address);
+            }
+
+            return new Message(requestBytes);
+        }
+
+        /// <summary>
+        /// Parse the response to a CRC batch query. The CRCs are returned in the same order as the ranges.
+        /// </summary>
+        internal Response<UInt32[]> ParseCrcBatch(Message responseMessage, IList<MemoryRange> ranges)
+        {
+            ResponseStatus status;
+            byte[] expected = new byte[] { Priority.Physical0, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x07, (byte)ranges.Count };
+            if (!TryVerifyInitialBytes(responseMessage, expected, out status))
+            {
+                byte[] refused = { Priority.Physical0, DeviceId.Tool, DeviceId.Pcm, Mode.NegativeResponse, 0x3D, 0x07 };
+                if (TryVerifyInitialBytes(responseMessage, refused, out status))
+                {
+                    return Response.Create(ResponseStatus.Refused, (UInt32[])null);
+                }
+
+                return Response.Create(status, (UInt32[])null);
+            }
+
+            byte[] responseBytes = responseMessage.GetBytes();
+            if (responseBytes.Length < 6 + (ranges.Count * 10))
+            {
+                return Response.Create(ResponseStatus.Truncated, (UInt32[])null);
+            }
+
+            UInt32[] crcs = new UInt32[ranges.Count];
+            for (int index = 0; index < ranges.Count; index++)
+            {
+                int offset = 6 + (index * 10);
+                UInt32 size = (UInt32)((responseBytes[offset] << 16) | (responseBytes[offset + 1] << 8) | responseBytes[offset + 2]);
+                UInt32 address = (UInt32)((responseBytes[offset + 3] << 16) | (responseBytes[offset + 4] << 8) | responseBytes[offset + 5]);
+                if ((size != ranges[index].Size) || (address != ranges[index].Address))
+                {
+                    return Response.Create(ResponseStatus.UnexpectedResponse, (UInt32[])null);
+                }
+
+                crcs[index] = (UInt32)(
+                    (responseBytes[offset + 6] << 24) |
+                    (responseBytes[offset + 7] << 16) |
+                    (responseBytes[offset + 8] << 8) |
+                    responseBytes[offset + 9]);
+            }
+
+            return Response.Create(ResponseStatus.Success, crcs);
+        }
+
+        /// <summary>
+        /// Blank scans report on chunks of this size.
+        /// </summary>
+        public const int BlankScanChunkSize = 4096;
+
+        /// <summary>
+        /// Most chunks that the kernel will scan in one query.
+        /// </summary>
+        public const int MaxBlankScanChunks = 2048;
+
+        /// <summary>
+        /// Create a request to find which chunks of flash are entirely erased.
+        /// </summary>
+        public Message CreateBlankScanQuery(int address, int chunkCount)
+        {
+            if ((chunkCount < 1) || (chunkCount > MaxBlankScanChunks))
+            {
+                throw new ArgumentOutOfRangeException(nameof(chunkCount));
+            }
+
+            return new Message(new byte[]
+            {
+                Priority.Physical0, DeviceId.Pcm, DeviceId.Tool, 0x3D, 0x09,
+                unchecked((byte)(address >> 16)),
+                unchecked((byte)(address >> 8)),
+                unchecked((byte)address),
+                unchecked((byte)(chunkCount >> 8)),
+                unchecked((byte)chunkCount),
+            });
+        }
+
+        /// <summary>
+        /// Parse the response to a blank scan query. Each element is true if that chunk is blank.
+        /// </summary>
+        public Response<bool[]> ParseBlankScan(Message responseMessage, int address, int chunkCount)
+        {
+            ResponseStatus status;
+            byte[] expected = new byte[]
+            {
+                Priority.Physical0, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x09,
+                unchecked((byte)(address >> 16)),
+                unchecked((byte)(address >> 8)),
+                unchecked((byte)address),
+                unchecked((byte)(chunkCount >> 8)),
+                unchecked((byte)chunkCount),
+            };
+
+            if (!TryVerifyInitialBytes(responseMessage, expected, out status))
+            {
+                return Response.Create(status, (bool[])null);
+            }
+
+            byte[] responseBytes = responseMessage.GetBytes();
+            if (responseBytes.Length < 10 + ((chunkCount + 7) / 8))
+            {
+                return Response.Create(ResponseStatus.Truncated, (bool[])null);
+            }
+
+            bool[] blank = new bool[chunkCount];
+            for (int chunk = 0; chunk < chunkCount; chunk++)
+            {
+                blank[chunk] = (responseBytes[10 + (chunk / 8)] & (0x80 >> (chunk % 8))) != 0;
+            }
+
+            return Response.Create(ResponseStatus.Success, blank);
+        }
+
+        /// <summary>
+        /// Create a request for the kernel's performance counters.
+        /// </summary>
+        /// <param name="clear">Reset the counters after reading them.</param>
+        public Message CreateKernelStatisticsQuery(bool clear)
+        {
+            return new Message(new byte[] { Priority.Physical0, DeviceId.Pcm, DeviceId.Tool, 0x3D, 0x08, (byte)(clear ? 0x01 : 0x00) });
+        }
+
+        /// <summary>
+        /// Parse the kernel's performance counters.
+        /// </summary>
+        internal Response<KernelStatistics> ParseKernelStatistics(Message responseMessage)
+        {
+            ResponseStatus status;
+            byte[] expected = new byte[] { Priority.Physical0, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x08 };
+            if (!TryVerifyInitialBytes(responseMessage, expected, out status))
+            {
+                return Response.Create(status, (KernelStatistics)null);
+            }
+
+            byte[] responseBytes = responseMessage.GetBytes();
+            if (responseBytes.Length < 5 + (KernelStatistics.CounterCount * 4))
+            {
+                return Response.Create(ResponseStatus.Truncated, (KernelStatistics)null);
+            }
+
+            UInt32[] counters = new UInt32[KernelStatistics.CounterCount];
+            for (int index = 0; index < counters.Length; index++)
+            {
+                int offset = 5 + (index * 4);
+                counters[index] = (UInt32)(
+                    (responseBytes[offset] << 24) |
+                    (responseBytes[offset + 1] << 16) |
+                    (responseBytes[offset + 2] << 8) |
+                    responseBytes[offset + 3]);
+            }
+
+            return Response.Create(ResponseStatus.Success, new KernelStatistics(counters));
+        }
+
         /// <summary>
         /// Ask the kernel to erase a block of flash memory.
         /// </summary>
@@ -153,6 +482,242 @@ namespace PcmHacking
             return ParseByte(message, 0x3D, 0x05);
         }
 
+        /// <summary>
+        /// Ask the kernel to start erasing a block of flash memory, and reply
+        /// without waiting for the erase to finish.
+        /// </summary>
+        public Message CreateFlashEraseStartRequest(UInt32 baseAddress)
+        {
+            return new Message(new byte[]
+            {
+                Priority.Physical0,
+                DeviceId.Pcm,
+                DeviceId.Tool,
+                0x3D,
+                0x0A,
+                (byte)(baseAddress >> 16),
+                (byte)(baseAddress >> 8),
+                (byte)baseAddress
+            });
+        }
+
+        /// <summary>
+        /// Find out whether the kernel started the erase.
+        /// </summary>
+        internal Response<byte> ParseFlashEraseStart(Message message)
+        {
+            return ParseByte(message, 0x3D, 0x0A);
+        }
+
+        /// <summary>
+        /// Ask the kernel whether the background erase has finished.
+        /// </summary>
+        public Message CreateFlashEraseStatusQuery()
+        {
+            return new Message(new byte[] { Priority.Physical0, DeviceId.Pcm, DeviceId.Tool, 0x3D, 0x0B });
+        }
+
+        /// <summary>
+        /// Parse the reply to an erase status query. The value is -1 while the
+        /// erase is still running, otherwise it's the same code that a blocking
+        /// erase request would have returned.
+        /// </summary>
+        public Response<int> ParseFlashEraseStatus(Message message)
+        {
+            Response<byte> result = ParseByte(message, 0x3D, 0x0B);
+            if (result.Status != ResponseStatus.Success)
+            {
+                return Response.Create(result.Status, -1);
+            }
+
+            byte[] responseBytes = message.GetBytes();
+            if (responseBytes.Length < 7)
+            {
+                return Response.Create(ResponseStatus.Truncated, -1);
+            }
+
+            return Response.Create(ResponseStatus.Success, responseBytes[6] != 0 ? -1 : (int)result.Value);
+        }
+
+        /// <summary>
+        /// Get the progress from an erase status reply. Kernels that support
+        /// full erase report how many of the erase's blocks have finished.
+        /// </summary>
+        public bool TryParseFlashEraseProgress(Message message, out int finished, out int total)
+        {
+            finished = 0;
+            total = 0;
+
+            byte[] responseBytes = message.GetBytes();
+            if ((responseBytes.Length < 9) || (responseBytes[3] != 0x7D) || (responseBytes[4] != 0x0B))
+            {
+                return false;
+            }
+
+            finished = responseBytes[7];
+            total = responseBytes[8];
+            return true;
+        }
+
+        /// <summary>
+        /// Most blocks that the kernel will accept in one batch erase request.
+        /// </summary>
+        public const int MaxEraseBatchRanges = 32;
+
+        /// <summary>
+        /// Ask the kernel to start erasing several blocks of flash memory, and
+        /// reply without waiting. AMD chips erase all of the blocks in one
+        /// operation. Poll for completion with CreateFlashEraseStatusQuery.
+        /// </summary>
+        public Message CreateFlashEraseBatchRequest(IList<MemoryRange> ranges)
+        {
+            if ((ranges.Count == 0) || (ranges.Count > MaxEraseBatchRanges))
+            {
+                throw new ArgumentOutOfRangeException(nameof(ranges));
+            }
+
+            byte[] requestBytes = new byte[6 + (ranges.Count * 3)];
+            requestBytes[0] = Priority.Physical0;
+            requestBytes[1] = DeviceId.Pcm;
+            requestBytes[2] = DeviceId.Tool;
+            requestBytes[3] = 0x3D;
+            requestBytes[4] = 0x0C;
+            requestBytes[5] = (byte)ranges.Count;
+
+            for (int index = 0; index < ranges.Count; index++)
+            {
+                int offset = 6 + (index * 3);
+                requestBytes[offset + 0] = unchecked((byte)(ranges[index].Address >> 16));
+                requestBytes[offset + 1] = unchecked((byte)(ranges[index].Address >> 8));
+                requestBytes[offset + 2] = unchecked((byte)ranges[index].Address);
+            }
+
+            return new Message(requestBytes);
+        }
+
+        /// <summary>
+        /// Find out whether the kernel started the batch erase. The value is
+        /// the number of blocks that it will erase.
+        /// </summary>
+        internal Response<byte> ParseFlashEraseBatch(Message message)
+        {
+            return ParseByte(message, 0x3D, 0x0C);
+        }
+
+        /// <summary>
+        /// Flags for CreateFlashEraseChipRequest. Without them, the kernel
+        /// leaves the boot and parameter blocks alone.
+        /// </summary>
+        public const byte EraseChipBoot = 0x01;
+        public const byte EraseChipParameters = 0x02;
+
+        /// <summary>
+        /// Ask the kernel to start erasing the whole flash chip, and reply
+        /// without waiting. The kernel knows the chip's blocks, and AMD chips
+        /// use their chip erase command when every block is to be erased.
+        /// Poll for completion with CreateFlashEraseStatusQuery.
+        /// </summary>
+        /// <param name="blockCount">Number of blocks that the erase should cover. The kernel refuses to start if its count differs.</param>
+        public Message CreateFlashEraseChipRequest(bool includeBoot, bool includeParameters, int blockCount)
+        {
+            byte flags = 0;
+            if (includeBoot)
+            {
+                flags |= EraseChipBoot;
+            }
+
+            if (includeParameters)
+            {
+                flags |= EraseChipParameters;
+            }
+
+            // The kernel checks the second copy, so a stale byte can't erase the boot block.
+            return new Message(new byte[]
+            {
+                Priority.Physical0,
+                DeviceId.Pcm,
+                DeviceId.Tool,
+                0x3D,
+                0x06,
+                flags,
+                (byte)(flags ^ 0xFF),
+                (byte)blockCount
+            });
+        }
+
+        /// <summary>
+        /// Find out whether the kernel started the chip erase. The value is
+        /// the number of blocks that it will erase.
+        /// </summary>
+        internal Response<byte> ParseFlashEraseChip(Message message)
+        {
+            return ParseByte(message, 0x3D, 0x06);
+        }
+
+        /// <summary>
+        /// Interval between progress frames, in units of 256 flash status
+        /// polls, so a frame every 65536 polls. The time a poll takes hasn't
+        /// been measured. The kernel's erase poll limits (0x640000 for Intel,
+        /// 0x1280000 for AMD) date from when one erase got the 7-second
+        /// EraseMemoryBlock timeout, which would make a poll about 1
+        /// microsecond on Intel and less on AMD, and a frame every 70 ms or
+        /// so. Polls could be more than ten times slower than that before
+        /// frames missed the 1-second FlashProgress timeout.
+        /// </summary>
+        public const UInt16 ProgressFrameInterval = 256;
+
+        /// <summary>
+        /// Ask the kernel to send progress frames during blocking erases and
+        /// flash writes, every interval * 256 status polls. Zero turns them off.
+        /// </summary>
+        public Message CreateProgressFramesRequest(UInt16 interval)
+        {
+            return new Message(new byte[]
+            {
+                Priority.Physical0,
+                DeviceId.Pcm,
+                DeviceId.Tool,
+                0x3D,
+                0x0D,
+                (byte)(interval >> 8),
+                (byte)interval
+            });
+        }
+
+        /// <summary>
+        /// Find out whether the kernel accepted the progress frame request.
+        /// </summary>
+        internal Response<byte> ParseProgressFramesResponse(Message message)
+        {
+            return ParseByte(message, 0x3D, 0x0D);
+        }
+
+        /// <summary>
+        /// Parse a progress frame: 7D 0E, operation, polls (4 bytes), status.
+        /// The operation is 05 for a blocking erase, or 36 for a flash write.
+        /// </summary>
+        public bool TryParseProgressFrame(Message message, out byte operation, out UInt32 polls, out byte status)
+        {
+            operation = 0;
+            polls = 0;
+            status = 0;
+
+            byte[] responseBytes = message.GetBytes();
+            if ((responseBytes.Length < 11) || (responseBytes[3] != 0x7D) || (responseBytes[4] != 0x0E))
+            {
+                return false;
+            }
+
+            operation = responseBytes[5];
+            polls = (UInt32)(
+                (responseBytes[6] << 24) |
+                (responseBytes[7] << 16) |
+                (responseBytes[8] << 8) |
+                responseBytes[9]);
+            status = responseBytes[10];
+            return true;
+        }
+
         /// <summary>
         /// Create a request for implementation details... for development use only.
         /// </summary>
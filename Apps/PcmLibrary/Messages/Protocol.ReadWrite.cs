@@ -14,10 +14,70 @@ namespace PcmHacking
 
         // Test copy to flash, but do not unlock or actually write.
         TestWrite = 0x44,
+
+        // Copy to flash, but skip words that already contain the new value.
+        // Kernels that don't know this code treat it as a plain copy.
+        DifferentialWrite = 0x0D,
+
+        // Differential write, programmed in the background so that the next
+        // block can be sent while this one is programmed. The kernel replies
+        // as soon as it has the block. If programming fails, the kernel
+        // rejects the next block, so the last block of a range should be
+        // sent as a DifferentialWrite, to find out before the range is done.
+        PipelinedDifferentialWrite = 0x2D,
+
+        // Differential write with a run-length encoded payload, programmed
+        // before the kernel replies. Check with Protocol.SupportsCompressedWrite
+        // before using this.
+        CompressedDifferentialWrite = 0x1D,
+
+        // Pipelined differential write with a run-length encoded payload. The
+        // header gives the encoded length, and the sum covers the decoded data.
+        // Older kernels would write the encoded bytes as-is, so check with
+        // Protocol.SupportsCompressedWrite before using this.
+        CompressedPipelinedDifferentialWrite = 0x3D,
+
+        // The payload is a list of patches, each programmed in place without
+        // an erase, and the address in the header is ignored. Older kernels
+        // would write the list itself to address zero, so check with
+        // Protocol.SupportsPatchWrite before using this.
+        PatchList = 0x0E,
+
+        // The payload gives a block's size, its CRC before and after, and a
+        // patch list. The kernel stages the block in RAM with the patches
+        // applied, then erases and reprograms it. Older kernels would write
+        // the payload to the block, so check with Protocol.SupportsSectorRewrite
+        // before using this.
+        SectorRewrite = 0x0F,
     };
 
     public partial class Protocol
     {
+        /// <summary>
+        /// Largest block that the kernel can expand from a compressed write.
+        /// </summary>
+        public const int MaxCompressedBlockSize = 4096;
+
+        /// <summary>
+        /// Most patches that the kernel will accept in one patch list.
+        /// </summary>
+        public const int MaxPatchListPatches = 255;
+
+        /// <summary>
+        /// Bytes that each patch adds to a patch list, in addition to its data.
+        /// </summary>
+        public const int PatchListHeaderSize = 5;
+
+        /// <summary>
+        /// Bytes at the start of a sector rewrite payload, before the patches.
+        /// </summary>
+        public const int SectorRewriteHeaderSize = 11;
+
+        /// <summary>
+        /// Largest block that the kernel will rewrite.
+        /// </summary>
+        public const int MaxSectorRewriteSize = 0x20000;
+
         /// <summary>
         /// Create a block message from the supplied arguments.
         /// </summary>
@@ -49,6 +109,212 @@ namespace PcmHacking
             return new Message(VpwUtilities.AddBlockChecksum(Buffer));
         }
 
+        /// <summary>
+        /// Create a block message with a run-length encoded payload, from CompressRunLength.
+        /// </summary>
+        /// <remarks>
+        /// The header gives the encoded length, but the sum covers the header and
+        /// the decoded data, so the kernel checks what it will actually write.
+        /// </remarks>
+        public Message CreateCompressedBlockMessage(byte[] payload, int offset, int length, byte[] encoded, int address, BlockCopyType copyType)
+        {
+            byte[] buffer = new byte[10 + encoded.Length + 2];
+            buffer[0] = Priority.Block;
+            buffer[1] = DeviceId.Pcm;
+            buffer[2] = DeviceId.Tool;
+            buffer[3] = Mode.PCMUpload;
+            buffer[4] = (byte)copyType;
+            buffer[5] = unchecked((byte)(encoded.Length >> 8));
+            buffer[6] = unchecked((byte)(encoded.Length & 0xFF));
+            buffer[7] = unchecked((byte)(address >> 16));
+            buffer[8] = unchecked((byte)(address >> 8));
+            buffer[9] = unchecked((byte)(address & 0xFF));
+            System.Buffer.BlockCopy(encoded, 0, buffer, 10, encoded.Length);
+
+            UInt16 sum = 0;
+            for (int index = 4; index < 10; index++)
+            {
+                sum += buffer[index];
+            }
+
+            for (int index = offset; index < offset + length; index++)
+            {
+                sum += payload[index];
+            }
+
+            buffer[buffer.Length - 2] = unchecked((byte)(sum >> 8));
+            buffer[buffer.Length - 1] = unchecked((byte)(sum & 0xFF));
+            return new Message(buffer);
+        }
+
+        /// <summary>
+        /// Create a patch list message. Each patch is sent with the image's
+        /// data for that range, as [address, 3 bytes] [length, 2 bytes] [data].
+        /// </summary>
+        /// <remarks>
+        /// The kernel only programs patches that clear bits, so that they don't
+        /// need an erase. It lists the others in its reply.
+        /// </remarks>
+        public Message CreatePatchListMessage(byte[] image, IList<MemoryRange> patches)
+        {
+            if ((patches.Count == 0) || (patches.Count > MaxPatchListPatches))
+            {
+                throw new ArgumentOutOfRangeException(nameof(patches));
+            }
+
+            int length = 0;
+            foreach (MemoryRange patch in patches)
+            {
+                length += PatchListHeaderSize + (int)patch.Size;
+            }
+
+            byte[] buffer = new byte[10 + length + 2];
+            buffer[0] = Priority.Block;
+            buffer[1] = DeviceId.Pcm;
+            buffer[2] = DeviceId.Tool;
+            buffer[3] = Mode.PCMUpload;
+            buffer[4] = (byte)BlockCopyType.PatchList;
+            buffer[5] = unchecked((byte)(length >> 8));
+            buffer[6] = unchecked((byte)(length & 0xFF));
+
+            int offset = 10;
+            foreach (MemoryRange patch in patches)
+            {
+                buffer[offset + 0] = unchecked((byte)(patch.Address >> 16));
+                buffer[offset + 1] = unchecked((byte)(patch.Address >> 8));
+                buffer[offset + 2] = unchecked((byte)patch.Address);
+                buffer[offset + 3] = unchecked((byte)(patch.Size >> 8));
+                buffer[offset + 4] = unchecked((byte)patch.Size);
+                System.Buffer.BlockCopy(image, (int)patch.Address, buffer, offset + PatchListHeaderSize, (int)patch.Size);
+                offset += PatchListHeaderSize + (int)patch.Size;
+            }
+
+            return new Message(VpwUtilities.AddBlockChecksum(buffer));
+        }
+
+        /// <summary>
+        /// Parse the response to a patch list. The value is the index of each
+        /// patch that the kernel skipped, because it would need an erase.
+        /// </summary>
+        public Response<IList<int>> ParsePatchListResponse(Message message)
+        {
+            ResponseStatus status;
+            byte[] expected = { Priority.Block, DeviceId.Tool, DeviceId.Pcm, Mode.PCMUpload + Mode.Response, (byte)BlockCopyType.PatchList };
+            if (!TryVerifyInitialBytes(message, expected, out status))
+            {
+                // 0xBE means the list was malformed. Anything else is a flash error.
+                byte[] refused = { Priority.Block, DeviceId.Tool, DeviceId.Pcm, Mode.NegativeResponse, Mode.PCMUpload, 0xBE };
+                if (TryVerifyInitialBytes(message, refused, out status))
+                {
+                    return Response.Create(ResponseStatus.Refused, (IList<int>)null);
+                }
+
+                byte[] failed = { Priority.Block, DeviceId.Tool, DeviceId.Pcm, Mode.NegativeResponse, Mode.PCMUpload };
+                if (TryVerifyInitialBytes(message, failed, out status))
+                {
+                    return Response.Create(ResponseStatus.Error, (IList<int>)null);
+                }
+
+                return Response.Create(status, (IList<int>)null);
+            }
+
+            byte[] bytes = message.GetBytes();
+            if ((bytes.Length < 8) || (bytes.Length < 8 + bytes[7]))
+            {
+                return Response.Create(ResponseStatus.Truncated, (IList<int>)null);
+            }
+
+            List<int> skipped = new List<int>();
+            for (int index = 0; index < bytes[7]; index++)
+            {
+                skipped.Add(bytes[8 + index]);
+            }
+
+            return Response.Create(ResponseStatus.Success, (IList<int>)skipped);
+        }
+
+        /// <summary>
+        /// Create a sector rewrite message. The patches are sent with the
+        /// image's data for each range, as in a patch list.
+        /// </summary>
+        /// <param name="block">The flash block to rewrite.</param>
+        /// <param name="crcBefore">CRC of the block in the PCM. Nothing is erased if the block has changed.</param>
+        /// <param name="crcAfter">CRC of the block in the image. Nothing is erased if the patches don't produce it.</param>
+        public Message CreateSectorRewriteMessage(byte[] image, MemoryRange block, UInt32 crcBefore, UInt32 crcAfter, IList<MemoryRange> patches)
+        {
+            int length = SectorRewriteHeaderSize;
+            foreach (MemoryRange patch in patches)
+            {
+                length += PatchListHeaderSize + (int)patch.Size;
+            }
+
+            byte[] buffer = new byte[10 + length + 2];
+            buffer[0] = Priority.Block;
+            buffer[1] = DeviceId.Pcm;
+            buffer[2] = DeviceId.Tool;
+            buffer[3] = Mode.PCMUpload;
+            buffer[4] = (byte)BlockCopyType.SectorRewrite;
+            buffer[5] = unchecked((byte)(length >> 8));
+            buffer[6] = unchecked((byte)(length & 0xFF));
+            buffer[7] = unchecked((byte)(block.Address >> 16));
+            buffer[8] = unchecked((byte)(block.Address >> 8));
+            buffer[9] = unchecked((byte)block.Address);
+            buffer[10] = unchecked((byte)(block.Size >> 16));
+            buffer[11] = unchecked((byte)(block.Size >> 8));
+            buffer[12] = unchecked((byte)block.Size);
+            buffer[13] = unchecked((byte)(crcBefore >> 24));
+            buffer[14] = unchecked((byte)(crcBefore >> 16));
+            buffer[15] = unchecked((byte)(crcBefore >> 8));
+            buffer[16] = unchecked((byte)crcBefore);
+            buffer[17] = unchecked((byte)(crcAfter >> 24));
+            buffer[18] = unchecked((byte)(crcAfter >> 16));
+            buffer[19] = unchecked((byte)(crcAfter >> 8));
+            buffer[20] = unchecked((byte)crcAfter);
+
+            int offset = 10 + SectorRewriteHeaderSize;
+            foreach (MemoryRange patch in patches)
+            {
+                buffer[offset + 0] = unchecked((byte)(patch.Address >> 16));
+                buffer[offset + 1] = unchecked((byte)(patch.Address >> 8));
+                buffer[offset + 2] = unchecked((byte)patch.Address);
+                buffer[offset + 3] = unchecked((byte)(patch.Size >> 8));
+                buffer[offset + 4] = unchecked((byte)patch.Size);
+                System.Buffer.BlockCopy(image, (int)patch.Address, buffer, offset + PatchListHeaderSize, (int)patch.Size);
+                offset += PatchListHeaderSize + (int)patch.Size;
+            }
+
+            return new Message(VpwUtilities.AddBlockChecksum(buffer));
+        }
+
+        /// <summary>
+        /// Parse the response to a sector rewrite. The value is zero if the
+        /// block was rewritten. Otherwise it's the kernel's reason, or the
+        /// flash status if programming failed.
+        /// </summary>
+        public Response<byte> ParseSectorRewriteResponse(Message message)
+        {
+            ResponseStatus status;
+            byte[] expected = { Priority.Block, DeviceId.Tool, DeviceId.Pcm, Mode.PCMUpload + Mode.Response, (byte)BlockCopyType.SectorRewrite };
+            if (TryVerifyInitialBytes(message, expected, out status))
+            {
+                return Response.Create(ResponseStatus.Success, (byte)0);
+            }
+
+            byte[] failed = { Priority.Block, DeviceId.Tool, DeviceId.Pcm, Mode.NegativeResponse, Mode.PCMUpload };
+            if (!TryVerifyInitialBytes(message, failed, out status))
+            {
+                return Response.Create(status, (byte)0);
+            }
+
+            byte[] bytes = message.GetBytes();
+            if (bytes.Length < 7)
+            {
+                return Response.Create(ResponseStatus.Truncated, (byte)0);
+            }
+
+            return Response.Create(ResponseStatus.Success, (bytes[5] != 0) ? bytes[5] : bytes[6]);
+        }
+
         /// <summary>
         /// Create a request to uploade size bytes to the given address
         /// </summary>
@@ -138,10 +404,12 @@ namespace PcmHacking
         /// </remarks>
         /// <param name="startAddress">Address of the first byte to read.</param>
         /// <param name="length">Number of bytes to read.</param>
+        /// <param name="allowCompression">Let the kernel send a run-length encoded reply. Kernels that don't support it will ignore this.</param>
         /// <returns></returns>
-        public Message CreateReadRequest(int startAddress, int length)
+        public Message CreateReadRequest(int startAddress, int length, bool allowCompression = false)
         {
-            byte[] request = { Priority.Block, DeviceId.Pcm, DeviceId.Tool, 0x35, 0x01, (byte)(length >> 8), (byte)(length & 0xFF), (byte)(startAddress >> 16), (byte)((startAddress >> 8) & 0xFF), (byte)(startAddress & 0xFF) };
+            byte submode = allowCompression ? (byte)0x02 : (byte)0x01;
+            byte[] request = { Priority.Block, DeviceId.Pcm, DeviceId.Tool, 0x35, submode, (byte)(length >> 8), (byte)(length & 0xFF), (byte)(startAddress >> 16), (byte)((startAddress >> 8) & 0xFF), (byte)(startAddress & 0xFF) };
             byte[] request2 = { Priority.Block, DeviceId.Pcm, DeviceId.Tool, 0x37, 0x01, (byte)(length >> 8), (byte)(length & 0xFF), (byte)(startAddress >> 24), (byte)(startAddress >> 16), (byte)((startAddress >> 8) & 0xFF), (byte)(startAddress & 0xFF) };
 
             if (startAddress > 0xFFFFFF)
@@ -154,6 +422,92 @@ namespace PcmHacking
             }
         }
 
+        /// <summary>
+        /// Create a request for a streaming read of an arbitrary address range.
+        /// </summary>
+        /// <remarks>
+        /// The kernel replies with consecutive mode-36 payloads, each of them
+        /// like the reply to a read request with compression allowed, without
+        /// waiting for a request for each block. Block N starts at
+        /// startAddress + (N * blockSize), so the address in each payload is
+        /// also its sequence number. The kernel sends at most 'window' blocks
+        /// past the last acknowledgement.
+        /// </remarks>
+        public Message CreateReadStreamRequest(int startAddress, int length, int blockSize, int window)
+        {
+            byte[] request =
+            {
+                Priority.Block, DeviceId.Pcm, DeviceId.Tool, 0x35, 0x03,
+                (byte)(blockSize >> 8), (byte)(blockSize & 0xFF),
+                (byte)(startAddress >> 16), (byte)((startAddress >> 8) & 0xFF), (byte)(startAddress & 0xFF),
+                (byte)(length >> 16), (byte)((length >> 8) & 0xFF), (byte)(length & 0xFF),
+                (byte)window,
+            };
+
+            return new Message(request);
+        }
+
+        /// <summary>
+        /// Tell the kernel that every block before this one has arrived, so it
+        /// can send more.
+        /// </summary>
+        public Message CreateReadStreamAcknowledge(int sequence)
+        {
+            return new Message(new byte[] { Priority.Block, DeviceId.Pcm, DeviceId.Tool, 0x35, 0x04, (byte)(sequence >> 8), (byte)(sequence & 0xFF) });
+        }
+
+        /// <summary>
+        /// Ask the kernel to send one block of the stream again.
+        /// </summary>
+        public Message CreateReadStreamResend(int sequence)
+        {
+            return new Message(new byte[] { Priority.Block, DeviceId.Pcm, DeviceId.Tool, 0x35, 0x05, (byte)(sequence >> 8), (byte)(sequence & 0xFF) });
+        }
+
+        /// <summary>
+        /// Parse one payload from a streaming read.
+        /// </summary>
+        /// <param name="sequence">The block number, or -1 if the message isn't part of the stream.</param>
+        /// <returns>Refused if the kernel rejected the stream request.</returns>
+        public Response<byte[]> ParseReadStreamPayload(Message message, int startAddress, int length, int blockSize, out int sequence)
+        {
+            sequence = -1;
+
+            byte[] actual = message.GetBytes();
+            byte[] refused = new byte[] { Priority.Block, DeviceId.Tool, DeviceId.Pcm, 0x7F, 0x35 };
+            if (TryVerifyInitialBytes(actual, refused, out ResponseStatus status))
+            {
+                return Response.Create(ResponseStatus.Refused, new byte[0]);
+            }
+
+            byte[] expected = new byte[] { Priority.Block, DeviceId.Tool, DeviceId.Pcm, Mode.PCMUpload };
+            if (!TryVerifyInitialBytes(actual, expected, out status))
+            {
+                return Response.Create(status, new byte[0]);
+            }
+
+            if (actual.Length < 10)
+            {
+                return Response.Create(ResponseStatus.Truncated, new byte[0]);
+            }
+
+            int offset = ((actual[7] << 16) + (actual[8] << 8) + actual[9]) - startAddress;
+            if ((offset < 0) || (offset >= length) || ((offset % blockSize) != 0))
+            {
+                return Response.Create(ResponseStatus.UnexpectedResponse, new byte[0]);
+            }
+
+            sequence = offset / blockSize;
+            int blockLength = Math.Min(blockSize, length - offset);
+            Response<byte[]> response = ParsePayload(message, blockLength, startAddress + offset);
+            if ((response.Status == ResponseStatus.Success) && (response.Value.Length != blockLength))
+            {
+                return Response.Create(ResponseStatus.Truncated, response.Value);
+            }
+
+            return response;
+        }
+
         /// <summary>
         /// Parse the payload of a read request.
         /// </summary>
@@ -210,19 +564,236 @@ namespace PcmHacking
             // RLE block
             else if (actual[4] == 2)
             {
-                // This isnt going to work with existing kernels... need to support variable length.
-                byte value = actual[10];
-                for (int index = 0; index < dataLength; index++)
+                if (actual.Length < 12)
                 {
-                    result[index] = value;
+                    return Response.Create(ResponseStatus.Truncated, new byte[0]);
                 }
 
-                return Response.Create(ResponseStatus.Error, result);
+                if (!TryExpandRunLength(actual, 10, actual.Length - 12, result))
+                {
+                    return Response.Create(ResponseStatus.Truncated, new byte[0]);
+                }
+
+                // The block sum covers the header and the decoded data.
+                UInt16 validSum = 0;
+                for (int index = 4; index < 10; index++)
+                {
+                    validSum += actual[index];
+                }
+
+                foreach (byte value in result)
+                {
+                    validSum += value;
+                }
+
+                int payloadSum = (actual[actual.Length - 2] << 8) + actual[actual.Length - 1];
+                if (payloadSum != validSum)
+                {
+                    return Response.Create(ResponseStatus.Error, result);
+                }
+
+                return Response.Create(ResponseStatus.Success, result);
             }
             else
             {
                 return Response.Create(ResponseStatus.Error, result);
             }
         }
+
+        /// <summary>
+        /// Expand a run-length encoded read payload.
+        /// </summary>
+        /// <remarks>
+        /// Each token starts with a control byte. 00-7F: that many literal bytes
+        /// (plus one) follow. 80-BF: a byte run; the low 6 bits and the next byte
+        /// are the count, then the value. C0-FF: a word run; the same count, in
+        /// words, then the two bytes of the word.
+        /// </remarks>
+        /// <returns>False if the encoding is malformed or doesn't fill the result exactly.</returns>
+        public static bool TryExpandRunLength(byte[] encoded, int offset, int count, byte[] result)
+        {
+            int index = offset;
+            int end = offset + count;
+            int output = 0;
+
+            while (index < end)
+            {
+                byte control = encoded[index++];
+                if (control < 0x80)
+                {
+                    int literal = control + 1;
+                    if ((index + literal > end) || (output + literal > result.Length))
+                    {
+                        return false;
+                    }
+
+                    Buffer.BlockCopy(encoded, index, result, output, literal);
+                    index += literal;
+                    output += literal;
+                    continue;
+                }
+
+                bool words = (control & 0x40) != 0;
+                int valueSize = words ? 2 : 1;
+                if (index + 1 + valueSize > end)
+                {
+                    return false;
+                }
+
+                int repeat = ((control & 0x3F) << 8) | encoded[index++];
+                if (output + (repeat * valueSize) > result.Length)
+                {
+                    return false;
+                }
+
+                for (int run = 0; run < repeat; run++)
+                {
+                    result[output++] = encoded[index];
+                    if (words)
+                    {
+                        result[output++] = encoded[index + 1];
+                    }
+                }
+
+                index += valueSize;
+            }
+
+            return output == result.Length;
+        }
+
+        /// <summary>
+        /// Run-length encode as much of a block as will fit in maxEncoded bytes,
+        /// in the format that TryExpandRunLength reads. This finds the same runs
+        /// as the kernel's encoder.
+        /// </summary>
+        /// <param name="consumed">Number of bytes encoded. Always even, since flash is written in words.</param>
+        public static byte[] CompressRunLength(byte[] data, int offset, int count, int maxEncoded, out int consumed)
+        {
+            count &= ~1;
+            for (;;)
+            {
+                List<byte> encoded = EncodeRunLength(data, offset, count, maxEncoded, out consumed);
+                if ((consumed & 1) == 0)
+                {
+                    return encoded.ToArray();
+                }
+
+                // Encoding one byte less can change the last token, so start over.
+                count = consumed - 1;
+            }
+        }
+
+        private const int RunLengthMaxLiteral = 128;
+        private const int RunLengthMaxCount = 0x3FFF;
+        private const int RunLengthMinBytes = 4;
+        private const int RunLengthMinWords = 3;
+
+        private static List<byte> EncodeRunLength(byte[] data, int offset, int count, int maxEncoded, out int consumed)
+        {
+            List<byte> encoded = new List<byte>();
+            int index = offset;
+            int end = offset + count;
+
+            while (index < end)
+            {
+                int repeat = ByteRunLength(data, index, end);
+                if (repeat >= RunLengthMinBytes)
+                {
+                    if (encoded.Count + 3 > maxEncoded)
+                    {
+                        break;
+                    }
+
+                    encoded.Add((byte)(0x80 | (repeat >> 8)));
+                    encoded.Add(unchecked((byte)repeat));
+                    encoded.Add(data[index]);
+                    index += repeat;
+                    continue;
+                }
+
+                repeat = WordRunLength(data, index, end);
+                if (repeat >= RunLengthMinWords)
+                {
+                    if (encoded.Count + 4 > maxEncoded)
+                    {
+                        break;
+                    }
+
+                    encoded.Add((byte)(0xC0 | (repeat >> 8)));
+                    encoded.Add(unchecked((byte)repeat));
+                    encoded.Add(data[index]);
+                    encoded.Add(data[index + 1]);
+                    index += repeat * 2;
+                    continue;
+                }
+
+                // Literal bytes, up to the next run worth encoding.
+                int literal = 1;
+                while ((index + literal < end) && (literal < RunLengthMaxLiteral) && !RunStartsAt(data, index + literal, end))
+                {
+                    literal++;
+                }
+
+                literal = Math.Min(literal, maxEncoded - encoded.Count - 1);
+                if (literal < 1)
+                {
+                    break;
+                }
+
+                encoded.Add((byte)(literal - 1));
+                for (int position = index; position < index + literal; position++)
+                {
+                    encoded.Add(data[position]);
+                }
+
+                index += literal;
+            }
+
+            consumed = index - offset;
+            return encoded;
+        }
+
+        private static int ByteRunLength(byte[] data, int index, int end)
+        {
+            int repeat = 1;
+            while ((index + repeat < end) && (data[index + repeat] == data[index]) && (repeat < RunLengthMaxCount))
+            {
+                repeat++;
+            }
+
+            return repeat;
+        }
+
+        private static int WordRunLength(byte[] data, int index, int end)
+        {
+            if (end - index < 2)
+            {
+                return 0;
+            }
+
+            int repeat = 1;
+            while ((index + (repeat * 2) + 1 < end) &&
+                (data[index + (repeat * 2)] == data[index]) &&
+                (data[index + (repeat * 2) + 1] == data[index + 1]) &&
+                (repeat < RunLengthMaxCount))
+            {
+                repeat++;
+            }
+
+            return repeat;
+        }
+
+        private static bool RunStartsAt(byte[] data, int index, int end)
+        {
+            if ((end - index >= RunLengthMinBytes) &&
+                (data[index + 1] == data[index]) && (data[index + 2] == data[index]) && (data[index + 3] == data[index]))
+            {
+                return true;
+            }
+
+            return (end - index >= RunLengthMinWords * 2) &&
+                (data[index + 2] == data[index]) && (data[index + 3] == data[index + 1]) &&
+                (data[index + 4] == data[index]) && (data[index + 5] == data[index + 1]);
+        }
     }
 }
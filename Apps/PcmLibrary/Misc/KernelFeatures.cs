@@ -0,0 +1,33 @@
+﻿using System;
+
+namespace PcmHacking
+{
+    /// <summary>
+    /// Optional features that a C kernel was built with (mode 3D, submode 0F).
+    /// </summary>
+    /// <remarks>
+    /// These match the Feature bits in the kernel's common.h. The P01 and P10
+    /// kernels don't have room for all of them, so a kernel can be new enough
+    /// for a feature and still not have it.
+    /// </remarks>
+    [Flags]
+    public enum KernelFeatures : UInt16
+    {
+        None = 0x0000,
+        PipelinedWrite = 0x0001,
+        CompressedRead = 0x0002,
+        CompressedWrite = 0x0004,
+        BlankScan = 0x0008,
+        BackgroundErase = 0x0010,
+        BatchErase = 0x0020,
+        StreamingRead = 0x0040,
+        PatchWrite = 0x0080,
+        SectorRewrite = 0x0100,
+        FullErase = 0x0200,
+        ProgressFrames = 0x0400,
+        CrcBatch = 0x0800,
+        Statistics = 0x1000,
+        BackgroundCrc = 0x2000,
+        All = 0x3FFF,
+    }
+}
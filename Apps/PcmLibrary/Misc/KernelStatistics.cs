@@ -0,0 +1,96 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+
+namespace PcmHacking
+{
+    /// <summary>
+    /// Performance counters from the kernel (mode 3D, submode 08).
+    /// </summary>
+    /// <remarks>
+    /// Kernels built with the Statistics feature (see KernelFeatures) keep
+    /// these counters all the time, so a slow session can be diagnosed from
+    /// the log without building a special kernel.
+    /// </remarks>
+    public class KernelStatistics
+    {
+        /// <summary>
+        /// Number of 4-byte counters in the kernel's reply.
+        /// </summary>
+        public const int CounterCount = 8;
+
+        public UInt32 BytesTransmitted { get; private set; }
+
+        public UInt32 BytesReceived { get; private set; }
+
+        /// <summary>
+        /// Times the kernel had to wait for room in the DLC transmit FIFO.
+        /// </summary>
+        public UInt32 TransmitStalls { get; private set; }
+
+        /// <summary>
+        /// Times the kernel gave up waiting for a message from the tool.
+        /// </summary>
+        public UInt32 ReadTimeouts { get; private set; }
+
+        /// <summary>
+        /// Mode 36 blocks that arrived with a bad block sum.
+        /// </summary>
+        public UInt32 ChecksumFailures { get; private set; }
+
+        /// <summary>
+        /// Status reads that found a flash word still programming.
+        /// </summary>
+        public UInt32 ProgramBusyPolls { get; private set; }
+
+        /// <summary>
+        /// Longest wait for a block erase, in status reads.
+        /// </summary>
+        public UInt32 MaxEraseIterations { get; private set; }
+
+        /// <summary>
+        /// Times the kernel checked for incoming data and found none.
+        /// </summary>
+        public UInt32 IdleSpins { get; private set; }
+
+        /// <summary>
+        /// Constructor. The counters are in the order that the kernel sends them.
+        /// </summary>
+        public KernelStatistics(UInt32[] counters)
+        {
+            if ((counters == null) || (counters.Length < CounterCount))
+            {
+                throw new ArgumentException("Not enough counters.", nameof(counters));
+            }
+
+            this.BytesTransmitted = counters[0];
+            this.BytesReceived = counters[1];
+            this.TransmitStalls = counters[2];
+            this.ReadTimeouts = counters[3];
+            this.ChecksumFailures = counters[4];
+            this.ProgramBusyPolls = counters[5];
+            this.MaxEraseIterations = counters[6];
+            this.IdleSpins = counters[7];
+        }
+
+        /// <summary>
+        /// Write the counters to the debug log, with a one-line summary for the user.
+        /// </summary>
+        public void Report(ILogger logger)
+        {
+            logger.AddUserMessage(
+                string.Format(
+                    "Kernel sent {0:n0} bytes and received {1:n0}, with {2:n0} transmit stalls and {3:n0} checksum failures.",
+                    this.BytesTransmitted,
+                    this.BytesReceived,
+                    this.TransmitStalls,
+                    this.ChecksumFailures));
+
+            logger.AddDebugMessage("Kernel read timeouts: " + this.ReadTimeouts);
+            logger.AddDebugMessage("Kernel program busy polls: " + this.ProgramBusyPolls);
+            logger.AddDebugMessage("Kernel max erase iterations: " + this.MaxEraseIterations);
+            logger.AddDebugMessage("Kernel idle spins: " + this.IdleSpins);
+        }
+    }
+}
@@ -50,6 +50,13 @@ namespace PcmHacking
 
         public int MaxTimeouts { get; set; }
 
+        /// <summary>
+        /// Optional handler for progress frames from the kernel. It returns
+        /// true for messages that it recognizes as progress frames, which
+        /// don't count as receive attempts, and reset the timeout count.
+        /// </summary>
+        public Func<Message, bool> Progress { get; set; }
+
         /// <summary>
         /// Constructor.
         /// </summary>
@@ -123,6 +130,15 @@ namespace PcmHacking
                         continue;
                     }
 
+                    // A progress frame shows that the PCM is still working on
+                    // the request, so it's not another reason to give up.
+                    if ((this.Progress != null) && this.Progress(received))
+                    {
+                        timeouts = 0;
+                        receiveAttempt--;
+                        continue;
+                    }
+
                     Response<T> result = this.filter(received);
                     if (result.Status == ResponseStatus.Success)
                     {
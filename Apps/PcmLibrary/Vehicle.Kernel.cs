@@ -254,6 +254,89 @@ namespace PcmHacking
             return 0;
         }
 
+        /// <summary>
+        /// Ask the kernel for its performance counters, log them, and reset them
+        /// so the next operation starts from zero. Older kernels don't support
+        /// this, so there's only one attempt and failures are not errors.
+        /// </summary>
+        public async Task ReportKernelStatistics(CancellationToken cancellationToken)
+        {
+            await this.SetDeviceTimeout(TimeoutScenario.ReadProperty);
+            Query<KernelStatistics> query = this.CreateQuery<KernelStatistics>(
+                () => this.protocol.CreateKernelStatisticsQuery(true),
+                this.protocol.ParseKernelStatistics,
+                cancellationToken);
+            query.MaxTimeouts = 1;
+
+            Response<KernelStatistics> response = await query.Execute();
+            if (response.Status != ResponseStatus.Success)
+            {
+                this.logger.AddDebugMessage("Kernel statistics not available: " + response.Status);
+                return;
+            }
+
+            response.Value.Report(this.logger);
+        }
+
+        /// <summary>
+        /// Find out which optional features the running kernel was built with.
+        /// Kernels from before the feature query have every feature that their
+        /// version supports. If the query fails, assume there are none.
+        /// </summary>
+        public async Task<KernelFeatures> GetKernelFeatures(UInt32 kernelVersion, CancellationToken cancellationToken)
+        {
+            if (!Protocol.SupportsFeatureQuery(kernelVersion))
+            {
+                return KernelFeatures.All;
+            }
+
+            await this.SetDeviceTimeout(TimeoutScenario.ReadProperty);
+            Query<KernelFeatures> query = this.CreateQuery<KernelFeatures>(
+                this.protocol.CreateKernelFeaturesQuery,
+                this.protocol.ParseKernelFeatures,
+                cancellationToken);
+
+            Response<KernelFeatures> response = await query.Execute();
+            if (response.Status != ResponseStatus.Success)
+            {
+                this.logger.AddDebugMessage("Unable to get kernel features: " + response.Status);
+                return KernelFeatures.None;
+            }
+
+            this.logger.AddDebugMessage("Kernel features: " + response.Value);
+            return response.Value;
+        }
+
+        /// <summary>
+        /// Ask the kernel which chunks of flash are entirely erased. Returns
+        /// null if the kernel can't tell us, so the caller reads everything.
+        /// </summary>
+        public async Task<bool[]> QueryBlankChunks(int imageSize, CancellationToken cancellationToken)
+        {
+            int chunkCount = imageSize / Protocol.BlankScanChunkSize;
+            if ((chunkCount < 1) || (chunkCount > Protocol.MaxBlankScanChunks))
+            {
+                return null;
+            }
+
+            // Scanning the whole chip takes a fraction of a second.
+            await this.SetDeviceTimeout(TimeoutScenario.ReadCrc);
+            Query<bool[]> query = this.CreateQuery<bool[]>(
+                () => this.protocol.CreateBlankScanQuery(0, chunkCount),
+                (message) => this.protocol.ParseBlankScan(message, 0, chunkCount),
+                cancellationToken);
+            query.MaxTimeouts = 1;
+
+            Response<bool[]> response = await query.Execute();
+            if (response.Status != ResponseStatus.Success)
+            {
+                this.logger.AddDebugMessage("Blank scan not available: " + response.Status);
+                return null;
+            }
+
+            return response.Value;
+        }
+
         /// <summary>
         /// Check for a running kernel.
         /// </summary>
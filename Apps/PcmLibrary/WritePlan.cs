@@ -0,0 +1,231 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+
+namespace PcmHacking
+{
+    /// <summary>
+    /// Decides which flash ranges need to be erased and rewritten.
+    /// </summary>
+    /// <remarks>
+    /// This relies on the CRCs that CKernelVerifier.CompareRanges stores in
+    /// each range. Ranges whose CRC from the PCM matches the CRC from the file
+    /// are left alone, so a small change to the calibration only costs one
+    /// erase and one block of writes, rather than all of them.
+    /// </remarks>
+    public class WritePlan
+    {
+        /// <summary>
+        /// Rough time to erase one range. The data sheets for both the Intel
+        /// and AMD chips give about one second as the typical block erase time.
+        /// The worst case is much longer, so this is only good for estimates.
+        /// </summary>
+        public const double EraseSecondsPerRange = 1.0;
+
+        /// <summary>
+        /// Ranges that must be erased and rewritten, in the chip's order.
+        /// </summary>
+        public IList<MemoryRange> RangesToWrite { get; private set; }
+
+        /// <summary>
+        /// Relevant ranges that already match the file.
+        /// </summary>
+        public IList<MemoryRange> UnchangedRanges { get; private set; }
+
+        /// <summary>
+        /// Ranges that were brought up to date without an erase.
+        /// </summary>
+        public IList<MemoryRange> PatchedRanges { get; private set; }
+
+        /// <summary>
+        /// Number of bytes that will be erased and rewritten.
+        /// </summary>
+        public UInt32 BytesToWrite { get; private set; }
+
+        /// <summary>
+        /// Number of bytes that can be skipped because they already match.
+        /// </summary>
+        public UInt32 UnchangedBytes { get; private set; }
+
+        /// <summary>
+        /// Constructor. Sorts the chip's ranges into changed and unchanged.
+        /// </summary>
+        /// <param name="ranges">Ranges from the flash chip, with CRCs from CompareRanges.</param>
+        /// <param name="relevantBlocks">Block types that the user wants to write.</param>
+        /// <param name="imageSize">Usable size of the PCM's flash.</param>
+        /// <param name="testWrite">Test writes process every relevant range.</param>
+        public WritePlan(IEnumerable<MemoryRange> ranges, BlockType relevantBlocks, int imageSize, bool testWrite)
+        {
+            this.RangesToWrite = new List<MemoryRange>();
+            this.UnchangedRanges = new List<MemoryRange>();
+            this.PatchedRanges = new List<MemoryRange>();
+
+            foreach (MemoryRange range in ranges)
+            {
+                // The P10 has the same flash chip as the P59, but the high bit of the address bus
+                // isn't connected, so there will be hardware errors talking to the top 512kb.
+                // So, we skip ranges that are beyond the size of the usable image.
+                if (range.Address >= imageSize)
+                {
+                    continue;
+                }
+
+                // Skip irrelevant blocks.
+                if ((range.Type & relevantBlocks) == 0)
+                {
+                    continue;
+                }
+
+                if ((range.ActualCrc == range.DesiredCrc) && !testWrite)
+                {
+                    this.UnchangedRanges.Add(range);
+                    this.UnchangedBytes += range.Size;
+                }
+                else
+                {
+                    this.RangesToWrite.Add(range);
+                    this.BytesToWrite += range.Size;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Record that a range no longer needs to be erased and rewritten,
+        /// because its differences were programmed in place.
+        /// </summary>
+        public void MarkPatched(MemoryRange range)
+        {
+            if (this.RangesToWrite.Remove(range))
+            {
+                this.PatchedRanges.Add(range);
+                this.BytesToWrite -= range.Size;
+            }
+        }
+
+        /// <summary>
+        /// Find out whether the ranges to write are every block that a full
+        /// erase would erase, so the kernel can erase them with one request.
+        /// The boot block and the parameter blocks are optional, but the
+        /// parameter blocks must be all in or all out.
+        /// </summary>
+        /// <param name="ranges">Ranges from the flash chip.</param>
+        /// <param name="imageSize">Usable size of the PCM's flash.</param>
+        public bool CoversChip(IEnumerable<MemoryRange> ranges, int imageSize, out bool includeBoot, out bool includeParameters)
+        {
+            includeBoot = false;
+            includeParameters = false;
+
+            int parameterRanges = 0;
+            int parameterRangesToWrite = 0;
+            foreach (MemoryRange range in ranges)
+            {
+                if (range.Address >= imageSize)
+                {
+                    continue;
+                }
+
+                bool writing = this.RangesToWrite.Contains(range);
+                switch (range.Type)
+                {
+                    case BlockType.Boot:
+                        includeBoot |= writing;
+                        break;
+
+                    case BlockType.Parameter:
+                        parameterRanges++;
+                        parameterRangesToWrite += writing ? 1 : 0;
+                        break;
+
+                    default:
+                        if (!writing)
+                        {
+                            return false;
+                        }
+                        break;
+                }
+            }
+
+            if ((parameterRangesToWrite != 0) && (parameterRangesToWrite != parameterRanges))
+            {
+                return false;
+            }
+
+            includeParameters = parameterRangesToWrite != 0;
+            return true;
+        }
+
+        /// <summary>
+        /// Check whether flash that holds the given data can be programmed to
+        /// match the file, starting at the given address, without an erase.
+        /// Programming can only clear bits.
+        /// </summary>
+        public static bool OnlyClearsBits(byte[] flash, byte[] image, UInt32 address)
+        {
+            for (int index = 0; index < flash.Length; index++)
+            {
+                byte wanted = image[address + index];
+                if ((flash[index] & wanted) != wanted)
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        /// <summary>
+        /// Estimate how long it will take to erase and write the given ranges.
+        /// </summary>
+        public static TimeSpan EstimateTime(IEnumerable<MemoryRange> ranges, double bytesPerSecond)
+        {
+            double seconds = 0;
+            foreach (MemoryRange range in ranges)
+            {
+                seconds += EraseSecondsPerRange;
+                if (bytesPerSecond > 0)
+                {
+                    seconds += range.Size / bytesPerSecond;
+                }
+            }
+
+            return TimeSpan.FromSeconds(seconds);
+        }
+
+        /// <summary>
+        /// Describe the plan, and how much time it saves compared to rewriting
+        /// every relevant range.
+        /// </summary>
+        public void Report(ILogger logger, double bytesPerSecond)
+        {
+            logger.AddUserMessage(
+                string.Format(
+                    "{0} of {1} ranges differ from the file, {2:n0} bytes to erase and rewrite.",
+                    this.RangesToWrite.Count,
+                    this.RangesToWrite.Count + this.UnchangedRanges.Count,
+                    this.BytesToWrite));
+
+            foreach (MemoryRange range in this.RangesToWrite)
+            {
+                logger.AddDebugMessage(
+                    string.Format(
+                        "Plan: write {0:X6}-{1:X6} ({2})",
+                        range.Address,
+                        range.Address + (range.Size - 1),
+                        range.Type));
+            }
+
+            logger.AddUserMessage("Estimated time to write: " + EstimateTime(this.RangesToWrite, bytesPerSecond).ToString("mm\\:ss"));
+
+            if (this.UnchangedRanges.Count > 0)
+            {
+                logger.AddUserMessage(
+                    string.Format(
+                        "Skipping {0} unchanged ranges ({1:n0} bytes) saves about {2}.",
+                        this.UnchangedRanges.Count,
+                        this.UnchangedBytes,
+                        EstimateTime(this.UnchangedRanges, bytesPerSecond).ToString("mm\\:ss")));
+            }
+        }
+    }
+}
@@ -0,0 +1,145 @@
+﻿using System;
+using System.Collections.Generic;
+using PcmHacking;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+
+namespace Tests
+{
+    [TestClass]
+    public class BackgroundEraseTests
+    {
+        [TestMethod]
+        public void EraseStartRequestLayout()
+        {
+            Protocol protocol = new Protocol();
+            byte[] bytes = protocol.CreateFlashEraseStartRequest(0x012000).GetBytes();
+            CollectionAssert.AreEqual(
+                new byte[] { Priority.Physical0, DeviceId.Pcm, DeviceId.Tool, 0x3D, 0x0A, 0x01, 0x20, 0x00 },
+                bytes,
+                "Request");
+        }
+
+        [TestMethod]
+        public void EraseBatchRequestLayout()
+        {
+            Protocol protocol = new Protocol();
+            List<MemoryRange> ranges = new List<MemoryRange>()
+            {
+                new MemoryRange(0x020000, 0x20000, BlockType.OperatingSystem),
+                new MemoryRange(0x1C0000, 0x40000, BlockType.OperatingSystem),
+            };
+
+            byte[] bytes = protocol.CreateFlashEraseBatchRequest(ranges).GetBytes();
+            CollectionAssert.AreEqual(
+                new byte[] { Priority.Physical0, DeviceId.Pcm, DeviceId.Tool, 0x3D, 0x0C, 0x02, 0x02, 0x00, 0x00, 0x1C, 0x00, 0x00 },
+                bytes,
+                "Request");
+        }
+
+        [TestMethod]
+        public void EraseStatusIsParsed()
+        {
+            Protocol protocol = new Protocol();
+
+            byte[] busy = { Priority.Physical0, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x0B, 0x00, 0x01 };
+            Response<int> response = protocol.ParseFlashEraseStatus(new Message(busy));
+            Assert.AreEqual(ResponseStatus.Success, response.Status, "Busy status");
+            Assert.AreEqual(-1, response.Value, "Busy");
+
+            byte[] done = { Priority.Physical0, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x0B, 0x00, 0x00 };
+            Assert.AreEqual(0, protocol.ParseFlashEraseStatus(new Message(done)).Value, "Done");
+
+            byte[] failed = { Priority.Physical0, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x0B, 0xA0, 0x00 };
+            Assert.AreEqual(0xA0, protocol.ParseFlashEraseStatus(new Message(failed)).Value, "Failed");
+
+            byte[] truncated = { Priority.Physical0, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x0B, 0x00 };
+            Assert.AreEqual(ResponseStatus.Truncated, protocol.ParseFlashEraseStatus(new Message(truncated)).Status, "Truncated");
+        }
+
+        [TestMethod]
+        public void BackgroundEraseNeedsNewerCKernel()
+        {
+            Assert.IsTrue(Protocol.SupportsBackgroundErase(0x01030801), "P01 1.3.8");
+            Assert.IsFalse(Protocol.SupportsBackgroundErase(0x01030701), "P01 1.3.7");
+            Assert.IsFalse(Protocol.SupportsBackgroundErase(0x080204FC), "P04");
+        }
+
+        [TestMethod]
+        public void BatchEraseNeedsNewerCKernel()
+        {
+            Assert.IsTrue(Protocol.SupportsBatchErase(0x0103090A), "P10 1.3.9");
+            Assert.IsFalse(Protocol.SupportsBatchErase(0x0103080A), "P10 1.3.8");
+        }
+
+        [TestMethod]
+        public void EraseChipRequestLayout()
+        {
+            Protocol protocol = new Protocol();
+            CollectionAssert.AreEqual(
+                new byte[] { Priority.Physical0, DeviceId.Pcm, DeviceId.Tool, 0x3D, 0x06, 0x00, 0xFF, 0x08 },
+                protocol.CreateFlashEraseChipRequest(false, false, 8).GetBytes(),
+                "Boot and parameters preserved");
+            CollectionAssert.AreEqual(
+                new byte[] { Priority.Physical0, DeviceId.Pcm, DeviceId.Tool, 0x3D, 0x06, 0x03, 0xFC, 0x0B },
+                protocol.CreateFlashEraseChipRequest(true, true, 11).GetBytes(),
+                "Everything");
+        }
+
+        [TestMethod]
+        public void EraseProgressIsParsed()
+        {
+            Protocol protocol = new Protocol();
+
+            byte[] progress = { Priority.Physical0, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x0B, 0x00, 0x01, 0x03, 0x09 };
+            Assert.IsTrue(protocol.TryParseFlashEraseProgress(new Message(progress), out int finished, out int total), "Progress");
+            Assert.AreEqual(3, finished, "Finished");
+            Assert.AreEqual(9, total, "Total");
+            Assert.AreEqual(-1, protocol.ParseFlashEraseStatus(new Message(progress)).Value, "Busy");
+
+            byte[] older = { Priority.Physical0, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x0B, 0x00, 0x01 };
+            Assert.IsFalse(protocol.TryParseFlashEraseProgress(new Message(older), out finished, out total), "Older kernel");
+        }
+
+        [TestMethod]
+        public void FullEraseNeedsNewerCKernel()
+        {
+            Assert.IsTrue(Protocol.SupportsFullErase(0x01030D01), "P01 1.3.13");
+            Assert.IsFalse(Protocol.SupportsFullErase(0x01030C01), "P01 1.3.12");
+        }
+
+        [TestMethod]
+        public void ProgressFramesRequestLayout()
+        {
+            Protocol protocol = new Protocol();
+            CollectionAssert.AreEqual(
+                new byte[] { Priority.Physical0, DeviceId.Pcm, DeviceId.Tool, 0x3D, 0x0D, 0x01, 0x00 },
+                protocol.CreateProgressFramesRequest(0x100).GetBytes(),
+                "Request");
+        }
+
+        [TestMethod]
+        public void ProgressFrameIsParsed()
+        {
+            Protocol protocol = new Protocol();
+
+            byte[] frame = { Priority.Physical0, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x0E, 0x05, 0x00, 0x02, 0x00, 0x00, 0x80 };
+            Assert.IsTrue(protocol.TryParseProgressFrame(new Message(frame), out byte operation, out UInt32 polls, out byte status), "Frame");
+            Assert.AreEqual(0x05, operation, "Operation");
+            Assert.AreEqual(0x20000u, polls, "Polls");
+            Assert.AreEqual(0x80, status, "Status");
+
+            // A frame is not a reply to the erase request.
+            Assert.AreNotEqual(ResponseStatus.Success, protocol.ParseFlashEraseBlock(new Message(frame)).Status, "Erase reply");
+
+            byte[] reply = { Priority.Physical0, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x05, 0x00, 0x00 };
+            Assert.IsFalse(protocol.TryParseProgressFrame(new Message(reply), out operation, out polls, out status), "Erase reply");
+        }
+
+        [TestMethod]
+        public void ProgressFramesNeedNewerCKernel()
+        {
+            Assert.IsTrue(Protocol.SupportsProgressFrames(0x01030E01), "P01 1.3.14");
+            Assert.IsFalse(Protocol.SupportsProgressFrames(0x01030D01), "P01 1.3.13");
+        }
+    }
+}
@@ -0,0 +1,60 @@
+﻿using System;
+using System.Collections.Generic;
+using PcmHacking;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+
+namespace Tests
+{
+    [TestClass]
+    public class BlankScanTests
+    {
+        [TestMethod]
+        public void BlankScanQueryLayout()
+        {
+            Protocol protocol = new Protocol();
+            byte[] bytes = protocol.CreateBlankScanQuery(0x010000, 0x200).GetBytes();
+            CollectionAssert.AreEqual(
+                new byte[] { Priority.Physical0, DeviceId.Pcm, DeviceId.Tool, 0x3D, 0x09, 0x01, 0x00, 0x00, 0x02, 0x00 },
+                bytes,
+                "Query");
+        }
+
+        [TestMethod]
+        public void BlankScanBitmapIsParsed()
+        {
+            // 10 chunks: 0, 7, 8 and 9 are blank.
+            byte[] reply = { Priority.Physical0, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x09, 0x00, 0x00, 0x00, 0x00, 0x0A, 0x81, 0xC0 };
+            Protocol protocol = new Protocol();
+            Response<bool[]> response = protocol.ParseBlankScan(new Message(reply), 0, 10);
+
+            Assert.AreEqual(ResponseStatus.Success, response.Status, "Status");
+            CollectionAssert.AreEqual(
+                new bool[] { true, false, false, false, false, false, false, true, true, true },
+                response.Value,
+                "Bitmap");
+        }
+
+        [TestMethod]
+        public void BlankScanReplyMustMatchQuery()
+        {
+            byte[] reply = { Priority.Physical0, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x09, 0x00, 0x00, 0x00, 0x00, 0x10, 0xFF, 0xFF };
+            Protocol protocol = new Protocol();
+
+            Assert.AreEqual(ResponseStatus.Success, protocol.ParseBlankScan(new Message(reply), 0, 0x10).Status, "Match");
+            Assert.AreNotEqual(ResponseStatus.Success, protocol.ParseBlankScan(new Message(reply), 0, 0x20).Status, "Count");
+            Assert.AreNotEqual(ResponseStatus.Success, protocol.ParseBlankScan(new Message(reply), 0x1000, 0x10).Status, "Address");
+
+            byte[] truncated = new byte[reply.Length - 1];
+            Buffer.BlockCopy(reply, 0, truncated, 0, truncated.Length);
+            Assert.AreEqual(ResponseStatus.Truncated, protocol.ParseBlankScan(new Message(truncated), 0, 0x10).Status, "Truncated");
+        }
+
+        [TestMethod]
+        public void BlankScanNeedsNewerCKernel()
+        {
+            Assert.IsTrue(Protocol.SupportsBlankScan(0x01030701), "P01 1.3.7");
+            Assert.IsFalse(Protocol.SupportsBlankScan(0x01030601), "P01 1.3.6");
+            Assert.IsFalse(Protocol.SupportsBlankScan(0x080204FC), "P04");
+        }
+    }
+}
@@ -0,0 +1,115 @@
+﻿using System;
+using System.Collections.Generic;
+using PcmHacking;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+
+namespace Tests
+{
+    [TestClass]
+    public class CompressedWriteTests
+    {
+        private static byte[] CreateImage()
+        {
+            // Blank space, code, padding words, then more blank space.
+            byte[] image = new byte[8192];
+            for (int index = 0; index < image.Length; index++)
+            {
+                image[index] = 0xFF;
+            }
+
+            for (int index = 1000; index < 2000; index++)
+            {
+                image[index] = (byte)((index * 7) ^ (index >> 5));
+            }
+
+            for (int index = 2000; index < 3000; index += 2)
+            {
+                image[index] = 0x4E;
+                image[index + 1] = 0x71;
+            }
+
+            return image;
+        }
+
+        private static byte[] Slice(byte[] data, int offset, int length)
+        {
+            byte[] result = new byte[length];
+            Buffer.BlockCopy(data, offset, result, 0, length);
+            return result;
+        }
+
+        [TestMethod]
+        public void CompressedBlockRoundTrips()
+        {
+            byte[] image = CreateImage();
+            int consumed;
+            byte[] encoded = Protocol.CompressRunLength(image, 0, 4096, 4096, out consumed);
+
+            Assert.AreEqual(4096, consumed, "Consumed");
+            Assert.IsTrue(encoded.Length < 1100, "Encoded length " + encoded.Length);
+
+            byte[] decoded = new byte[consumed];
+            Assert.IsTrue(Protocol.TryExpandRunLength(encoded, 0, encoded.Length, decoded), "Expand");
+            CollectionAssert.AreEqual(Slice(image, 0, consumed), decoded, "Data");
+        }
+
+        [TestMethod]
+        public void CompressionStopsAtEncodedLimit()
+        {
+            byte[] image = CreateImage();
+            for (int limit = 20; limit < 600; limit += 37)
+            {
+                int consumed;
+                byte[] encoded = Protocol.CompressRunLength(image, 999, 4096, limit, out consumed);
+
+                Assert.IsTrue(encoded.Length <= limit, "Encoded length " + encoded.Length);
+                Assert.AreEqual(0, consumed & 1, "Odd length " + consumed);
+
+                byte[] decoded = new byte[consumed];
+                Assert.IsTrue(Protocol.TryExpandRunLength(encoded, 0, encoded.Length, decoded), "Expand");
+                CollectionAssert.AreEqual(Slice(image, 999, consumed), decoded, "Data");
+            }
+        }
+
+        [TestMethod]
+        public void CompressedBlockSumCoversDecodedData()
+        {
+            byte[] image = CreateImage();
+            int consumed;
+            byte[] encoded = Protocol.CompressRunLength(image, 2000, 1000, 100, out consumed);
+
+            Protocol protocol = new Protocol();
+            Message message = protocol.CreateCompressedBlockMessage(image, 2000, consumed, encoded, 0x12000, BlockCopyType.CompressedPipelinedDifferentialWrite);
+            byte[] bytes = message.GetBytes();
+
+            Assert.AreEqual(0x3D, bytes[4], "Command");
+            Assert.AreEqual(encoded.Length, (bytes[5] << 8) | bytes[6], "Length");
+            Assert.AreEqual(0x012000, (bytes[7] << 16) | (bytes[8] << 8) | bytes[9], "Address");
+
+            UInt16 sum = 0;
+            for (int index = 4; index < 10; index++)
+            {
+                sum += bytes[index];
+            }
+
+            for (int index = 2000; index < 2000 + consumed; index++)
+            {
+                sum += image[index];
+            }
+
+            Assert.AreEqual(sum, (bytes[bytes.Length - 2] << 8) | bytes[bytes.Length - 1], "Sum");
+        }
+
+        [TestMethod]
+        public void CompressedWritesNeedNewerCKernel()
+        {
+            Assert.IsTrue(Protocol.SupportsCompressedWrite(0x01030601), "P01 1.3.6");
+            Assert.IsTrue(Protocol.SupportsCompressedWrite(0x0103060C), "P12 1.3.6");
+            Assert.IsTrue(Protocol.SupportsCompressedWrite(0x0104000A), "P10 1.4.0");
+            Assert.IsFalse(Protocol.SupportsCompressedWrite(0x01030501), "P01 1.3.5");
+            Assert.IsFalse(Protocol.SupportsCompressedWrite(0x080204FC), "P04");
+            Assert.IsFalse(Protocol.SupportsCompressedWrite(0x82400000), "Assembly kernel");
+            Assert.IsFalse(Protocol.SupportsCompressedWrite(0), "No kernel");
+        }
+    }
+}
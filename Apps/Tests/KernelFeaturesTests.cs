@@ -0,0 +1,55 @@
+﻿using System;
+using PcmHacking;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+
+namespace Tests
+{
+    [TestClass]
+    public class KernelFeaturesTests
+    {
+        [TestMethod]
+        public void KernelFeaturesQueryLayout()
+        {
+            Protocol protocol = new Protocol();
+            byte[] bytes = protocol.CreateKernelFeaturesQuery().GetBytes();
+            CollectionAssert.AreEqual(
+                new byte[] { Priority.Physical0, DeviceId.Pcm, DeviceId.Tool, 0x3D, 0x0F },
+                bytes,
+                "Query");
+        }
+
+        [TestMethod]
+        public void KernelFeaturesAreParsed()
+        {
+            byte[] reply = { Priority.Physical0, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x0F, 0x10, 0x09 };
+            Protocol protocol = new Protocol();
+            Response<KernelFeatures> response = protocol.ParseKernelFeatures(new Message(reply));
+
+            Assert.AreEqual(ResponseStatus.Success, response.Status, "Status");
+            Assert.AreEqual(
+                KernelFeatures.Statistics | KernelFeatures.BlankScan | KernelFeatures.PipelinedWrite,
+                response.Value,
+                "Features");
+        }
+
+        [TestMethod]
+        public void KernelFeaturesReplyMustMatchQuery()
+        {
+            Protocol protocol = new Protocol();
+            byte[] other = { Priority.Physical0, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x08, 0x10, 0x09 };
+            Assert.AreNotEqual(ResponseStatus.Success, protocol.ParseKernelFeatures(new Message(other)).Status, "Submode");
+
+            byte[] truncated = { Priority.Physical0, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x0F, 0x10 };
+            Assert.AreEqual(ResponseStatus.Truncated, protocol.ParseKernelFeatures(new Message(truncated)).Status, "Truncated");
+        }
+
+        [TestMethod]
+        public void KernelFeaturesNeedNewerCKernel()
+        {
+            Assert.IsTrue(Protocol.SupportsFeatureQuery(0x01030F01), "P01 1.3.15");
+            Assert.IsTrue(Protocol.SupportsFeatureQuery(0x01030F0A), "P10 1.3.15");
+            Assert.IsFalse(Protocol.SupportsFeatureQuery(0x01030E01), "P01 1.3.14");
+            Assert.IsFalse(Protocol.SupportsFeatureQuery(0x080204FC), "P04");
+        }
+    }
+}
@@ -0,0 +1,167 @@
+﻿using System;
+using System.Collections.Generic;
+using PcmHacking;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+
+namespace Tests
+{
+    [TestClass]
+    public class PatchWriteTests
+    {
+        [TestMethod]
+        public void PatchListLayout()
+        {
+            byte[] image = new byte[0x20000];
+            image[0x012000] = 0x12;
+            image[0x012001] = 0x34;
+            image[0x01FFFE] = 0x56;
+            image[0x01FFFF] = 0x78;
+
+            List<MemoryRange> patches = new List<MemoryRange>()
+            {
+                new MemoryRange(0x012000, 2, BlockType.Calibration),
+                new MemoryRange(0x01FFFE, 2, BlockType.Calibration),
+            };
+
+            Protocol protocol = new Protocol();
+            byte[] bytes = protocol.CreatePatchListMessage(image, patches).GetBytes();
+
+            UInt16 sum = 0x0E + 0x0E + 0x01 + 0x20 + 0x02 + 0x12 + 0x34 + 0x01 + 0xFF + 0xFE + 0x02 + 0x56 + 0x78;
+            CollectionAssert.AreEqual(
+                new byte[]
+                {
+                    Priority.Block, DeviceId.Pcm, DeviceId.Tool, 0x36, 0x0E, 0x00, 0x0E, 0x00, 0x00, 0x00,
+                    0x01, 0x20, 0x00, 0x00, 0x02, 0x12, 0x34,
+                    0x01, 0xFF, 0xFE, 0x00, 0x02, 0x56, 0x78,
+                    (byte)(sum >> 8), (byte)sum,
+                },
+                bytes,
+                "Message");
+        }
+
+        [TestMethod]
+        public void PatchListResponseIsParsed()
+        {
+            Protocol protocol = new Protocol();
+
+            byte[] allProgrammed = { Priority.Block, DeviceId.Tool, DeviceId.Pcm, 0x76, 0x0E, 0x00, 0x40, 0x00 };
+            Response<IList<int>> response = protocol.ParsePatchListResponse(new Message(allProgrammed));
+            Assert.AreEqual(ResponseStatus.Success, response.Status, "All programmed status");
+            Assert.AreEqual(0, response.Value.Count, "All programmed");
+
+            byte[] someSkipped = { Priority.Block, DeviceId.Tool, DeviceId.Pcm, 0x76, 0x0E, 0x00, 0x01, 0x02, 0x01, 0x03 };
+            response = protocol.ParsePatchListResponse(new Message(someSkipped));
+            CollectionAssert.AreEqual(new int[] { 1, 3 }, new List<int>(response.Value), "Skipped");
+
+            byte[] truncated = { Priority.Block, DeviceId.Tool, DeviceId.Pcm, 0x76, 0x0E, 0x00, 0x01, 0x02, 0x01 };
+            Assert.AreEqual(ResponseStatus.Truncated, protocol.ParsePatchListResponse(new Message(truncated)).Status, "Truncated");
+
+            byte[] malformed = { Priority.Block, DeviceId.Tool, DeviceId.Pcm, 0x7F, 0x36, 0xBE, 0x00 };
+            Assert.AreEqual(ResponseStatus.Refused, protocol.ParsePatchListResponse(new Message(malformed)).Status, "Malformed");
+
+            byte[] flashError = { Priority.Block, DeviceId.Tool, DeviceId.Pcm, 0x7F, 0x36, 0x00, 0xA0 };
+            Assert.AreEqual(ResponseStatus.Error, protocol.ParsePatchListResponse(new Message(flashError)).Status, "Flash error");
+
+            byte[] plainWrite = { Priority.Block, DeviceId.Tool, DeviceId.Pcm, 0x76 };
+            Assert.AreNotEqual(ResponseStatus.Success, protocol.ParsePatchListResponse(new Message(plainWrite)).Status, "Plain write");
+        }
+
+        [TestMethod]
+        public void OnlyClearsBits()
+        {
+            byte[] image = new byte[0x100];
+            image[0x80] = 0x12;
+            image[0x81] = 0xF0;
+
+            Assert.IsTrue(WritePlan.OnlyClearsBits(new byte[] { 0xFF, 0xFF }, image, 0x80), "Blank");
+            Assert.IsTrue(WritePlan.OnlyClearsBits(new byte[] { 0x13, 0xF0 }, image, 0x80), "Clears one bit");
+            Assert.IsFalse(WritePlan.OnlyClearsBits(new byte[] { 0x12, 0x70 }, image, 0x80), "Sets one bit");
+        }
+
+        [TestMethod]
+        public void SectorRewriteLayout()
+        {
+            byte[] image = new byte[0x10000];
+            image[0x006010] = 0xAB;
+            image[0x006011] = 0xCD;
+
+            List<MemoryRange> patches = new List<MemoryRange>()
+            {
+                new MemoryRange(0x006010, 2, BlockType.Calibration),
+            };
+
+            Protocol protocol = new Protocol();
+            MemoryRange block = new MemoryRange(0x006000, 0x2000, BlockType.Calibration);
+            byte[] bytes = protocol.CreateSectorRewriteMessage(image, block, 0x11223344, 0x55667788, patches).GetBytes();
+
+            byte[] expected = new byte[]
+            {
+                Priority.Block, DeviceId.Pcm, DeviceId.Tool, 0x36, 0x0F, 0x00, 0x12, 0x00, 0x60, 0x00,
+                0x00, 0x20, 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88,
+                0x00, 0x60, 0x10, 0x00, 0x02, 0xAB, 0xCD,
+                0x00, 0x00,
+            };
+
+            UInt16 sum = 0;
+            for (int index = 4; index < expected.Length - 2; index++)
+            {
+                sum += expected[index];
+            }
+
+            expected[expected.Length - 2] = (byte)(sum >> 8);
+            expected[expected.Length - 1] = (byte)sum;
+            CollectionAssert.AreEqual(expected, bytes, "Message");
+        }
+
+        [TestMethod]
+        public void SectorRewriteResponseIsParsed()
+        {
+            Protocol protocol = new Protocol();
+
+            byte[] rewritten = { Priority.Block, DeviceId.Tool, DeviceId.Pcm, 0x76, 0x0F, 0x04, 0x30 };
+            Response<byte> response = protocol.ParseSectorRewriteResponse(new Message(rewritten));
+            Assert.AreEqual(ResponseStatus.Success, response.Status, "Rewritten status");
+            Assert.AreEqual(0, response.Value, "Rewritten");
+
+            byte[] tooBig = { Priority.Block, DeviceId.Tool, DeviceId.Pcm, 0x7F, 0x36, 0xBC, 0x00 };
+            Assert.AreEqual(0xBC, protocol.ParseSectorRewriteResponse(new Message(tooBig)).Value, "Too big");
+
+            byte[] flashError = { Priority.Block, DeviceId.Tool, DeviceId.Pcm, 0x7F, 0x36, 0x00, 0xA0 };
+            Assert.AreEqual(0xA0, protocol.ParseSectorRewriteResponse(new Message(flashError)).Value, "Flash error");
+
+            byte[] truncated = { Priority.Block, DeviceId.Tool, DeviceId.Pcm, 0x7F, 0x36, 0xBC };
+            Assert.AreEqual(ResponseStatus.Truncated, protocol.ParseSectorRewriteResponse(new Message(truncated)).Status, "Truncated");
+
+            byte[] patchList = { Priority.Block, DeviceId.Tool, DeviceId.Pcm, 0x76, 0x0E, 0x00, 0x01, 0x00 };
+            Assert.AreNotEqual(ResponseStatus.Success, protocol.ParseSectorRewriteResponse(new Message(patchList)).Status, "Patch list");
+        }
+
+        [TestMethod]
+        public void PatchedRangesLeaveThePlan()
+        {
+            MemoryRange changed = new MemoryRange(0x008000, 0x8000, BlockType.Calibration) { ActualCrc = 1, DesiredCrc = 2 };
+            MemoryRange patched = new MemoryRange(0x010000, 0x10000, BlockType.Calibration) { ActualCrc = 3, DesiredCrc = 4 };
+            WritePlan plan = new WritePlan(new MemoryRange[] { changed, patched }, BlockType.Calibration, 0x80000, false);
+
+            plan.MarkPatched(patched);
+            CollectionAssert.AreEqual(new MemoryRange[] { changed }, new List<MemoryRange>(plan.RangesToWrite), "Ranges to write");
+            CollectionAssert.AreEqual(new MemoryRange[] { patched }, new List<MemoryRange>(plan.PatchedRanges), "Patched ranges");
+            Assert.AreEqual(0x8000u, plan.BytesToWrite, "Bytes to write");
+        }
+
+        [TestMethod]
+        public void PatchWriteNeedsNewerCKernel()
+        {
+            Assert.IsTrue(Protocol.SupportsPatchWrite(0x01030B01), "P01 1.3.11");
+            Assert.IsFalse(Protocol.SupportsPatchWrite(0x01030A01), "P01 1.3.10");
+            Assert.IsFalse(Protocol.SupportsPatchWrite(0x080204FC), "P04");
+        }
+
+        [TestMethod]
+        public void SectorRewriteNeedsNewerCKernel()
+        {
+            Assert.IsTrue(Protocol.SupportsSectorRewrite(0x01030C01), "P01 1.3.12");
+            Assert.IsFalse(Protocol.SupportsSectorRewrite(0x01030B01), "P01 1.3.11");
+        }
+    }
+}
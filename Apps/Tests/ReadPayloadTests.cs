@@ -0,0 +1,155 @@
+﻿using System;
+using System.Collections.Generic;
+using PcmHacking;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+
+namespace Tests
+{
+    [TestClass]
+    public class ReadPayloadTests
+    {
+        private static Message CreateReply(byte submode, int length, int address, byte[] payload, byte[] decoded)
+        {
+            List<byte> bytes = new List<byte>
+            {
+                Priority.Block, DeviceId.Tool, DeviceId.Pcm, 0x36, submode,
+                (byte)(length >> 8), (byte)length,
+                (byte)(address >> 16), (byte)(address >> 8), (byte)address,
+            };
+
+            UInt16 sum = 0;
+            for (int index = 4; index < 10; index++)
+            {
+                sum += bytes[index];
+            }
+
+            foreach (byte value in decoded)
+            {
+                sum += value;
+            }
+
+            bytes.AddRange(payload);
+            bytes.Add((byte)(sum >> 8));
+            bytes.Add((byte)sum);
+            return new Message(bytes.ToArray());
+        }
+
+        [TestMethod]
+        public void RunLengthPayloadIsExpanded()
+        {
+            // 3 literal bytes, 0x105 bytes of FF, then 3 copies of 4E 71.
+            byte[] payload = { 0x02, 0x01, 0x02, 0x03, 0x81, 0x05, 0xFF, 0xC0, 0x03, 0x4E, 0x71 };
+            byte[] decoded = new byte[3 + 0x105 + 6];
+            decoded[0] = 1;
+            decoded[1] = 2;
+            decoded[2] = 3;
+            for (int index = 3; index < 3 + 0x105; index++)
+            {
+                decoded[index] = 0xFF;
+            }
+
+            for (int index = 3 + 0x105; index < decoded.Length; index += 2)
+            {
+                decoded[index] = 0x4E;
+                decoded[index + 1] = 0x71;
+            }
+
+            Protocol protocol = new Protocol();
+            Message reply = CreateReply(0x02, decoded.Length, 0x12000, payload, decoded);
+            Response<byte[]> response = protocol.ParsePayload(reply, decoded.Length, 0x12000);
+
+            Assert.AreEqual(ResponseStatus.Success, response.Status, "Status");
+            CollectionAssert.AreEqual(decoded, response.Value, "Data");
+        }
+
+        [TestMethod]
+        public void RunLengthChecksumCoversDecodedData()
+        {
+            byte[] payload = { 0x80, 0x10, 0xFF };
+            byte[] decoded = new byte[0x10];
+
+            // Sum computed over zeros instead of the decoded FF bytes.
+            Protocol protocol = new Protocol();
+            Message reply = CreateReply(0x02, decoded.Length, 0, payload, decoded);
+            Response<byte[]> response = protocol.ParsePayload(reply, decoded.Length, 0);
+
+            Assert.AreEqual(ResponseStatus.Error, response.Status, "Status");
+        }
+
+        [TestMethod]
+        public void MalformedRunLengthIsRejected()
+        {
+            byte[] result = new byte[8];
+
+            // Literal runs past the end of the payload.
+            Assert.IsFalse(Protocol.TryExpandRunLength(new byte[] { 0x05, 0x01 }, 0, 2, result), "Short literal");
+
+            // Run overflows the result.
+            Assert.IsFalse(Protocol.TryExpandRunLength(new byte[] { 0x80, 0x09, 0xFF }, 0, 3, result), "Long run");
+
+            // Doesn't fill the result.
+            Assert.IsFalse(Protocol.TryExpandRunLength(new byte[] { 0x80, 0x07, 0xFF }, 0, 3, result), "Short run");
+
+            Assert.IsTrue(Protocol.TryExpandRunLength(new byte[] { 0x80, 0x08, 0xFF }, 0, 3, result), "Exact run");
+        }
+
+        [TestMethod]
+        public void ReadStreamRequestLayout()
+        {
+            Protocol protocol = new Protocol();
+            byte[] bytes = protocol.CreateReadStreamRequest(0x012000, 0x0E0000, 0x0800, 4).GetBytes();
+            CollectionAssert.AreEqual(
+                new byte[] { Priority.Block, DeviceId.Pcm, DeviceId.Tool, 0x35, 0x03, 0x08, 0x00, 0x01, 0x20, 0x00, 0x0E, 0x00, 0x00, 0x04 },
+                bytes,
+                "Request");
+
+            CollectionAssert.AreEqual(
+                new byte[] { Priority.Block, DeviceId.Pcm, DeviceId.Tool, 0x35, 0x04, 0x01, 0x02 },
+                protocol.CreateReadStreamAcknowledge(0x102).GetBytes(),
+                "Acknowledge");
+
+            CollectionAssert.AreEqual(
+                new byte[] { Priority.Block, DeviceId.Pcm, DeviceId.Tool, 0x35, 0x05, 0x00, 0x03 },
+                protocol.CreateReadStreamResend(3).GetBytes(),
+                "Resend");
+        }
+
+        [TestMethod]
+        public void ReadStreamPayloadHasSequenceNumber()
+        {
+            // Three blocks of 16 bytes, the last one short.
+            byte[] data = { 1, 2, 3, 4, 5 };
+            Protocol protocol = new Protocol();
+            Message reply = CreateReply(0x01, data.Length, 0x12020, data, data);
+            Response<byte[]> response = protocol.ParseReadStreamPayload(reply, 0x12000, 37, 16, out int sequence);
+
+            Assert.AreEqual(ResponseStatus.Success, response.Status, "Status");
+            Assert.AreEqual(2, sequence, "Sequence");
+            CollectionAssert.AreEqual(data, response.Value, "Data");
+
+            // A full-size block can't be the last one.
+            response = protocol.ParseReadStreamPayload(reply, 0x12010, 37, 16, out sequence);
+            Assert.AreEqual(1, sequence, "Sequence of short block");
+            Assert.AreNotEqual(ResponseStatus.Success, response.Status, "Short block");
+
+            // Addresses between blocks, or outside the range, aren't part of the stream.
+            protocol.ParseReadStreamPayload(reply, 0x12018, 37, 16, out sequence);
+            Assert.AreEqual(-1, sequence, "Unaligned");
+            protocol.ParseReadStreamPayload(reply, 0x12000, 32, 16, out sequence);
+            Assert.AreEqual(-1, sequence, "Outside");
+        }
+
+        [TestMethod]
+        public void ReadStreamRefusal()
+        {
+            Protocol protocol = new Protocol();
+            Message refusal = new Message(new byte[] { Priority.Block, DeviceId.Tool, DeviceId.Pcm, 0x7F, 0x35 });
+            Response<byte[]> response = protocol.ParseReadStreamPayload(refusal, 0, 0x1000, 0x400, out int sequence);
+            Assert.AreEqual(ResponseStatus.Refused, response.Status, "Status");
+            Assert.AreEqual(-1, sequence, "Sequence");
+
+            Assert.IsTrue(Protocol.SupportsStreamingRead(0x01030A01), "P01 1.3.10");
+            Assert.IsFalse(Protocol.SupportsStreamingRead(0x01030901), "P01 1.3.9");
+        }
+    }
+}
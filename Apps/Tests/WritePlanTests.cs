@@ -0,0 +1,134 @@
+using System;
+using System.Collections.Generic;
+using PcmHacking;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+
+namespace Tests
+{
+    [TestClass]
+    public class WritePlanTests
+    {
+        private static MemoryRange CreateRange(UInt32 address, UInt32 size, BlockType type, bool changed)
+        {
+            MemoryRange range = new MemoryRange(address, size, type);
+            range.DesiredCrc = 0x12345678;
+            range.ActualCrc = changed ? 0x87654321 : 0x12345678;
+            return range;
+        }
+
+        [TestMethod]
+        public void OnlyChangedRangesAreWritten()
+        {
+            List<MemoryRange> ranges = new List<MemoryRange>
+            {
+                CreateRange(0x20000, 0x20000, BlockType.OperatingSystem, false),
+                CreateRange(0x08000, 0x18000, BlockType.Calibration, true),
+                CreateRange(0x06000, 0x02000, BlockType.Calibration, false),
+                CreateRange(0x04000, 0x02000, BlockType.Parameter, true),
+            };
+
+            WritePlan plan = new WritePlan(ranges, BlockType.Calibration, 0x40000, false);
+            Assert.AreEqual(1, plan.RangesToWrite.Count, "Ranges to write");
+            Assert.AreEqual(0x08000u, plan.RangesToWrite[0].Address, "Changed range");
+            Assert.AreEqual(0x18000u, plan.BytesToWrite, "Bytes to write");
+            Assert.AreEqual(1, plan.UnchangedRanges.Count, "Unchanged ranges");
+            Assert.AreEqual(0x02000u, plan.UnchangedBytes, "Unchanged bytes");
+        }
+
+        [TestMethod]
+        public void TestWriteProcessesEveryRelevantRange()
+        {
+            List<MemoryRange> ranges = new List<MemoryRange>
+            {
+                CreateRange(0x08000, 0x18000, BlockType.Calibration, false),
+                CreateRange(0x06000, 0x02000, BlockType.Calibration, false),
+            };
+
+            WritePlan plan = new WritePlan(ranges, BlockType.Calibration, 0x40000, true);
+            Assert.AreEqual(2, plan.RangesToWrite.Count, "Ranges to write");
+            Assert.AreEqual(0, plan.UnchangedRanges.Count, "Unchanged ranges");
+        }
+
+        [TestMethod]
+        public void RangesBeyondImageAreIgnored()
+        {
+            List<MemoryRange> ranges = new List<MemoryRange>
+            {
+                CreateRange(0x80000, 0x20000, BlockType.OperatingSystem, true),
+                CreateRange(0x60000, 0x20000, BlockType.OperatingSystem, true),
+            };
+
+            WritePlan plan = new WritePlan(ranges, BlockType.All, 0x80000, false);
+            Assert.AreEqual(1, plan.RangesToWrite.Count, "Ranges to write");
+            Assert.AreEqual(0x60000u, plan.RangesToWrite[0].Address, "Range inside the image");
+        }
+
+        [TestMethod]
+        public void EstimateTime()
+        {
+            List<MemoryRange> ranges = new List<MemoryRange>
+            {
+                CreateRange(0x08000, 0x1000, BlockType.Calibration, true),
+                CreateRange(0x06000, 0x1000, BlockType.Calibration, true),
+            };
+
+            TimeSpan estimate = WritePlan.EstimateTime(ranges, 0x1000);
+            Assert.AreEqual(2 * WritePlan.EraseSecondsPerRange + 2, estimate.TotalSeconds, 0.001, "Two erases plus two seconds of writing");
+        }
+
+        private static List<MemoryRange> CreateChip(bool bootChanged, bool parametersChanged, bool osChanged)
+        {
+            return new List<MemoryRange>
+            {
+                CreateRange(0x60000, 0x20000, BlockType.OperatingSystem, true),
+                CreateRange(0x40000, 0x20000, BlockType.OperatingSystem, osChanged),
+                CreateRange(0x20000, 0x20000, BlockType.OperatingSystem, true),
+                CreateRange(0x08000, 0x18000, BlockType.Calibration, true),
+                CreateRange(0x06000, 0x02000, BlockType.Parameter, parametersChanged),
+                CreateRange(0x04000, 0x02000, BlockType.Parameter, true),
+                CreateRange(0x00000, 0x04000, BlockType.Boot, bootChanged),
+            };
+        }
+
+        [TestMethod]
+        public void FullWriteCoversChip()
+        {
+            List<MemoryRange> ranges = CreateChip(true, true, true);
+            WritePlan plan = new WritePlan(ranges, BlockType.All, 0x80000, false);
+            Assert.IsTrue(plan.CoversChip(ranges, 0x80000, out bool includeBoot, out bool includeParameters), "Covers chip");
+            Assert.IsTrue(includeBoot, "Boot");
+            Assert.IsTrue(includeParameters, "Parameters");
+        }
+
+        [TestMethod]
+        public void UnchangedBootAndParametersAreLeftOut()
+        {
+            List<MemoryRange> ranges = CreateChip(false, true, true);
+            WritePlan plan = new WritePlan(ranges, (BlockType)(BlockType.All - BlockType.Parameter), 0x80000, false);
+            Assert.IsTrue(plan.CoversChip(ranges, 0x80000, out bool includeBoot, out bool includeParameters), "Covers chip");
+            Assert.IsFalse(includeBoot, "Boot");
+            Assert.IsFalse(includeParameters, "Parameters");
+        }
+
+        [TestMethod]
+        public void PartialWritesDoNotCoverChip()
+        {
+            List<MemoryRange> ranges = CreateChip(true, true, false);
+            WritePlan plan = new WritePlan(ranges, BlockType.All, 0x80000, false);
+            Assert.IsFalse(plan.CoversChip(ranges, 0x80000, out bool includeBoot, out bool includeParameters), "Unchanged OS range");
+
+            ranges = CreateChip(true, false, true);
+            plan = new WritePlan(ranges, BlockType.All, 0x80000, false);
+            Assert.IsFalse(plan.CoversChip(ranges, 0x80000, out includeBoot, out includeParameters), "One parameter range");
+        }
+
+        [TestMethod]
+        public void CrcBatchesFitDeviceMessages()
+        {
+            Assert.AreEqual(9, Protocol.GetCrcBatchRangeLimit(100, 100), "Default device");
+            Assert.AreEqual(19, Protocol.GetCrcBatchRangeLimit(200, 200), "ELM device");
+            Assert.AreEqual(Protocol.MaxCrcBatchRanges, Protocol.GetCrcBatchRangeLimit(1024 + 12, 1024 + 12), "AllPro device");
+            Assert.AreEqual(1, Protocol.GetCrcBatchRangeLimit(12, 16), "Tiny device");
+        }
+    }
+}
@@ -30,5 +30,8 @@ goto beginning
 :beginning
 
 if "%1"=="" goto :EOF
-echo SECTIONS {	.text (0x12340000) :	{	main.o	}	.kernel_code :	{	Kernel-%1.o (.kernelstart)	* (.text)	}	.kernel_data :	{	* (.kerneldata)	}} > LinkerScript.tmp
+rem * On the P01 the tool does not write RAM above FFCDFF, see common.h.
+set RAM_END=1000000
+if /i "%1"=="P01" set RAM_END=FFCE00
+echo SECTIONS {	.text (0x12340000) :	{	main.o	}	.kernel_code :	{	KernelImageStart = . ;	Kernel-%1.o (.kernelstart)	* (.text)	}	.kernel_data :	{	* (.kerneldata)	KernelImageEnd = . ;	}}	ASSERT(KernelImageEnd ^<= 0x%RAM_END%, "Kernel data overlaps the RAM above 0x%RAM_END%") > LinkerScript.tmp
 
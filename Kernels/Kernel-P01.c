@@ -7,6 +7,31 @@
 
 uint32_t __attribute((section(".kerneldata"))) flashIdentifier;
 
+#if KERNEL_FEATURES & FeatureBackgroundErase
+// Background erase, started by submode 0A, 0C or 06. Blocks before eraseNext
+// in eraseSectors have been started, blocks before eraseDone have finished,
+// and eraseAddress is the one being polled. eraseWholeChip makes the AMD chips
+// erase everything with one command. The result is only valid once eraseBusy
+// has gone back to zero. eraseSettle counts the milliseconds left before the
+// Intel chips have their programming voltage, and eraseLimit is how many polls
+// the current operation gets, counting from eraseStartPolls. eraseSubmode and
+// eraseChipFlags identify the request, so that a repeat of it can be spotted.
+int __attribute((section(".kerneldata"))) eraseBusy;
+uint32_t __attribute((section(".kerneldata"))) eraseSectors[EraseBatchMaxSectors];
+int __attribute((section(".kerneldata"))) eraseCount;
+int __attribute((section(".kerneldata"))) eraseNext;
+int __attribute((section(".kerneldata"))) eraseDone;
+int __attribute((section(".kerneldata"))) eraseWholeChip;
+uint32_t __attribute((section(".kerneldata"))) eraseAddress;
+uint32_t __attribute((section(".kerneldata"))) erasePolls;
+uint8_t __attribute((section(".kerneldata"))) eraseResult;
+uint32_t __attribute((section(".kerneldata"))) eraseSettle;
+uint32_t __attribute((section(".kerneldata"))) eraseStartPolls;
+uint32_t __attribute((section(".kerneldata"))) eraseLimit;
+uint8_t __attribute((section(".kerneldata"))) eraseSubmode;
+uint8_t __attribute((section(".kerneldata"))) eraseChipFlags;
+#endif
+
 // This kernel uses Mode 3D extensively, because apparently nothing else does. Submodes are:
 //
 // 00 - Get kernel version
@@ -15,9 +40,19 @@ uint32_t __attribute((section(".kerneldata"))) flashIdentifier;
 // 03 - unlock flash
 // 04 - lock flash
 // 05 - erase calibration
-// 06 - erase everything? (not until everything else is thoroughly proven)
+// 06 - Start erasing the whole chip, except for protected blocks
+// 07 - Query CRCs for a list of ranges
+// 08 - Query performance counters
+// 09 - Find erased 4 KB chunks
+// 0A - Start erasing a block, and reply right away
+// 0B - Query the status of the erase started by 0A, 0C or 06
+// 0C - Start erasing a list of blocks, and reply right away
+// 0D - Send progress frames (7D 0E) during long flash operations
+// 0F - Query the optional features that this kernel was built with
 // FF - send debug info (because I was curious about the stack address)
 //
+// Submodes 06, 07, 08, 09, 0A, 0B, 0C and 0D are optional features, see common.h.
+//
 // Writes to flash use mode 35 and mode 36, like writing to RAM.
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -70,7 +105,8 @@ void HandleFlashChipQuery()
 	ScratchWatchdog();
 
 	// The AllPro and ScanTool devices need a short delay to switch from
-	// sending to receiving. Otherwise they'll miss the response.
+	// sending to receiving. Otherwise they'll miss the response. This one
+	// was tuned with those devices, so it's longer than ElmSleep.
 	VariableSleep(1);
 
 	MessageBuffer[0] = 0x6C;
@@ -96,7 +132,7 @@ void HandleCrcQuery()
 	unsigned address = (MessageBuffer[8] << 16) + (MessageBuffer[9] << 8) + MessageBuffer[10];
 
 	// Convert to names and types that match the CRC code.
-	unsigned char *message = (unsigned char*)address;
+	unsigned char *message = PCM_POINTER(address);
 	int nBytes = length;
 
 	char path;
@@ -121,12 +157,12 @@ void HandleCrcQuery()
 		MessageBuffer[2] = 0x10;
 		MessageBuffer[3] = 0x7D;
 		MessageBuffer[4] = 0x02;
-		MessageBuffer[5] = (char)(crcLength >> 16);
-		MessageBuffer[6] = (char)(crcLength >> 8);
-		MessageBuffer[7] = (char)crcLength;
-		MessageBuffer[8] = (char)((uint32_t)crcStartAddress >> 16);
-		MessageBuffer[9] = (char)((uint32_t)crcStartAddress >> 8);
-		MessageBuffer[10] = (char)(uint32_t)crcStartAddress;
+		MessageBuffer[5] = (char)(length >> 16);
+		MessageBuffer[6] = (char)(length >> 8);
+		MessageBuffer[7] = (char)length;
+		MessageBuffer[8] = (char)(address >> 16);
+		MessageBuffer[9] = (char)(address >> 8);
+		MessageBuffer[10] = (char)address;
 		MessageBuffer[11] = (char)(crc >> 24);
 		MessageBuffer[12] = (char)(crc >> 16);
 		MessageBuffer[13] = (char)(crc >> 8);
@@ -149,6 +185,260 @@ void HandleCrcQuery()
 	}
 }
 
+#if KERNEL_FEATURES & FeatureCrcBatch
+///////////////////////////////////////////////////////////////////////////////
+// Get the CRCs of a list of memory ranges, with one reply for all of them.
+//
+// Request: 3D 07, count, then count * (3-byte length, 3-byte address).
+// Reply:   7D 07, count, then count * (3-byte length, 3-byte address, 4-byte CRC).
+//
+// The ranges are processed last to first, because each reply entry is larger
+// than the request entry it replaces. That way the entries that are still to
+// be processed are never overwritten.
+///////////////////////////////////////////////////////////////////////////////
+void HandleCrcBatchQuery()
+{
+	unsigned count = MessageBuffer[5];
+	if ((count == 0) || (count > CrcBatchMaxRanges))
+	{
+		ElmSleep();
+		SendReply(0, 0x07, 0x01, count);
+		return;
+	}
+
+	for (int index = count - 1; index >= 0; index--)
+	{
+		unsigned char *request = &MessageBuffer[6 + (index * 6)];
+		unsigned length = (request[0] << 16) + (request[1] << 8) + request[2];
+		unsigned address = (request[3] << 16) + (request[4] << 8) + request[5];
+
+		unsigned char *message = PCM_POINTER(address);
+		crcStart(message, length);
+		while (!crcIsDone(message, length))
+		{
+			crcProcessSlice();
+		}
+
+		unsigned crc = crcGetResult();
+		unsigned char *reply = &MessageBuffer[6 + (index * 10)];
+		reply[0] = (char)(length >> 16);
+		reply[1] = (char)(length >> 8);
+		reply[2] = (char)length;
+		reply[3] = (char)(address >> 16);
+		reply[4] = (char)(address >> 8);
+		reply[5] = (char)address;
+		reply[6] = (char)(crc >> 24);
+		reply[7] = (char)(crc >> 16);
+		reply[8] = (char)(crc >> 8);
+		reply[9] = (char)crc;
+	}
+
+	ElmSleep();
+
+	MessageBuffer[0] = 0x6C;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x7D;
+	MessageBuffer[4] = 0x07;
+	MessageBuffer[5] = count;
+	WriteMessage(MessageBuffer, 6 + (count * 10), Complete);
+}
+#endif
+
+#if KERNEL_FEATURES & FeatureBlankScan
+///////////////////////////////////////////////////////////////////////////////
+// Check whether a chunk of flash is entirely 0xFF, a long word at a time.
+///////////////////////////////////////////////////////////////////////////////
+static int IsBlank(unsigned address, unsigned length)
+{
+	unsigned char *data = PCM_POINTER(address);
+	for (unsigned index = 0; index < length; index += 4)
+	{
+		if (PCM_LONG(&data[index]) != 0xFFFFFFFF)
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+#endif
+
+#if KERNEL_FEATURES & (FeatureBlankScan | FeatureSectorRewrite | FeatureFullErase)
+///////////////////////////////////////////////////////////////////////////////
+// Erase block layout. The blocks are the same as in FlashChip.cs. Every chip
+// has the boot block at 0, two parameter blocks at 4000 and 6000, and a block
+// from 8000 up to the first of its main blocks. The main blocks come in runs
+// of equal-sized blocks, from first up to end.
+///////////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+	uint32_t first;
+	uint32_t size;
+	uint32_t end;
+} BlockRun;
+
+#define MaxBlockRuns 2
+
+static void SetBlockRun(BlockRun *run, uint32_t first, uint32_t size, uint32_t end)
+{
+#if defined P10
+	// Only the bottom half of the chip is connected.
+	if (end > 0x80000)
+	{
+		end = 0x80000;
+	}
+#endif
+
+	run->first = first;
+	run->size = size;
+	run->end = end;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fill in the runs of main blocks for the chip that HandleFlashChipQuery
+// found, and return how many there are. Zero means the chip isn't known.
+///////////////////////////////////////////////////////////////////////////////
+static int GetMainBlocks(BlockRun *runs)
+{
+	switch (flashIdentifier)
+	{
+		case FLASH_ID_INTEL_28F400B:
+			SetBlockRun(&runs[0], 0x20000, 0x20000, 0x80000);
+			return 1;
+
+		case FLASH_ID_INTEL_28F800B:
+			SetBlockRun(&runs[0], 0x20000, 0x20000, 0x100000);
+			return 1;
+
+		case FLASH_ID_AMD_AM29F800BB:
+			SetBlockRun(&runs[0], 0x10000, 0x10000, 0x100000);
+			return 1;
+
+		case FLASH_ID_AMD_AM29BL802C:
+			SetBlockRun(&runs[0], 0x20000, 0x20000, 0x80000);
+			SetBlockRun(&runs[1], 0x80000, 0x40000, 0x100000);
+			return 2;
+
+		case FLASH_ID_AMD_AM29BL162C:
+			SetBlockRun(&runs[0], 0x40000, 0x40000, 0x200000);
+			return 1;
+
+		default:
+			return 0;
+	}
+}
+#endif
+
+#if KERNEL_FEATURES & FeatureBlankScan
+///////////////////////////////////////////////////////////////////////////////
+// Size of the flash chip that HandleFlashChipQuery found, or zero if unknown.
+///////////////////////////////////////////////////////////////////////////////
+static uint32_t FlashChipSize()
+{
+	BlockRun runs[MaxBlockRuns];
+	int count = GetMainBlocks(runs);
+	return (count == 0) ? 0 : runs[count - 1].end;
+}
+#endif
+
+#if KERNEL_FEATURES & FeatureSectorRewrite
+///////////////////////////////////////////////////////////////////////////////
+// See common.h. The block sizes are all powers of two.
+///////////////////////////////////////////////////////////////////////////////
+uint32_t EraseBlockSize(uint32_t address)
+{
+	BlockRun runs[MaxBlockRuns];
+	int count = GetMainBlocks(runs);
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	switch (address)
+	{
+		case 0x0000:
+			return 0x4000;
+
+		case 0x4000:
+		case 0x6000:
+			return 0x2000;
+
+		case 0x8000:
+			return runs[0].first - 0x8000;
+	}
+
+	for (int run = 0; run < count; run++)
+	{
+		if ((address >= runs[run].first) &&
+			(address < runs[run].end) &&
+			(((address - runs[run].first) & (runs[run].size - 1)) == 0))
+		{
+			return runs[run].size;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+#if KERNEL_FEATURES & FeatureBlankScan
+///////////////////////////////////////////////////////////////////////////////
+// Find the chunks that are entirely erased, so the tool can skip reading them.
+//
+// Request: 3D 09, 3-byte address, 2-byte chunk count.
+// Reply:   7D 09, 3-byte address, 2-byte chunk count, then one bit per chunk,
+//          most significant bit first. A set bit means the chunk is blank.
+//
+// Chunks past the end of the chip aren't scanned, and the count in the reply
+// says how many were. If the chip hasn't been identified, the scan is refused.
+///////////////////////////////////////////////////////////////////////////////
+void HandleBlankScanQuery()
+{
+	unsigned address = (MessageBuffer[5] << 16) + (MessageBuffer[6] << 8) + MessageBuffer[7];
+	unsigned count = (MessageBuffer[8] << 8) + MessageBuffer[9];
+	uint32_t chipSize = FlashChipSize();
+	if ((address < chipSize) && (count > (chipSize - address) / BlankScanChunkSize))
+	{
+		count = (chipSize - address) / BlankScanChunkSize;
+	}
+
+	if ((count == 0) || (count > BlankScanMaxChunks) || (address & 3) || (address >= chipSize))
+	{
+		ElmSleep();
+		SendReply(0, 0x09, 0x01, 0);
+		return;
+	}
+
+	unsigned char *bitmap = &MessageBuffer[10];
+	for (unsigned index = 0; index < (count + 7) / 8; index++)
+	{
+		bitmap[index] = 0;
+	}
+
+	for (unsigned chunk = 0; chunk < count; chunk++)
+	{
+		ScratchWatchdog();
+		if (IsBlank(address + (chunk * BlankScanChunkSize), BlankScanChunkSize))
+		{
+			bitmap[chunk / 8] |= 0x80 >> (chunk % 8);
+		}
+	}
+
+	ElmSleep();
+
+	// The address is still in place from the request.
+	MessageBuffer[0] = 0x6C;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x7D;
+	MessageBuffer[4] = 0x09;
+	MessageBuffer[8] = count >> 8;
+	MessageBuffer[9] = count;
+	WriteMessage(MessageBuffer, 10 + ((count + 7) / 8), Complete);
+}
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 // Tell the app which OS is installed on this PCM.
 //
@@ -168,11 +458,11 @@ void HandleOperatingSystemQuery()
 {
 	ElmSleep();
 #if defined P10
-	uint8_t *osid = (uint8_t*)0x52E;
+	uint8_t *osid = PCM_POINTER(0x52E);
 #elif defined P12
-	uint8_t *osid = (uint8_t*)0x8004;
+	uint8_t *osid = PCM_POINTER(0x8004);
 #else
-	uint8_t *osid = (uint8_t*)0x504;
+	uint8_t *osid = PCM_POINTER(0x504);
 #endif
 	MessageBuffer[0] = 0x6C;
 	MessageBuffer[1] = 0xF0;
@@ -186,6 +476,314 @@ void HandleOperatingSystemQuery()
 	WriteMessage(MessageBuffer, 9, Complete);
 }
 
+#if KERNEL_FEATURES & FeatureBackgroundErase
+///////////////////////////////////////////////////////////////////////////////
+// Start erasing the next blocks in eraseSectors.
+///////////////////////////////////////////////////////////////////////////////
+static void StartNextErase()
+{
+	int first = eraseNext;
+
+	switch (flashIdentifier)
+	{
+		case FLASH_ID_INTEL_28F400B:
+		case FLASH_ID_INTEL_28F800B:
+			// The Intel chips erase one block at a time.
+			eraseAddress = eraseSectors[eraseNext++];
+			Intel_EraseStart(eraseAddress);
+			eraseLimit = IntelErasePollLimit;
+			break;
+
+		default:
+#if KERNEL_FEATURES & FeatureFullErase
+			if (eraseWholeChip)
+			{
+				Amd_EraseStartChip();
+				eraseNext = eraseCount;
+				eraseAddress = eraseSectors[eraseCount - 1];
+			}
+			else
+#endif
+			{
+				// The AMD chips erase every block that they accept in one operation.
+				eraseNext += Amd_EraseStartSectors(&eraseSectors[eraseNext], eraseCount - eraseNext);
+				eraseAddress = eraseSectors[eraseNext - 1];
+			}
+
+			// Allow the same polls per block as Amd_EraseBlock does.
+			eraseLimit = AmdErasePollLimit * (eraseNext - first);
+			break;
+	}
+
+	eraseStartPolls = erasePolls;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Background job for the erase started by HandleEraseStart. Returns nonzero
+// while the erase is still running. Anything that uses the flash chip has to
+// wait for this, which FinishPipelinedWrite does.
+///////////////////////////////////////////////////////////////////////////////
+int PollErase()
+{
+	if (!eraseBusy)
+	{
+		return 0;
+	}
+
+	ScratchWatchdog();
+	if (eraseSettle != 0)
+	{
+		// Wait for the programming voltage a millisecond at a time, so that
+		// messages keep being received in between.
+		SleepMicroseconds(1000);
+		if (--eraseSettle == 0)
+		{
+			StartNextErase();
+		}
+
+		return 1;
+	}
+
+	erasePolls++;
+	int timedOut = (erasePolls - eraseStartPolls) >= eraseLimit;
+
+	uint16_t status = 0;
+	switch (flashIdentifier)
+	{
+		case FLASH_ID_INTEL_28F400B:
+		case FLASH_ID_INTEL_28F800B:
+			if (!Intel_EraseDone(eraseAddress, &status) && !timedOut)
+			{
+				return 1;
+			}
+
+			eraseResult = Intel_EraseFinish(eraseAddress, status);
+			break;
+
+		default:
+			if (!Amd_EraseDone(eraseAddress, &status) && !timedOut)
+			{
+				return 1;
+			}
+
+			eraseResult = Amd_EraseFinish(eraseAddress, status);
+			break;
+	}
+
+	// The chip may never report that it's done, so give up rather than
+	// leave every later flash operation waiting for it.
+	if (timedOut)
+	{
+		eraseResult = EraseTimedOut;
+	}
+	else
+	{
+		eraseDone = eraseNext;
+	}
+
+	if ((eraseResult == 0) && (eraseNext < eraseCount))
+	{
+		StartNextErase();
+		return 1;
+	}
+
+	PeakStatistic(maxEraseIterations, erasePolls);
+
+	eraseBusy = 0;
+	eraseWholeChip = 0;
+	crcReset();
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Handle a start request that arrives while an erase is running. The tool
+// sends its request again when the reply is slow, so a repeat of the running
+// erase gets the same reply again. Anything else is refused, because the
+// running erase is still using eraseSectors. Returns nonzero if the request
+// has been answered.
+///////////////////////////////////////////////////////////////////////////////
+static int RepeatedErase(unsigned char submode, int same)
+{
+	if (!eraseBusy)
+	{
+		return 0;
+	}
+
+	ElmSleep();
+	if (same && (submode == eraseSubmode))
+	{
+		SendReply(1, submode, eraseCount, 0x00);
+	}
+	else
+	{
+		SendReply(0, submode, 0x02, 0x00);
+	}
+
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Start erasing the blocks in eraseSectors, and reply without waiting for
+// them to finish. The tool can send the first block of data while the chip is
+// busy, and then poll with HandleEraseStatus.
+///////////////////////////////////////////////////////////////////////////////
+static void StartErase(unsigned char submode)
+{
+	int intel = 0;
+	switch (flashIdentifier)
+	{
+		case FLASH_ID_INTEL_28F400B:
+		case FLASH_ID_INTEL_28F800B:
+			intel = 1;
+			break;
+
+		case FLASH_ID_AMD_AM29F800BB:
+		case FLASH_ID_AMD_AM29BL162C:
+		case FLASH_ID_AMD_AM29BL802C:
+			break;
+
+		default:
+			ElmSleep();
+			SendReply(0, submode, 0xFF, 0xFF);
+			return;
+	}
+
+	// A background CRC would read the chip while it's in status mode.
+	crcReset();
+
+	eraseSubmode = submode;
+	eraseNext = 0;
+	eraseDone = 0;
+	erasePolls = 0;
+	eraseResult = 0;
+	eraseSettle = 0;
+	eraseBusy = 1;
+
+	// Reply first. Unlocking the Intel chips takes longer than the tool
+	// waits for a reply.
+	ElmSleep();
+	SendReply(1, submode, eraseCount, 0x00);
+
+	if (intel && !flashHoldUnlocked)
+	{
+		// Hold the chip unlocked, so it isn't locked by the background job
+		// while a message is arriving. FinishPipelinedWrite locks it. The
+		// erase starts once PollErase has waited for the supply to settle.
+		FlashSwitchVoltage(true);
+		flashHoldUnlocked = 1;
+		eraseSettle = FlashSettleMilliseconds;
+	}
+	else
+	{
+		StartNextErase();
+	}
+
+	StartBackgroundJob(PollErase);
+}
+
+#if KERNEL_FEATURES & FeatureBatchErase
+
+///////////////////////////////////////////////////////////////////////////////
+// Read the address of a block from a submode 0C request.
+///////////////////////////////////////////////////////////////////////////////
+static uint32_t EraseRequestAddress(unsigned index)
+{
+	unsigned char *request = &MessageBuffer[6 + (index * 3)];
+	return (request[0] << 16) + (request[1] << 8) + request[2];
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Start erasing a block.
+//
+// Request: 3D 0A, 3-byte address.
+// Reply:   7D 0A 01 00. While an erase is running, a repeat of its request
+//          gets the same reply, and anything else gets 7F 3D 0A 02 00.
+///////////////////////////////////////////////////////////////////////////////
+void HandleEraseStart()
+{
+	uint32_t address = (MessageBuffer[5] << 16) + (MessageBuffer[6] << 8) + MessageBuffer[7];
+	if (RepeatedErase(0x0A, (eraseCount == 1) && (eraseSectors[0] == address)))
+	{
+		return;
+	}
+
+	eraseSectors[0] = address;
+	eraseCount = 1;
+	eraseWholeChip = 0;
+	StartErase(0x0A);
+}
+
+#if KERNEL_FEATURES & FeatureBatchErase
+
+///////////////////////////////////////////////////////////////////////////////
+// Start erasing a list of blocks. The AMD chips erase them all in one
+// operation, so this takes about as long as erasing one block. The Intel
+// chips erase them one after another, but without a round trip for each.
+//
+// Request: 3D 0C, count, then count * 3-byte address.
+// Reply:   7D 0C, count, 00.
+///////////////////////////////////////////////////////////////////////////////
+void HandleEraseSectors()
+{
+	unsigned count = MessageBuffer[5];
+	if ((count == 0) || (count > EraseBatchMaxSectors))
+	{
+		ElmSleep();
+		SendReply(0, 0x0C, 0x01, count);
+		return;
+	}
+
+	int same = (count == (unsigned)eraseCount);
+	for (unsigned index = 0; same && (index < count); index++)
+	{
+		same = (eraseSectors[index] == EraseRequestAddress(index));
+	}
+
+	if (RepeatedErase(0x0C, same))
+	{
+		return;
+	}
+
+	for (unsigned index = 0; index < count; index++)
+	{
+		eraseSectors[index] = EraseRequestAddress(index);
+	}
+
+	eraseCount = count;
+	eraseWholeChip = 0;
+	StartErase(0x0C);
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Report on the erase started by HandleEraseStart.
+//
+// Request: 3D 0B.
+// Reply:   7D 0B, result, busy, blocks finished, block count. The result is
+//          zero on success, or the same error code that submode 05 would
+//          give. It's only valid when busy is zero. The tool polls with this
+//          during long erases, so the counts let it show progress.
+///////////////////////////////////////////////////////////////////////////////
+void HandleEraseStatus()
+{
+	int busy = PollErase();
+
+	MessageBuffer[0] = 0x6C;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x7D;
+	MessageBuffer[4] = 0x0B;
+	MessageBuffer[5] = busy ? 0 : eraseResult;
+	MessageBuffer[6] = busy;
+	MessageBuffer[7] = eraseDone;
+	MessageBuffer[8] = eraseCount;
+
+	ElmSleep();
+	WriteMessage(MessageBuffer, 9, Complete);
+}
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 // Erase the given block.
 ///////////////////////////////////////////////////////////////////////////////
@@ -194,6 +792,7 @@ void HandleEraseBlock()
 	unsigned address = (MessageBuffer[5] << 16) + (MessageBuffer[6] << 8) + MessageBuffer[7];
 	uint8_t status = 0;
 
+	StartProgress(0x05);
 	switch (flashIdentifier)
 	{
 		case FLASH_ID_INTEL_28F400B:
@@ -208,11 +807,14 @@ void HandleEraseBlock()
 			break;
 
 		default:
+			StopProgress();
 			VariableSleep(2);
 			SendReply(0, 0x05, 0xFF, 0xFF);
 			return;
 	}
 
+	StopProgress();
+
 	// The AllPro and ScanTool devices need a short delay to switch from
 	// sending to receiving. Otherwise they'll miss the response.
 	// Also, give the lock-flash operation time to take full effect, because
@@ -223,21 +825,147 @@ void HandleEraseBlock()
 	SendReply(1, 0x05, status, 0x00);
 }
 
+#if KERNEL_FEATURES & FeatureProgressFrames
+///////////////////////////////////////////////////////////////////////////////
+// Turn progress frames on or off. While they're on, blocking erases (submode
+// 05) and flash writes that the tool waits for (mode 36, apart from pipelined
+// writes) send a frame every interval status polls:
+//
+//   7D 0E, operation (05 or 36), polls so far (4 bytes), status.
+//
+// The status is the Intel status register, or what the AMD chip reads back
+// while it's busy. The tool can treat each frame as a sign of life, and use a
+// short timeout instead of the worst-case time for the operation.
+//
+// Request: 3D 0D, interval (2 bytes, in units of 256 polls). Zero turns the
+//          frames off.
+// Reply:   7D 0D, interval (2 bytes).
+///////////////////////////////////////////////////////////////////////////////
+void HandleProgressRequest()
+{
+	unsigned interval = (MessageBuffer[5] << 8) | MessageBuffer[6];
+	SetProgressInterval(interval * ProgressIntervalUnit);
+
+	ElmSleep();
+	SendReply(1, 0x0D, MessageBuffer[5], MessageBuffer[6]);
+}
+#endif
+
+#if KERNEL_FEATURES & FeatureSectorRewrite
+
+///////////////////////////////////////////////////////////////////////////////
+// Erase a block for other handlers, without sending a reply.
+///////////////////////////////////////////////////////////////////////////////
+unsigned char EraseFlashBlock(unsigned address)
+{
+	switch (flashIdentifier)
+	{
+		case FLASH_ID_INTEL_28F400B:
+		case FLASH_ID_INTEL_28F800B:
+			return Intel_EraseBlock(address);
+
+		case FLASH_ID_AMD_AM29F800BB:
+		case FLASH_ID_AMD_AM29BL162C:
+		case FLASH_ID_AMD_AM29BL802C:
+			return Amd_EraseBlock(address);
+
+		default:
+			return 0xEE;
+	}
+}
+#endif
+
+#if KERNEL_FEATURES & FeatureFullErase
+///////////////////////////////////////////////////////////////////////////////
+// Add the blocks from first up to end, step bytes apart, to eraseSectors.
+///////////////////////////////////////////////////////////////////////////////
+static void AddEraseBlocks(uint32_t first, uint32_t step, uint32_t end)
+{
+	for (uint32_t address = first; address < end; address += step)
+	{
+		eraseSectors[eraseCount++] = address;
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////////
-// Erase everything? Nope, not yet.
+// Start erasing the whole chip, and reply without waiting. The blocks are
+// described above GetMainBlocks. The boot and parameter blocks are only
+// erased if the flags ask for them, because losing
+// the boot block makes the PCM unrecoverable, and the parameter blocks hold
+// the VIN and the EBCM pairing.
+//
+// When every block is to be erased, the AMD chips use their chip erase
+// command. Otherwise the AMD chips erase the listed blocks in one operation,
+// and the Intel chips erase them one after another, as for submode 0C.
+//
+// Request: 3D 06, flags, flags ^ FF, block count. Flag 01 erases the boot
+//          block, and flag 02 erases the parameter blocks. The second copy of
+//          the flags makes sure that a short request can't pick up an old byte
+//          from the buffer. The block count is the number of blocks that the
+//          tool expects to be erased, so that nothing starts if the kernel's
+//          idea of the chip is different.
+// Reply:   7D 06, block count, 00. Poll for the result with submode 0B.
+//          7F 3D 06 03 and the kernel's block count if the counts differ.
 ///////////////////////////////////////////////////////////////////////////////
 void HandleEraseEverythingRequest()
 {
-	MessageBuffer[0] = 0x6C;
-	MessageBuffer[1] = 0xF0;
-	MessageBuffer[2] = 0x10;
-	MessageBuffer[3] = 0x7F; // Reject
-	MessageBuffer[4] = 0x3D;
-	MessageBuffer[5] = 0x06;
-	MessageBuffer[6] = 0x00;
+	unsigned char flags = MessageBuffer[5];
+	if ((MessageBuffer[6] != (flags ^ 0xFF)) || (flags & ~(EraseChipBoot | EraseChipParameters)))
+	{
+		ElmSleep();
+		SendReply(0, 0x06, 0x01, flags);
+		return;
+	}
 
-	WriteMessage(MessageBuffer, 7, Complete);
+	unsigned char expected = MessageBuffer[7];
+	if (RepeatedErase(0x06, (flags == eraseChipFlags) && (expected == eraseCount)))
+	{
+		return;
+	}
+
+	BlockRun runs[MaxBlockRuns];
+	int runCount = GetMainBlocks(runs);
+	if (runCount == 0)
+	{
+		ElmSleep();
+		SendReply(0, 0x06, 0xFF, 0xFF);
+		return;
+	}
+
+	eraseChipFlags = flags;
+	eraseCount = 0;
+	if (flags & EraseChipBoot)
+	{
+		AddEraseBlocks(0x0000, 0x4000, 0x4000);
+	}
+
+	if (flags & EraseChipParameters)
+	{
+		AddEraseBlocks(0x4000, 0x2000, 0x8000);
+	}
+
+	eraseSectors[eraseCount++] = 0x8000;
+	for (int run = 0; run < runCount; run++)
+	{
+		AddEraseBlocks(runs[run].first, runs[run].size, runs[run].end);
+	}
+
+	if (eraseCount != expected)
+	{
+		ElmSleep();
+		SendReply(0, 0x06, 0x03, eraseCount);
+		return;
+	}
+
+	// The P10 can't see the top half of its chip, so it erases by block.
+#if defined P10
+	eraseWholeChip = 0;
+#else
+	eraseWholeChip = (flags == (EraseChipBoot | EraseChipParameters));
+#endif
+	StartErase(0x06);
 }
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 // This is available for arbitrary diagnostic / troubleshooting use.
@@ -259,29 +987,91 @@ void HandleDebugQuery()
 	WriteMessage(MessageBuffer, 9, Complete);
 }
 
+#if KERNEL_FEATURES & FeatureStatistics
+///////////////////////////////////////////////////////////////////////////////
+// Send the performance counters. (Mode 3D, submode 08)
+//
+// Request: 3D 08, flags. Flag 01 clears the counters after sending them.
+// Reply:   7D 08, then each counter in KernelStatistics as a 4-byte value.
+///////////////////////////////////////////////////////////////////////////////
+void HandleStatisticsQuery()
+{
+	int clear = MessageBuffer[5] & 0x01;
+
+	MessageBuffer[0] = 0x6C;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x7D;
+	MessageBuffer[4] = 0x08;
+
+	uint32_t *counters = (uint32_t*)&kernelStatistics;
+	for (unsigned index = 0; index < KernelStatisticsCount; index++)
+	{
+		unsigned char *reply = &MessageBuffer[5 + (index * 4)];
+		reply[0] = (char)(counters[index] >> 24);
+		reply[1] = (char)(counters[index] >> 16);
+		reply[2] = (char)(counters[index] >> 8);
+		reply[3] = (char)counters[index];
+	}
+
+	if (clear)
+	{
+		ClearKernelStatistics();
+	}
+
+	ElmSleep();
+	WriteMessage(MessageBuffer, 5 + (KernelStatisticsCount * 4), Complete);
+}
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 // Write data to flash memory.
 // This is invoked by HandleWriteMode36 in common-readwrite.c
 // read-kernel.c has a stub to keep the compiler happy until this is released.
 ///////////////////////////////////////////////////////////////////////////////
-unsigned char WriteToFlash(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int testWrite)
+unsigned char WriteToFlash(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int testWrite, int differential)
 {
 	switch (flashIdentifier)
 	{
 		case FLASH_ID_INTEL_28F400B:
 		case FLASH_ID_INTEL_28F800B:
-			return Intel_WriteToFlash(payloadLengthInBytes, startAddress, payloadBytes, testWrite);
+			return Intel_WriteToFlash(payloadLengthInBytes, startAddress, payloadBytes, testWrite, differential);
 
 		case FLASH_ID_AMD_AM29F800BB:
 		case FLASH_ID_AMD_AM29BL162C:
 		case FLASH_ID_AMD_AM29BL802C:
-			return Amd_WriteToFlash(payloadLengthInBytes, startAddress, payloadBytes, testWrite);
+			return Amd_WriteToFlash(payloadLengthInBytes, startAddress, payloadBytes, testWrite, differential);
 
 		default:
 			return 0xEE;
 	}
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Keep the flash unlocked between writes, or stop doing so.
+///////////////////////////////////////////////////////////////////////////////
+void HoldFlashUnlocked(int hold)
+{
+	switch (flashIdentifier)
+	{
+		case FLASH_ID_INTEL_28F400B:
+		case FLASH_ID_INTEL_28F800B:
+			FlashUnlock(hold);
+			break;
+
+		default:
+			// The AMD chips are unlocked by Amd_WriteToFlash, and stay in
+			// unlock-bypass mode until this is turned off.
+			if (!hold)
+			{
+				Amd_EndBypass();
+			}
+			break;
+	}
+
+	flashHoldUnlocked = hold;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Process an incoming message.
 ///////////////////////////////////////////////////////////////////////////////
@@ -299,6 +1089,35 @@ void ProcessMessage(int iterations)
 		return;
 	}
 
+	// A pipelined flash write, or a background erase, must finish before
+	// anything else uses the flash. The tool sends tool-present and mode-34
+	// messages between blocks, and polls for the end of an erase, and those
+	// don't need to wait. Nor does a start request that arrives during an
+	// erase, because it's only answered by RepeatedErase.
+	int eraseRepeat = 0;
+#if KERNEL_FEATURES & FeatureBackgroundErase
+	eraseRepeat = eraseBusy && (MessageBuffer[3] == 0x3D) &&
+		((MessageBuffer[4] == 0x0A) || (MessageBuffer[4] == 0x0C) || (MessageBuffer[4] == 0x06));
+#endif
+
+	if ((MessageBuffer[3] != 0x34) &&
+		(MessageBuffer[3] != 0x36) &&
+		(MessageBuffer[3] != 0x3F) &&
+		((MessageBuffer[3] != 0x3D) || (MessageBuffer[4] != 0x0B)) &&
+		!eraseRepeat)
+	{
+		FinishPipelinedWrite();
+	}
+
+#if KERNEL_FEATURES & FeatureStreamingRead
+	// A streaming read carries on until the tool asks for something else.
+	if ((MessageBuffer[3] != 0x3F) &&
+		((MessageBuffer[3] != 0x35) || ((MessageBuffer[4] != 0x04) && (MessageBuffer[4] != 0x05))))
+	{
+		StopReadStream();
+	}
+#endif
+
 	switch (MessageBuffer[3])
 	{
 	case 0x20:
@@ -312,7 +1131,23 @@ void ProcessMessage(int iterations)
 		break;
 
 	case 0x35:
-		HandleReadMode35();
+		switch (MessageBuffer[4])
+		{
+#if KERNEL_FEATURES & FeatureStreamingRead
+		case 0x03:
+			HandleReadStream();
+			break;
+
+		case 0x04:
+		case 0x05:
+			HandleReadStreamAcknowledge();
+			break;
+#endif
+
+		default:
+			HandleReadMode35();
+			break;
+		}
 		break;
 
 	case 0x36:
@@ -358,6 +1193,56 @@ void ProcessMessage(int iterations)
 			crcReset();
 			break;
 
+#if KERNEL_FEATURES & FeatureFullErase
+		case 0x06:
+			HandleEraseEverythingRequest();
+			break;
+#endif
+
+#if KERNEL_FEATURES & FeatureCrcBatch
+		case 0x07:
+			HandleCrcBatchQuery();
+			break;
+#endif
+
+#if KERNEL_FEATURES & FeatureStatistics
+		case 0x08:
+			HandleStatisticsQuery();
+			break;
+#endif
+
+#if KERNEL_FEATURES & FeatureBlankScan
+		case 0x09:
+			HandleBlankScanQuery();
+			break;
+#endif
+
+#if KERNEL_FEATURES & FeatureBackgroundErase
+		case 0x0A:
+			HandleEraseStart();
+			break;
+
+		case 0x0B:
+			HandleEraseStatus();
+			break;
+#endif
+
+#if KERNEL_FEATURES & FeatureBatchErase
+		case 0x0C:
+			HandleEraseSectors();
+			break;
+#endif
+
+#if KERNEL_FEATURES & FeatureProgressFrames
+		case 0x0D:
+			HandleProgressRequest();
+			break;
+#endif
+
+		case 0x0F:
+			HandleFeatureQuery();
+			break;
+
 		case 0xFF:
 			HandleDebugQuery();
 			break;
@@ -393,12 +1278,29 @@ int
 __attribute__((section(".kernelstart")))
 KernelStart(void)
 {
+#if !defined HOST
 	// Disable peripheral interrupts
 	asm("ORI #0x700, %SR");
+#endif
 
-	ScratchWatchdog();
+	ServiceWatchdog();
+	InitializeSleep();
+	ResetReceive();
+	StartWatchdogTimer();
+	ClearKernelStatistics();
 
 	DLC_INTERRUPTCONFIGURATION = 0x00;
+	ClearBackgroundJobs();
+	ResetPipelinedWrite();
+#if KERNEL_FEATURES & FeatureStreamingRead
+	StopReadStream();
+#endif
+	amdBypass = 0;
+#if KERNEL_FEATURES & FeatureBackgroundErase
+	eraseBusy = 0;
+	eraseWholeChip = 0;
+#endif
+	SetProgressInterval(0);
 	crcInit();
 
 	// Flush the DLC
@@ -418,7 +1320,6 @@ KernelStart(void)
 
 	uint32_t iterations = 0;
 	uint32_t timeout = 2500; // Timeout of 2500 = 2.2 seconds between messages. 5,000 = 3.9 seconds.
-	uint32_t lastMessage = (iterations - timeout) + 1;
 	uint32_t lastActivity = iterations - timeout;
 
 	for(;;)
@@ -427,11 +1328,14 @@ KernelStart(void)
 
 		ScratchWatchdog();
 
-		char completionCode = 0xFF;
-		char readState = 0xFF;
+		unsigned char completionCode = 0xFF;
+		unsigned char readState = 0xFF;
 		int length = ReadMessage(&completionCode, &readState);
 		if (length == 0)
 		{
+			// Don't leave the flash unlocked if the tool has gone quiet.
+			FinishPipelinedWrite();
+
 			if (iterations > (lastActivity + timeout))
 			{
 				SendToolPresent(110, 115, 102, 119);
@@ -444,7 +1348,7 @@ KernelStart(void)
 // from failed flashes, especially those involving the boot block.
 //
 //			// If no message received for N iterations, reboot.
-//			if (iterations > (lastMessage + timeout))
+//			if (iterations > (lastActivity + timeout))
 //			{
 //				Reboot(0xFFFFFFFF);
 //			}
@@ -464,7 +1368,6 @@ KernelStart(void)
 			continue;
 		}
 
-		lastMessage = iterations;
 		lastActivity = iterations;
 
 		ProcessMessage(iterations);
@@ -165,11 +165,31 @@ void ProcessMessage(int length)
 ///////////////////////////////////////////////////////////////////////////////
 // This is needed to satisfy the compiler until we publish the secret sauce.
 ///////////////////////////////////////////////////////////////////////////////
-unsigned char WriteToFlash(const unsigned length, const unsigned startAddress, unsigned char *data, int testWrite)
+unsigned char WriteToFlash(const unsigned length, const unsigned startAddress, unsigned char *data, int testWrite, int differential)
 {
 	// This space intentionally left blank.
 }
 
+void HoldFlashUnlocked(int hold)
+{
+	// This space intentionally left blank.
+}
+
+int PollErase()
+{
+	return 0;
+}
+
+unsigned char EraseFlashBlock(unsigned address)
+{
+	return 0xEE;
+}
+
+uint32_t EraseBlockSize(uint32_t address)
+{
+	return 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // This is the entry point for the kernel.
 ///////////////////////////////////////////////////////////////////////////////
@@ -181,6 +201,7 @@ KernelStart(void)
 	asm("ORI #0x700, %SR");
 
 	ScratchWatchdog();
+	InitializeSleep();
 
 	DLC_INTERRUPTCONFIGURATION = 0x00;
 	LongSleepWithWatchdog();
@@ -190,6 +211,10 @@ KernelStart(void)
 	DLC_TRANSMIT_FIFO = 0x00;
 
 	ClearMessageBuffer();
+	ClearKernelStatistics();
+	ResetReceive();
+	ClearBackgroundJobs();
+	SetProgressInterval(0);
 	WasteTime();
 
 	SendToolPresent(0, 0, 0, 0);
@@ -209,8 +234,8 @@ KernelStart(void)
 
 		ScratchWatchdog();
 
-		char completionCode = 0xFF;
-		char readState = 0xFF;
+		unsigned char completionCode = 0xFF;
+		unsigned char readState = 0xFF;
 		int length = ReadMessage(&completionCode, &readState);
 		if (length == 0)
 		{
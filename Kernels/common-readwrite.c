@@ -3,8 +3,90 @@
 ///////////////////////////////////////////////////////////////////////////////
 #include "common.h"
 
+// Number of words programmed by the most recent flash write.
+unsigned __attribute((section(".kerneldata"))) flashWordsProgrammed;
+
+// Set while HoldFlashUnlocked is keeping the chip unlocked between writes.
+int __attribute((section(".kerneldata"))) flashHoldUnlocked;
+
+// Pipelined writes are copied here, so that MessageBuffer is free to receive
+// the next block while this one is programmed. Compressed writes are expanded
+// into it, and sector rewrites are staged in it. Without those features it
+// isn't needed, which saves 4 KB of the P01's RAM.
+#if KERNEL_FEATURES & (FeaturePipelinedWrite | FeatureCompressedWrite | FeatureSectorRewrite)
+#define PipelineBufferSize 4096
+unsigned char __attribute((section(".kerneldata"))) PipelineBuffer[PipelineBufferSize];
+#endif
+
+#if KERNEL_FEATURES & FeaturePipelinedWrite
+unsigned __attribute((section(".kerneldata"))) pipelineStart;
+unsigned __attribute((section(".kerneldata"))) pipelineLength;
+unsigned __attribute((section(".kerneldata"))) pipelineIndex;
+int __attribute((section(".kerneldata"))) pipelineDifferential;
+unsigned char __attribute((section(".kerneldata"))) pipelineError;
+
+// Bytes programmed between drains of the receive FIFO. Two words take less
+// time than the DLC receive FIFO takes to fill up, even at 4x. The chip is
+// held unlocked (and AMD chips in unlock-bypass mode) for the whole block, so
+// small slices don't pay for unlocking it each time. With
+// host-benchmark -w 10, 8 bytes already loses data from the FIFO while
+// streaming to the Intel chips without the watchdog interrupt, 16 bytes loses
+// data with it, and 8 bytes only saves 2% of the cycles per byte.
+#define PipelineSliceSize 4
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Fill in the header for a mode-36 read reply, and send the payload. The
+// header buffer needs room for 10 bytes.
+//
+// Submode 02 means the payload is run-length encoded (see common.c), which is
+// only used when it's allowed and actually smaller.
+///////////////////////////////////////////////////////////////////////////////
+static void SendReadPayload(unsigned char *header, unsigned start, unsigned length, int allowCompression)
+{
+#if KERNEL_FEATURES & FeatureCompressedRead
+	int compress = allowCompression && (RunLengthSize(PCM_POINTER(start), length) < length);
+#else
+	int compress = 0;
+#endif
+
+	header[0] = 0x6D;
+	header[1] = 0xF0;
+	header[2] = 0x10;
+	header[3] = 0x36;
+	header[4] = compress ? 0x02 : 0x01;
+	header[5] = length >> 8;
+	header[6] = length;
+	header[7] = start >> 16;
+	header[8] = start >> 8;
+	header[9] = start;
+
+	// Like StartChecksum, but for this header.
+	unsigned short checksum = 0;
+	for (int index = 4; index < 10; index++)
+	{
+		checksum += header[index];
+	}
+
+	WriteMessage(header, 10, Start);
+#if KERNEL_FEATURES & FeatureCompressedRead
+	if (compress)
+	{
+		WriteRunLengthBlock(PCM_POINTER(start), length, checksum);
+		return;
+	}
+#endif
+
+	WriteBlock(PCM_POINTER(start), length, checksum);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Process a mode-35 read.
+//
+// Submode 01 asks for the data as-is. Submode 02 allows a run-length encoded
+// reply, which is sent with submode 02 if it's smaller. Older kernels, and
+// kernels built without FeatureCompressedRead, ignore the submode and always
+// reply with 01.
 ///////////////////////////////////////////////////////////////////////////////
 void HandleReadMode35()
 {
@@ -12,22 +94,193 @@ void HandleReadMode35()
 	unsigned start = (MessageBuffer[7] << 16) + (MessageBuffer[8] << 8) + MessageBuffer[9];
 	// TODO: Validate the start address and length, fail if unreasonable.
 
-	// Send the payload
-	MessageBuffer[0] = 0x6D;
-	MessageBuffer[1] = 0xF0;
-	MessageBuffer[2] = 0x10;
-	MessageBuffer[3] = 0x36;
-	MessageBuffer[4] = 0x01;
-	MessageBuffer[5] = length >> 8;
-	MessageBuffer[6] = length;
-	MessageBuffer[7] = start >> 16;
-	MessageBuffer[8] = start >> 8;
-	MessageBuffer[9] = start;
+	int allowCompression = (MessageBuffer[4] == 0x02);
+
+	ElmSleep();
+	SendReadPayload(MessageBuffer, start, length, allowCompression);
+}
+
+#if KERNEL_FEATURES & FeatureStreamingRead
+///////////////////////////////////////////////////////////////////////////////
+// Streaming reads.
+//
+// Mode 35 submode 03 asks for a whole range at once:
+//
+//   35 03 [block size, 2 bytes] [start, 3 bytes] [length, 3 bytes] [window]
+//
+// The kernel then sends the range as consecutive mode-36 replies, exactly
+// like the replies to submode 02, without waiting for a request for each one.
+// Block N starts at start + (N * block size), so the address in each reply
+// doubles as its sequence number. At most [window] blocks are sent past the
+// last acknowledgement.
+//
+//   35 04 [sequence, 2 bytes] acknowledges every block before that one.
+//   35 05 [sequence, 2 bytes] asks for that block to be sent again.
+//
+// Neither gets a reply. The stream ends when every block has been
+// acknowledged, or when any other request arrives.
+///////////////////////////////////////////////////////////////////////////////
+#define ReadStreamMaxBlockSize 4096
+#define ReadStreamResendSlots 8
+
+unsigned __attribute((section(".kerneldata"))) streamStart;
+unsigned __attribute((section(".kerneldata"))) streamLength;
+unsigned __attribute((section(".kerneldata"))) streamBlockSize;
+unsigned __attribute((section(".kerneldata"))) streamBlocks;
+unsigned __attribute((section(".kerneldata"))) streamWindow;
+unsigned __attribute((section(".kerneldata"))) streamNext;
+unsigned __attribute((section(".kerneldata"))) streamAcknowledged;
+unsigned __attribute((section(".kerneldata"))) streamResend[ReadStreamResendSlots];
+unsigned __attribute((section(".kerneldata"))) streamResendCount;
+
+// Set when the tool has sent something since the last block. The AllPro and
+// ScanTool need ElmSleep to switch from sending to receiving, just as they
+// do before a reply.
+int __attribute((section(".kerneldata"))) streamPause;
+
+// The replies can't be built in MessageBuffer, because they're sent while
+// ReadMessage is receiving the next request into it.
+unsigned char __attribute((section(".kerneldata"))) streamHeader[10];
+
+///////////////////////////////////////////////////////////////////////////////
+// Drop the current stream, if any. Call this once at startup.
+///////////////////////////////////////////////////////////////////////////////
+void StopReadStream()
+{
+	streamBlocks = 0;
+	streamNext = 0;
+	streamAcknowledged = 0;
+	streamResendCount = 0;
+	streamPause = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Background job that sends the stream, one block per turn, so that
+// ReadMessage can collect acknowledgements in between.
+///////////////////////////////////////////////////////////////////////////////
+int ReadStreamJob()
+{
+	if (streamAcknowledged >= streamBlocks)
+	{
+		return 0;
+	}
+
+	unsigned block;
+	if (streamResendCount != 0)
+	{
+		block = streamResend[0];
+		streamResendCount--;
+		for (unsigned index = 0; index < streamResendCount; index++)
+		{
+			streamResend[index] = streamResend[index + 1];
+		}
+
+		if (block < streamAcknowledged)
+		{
+			// It turned up after all.
+			return 1;
+		}
+	}
+	else if ((streamNext < streamBlocks) && (streamNext < streamAcknowledged + streamWindow))
+	{
+		block = streamNext++;
+	}
+	else
+	{
+		// Waiting for the tool to catch up.
+		return 1;
+	}
+
+	unsigned offset = block * streamBlockSize;
+	unsigned length = streamLength - offset;
+	if (length > streamBlockSize)
+	{
+		length = streamBlockSize;
+	}
+
+	if (streamPause)
+	{
+		streamPause = 0;
+		ElmSleep();
+	}
+
+	SendReadPayload(streamHeader, streamStart + offset, length, 1);
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Mode 35 submode 03: start a stream.
+///////////////////////////////////////////////////////////////////////////////
+void HandleReadStream()
+{
+	unsigned blockSize = (MessageBuffer[5] << 8) + MessageBuffer[6];
+	unsigned start = (MessageBuffer[7] << 16) + (MessageBuffer[8] << 8) + MessageBuffer[9];
+	unsigned length = (MessageBuffer[10] << 16) + (MessageBuffer[11] << 8) + MessageBuffer[12];
+	unsigned window = MessageBuffer[13];
+
+	StopReadStream();
+
+	unsigned blocks = (blockSize == 0) ? 0 : (length + blockSize - 1) / blockSize;
+	if ((blockSize > ReadStreamMaxBlockSize) || (blocks == 0) || (blocks > 0xFFFF) || (window == 0))
+	{
+		MessageBuffer[0] = 0x6C;
+		MessageBuffer[1] = 0xF0;
+		MessageBuffer[2] = 0x10;
+		MessageBuffer[3] = 0x7F;
+		MessageBuffer[4] = 0x35;
+
+		WriteMessage(MessageBuffer, 5, Complete);
+		return;
+	}
 
+	streamStart = start;
+	streamLength = length;
+	streamBlockSize = blockSize;
+	streamWindow = window;
+	streamBlocks = blocks;
+
+	// The first block goes out right away, the rest as background work.
 	ElmSleep();
-	WriteMessage(MessageBuffer, 10, Start);
-	WriteMessage((char*)start, length, End|AddSum);
+	ReadStreamJob();
+	StartBackgroundJob(ReadStreamJob);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Mode 35 submodes 04 and 05: acknowledge blocks, or ask for one again.
+///////////////////////////////////////////////////////////////////////////////
+void HandleReadStreamAcknowledge()
+{
+	unsigned sequence = (MessageBuffer[5] << 8) + MessageBuffer[6];
+	streamPause = 1;
+
+	if (MessageBuffer[4] == 0x04)
+	{
+		if ((sequence > streamAcknowledged) && (sequence <= streamNext))
+		{
+			streamAcknowledged = sequence;
+		}
+
+		return;
+	}
+
+	if ((sequence < streamAcknowledged) ||
+		(sequence >= streamNext) ||
+		(streamResendCount == ReadStreamResendSlots))
+	{
+		return;
+	}
+
+	for (unsigned index = 0; index < streamResendCount; index++)
+	{
+		if (streamResend[index] == sequence)
+		{
+			return;
+		}
+	}
+
+	streamResend[streamResendCount++] = sequence;
 }
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 // Handle a mode-34 request for permission to write.
@@ -35,7 +288,6 @@ void HandleReadMode35()
 void HandleWriteRequestMode34()
 {
 	unsigned length = (MessageBuffer[5] << 8) + MessageBuffer[6];
-	unsigned start = (MessageBuffer[7] << 16) + (MessageBuffer[8] << 8) + MessageBuffer[9];
 
 	if (length > 4096)
 	{
@@ -72,6 +324,22 @@ void SendWriteSuccess(unsigned char code)
 	WriteMessage(MessageBuffer, 5, Complete);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// The reply to a differential write also says how many words were programmed.
+///////////////////////////////////////////////////////////////////////////////
+void SendDifferentialWriteSuccess(unsigned wordsProgrammed)
+{
+	MessageBuffer[0] = 0x6D;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x76;
+	MessageBuffer[4] = 0x0D;
+	MessageBuffer[5] = wordsProgrammed >> 8;
+	MessageBuffer[6] = wordsProgrammed;
+
+	WriteMessage(MessageBuffer, 7, Complete);
+}
+
 void SendWriteFail(unsigned char callerError, unsigned char flashError)
 {
 	MessageBuffer[0] = 0x6D;
@@ -84,29 +352,678 @@ void SendWriteFail(unsigned char callerError, unsigned char flashError)
 	WriteMessage(MessageBuffer, 7, Complete);
 }
 
+#if KERNEL_FEATURES & FeaturePatchWrite
+///////////////////////////////////////////////////////////////////////////////
+// Patch lists (mode-36 command 0E). Each patch in the payload is
+//
+//   [address, 3 bytes] [length, 2 bytes] [data]
+//
+// Programming can clear flash bits but not set them, so a patch that only
+// clears bits is programmed in place, without erasing its block. Any other
+// patch is left alone, and listed in the reply so that the tool can erase
+// and rewrite that part of the flash:
+//
+//   76 0E [words programmed, 2 bytes] [count] [index of each skipped patch]
+///////////////////////////////////////////////////////////////////////////////
+unsigned char __attribute((section(".kerneldata"))) patchesSkipped[PatchListMaxPatches];
+
+static int CanPatch(unsigned start, unsigned length, unsigned char *data)
+{
+	if ((start & 1) || (length & 1))
+	{
+		return 0;
+	}
+
+	unsigned char *flash = PCM_POINTER(start);
+	for (unsigned index = 0; index < length; index++)
+	{
+		if ((flash[index] & data[index]) != data[index])
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+void HandlePatchList(unsigned char *data, unsigned length)
+{
+	// Don't program anything unless the whole list makes sense.
+	unsigned offset = 0;
+	unsigned patches = 0;
+	while (offset < length)
+	{
+		if ((offset + 5 > length) || (patches == PatchListMaxPatches))
+		{
+			SendWriteFail(0xBE, 0);
+			return;
+		}
+
+		offset += 5 + ((data[offset + 3] << 8) | data[offset + 4]);
+		patches++;
+	}
+
+	if (offset != length)
+	{
+		SendWriteFail(0xBE, 0);
+		return;
+	}
+
+	FinishPipelinedWrite();
+
+	unsigned skipped = 0;
+	unsigned wordsProgrammed = 0;
+	offset = 0;
+	for (unsigned patch = 0; patch < patches; patch++)
+	{
+		unsigned start = (data[offset] << 16) | (data[offset + 1] << 8) | data[offset + 2];
+		unsigned size = (data[offset + 3] << 8) | data[offset + 4];
+		unsigned char *bytes = &data[offset + 5];
+		offset += 5 + size;
+
+		ScratchWatchdog();
+		if (!CanPatch(start, size, bytes))
+		{
+			patchesSkipped[skipped++] = patch;
+			continue;
+		}
+
+		unsigned char flashError = WriteToFlash(size, start, bytes, 0, 1);
+		wordsProgrammed += flashWordsProgrammed;
+		if (flashError)
+		{
+			crcReset();
+			SendWriteFail(0, flashError);
+			return;
+		}
+	}
+
+	crcReset();
+
+	MessageBuffer[0] = 0x6D;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x76;
+	MessageBuffer[4] = PatchListWrite;
+	MessageBuffer[5] = wordsProgrammed >> 8;
+	MessageBuffer[6] = wordsProgrammed;
+	MessageBuffer[7] = skipped;
+	for (unsigned index = 0; index < skipped; index++)
+	{
+		MessageBuffer[8 + index] = patchesSkipped[index];
+	}
+
+	WriteMessage(MessageBuffer, 8 + skipped, Complete);
+}
+#endif
+
+#if KERNEL_FEATURES & FeatureSectorRewrite
+///////////////////////////////////////////////////////////////////////////////
+// Sector rewrites (mode-36 command 0F). See common.h for the payload.
+//
+// The whole block has to be in RAM while it's erased, and the only RAM to
+// spare is the pipeline buffer, so the block is staged compactly. Erased words
+// aren't stored at all, and runs of one value are stored as a count. Each
+// record in the staging buffer is
+//
+//   [word offset, 2 bytes] [word count, 2 bytes] [data]
+//
+// with the top bit of the count set for a run, whose data is just the value.
+//
+// Nothing is erased unless the block matches the CRC before, and the staged
+// copy, with the patches applied, matches the CRC after. Blocks that don't fit
+// are refused, and the tool erases and rewrites them as usual. The reply is
+//
+//   76 0F [staged bytes, 2 bytes]
+//
+// or a write failure, with one of the codes below. Only the last two mean
+// that the block was changed.
+///////////////////////////////////////////////////////////////////////////////
+#define RewriteMalformed 0xBE
+#define RewriteCrcBefore 0xBD
+#define RewriteTooBig 0xBC
+#define RewriteCrcStaged 0xBA
+#define RewriteCrcAfter 0xB9
+
+// Shorter runs are cheaper to store as part of a literal record.
+#define RewriteMinimumRun 4
+
+static unsigned char rewriteErased[2] = { 0xFF, 0xFF };
+
+// The word at this address once the patches are applied.
+static unsigned char *RewriteWord(unsigned address, unsigned char *patches, unsigned length)
+{
+	unsigned offset = 0;
+	while (offset < length)
+	{
+		unsigned start = (patches[offset] << 16) | (patches[offset + 1] << 8) | patches[offset + 2];
+		unsigned size = (patches[offset + 3] << 8) | patches[offset + 4];
+		if ((address >= start) && (address < start + size))
+		{
+			return &patches[offset + 5 + (address - start)];
+		}
+
+		offset += 5 + size;
+	}
+
+	return PCM_POINTER(address);
+}
+
+// Returns the number of bytes staged, or -1 if the block doesn't fit.
+static int StageSector(unsigned start, unsigned size, unsigned char *patches, unsigned length)
+{
+	unsigned words = size / 2;
+	unsigned word = 0;
+	unsigned lastScratch = 0;
+	unsigned staged = 0;
+	unsigned char *literal = 0;
+
+	while (word < words)
+	{
+		if (word - lastScratch >= 256)
+		{
+			ScratchWatchdog();
+			lastScratch = word;
+		}
+
+		unsigned char *value = RewriteWord(start + (word * 2), patches, length);
+		if ((value[0] == 0xFF) && (value[1] == 0xFF))
+		{
+			literal = 0;
+			word++;
+			continue;
+		}
+
+		unsigned run = 1;
+		while ((word + run < words) && (run < 0x7FFF))
+		{
+			unsigned char *next = RewriteWord(start + ((word + run) * 2), patches, length);
+			if ((next[0] != value[0]) || (next[1] != value[1]))
+			{
+				break;
+			}
+
+			run++;
+		}
+
+		if (run >= RewriteMinimumRun)
+		{
+			if (staged + 6 > PipelineBufferSize)
+			{
+				return -1;
+			}
+
+			unsigned char *record = &PipelineBuffer[staged];
+			record[0] = word >> 8;
+			record[1] = word;
+			record[2] = 0x80 | (run >> 8);
+			record[3] = run;
+			record[4] = value[0];
+			record[5] = value[1];
+			staged += 6;
+			literal = 0;
+			word += run;
+			continue;
+		}
+
+		if (staged + (literal ? 2 : 6) > PipelineBufferSize)
+		{
+			return -1;
+		}
+
+		if (!literal)
+		{
+			literal = &PipelineBuffer[staged];
+			literal[0] = word >> 8;
+			literal[1] = word;
+			literal[2] = 0;
+			literal[3] = 0;
+			staged += 4;
+		}
+
+		PipelineBuffer[staged++] = value[0];
+		PipelineBuffer[staged++] = value[1];
+		unsigned count = ((literal[2] << 8) | literal[3]) + 1;
+		literal[2] = count >> 8;
+		literal[3] = count;
+		word++;
+	}
+
+	return staged;
+}
+
+// The CRC of the block that the staging buffer describes.
+static unsigned StagedCrc(unsigned size, int staged)
+{
+	unsigned remainder = 0;
+	unsigned word = 0;
+	int index = 0;
+	while (index < staged)
+	{
+		unsigned char *record = &PipelineBuffer[index];
+		unsigned offset = (record[0] << 8) | record[1];
+		unsigned count = ((record[2] & 0x7F) << 8) | record[3];
+
+		remainder = crcRepeat(remainder, rewriteErased, offset - word);
+		if (record[2] & 0x80)
+		{
+			remainder = crcRepeat(remainder, &record[4], count);
+			index += 6;
+		}
+		else
+		{
+			remainder = crcContinue(remainder, &record[4], count * 2);
+			index += 4 + (count * 2);
+		}
+
+		word = offset + count;
+		ScratchWatchdog();
+	}
+
+	return crcRepeat(remainder, rewriteErased, (size / 2) - word);
+}
+
+// Program the staged block into the erased flash. Runs are programmed from
+// MessageBuffer, which isn't needed once the patches have been staged.
+static unsigned char ProgramStagedSector(unsigned start, int staged)
+{
+	int index = 0;
+	while (index < staged)
+	{
+		unsigned char *record = &PipelineBuffer[index];
+		unsigned address = start + (((record[0] << 8) | record[1]) * 2);
+		unsigned count = ((record[2] & 0x7F) << 8) | record[3];
+		unsigned char flashError;
+
+		ScratchWatchdog();
+		if (!(record[2] & 0x80))
+		{
+			flashError = WriteToFlash(count * 2, address, &record[4], 0, 0);
+			index += 4 + (count * 2);
+			if (flashError)
+			{
+				return flashError;
+			}
+
+			continue;
+		}
+
+		unsigned fill = (count * 2 < MessageBufferSize) ? count * 2 : MessageBufferSize & ~1;
+		for (unsigned offset = 0; offset < fill; offset += 2)
+		{
+			MessageBuffer[offset] = record[4];
+			MessageBuffer[offset + 1] = record[5];
+		}
+
+		index += 6;
+		for (unsigned offset = 0; offset < count * 2; offset += fill)
+		{
+			unsigned size = (count * 2) - offset;
+			flashError = WriteToFlash((size < fill) ? size : fill, address + offset, MessageBuffer, 0, 0);
+			if (flashError)
+			{
+				return flashError;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// CRC of a range of flash, all at once.
+static unsigned FlashCrc(unsigned start, unsigned size)
+{
+	unsigned char *data = PCM_POINTER(start);
+	crcStart(data, size);
+	while (!crcIsDone(data, size))
+	{
+		crcProcessSlice();
+	}
+
+	return crcGetResult();
+}
+
+void HandleSectorRewrite(unsigned start, unsigned char *data, unsigned length)
+{
+	if (length < 11)
+	{
+		SendWriteFail(RewriteMalformed, 0);
+		return;
+	}
+
+	unsigned size = (data[0] << 16) | (data[1] << 8) | data[2];
+	unsigned crcBefore = (data[3] << 24) | (data[4] << 16) | (data[5] << 8) | data[6];
+	unsigned crcAfter = (data[7] << 24) | (data[8] << 16) | (data[9] << 8) | data[10];
+	unsigned char *patches = &data[11];
+	length -= 11;
+
+	// The range must be exactly one erase block, because the whole block is
+	// about to be erased.
+	if ((size == 0) || (size > SectorRewriteMaxSize) || (EraseBlockSize(start) != size))
+	{
+		SendWriteFail(RewriteMalformed, 0);
+		return;
+	}
+
+	// Every patch must be word-aligned, and inside the block.
+	unsigned offset = 0;
+	while (offset < length)
+	{
+		if (offset + 5 > length)
+		{
+			SendWriteFail(RewriteMalformed, 0);
+			return;
+		}
+
+		unsigned patchStart = (patches[offset] << 16) | (patches[offset + 1] << 8) | patches[offset + 2];
+		unsigned patchSize = (patches[offset + 3] << 8) | patches[offset + 4];
+		offset += 5 + patchSize;
+		if ((offset > length) ||
+			(patchStart & 1) ||
+			(patchSize & 1) ||
+			(patchStart < start) ||
+			(patchStart + patchSize > start + size))
+		{
+			SendWriteFail(RewriteMalformed, 0);
+			return;
+		}
+	}
+
+	// The pipeline buffer is about to be overwritten.
+	FinishPipelinedWrite();
+
+	if (FlashCrc(start, size) != crcBefore)
+	{
+		crcReset();
+		SendWriteFail(RewriteCrcBefore, 0);
+		return;
+	}
+
+	int staged = StageSector(start, size, patches, length);
+	if (staged < 0)
+	{
+		crcReset();
+		SendWriteFail(RewriteTooBig, 0);
+		return;
+	}
+
+	if (StagedCrc(size, staged) != crcAfter)
+	{
+		crcReset();
+		SendWriteFail(RewriteCrcStaged, 0);
+		return;
+	}
+
+	// From here on, the block only exists in the staging buffer.
+	unsigned char flashError = EraseFlashBlock(start);
+	if (flashError == 0)
+	{
+		HoldFlashUnlocked(1);
+		flashError = ProgramStagedSector(start, staged);
+		HoldFlashUnlocked(0);
+	}
+
+	crcReset();
+	if (flashError)
+	{
+		SendWriteFail(0, flashError);
+		return;
+	}
+
+	unsigned crc = FlashCrc(start, size);
+	crcReset();
+	if (crc != crcAfter)
+	{
+		SendWriteFail(RewriteCrcAfter, 0);
+		return;
+	}
+
+	MessageBuffer[0] = 0x6D;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x76;
+	MessageBuffer[4] = SectorRewrite;
+	MessageBuffer[5] = staged >> 8;
+	MessageBuffer[6] = staged;
+	WriteMessage(MessageBuffer, 7, Complete);
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Pipelined writes. Call ResetPipelinedWrite once at startup.
+///////////////////////////////////////////////////////////////////////////////
+void ResetPipelinedWrite()
+{
+#if KERNEL_FEATURES & FeaturePipelinedWrite
+	pipelineLength = 0;
+	pipelineIndex = 0;
+	pipelineError = 0;
+#endif
+	flashHoldUnlocked = 0;
+}
+
+#if KERNEL_FEATURES & FeaturePipelinedWrite
+
+///////////////////////////////////////////////////////////////////////////////
+// Background job that programs the pipelined block. Between slices it drains
+// the DLC's receive FIFO, and it keeps going until the next message is
+// complete, so the flash is busy while the tool is sending.
+///////////////////////////////////////////////////////////////////////////////
+int PipelinedWriteJob()
+{
+#if KERNEL_FEATURES & FeatureBackgroundErase
+	// The block may have arrived while its erase block is still being erased.
+	if ((pipelineIndex < pipelineLength) && PollErase())
+	{
+		return 1;
+	}
+#endif
+
+	while (pipelineIndex < pipelineLength)
+	{
+		unsigned length = pipelineLength - pipelineIndex;
+		if (length > PipelineSliceSize)
+		{
+			length = PipelineSliceSize;
+		}
+
+		unsigned char flashError = WriteToFlash(length, pipelineStart + pipelineIndex, &PipelineBuffer[pipelineIndex], 0, pipelineDifferential);
+		pipelineIndex += length;
+
+		if (flashError != 0)
+		{
+			// Give up on the rest of the block. The tool finds out when it
+			// sends the next block, which it sends without the pipeline flag
+			// if it's the last block of the range.
+			pipelineError = flashError;
+			pipelineIndex = pipelineLength;
+		}
+
+		if (pipelineIndex >= pipelineLength)
+		{
+			// Leave the chip unlocked, in case another block follows. Locking
+			// an Intel chip takes long enough to lose incoming data, and an
+			// AMD chip stays in unlock-bypass mode until FinishPipelinedWrite.
+			return 0;
+		}
+
+		// Keep programming while the next message arrives, until it's
+		// complete. Outside of ReadMessage, stop when any data arrives.
+		if (MessageWaiting())
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Wait for the pipelined block to be programmed, and for any background erase,
+// and lock the chip. This must be called before anything else uses the flash
+// chip or the pipeline buffer.
+///////////////////////////////////////////////////////////////////////////////
+void FinishPipelinedWrite()
+{
+#if KERNEL_FEATURES & FeaturePipelinedWrite
+	while (PipelinedWriteJob())
+	{
+	}
+#endif
+
+#if KERNEL_FEATURES & FeatureBackgroundErase
+	while (PollErase())
+	{
+	}
+#endif
+
+	if (flashHoldUnlocked)
+	{
+		HoldFlashUnlocked(0);
+	}
+}
+
+#if KERNEL_FEATURES & FeaturePipelinedWrite
+///////////////////////////////////////////////////////////////////////////////
+// If the previous pipelined block failed, reject the current write to say so.
+// Returns nonzero if the write was rejected.
+///////////////////////////////////////////////////////////////////////////////
+static int ReportPipelineError()
+{
+	if (pipelineError == 0)
+	{
+		return 0;
+	}
+
+	unsigned char flashError = pipelineError;
+	pipelineError = 0;
+	SendWriteFail(0xBF, flashError);
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Accept a block for pipelined programming.
+//
+// The reply goes out as soon as the block has been copied to the pipeline
+// buffer, and the tool waits for that reply before sending the next block.
+// Since the previous block is finished before the copy, there is never more
+// than one block waiting to be programmed, and one arriving. Compressed blocks
+// have already been expanded into the pipeline buffer, so there's no copy.
+///////////////////////////////////////////////////////////////////////////////
+void HandlePipelinedWrite(unsigned char command, unsigned char *data, unsigned length, unsigned start)
+{
+	while (PipelinedWriteJob())
+	{
+	}
+
+	if (ReportPipelineError())
+	{
+		return;
+	}
+
+	if (data != PipelineBuffer)
+	{
+		for (unsigned index = 0; index < length; index++)
+		{
+			if (index % 1024 == 0)
+			{
+				ScratchWatchdog();
+			}
+
+			PipelineBuffer[index] = data[index];
+		}
+	}
+
+	pipelineStart = start;
+	pipelineLength = length;
+	pipelineIndex = 0;
+	pipelineDifferential = (command & ~(PipelinedWrite | RunLengthWrite)) == 0x0D;
+
+	crcReset();
+	if (!flashHoldUnlocked)
+	{
+		HoldFlashUnlocked(1);
+	}
+
+	StartBackgroundJob(PipelinedWriteJob);
+
+	SendWriteSuccess(command);
+}
+#endif
+
 typedef void(*EntryPoint)();
 
+// Refusal for a write that needs a feature this kernel was built without.
+#define UnsupportedWrite 0xB8
+
 void HandleWriteMode36()
 {
 	unsigned char command = MessageBuffer[4];
 	unsigned length = (MessageBuffer[5] << 8) + MessageBuffer[6];
 	unsigned start = (MessageBuffer[7] << 16) + (MessageBuffer[8] << 8) + MessageBuffer[9];
+	unsigned short expected = (MessageBuffer[10 + length] << 8) | MessageBuffer[10 + length + 1];
+	unsigned char *data = &MessageBuffer[10];
+	unsigned char operation = command & ~(PipelinedWrite | RunLengthWrite);
 
-	// Compute checksum
-	unsigned short checksum = 0;
-	for (unsigned int index = 4; index < length + 10 ; index++) // vpw header = 10 bytes offset from payload length
+	// Older kernels would write these payloads to flash as they are.
+	if (((command & RunLengthWrite) && !(KERNEL_FEATURES & FeatureCompressedWrite)) ||
+		((operation == PatchListWrite) && !(KERNEL_FEATURES & FeaturePatchWrite)) ||
+		((operation == SectorRewrite) && !(KERNEL_FEATURES & FeatureSectorRewrite)))
+	{
+		SendWriteFail(UnsupportedWrite, 0);
+		return;
+	}
+
+#if KERNEL_FEATURES & FeatureCompressedWrite
+	if (command & RunLengthWrite)
 	{
-		if (index % 1024 == 0)
+		// Expand into the pipeline buffer, once the previous pipelined block
+		// is done with it. From here on, length is the decoded length.
+#if KERNEL_FEATURES & FeaturePipelinedWrite
+		while (PipelinedWriteJob())
 		{
-			ScratchWatchdog();
 		}
-		checksum += MessageBuffer[index];
+#endif
+
+		data = PipelineBuffer;
+		length = ExpandRunLength(&MessageBuffer[10], length, PipelineBuffer, PipelineBufferSize);
+	}
+#endif
+
+	// Compute checksum, over the header and the (decoded) payload. The
+	// receive engine has already summed everything that came off the wire,
+	// so only a decoded payload needs another pass.
+	unsigned short checksum;
+#if KERNEL_FEATURES & FeatureCompressedWrite
+	if (command & RunLengthWrite)
+	{
+		checksum = 0;
+		for (unsigned int index = 4; index < 10; index++)
+		{
+			checksum += MessageBuffer[index];
+		}
+
+		for (unsigned int index = 0; index < length; index++)
+		{
+			if (index % 1024 == 0)
+			{
+				ScratchWatchdog();
+			}
+			checksum += data[index];
+		}
+	}
+	else
+#endif
+	{
+		checksum = ReceivedBlockSum(length);
 	}
 
 	// Validate checksum
-	unsigned short expected = (MessageBuffer[10 + length] << 8) | MessageBuffer[10 + length + 1];
-	if (checksum != expected)
+	if ((checksum != expected) || ((command & RunLengthWrite) && (length == 0)))
 	{
+		CountStatistic(checksumFailures, 1);
+
 		/*unsigned char tmp = MessageBuffer[1];
 		MessageBuffer[1] = MessageBuffer[2];
 		MessageBuffer[2] = tmp;
@@ -136,37 +1053,97 @@ void HandleWriteMode36()
 		return;
 	}
 
+	// The tool waits for the reply to anything but a pipelined write, so
+	// long operations can send it progress frames in the meantime.
+#if KERNEL_FEATURES & FeaturePatchWrite
+	if (operation == PatchListWrite)
+	{
+		StartProgress(0x36);
+		HandlePatchList(data, length);
+		StopProgress();
+		return;
+	}
+#endif
+
+#if KERNEL_FEATURES & FeatureSectorRewrite
+	if (operation == SectorRewrite)
+	{
+		StartProgress(0x36);
+		HandleSectorRewrite(start, data, length);
+		StopProgress();
+		return;
+	}
+#endif
+
 	if ((start >= 0xFF8000) && (start + length <= 0xFFCDFF))
 	{
-		// Copy content
-		unsigned int address = 0;
-		for (int index = 0; index < length; index++)
+		// Don't overwrite code or data that the pipelined write is using.
+		FinishPipelinedWrite();
+
+		// Copy content. The payload waits in MessageBuffer until its sum has
+		// been checked, so a damaged upload never reaches RAM. The receive
+		// engine summed it on the way in, so this is the only other pass.
+		unsigned char *address = PCM_POINTER(start);
+		for (unsigned index = 0; index < length; index++)
 		{
-			if (index % 50 == 1)
+			if (index % 1024 == 0)
 			{
 				ScratchWatchdog();
 			}
-			address = start + index;
-			*((unsigned char*)address) = MessageBuffer[10 + index];
+			address[index] = data[index];
 		}
 
 		// Notify the tool that the write succeeded.
 		SendWriteSuccess(command);
 
 		// Execute if requested to do so.
+#if !defined HOST
 		if (command == 0x80)
 		{
+			// The new code might overwrite the watchdog interrupt handler.
+			StopWatchdogTimer();
+
 			EntryPoint entryPoint = (EntryPoint)start;
 			entryPoint();
 		}
+#endif
 	}
 	else
 	{
-		char flashError = WriteToFlash(length, start, &MessageBuffer[10], command == 0x44);
+#if KERNEL_FEATURES & FeaturePipelinedWrite
+		// Test writes don't touch the flash, so there's nothing to overlap.
+		if ((command & PipelinedWrite) && (operation != 0x44) && (length <= PipelineBufferSize))
+		{
+			HandlePipelinedWrite(command, data, length, start);
+			return;
+		}
+#endif
+
+		// Without FeaturePipelinedWrite, a pipelined block is written before
+		// the reply, as though the flag weren't set.
+		FinishPipelinedWrite();
+#if KERNEL_FEATURES & FeaturePipelinedWrite
+		if (ReportPipelineError())
+		{
+			return;
+		}
+#endif
+
+		StartProgress(0x36);
+		char flashError = WriteToFlash(length, start, data, operation == 0x44, operation == 0x0D);
+		StopProgress();
+		crcReset();
 
 		if (flashError == 0)
 		{
-			SendWriteSuccess(command);
+			if (operation == 0x0D)
+			{
+				SendDifferentialWriteSuccess(flashWordsProgrammed);
+			}
+			else
+			{
+				SendWriteSuccess(command);
+			}
 		}
 		else
 		{
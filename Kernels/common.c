@@ -19,16 +19,126 @@ unsigned char __attribute((section(".kerneldata"))) MessageBuffer[MessageBufferS
 // well, and then dump this buffer later to find out what was going on.
 unsigned char __attribute((section(".kerneldata"))) BreadcrumbBuffer[BreadcrumbBufferSize];
 
+#if KERNEL_FEATURES & BackgroundJobFeatures
+// Background jobs, and the one that ran most recently.
+BackgroundJob __attribute((section(".kerneldata"))) backgroundJobs[BackgroundJobCount];
+int __attribute((section(".kerneldata"))) backgroundJobIndex;
+#endif
+
+#if KERNEL_FEATURES & FeatureStatistics
+KernelStatistics __attribute((section(".kerneldata"))) kernelStatistics;
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 // This needs to be called periodically to prevent the PCM from rebooting.
+// Most code should use ScratchWatchdog, which does nothing when the watchdog
+// interrupt is doing this instead.
 ///////////////////////////////////////////////////////////////////////////////
-void ScratchWatchdog()
+void ServiceWatchdog()
 {
 	WATCHDOG1 = 0x55;
 	WATCHDOG1 = 0xAA;
 	WATCHDOG2 ^= 0x80;
 }
 
+#if defined WATCHDOG_TIMER
+///////////////////////////////////////////////////////////////////////////////
+// Watchdog interrupt.
+//
+// The periodic interrupt timer counts in units of four cycles of the 32.768
+// kHz crystal, so a PITR value of 2 gives an interrupt every 244 us. That's a
+// little more than one byte time at 4x, so the interrupt can drain the DLC's
+// receive FIFO long before it fills up, and it scratches the watchdog every
+// fourth time. It runs at level 7, which can't be masked, so the kernel
+// leaves the other interrupts disabled as before.
+//
+// The PCM's vector table is in flash, so the kernel points the VBR at its own
+// table while the timer runs. The timer uses vector 31, the level 7 autovector,
+// which keeps the table down to 128 bytes of RAM. The entries below it are
+// copied from the PCM's table, so exceptions are handled as they were.
+///////////////////////////////////////////////////////////////////////////////
+#define WatchdogVector 31
+#define WatchdogPeriod 2
+#define WatchdogInterruptsPerScratch 4
+
+typedef void (*InterruptHandler)(void);
+
+InterruptHandler __attribute((section(".kerneldata"))) watchdogVectors[WatchdogVector + 1];
+InterruptHandler __attribute((section(".kerneldata"))) *savedVectors;
+unsigned __attribute((section(".kerneldata"))) watchdogInterrupts;
+extern volatile int receiveInterrupt;
+
+#if defined HOST
+static void WatchdogInterrupt(void)
+#else
+static void __attribute__((interrupt)) WatchdogInterrupt(void)
+#endif
+{
+	receiveInterrupt = 1;
+	DrainReceiveFifo();
+	receiveInterrupt = 0;
+
+	if (++watchdogInterrupts % WatchdogInterruptsPerScratch == 0)
+	{
+		ServiceWatchdog();
+	}
+}
+
+static InterruptHandler *GetVectorBase()
+{
+#if defined HOST
+	return HostGetVbr();
+#else
+	InterruptHandler *table;
+	asm volatile("movec %%vbr, %0" : "=r" (table));
+	return table;
+#endif
+}
+
+static void SetVectorBase(InterruptHandler *table)
+{
+#if defined HOST
+	HostSetVbr(table);
+#else
+	asm volatile("movec %0, %%vbr" : : "r" (table));
+#endif
+}
+
+void StartWatchdogTimer()
+{
+	ServiceWatchdog();
+
+	savedVectors = GetVectorBase();
+	for (int index = 0; index < WatchdogVector; index++)
+	{
+		watchdogVectors[index] = savedVectors[index];
+	}
+
+	watchdogVectors[WatchdogVector] = WatchdogInterrupt;
+	watchdogInterrupts = 0;
+	SetVectorBase(watchdogVectors);
+
+	SIM_PITR = WatchdogPeriod;
+	SIM_PICR = (7 << 8) | WatchdogVector;
+}
+
+void StopWatchdogTimer()
+{
+	SIM_PICR = 0;
+	SIM_PITR = 0;
+	SetVectorBase(savedVectors);
+	ServiceWatchdog();
+}
+#else
+void StartWatchdogTimer()
+{
+}
+
+void StopWatchdogTimer()
+{
+}
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 // Does what it says.
 ///////////////////////////////////////////////////////////////////////////////
@@ -41,62 +151,118 @@ void WasteTime()
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Shared sleep code for multiple scenarios
+// Sleep timing.
+//
+// The PCMs run at different clock speeds, so a fixed loop count gives a
+// different delay on each one. InitializeSleep works out the CPU clock from
+// the clock synthesizer (SYNCR) and converts that into delay loop iterations.
+// The 68332's PIT and TPU counters aren't readable without interrupts, which
+// the kernel keeps disabled, so the synthesizer setting is the best reference
+// we have.
+//
+// f = 32.768 kHz * 4(Y+1) * 2^(2W+X). The P01 runs at 32768 * 640 = 20.97 MHz.
 ///////////////////////////////////////////////////////////////////////////////
-void PrivateSleep(int outerLoop, int innerLoop)
+#define SleepReferenceHertz 32768
+#define SleepDefaultKilohertz 20972
+
+// Each iteration of the delay loop is a subq (2 clocks) and a taken bne
+// (6 clocks). Wait states can only make it slower, so the delays err long.
+#define SleepClocksPerIteration 8
+
+// Delay loop iterations per millisecond.
+unsigned __attribute((section(".kerneldata"))) sleepIterationsPerMillisecond;
+
+void InitializeSleep()
 {
-	for (int outer = 0; outer < outerLoop; outer++)
+	unsigned kilohertz = SleepDefaultKilohertz;
+
+#if defined SIM_SYNCR
+	unsigned short syncr = SIM_SYNCR;
+	unsigned y = (syncr >> 8) & 0x3F;
+	unsigned shift = (((syncr >> 15) & 1) * 2) + ((syncr >> 14) & 1);
+	unsigned hertz = (SleepReferenceHertz * 4 * (y + 1)) << shift;
+
+	// If the clock comes from an external oscillator rather than the
+	// synthesizer, SYNCR tells us nothing useful.
+	if ((hertz >= 8000000) && (hertz <= 33000000))
 	{
-		for (int inner = 0; inner < innerLoop; inner++)
-		{
-			asm("nop");
-			asm("nop");
-			asm("nop");
-			asm("nop");
+		kilohertz = hertz / 1000;
+	}
+#endif
+
+	sleepIterationsPerMillisecond = kilohertz / SleepClocksPerIteration;
+}
 
-			asm("nop");
-			asm("nop");
-			asm("nop");
-			asm("nop");
+///////////////////////////////////////////////////////////////////////////////
+// Spin for the given number of delay loop iterations.
+///////////////////////////////////////////////////////////////////////////////
+static void DelayLoop(unsigned iterations)
+{
+#if defined HOST
+	for (volatile unsigned count = iterations; count != 0; count--);
+#else
+	asm volatile(
+		"1:	subq.l #1, %0\n"
+		"	bne.s 1b"
+		: "+d" (iterations));
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sleep for the given number of microseconds, scratching the watchdog every
+// millisecond.
+///////////////////////////////////////////////////////////////////////////////
+void SleepMicroseconds(unsigned microseconds)
+{
+	while (microseconds != 0)
+	{
+		unsigned slice = microseconds > 1000 ? 1000 : microseconds;
+		unsigned iterations = (slice * sleepIterationsPerMillisecond) / 1000;
+		if (iterations != 0)
+		{
+			DelayLoop(iterations);
 		}
 
 		ScratchWatchdog();
+		microseconds -= slice;
 	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Pause for about half a second. TODO: remove this, replace with either
-// ElmSleep or VariableSleep, as appropriate.
+// Pause for half a second. TODO: remove this, replace with either
+// ElmSleep or SleepMicroseconds, as appropriate.
 ///////////////////////////////////////////////////////////////////////////////
 void LongSleepWithWatchdog()
 {
-	PrivateSleep(10 * 1000, 5);
+	SleepMicroseconds(500 * 1000);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // ELM-based devices need a short pause between transmit and receive, otherwise
-// they will miss the responses from the PCM. This function should be tuned to
-// provide the right delay with AllPro and Scantool devices.
+// they will miss the responses from the PCM.
+//
+// The old nop loop here was tuned by trial with the AllPro and Scantool. It ran
+// 50 inner iterations where VariableSleep runs 250, so it took a fifth of a
+// VariableSleep unit, or 500us. J1850 only requires an inter-frame separation
+// of 300us, but a shorter pause hasn't been tried with those devices yet.
 ///////////////////////////////////////////////////////////////////////////////
+#define VariableSleepMicroseconds 2500
+#define ElmSleepMicroseconds (VariableSleepMicroseconds / 5)
+
 void ElmSleep()
 {
-	// 1,25 worked well for a long series of kernel-version requests with both
-	// the AllPro and Scantool at 1x speed.
-	// CRC responses aren't received by either device. Not sure if timing related.
-	// Have not tested 4x yet. Have not tried smaller delay either.
-	PrivateSleep(1, 50);
+	SleepMicroseconds(ElmSleepMicroseconds);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Sleep for a variable amount of time. This should be close to Dimented24x7's
-// assembly-language implementation.
-// Consider cutting the inner loop down, and increasing the parameter at all
-// call sites. Consecutive message-sends (e.g. in HandleReadMode35) work fine
-// with an inner loop of 100. Haven't tried 50 yet.
+// Sleep for a variable amount of time, in units of 2.5ms. This is about what
+// one iteration of the old nop loop took, which was meant to be close to
+// Dimented24x7's assembly-language implementation. New code should call
+// SleepMicroseconds instead.
 ///////////////////////////////////////////////////////////////////////////////
 void VariableSleep(unsigned int iterations)
 {
-	PrivateSleep(iterations, 250);
+	SleepMicroseconds(iterations * VariableSleepMicroseconds);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -130,6 +296,161 @@ void ClearBreadcrumbBuffer()
 	}
 }
 
+#if KERNEL_FEATURES & BackgroundJobFeatures
+///////////////////////////////////////////////////////////////////////////////
+// The kernel data section isn't initialized, so this must be called at startup.
+///////////////////////////////////////////////////////////////////////////////
+void ClearBackgroundJobs()
+{
+	for (int index = 0; index < BackgroundJobCount; index++)
+	{
+		backgroundJobs[index] = 0;
+	}
+
+	backgroundJobIndex = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Add a job to the background list, unless it's already there.
+///////////////////////////////////////////////////////////////////////////////
+void StartBackgroundJob(BackgroundJob job)
+{
+	int available = -1;
+	for (int index = 0; index < BackgroundJobCount; index++)
+	{
+		if (backgroundJobs[index] == job)
+		{
+			return;
+		}
+
+		if ((backgroundJobs[index] == 0) && (available == -1))
+		{
+			available = index;
+		}
+	}
+
+	if (available != -1)
+	{
+		backgroundJobs[available] = job;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Give one background job a turn, and drop it from the list when it's done.
+// Jobs take turns, so a long job doesn't hold up the others.
+///////////////////////////////////////////////////////////////////////////////
+void RunBackgroundJob()
+{
+	for (int count = 0; count < BackgroundJobCount; count++)
+	{
+		backgroundJobIndex = (backgroundJobIndex + 1) % BackgroundJobCount;
+		BackgroundJob job = backgroundJobs[backgroundJobIndex];
+		if (job != 0)
+		{
+			if (!job())
+			{
+				backgroundJobs[backgroundJobIndex] = 0;
+			}
+
+			return;
+		}
+	}
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Progress frames. The tool can't tell a slow erase from a dead PCM, so
+// without these it has to wait for the worst case before giving up. Handlers
+// that keep the tool waiting for a reply call StartProgress, and the flash
+// loops call ProgressDue on each status poll and SendProgress when it says
+// so. The frame is 7D 0E, operation, polls so far (4 bytes), status.
+//
+// Frames are only sent while the tool is waiting, because a frame sent while
+// the tool is talking would collide with it. They have their own buffer,
+// because the payload being programmed may still be in MessageBuffer.
+///////////////////////////////////////////////////////////////////////////////
+#if KERNEL_FEATURES & FeatureProgressFrames
+uint32_t __attribute((section(".kerneldata"))) progressInterval;
+uint32_t __attribute((section(".kerneldata"))) progressCountdown;
+uint32_t __attribute((section(".kerneldata"))) progressPolls;
+unsigned char __attribute((section(".kerneldata"))) progressOperation;
+unsigned char __attribute((section(".kerneldata"))) progressFrame[11];
+
+///////////////////////////////////////////////////////////////////////////////
+// Send a progress frame every interval polls, or never if it's zero. The
+// kernel data section isn't initialized, so this must be called at startup.
+///////////////////////////////////////////////////////////////////////////////
+void SetProgressInterval(uint32_t interval)
+{
+	progressInterval = interval;
+	progressOperation = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Start counting polls for the given operation, which is the mode (or mode
+// 3D submode) of the request that the tool is waiting on.
+///////////////////////////////////////////////////////////////////////////////
+void StartProgress(unsigned char operation)
+{
+	progressOperation = progressInterval ? operation : 0;
+	progressCountdown = progressInterval;
+	progressPolls = 0;
+}
+
+void StopProgress()
+{
+	progressOperation = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Count one status poll. Returns nonzero when it's time for a frame.
+///////////////////////////////////////////////////////////////////////////////
+int ProgressDue()
+{
+	if (!progressOperation || --progressCountdown)
+	{
+		return 0;
+	}
+
+	progressCountdown = progressInterval;
+	progressPolls += progressInterval;
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Send a progress frame with the chip's latest status.
+///////////////////////////////////////////////////////////////////////////////
+void SendProgress(uint16_t status)
+{
+	progressFrame[0] = 0x6C;
+	progressFrame[1] = 0xF0;
+	progressFrame[2] = 0x10;
+	progressFrame[3] = 0x7D;
+	progressFrame[4] = 0x0E;
+	progressFrame[5] = progressOperation;
+	progressFrame[6] = progressPolls >> 24;
+	progressFrame[7] = progressPolls >> 16;
+	progressFrame[8] = progressPolls >> 8;
+	progressFrame[9] = progressPolls;
+	progressFrame[10] = status;
+	WriteMessage(progressFrame, 11, Complete);
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Reset the performance counters.
+///////////////////////////////////////////////////////////////////////////////
+#if KERNEL_FEATURES & FeatureStatistics
+void ClearKernelStatistics()
+{
+	uint32_t *counters = (uint32_t*)&kernelStatistics;
+	for (unsigned index = 0; index < KernelStatisticsCount; index++)
+	{
+		counters[index] = 0;
+	}
+}
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 // Send a byte - used by WriteMessage
 ///////////////////////////////////////////////////////////////////////////////
@@ -156,6 +477,12 @@ void WriteByte(unsigned char byte)
 		ScratchWatchdog();
 		status = DLC_STATUS & 0x03;
 	}
+
+	if (loopCount != 0)
+	{
+		CountStatistic(transmitStalls, 1);
+	}
+
 	DLC_TRANSMIT_FIFO = byte;
 }
 
@@ -172,6 +499,8 @@ void WriteMessage(unsigned char *start, unsigned short length, Segment segment)
 {
 	ScratchWatchdog();
 
+	CountStatistic(bytesTransmitted, (segment & AddSum) ? length + 2 : length);
+
 	if ((segment & Start) != 0)
 	{
 		DLC_TRANSMIT_COMMAND = 0x14;
@@ -240,116 +569,635 @@ void WriteMessage(unsigned char *start, unsigned short length, Segment segment)
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Read a VPW message into the 'MessageBuffer' buffer.
+// Wait until the DLC transmit FIFO has room, and return how many bytes can be
+// written before it needs to be checked again.
+//
+// The FIFO holds 12 bytes. An empty FIFO takes 8 bytes without reaching the
+// almost-full threshold, which is what WriteByte has always relied on. When
+// the FIFO is below the threshold it holds at most 7 bytes, so 4 more still
+// fit. The wire keeps draining while we write, so these are worst cases.
 ///////////////////////////////////////////////////////////////////////////////
-int ReadMessage(unsigned char *completionCode, unsigned char *readState)
+unsigned WaitForTransmitRoom()
+{
+	unsigned char status = DLC_STATUS & 0x03;
+	unsigned char loopCount = 0;
+	while ((status == 0x02 || status == 0x03) && loopCount < 250)
+	{
+		loopCount++;
+
+		for (int iterations = 0; iterations < 50; iterations++)
+		{
+			WasteTime();
+		}
+
+		ScratchWatchdog();
+		status = DLC_STATUS & 0x03;
+	}
+
+	if (loopCount != 0)
+	{
+		CountStatistic(transmitStalls, 1);
+	}
+
+	if (status == 0)
+	{
+		return 8;
+	}
+
+	if (status == 1)
+	{
+		return 4;
+	}
+
+	// Timed out. Send one byte at a time, as WriteByte would.
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Send a block of data followed by its 16-bit sum, and end the message. The
+// checksum argument carries the sum of the header, from StartChecksum().
+//
+// This is the mode-35 payload path, so it avoids WriteByte's per-byte costs:
+// the data is read a long at a time, the DLC status is only checked when the
+// last burst could have filled the FIFO, and the watchdog is scratched every
+// WriteBlockWatchdogBytes rather than every byte. Waiting for the FIFO
+// scratches it too, and at VPW speeds that happens every few bytes anyway.
+///////////////////////////////////////////////////////////////////////////////
+#define WriteBlockWatchdogBytes 256
+
+void WriteBlock(unsigned char *data, unsigned length, unsigned short checksum)
 {
+	unsigned char *end = data + length;
+	unsigned room = 0;
+
 	ScratchWatchdog();
-	unsigned char status;
+	CountStatistic(bytesTransmitted, length);
 
-	unsigned int iterations = 0;
-	int length = 0;
-	for (;;)
+	// A byte at a time until the data is long-aligned.
+	while ((data < end) && ((uint32_t)data & 3))
+	{
+		if (room == 0)
+		{
+			room = WaitForTransmitRoom();
+		}
+
+		checksum += *data;
+		DLC_TRANSMIT_FIFO = *data++;
+		room--;
+	}
+
+	// Then a long at a time.
+	while (end - data >= 4)
 	{
+		unsigned char *stop = data + ((end - data) & ~3);
+		if (stop - data > WriteBlockWatchdogBytes)
+		{
+			stop = data + WriteBlockWatchdogBytes;
+		}
+
+		for ( ; data < stop; data += 4)
+		{
+			if (room < 4)
+			{
+				room = WaitForTransmitRoom();
+				if (room < 4)
+				{
+					break;
+				}
+			}
+
+			uint32_t value = PCM_LONG(data);
+
+			// Sum the odd and even bytes in separate 16-bit lanes, then
+			// add the lanes. Same result as adding one byte at a time.
+			uint32_t lanes = (value & 0x00FF00FF) + ((value >> 8) & 0x00FF00FF);
+			checksum += (unsigned short)(lanes + (lanes >> 16));
+
+			DLC_TRANSMIT_FIFO = value >> 24;
+			DLC_TRANSMIT_FIFO = value >> 16;
+			DLC_TRANSMIT_FIFO = value >> 8;
+			DLC_TRANSMIT_FIFO = value;
+			room -= 4;
+		}
+
+		// The DLC timed out, so fall back to one byte per status check.
+		if (data < stop)
+		{
+			break;
+		}
+
 		ScratchWatchdog();
-		iterations++;
+	}
 
-		// If no message received for N iterations, exit.
-		if (iterations > 0x30000)
+	// Whatever is left.
+	while (data < end)
+	{
+		if (room == 0)
+		{
+			room = WaitForTransmitRoom();
+		}
+
+		checksum += *data;
+		DLC_TRANSMIT_FIFO = *data++;
+		room--;
+	}
+
+	// WriteMessage sends the sum, so the end of the frame is handled the same
+	// way as every other message.
+	unsigned char sum[2];
+	sum[0] = checksum >> 8;
+	sum[1] = checksum;
+	WriteMessage(sum, 2, End);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Run-length encoding for compressed mode-35 replies and mode-36 writes. Each
+// token starts with a control byte:
+//
+//   00-7F: (n + 1) literal bytes follow.
+//   80-BF: Byte run. The low 6 bits and the next byte give the count, and the
+//          byte after that is the value.
+//   C0-FF: Word run. The low 6 bits and the next byte give the count in
+//          words, and the two bytes after that are the value.
+//
+// Erased flash and the repeated padding words found in most images shrink to
+// a few bytes per run, and everything else costs one extra byte in 128.
+///////////////////////////////////////////////////////////////////////////////
+#if KERNEL_FEATURES & FeatureCompressedRead
+#define RunLengthMaxLiteral 128
+#define RunLengthMaxCount 0x3FFF
+#define RunLengthMinBytes 4
+#define RunLengthMinWords 3
+
+// Count the bytes that match the first one.
+static unsigned ByteRunLength(unsigned char *data, unsigned char *end)
+{
+	unsigned count = 1;
+	while ((data + count < end) && (data[count] == data[0]) && (count < RunLengthMaxCount))
+	{
+		count++;
+	}
+
+	return count;
+}
+
+// Count the words that match the first one. The data need not be aligned.
+static unsigned WordRunLength(unsigned char *data, unsigned char *end)
+{
+	if (end - data < 2)
+	{
+		return 0;
+	}
+
+	unsigned count = 1;
+	while ((data + (count * 2) + 1 < end) &&
+		(data[count * 2] == data[0]) &&
+		(data[(count * 2) + 1] == data[1]) &&
+		(count < RunLengthMaxCount))
+	{
+		count++;
+	}
+
+	return count;
+}
+
+// Is a run long enough to be worth encoding starting here?
+static int RunStartsAt(unsigned char *data, unsigned char *end)
+{
+	if ((end - data >= RunLengthMinBytes) &&
+		(data[1] == data[0]) && (data[2] == data[0]) && (data[3] == data[0]))
+	{
+		return 1;
+	}
+
+	return (end - data >= RunLengthMinWords * 2) &&
+		(data[2] == data[0]) && (data[3] == data[1]) &&
+		(data[4] == data[0]) && (data[5] == data[1]);
+}
+
+// Send one byte, checking for room in the FIFO only when it might be needed.
+static void TransmitByte(unsigned *room, unsigned char value)
+{
+	if (*room == 0)
+	{
+		*room = WaitForTransmitRoom();
+	}
+
+	DLC_TRANSMIT_FIFO = value;
+	(*room)--;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Encode a block. If 'send' is zero this only measures the encoded size, so
+// the caller can decide whether compression is worth it. Otherwise the tokens
+// go straight to the DLC as they are found, and the sum of the decoded bytes
+// is added to the checksum.
+///////////////////////////////////////////////////////////////////////////////
+static unsigned EncodeRunLength(unsigned char *data, unsigned length, unsigned short *checksum, int send)
+{
+	unsigned char *end = data + length;
+	unsigned char *lastScratch = data;
+	unsigned encoded = 0;
+	unsigned room = 0;
+
+	while (data < end)
+	{
+		if (data - lastScratch >= 256)
+		{
+			ScratchWatchdog();
+			lastScratch = data;
+		}
+
+		unsigned count = ByteRunLength(data, end);
+		if (count >= RunLengthMinBytes)
+		{
+			if (send)
+			{
+				TransmitByte(&room, 0x80 | (count >> 8));
+				TransmitByte(&room, count);
+				TransmitByte(&room, data[0]);
+				*checksum += count * data[0];
+			}
+
+			encoded += 3;
+			data += count;
+			continue;
+		}
+
+		count = WordRunLength(data, end);
+		if (count >= RunLengthMinWords)
+		{
+			if (send)
+			{
+				TransmitByte(&room, 0xC0 | (count >> 8));
+				TransmitByte(&room, count);
+				TransmitByte(&room, data[0]);
+				TransmitByte(&room, data[1]);
+				*checksum += count * (data[0] + data[1]);
+			}
+
+			encoded += 4;
+			data += count * 2;
+			continue;
+		}
+
+		// Literal bytes, up to the next run worth encoding.
+		count = 1;
+		while ((data + count < end) && (count < RunLengthMaxLiteral) && !RunStartsAt(data + count, end))
+		{
+			count++;
+		}
+
+		if (send)
+		{
+			TransmitByte(&room, count - 1);
+			for (unsigned index = 0; index < count; index++)
+			{
+				TransmitByte(&room, data[index]);
+				*checksum += data[index];
+			}
+		}
+
+		encoded += count + 1;
+		data += count;
+	}
+
+	return encoded;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Number of bytes that WriteRunLengthBlock would send for this block, not
+// counting the sum.
+///////////////////////////////////////////////////////////////////////////////
+unsigned RunLengthSize(unsigned char *data, unsigned length)
+{
+	return EncodeRunLength(data, length, 0, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Like WriteBlock, but run-length encoded. The sum still covers the decoded
+// data, so the tool checks the same thing either way.
+///////////////////////////////////////////////////////////////////////////////
+void WriteRunLengthBlock(unsigned char *data, unsigned length, unsigned short checksum)
+{
+	ScratchWatchdog();
+	CountStatistic(bytesTransmitted, EncodeRunLength(data, length, &checksum, 1));
+
+	unsigned char sum[2];
+	sum[0] = checksum >> 8;
+	sum[1] = checksum;
+	WriteMessage(sum, 2, End);
+}
+#endif
+
+#if KERNEL_FEATURES & FeatureCompressedWrite
+///////////////////////////////////////////////////////////////////////////////
+// Expand a run-length encoded block from the tool. Returns the decoded length,
+// or zero if the encoding is malformed or doesn't fit in 'size' bytes.
+///////////////////////////////////////////////////////////////////////////////
+unsigned ExpandRunLength(unsigned char *encoded, unsigned length, unsigned char *result, unsigned size)
+{
+	unsigned char *end = encoded + length;
+	unsigned char *lastScratch = encoded;
+	unsigned output = 0;
+
+	while (encoded < end)
+	{
+		if (encoded - lastScratch >= 256)
+		{
+			ScratchWatchdog();
+			lastScratch = encoded;
+		}
+
+		unsigned char control = *encoded++;
+		if (control < 0x80)
+		{
+			unsigned count = control + 1;
+			if ((end - encoded < count) || (size - output < count))
+			{
+				return 0;
+			}
+
+			for (unsigned index = 0; index < count; index++)
+			{
+				result[output++] = *encoded++;
+			}
+
+			continue;
+		}
+
+		unsigned valueSize = (control & 0x40) ? 2 : 1;
+		if (end - encoded < 1 + valueSize)
 		{
 			return 0;
 		}
 
-		// Let us not overflow MessageBuffer.
-		if (length > MessageBufferSize)
+		unsigned count = ((control & 0x3F) << 8) | *encoded++;
+		if ((size - output) / valueSize < count)
 		{
-			*readState = 0xEE;
-			return length;
+			return 0;
 		}
 
-		status = DLC_STATUS >> 5;
-		switch (status)
+		for (unsigned run = 0; run < count; run++)
 		{
-			case 0: // No data to process.
-				break;
-			case 1: // Buffer contains 2-12 data bytes.
-			case 2: // Buffer contains data followed by a completion code.
-			case 4: // Buffer contains just one data byte.
-				do {
-					MessageBuffer[length++] = DLC_RECEIVE_FIFO;
-					status = (DLC_STATUS >> 5);
-				} while ( status == 1 || status == 2 || status == 4 );
-				iterations = 0; // reset the timer every byte received
+			result[output++] = encoded[0];
+			if (valueSize == 2)
+			{
+				result[output++] = encoded[1];
+			}
+		}
+
+		encoded += valueSize;
+	}
+
+	return output;
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Receive engine.
+//
+// ReadMessage arms the engine, and it disarms itself when the completion code
+// arrives. receiveBusy keeps the periodic interrupt out while the main code is
+// draining. The interrupt can't be masked, but it runs to completion, so it
+// never leaves receiveBusy set.
+//
+// receiveInterrupt is set while the interrupt drains. The interrupt may have
+// stopped a WriteMessage halfway, so it doesn't touch the transmit command
+// register. It sets receiveAcknowledge instead, and ReadMessage writes the
+// register once the message is in.
+///////////////////////////////////////////////////////////////////////////////
+volatile int __attribute((section(".kerneldata"))) receiveArmed;
+volatile int __attribute((section(".kerneldata"))) receiveBusy;
+volatile int __attribute((section(".kerneldata"))) receiveLength;
+volatile unsigned short __attribute((section(".kerneldata"))) receiveSum;
+volatile unsigned char __attribute((section(".kerneldata"))) receiveState;
+volatile unsigned char __attribute((section(".kerneldata"))) receiveCompletion;
+volatile int __attribute((section(".kerneldata"))) receiveInterrupt;
+volatile int __attribute((section(".kerneldata"))) receiveAcknowledge;
+
+void ResetReceive()
+{
+	receiveArmed = 0;
+	receiveBusy = 0;
+	receiveLength = 0;
+	receiveSum = 0;
+	receiveState = 0;
+	receiveInterrupt = 0;
+	receiveAcknowledge = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Move everything in the receive FIFO into MessageBuffer, stopping at the end
+// of the frame, and add the bytes to receiveSum. Returns the number of data
+// bytes moved.
+//
+// receiveState is zero until the frame is done. Then it's 1 for success, 2 for
+// a bad completion code, 0x0B for a FIFO overflow, or 0xEE if the message
+// didn't fit in MessageBuffer.
+///////////////////////////////////////////////////////////////////////////////
+int DrainReceiveFifo()
+{
+	if (!receiveArmed || receiveBusy)
+	{
+		return 0;
+	}
+
+	receiveBusy = 1;
+
+	int received = 0;
+	for (;;)
+	{
+		unsigned char status = DLC_STATUS >> 5;
+		if ((status == 1) || (status == 2) || (status == 4))
+		{
+			// Data bytes.
+			if (receiveLength >= MessageBufferSize)
+			{
+				receiveState = 0xEE;
+				receiveArmed = 0;
 				break;
-			case 5: // Buffer contains a completion code, followed by more data bytes.
-			case 6: // Buffer contains a completion code, followed by a full frame.
-			case 7: // Buffer contains a completion code only.
-				*completionCode = DLC_RECEIVE_FIFO;
+			}
 
-				// Not sure if this is necessary - the code works without it, but it seems
-				// like a good idea according to 5.1.3.2. of the DLC data sheet.
+			unsigned char value = DLC_RECEIVE_FIFO;
+			MessageBuffer[receiveLength] = value;
+			receiveLength++;
+			receiveSum += value;
+			received++;
+			continue;
+		}
+
+		if (status >= 5)
+		{
+			// A completion code.
+			unsigned char completionCode = DLC_RECEIVE_FIFO;
+
+			// Not sure if this is necessary - the code works without it, but it seems
+			// like a good idea according to 5.1.3.2. of the DLC data sheet.
+			if (receiveInterrupt)
+			{
+				receiveAcknowledge = 1;
+			}
+			else
+			{
 				DLC_TRANSMIT_COMMAND = 0x02;
+			}
 
-				// If we return here when the length is zero, we'll never return
-				// any message data at all. Not sure why.
-				if (length == 0)
-				{
-					break;
-				}
+			// A completion code before any data doesn't end a message.
+			if (receiveLength == 0)
+			{
+				continue;
+			}
 
-				if (*completionCode & 0x30)
-				{
-					*readState = 2;
-					return 0;
-				}
+			receiveCompletion = completionCode;
+			receiveState = (completionCode & 0x30) ? 2 : 1;
+			receiveArmed = 0;
+			break;
+		}
 
-				*readState = 1;
-				return length;
+		if (status == 3)
+		{
+			// Buffer overflow. Just throw the message away and hope the tool
+			// sends again.
+			receiveState = 0x0B;
+			receiveArmed = 0;
+		}
 
-			case 3:  // Buffer overflow. What to do here?
-				// Just throw the message away and hope the tool sends again?
-				while (DLC_STATUS & 0xE0 == 0x60)
-				{
-					MessageBuffer[length] = DLC_RECEIVE_FIFO;
-				}
-				*readState = 0x0B;
-				return 0;
+		break;
+	}
+
+	receiveBusy = 0;
+	return received;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// See common.h.
+///////////////////////////////////////////////////////////////////////////////
+int MessageWaiting()
+{
+	if (receiveArmed)
+	{
+		DrainReceiveFifo();
+		return !receiveArmed;
+	}
+
+	return receiveState || (DLC_STATUS & 0xE0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Read a VPW message into the 'MessageBuffer' buffer.
+///////////////////////////////////////////////////////////////////////////////
+int ReadMessage(unsigned char *completionCode, unsigned char *readState)
+{
+	ScratchWatchdog();
+
+	receiveLength = 0;
+	receiveSum = 0;
+	receiveState = 0;
+	receiveBusy = 0;
+	receiveArmed = 1;
+
+	unsigned int iterations = 0;
+	int lastLength = 0;
+	for (;;)
+	{
+		ScratchWatchdog();
+		iterations++;
+
+		if (DrainReceiveFifo() == 0)
+		{
+			if (receiveState != 0)
+			{
+				break;
+			}
+
+			// Put the idle time to use. Each job step is short enough
+			// that the receive FIFO can't fill up in the meantime, and
+			// long steps drain the FIFO themselves.
+			CountStatistic(idleSpins, 1);
+			RunBackgroundJob();
+		}
+
+		// Reset the timer whenever data arrives, even if the periodic
+		// interrupt was the one that drained it.
+		if (receiveLength != lastLength)
+		{
+			lastLength = receiveLength;
+			iterations = 0;
+		}
+
+		if (receiveState != 0)
+		{
+			break;
+		}
+
+		// If no message received for N iterations, exit.
+		if (iterations > 0x30000)
+		{
+			receiveArmed = 0;
+			CountStatistic(readTimeouts, 1);
+			return 0;
 		}
 	}
 
-	// If we reach this point, the loop above probably just hit maxIterations.
-	// Or maybe the tool sent a message bigger than the buffer.
-	// Either way, we have "received" an incomplete message.
-	// Might be better to return zero and hope the tool sends again.
-	// But for debugging we'll just see what we managed to receive.
-	*readState = 0x0A;
-	return length;
+	// Nothing is being transmitted now, so finish what the interrupt left.
+	if (receiveAcknowledge)
+	{
+		receiveAcknowledge = 0;
+		DLC_TRANSMIT_COMMAND = 0x02;
+	}
+
+	// The message belongs to the caller now, and receiveState goes back to
+	// zero so that MessageWaiting only looks at the DLC until the next call.
+	*completionCode = receiveCompletion;
+	*readState = receiveState;
+	receiveState = 0;
+
+	switch (*readState)
+	{
+		case 1:
+			CountStatistic(bytesReceived, receiveLength);
+			return receiveLength;
+
+		case 0xEE:
+			// The tool sent a message bigger than the buffer. For debugging
+			// we'll just see what we managed to receive.
+			return receiveLength;
+
+		default:
+			return 0;
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Copy the given buffer into the message buffer.
+// See common.h. The running sum covers the whole message, so take out the
+// priority, addresses and mode, and the block sum at the end.
 ///////////////////////////////////////////////////////////////////////////////
-void CopyToMessageBuffer(unsigned char* start, unsigned int length, unsigned int offset)
+unsigned short ReceivedBlockSum(unsigned payloadLength)
 {
-	// This is the obvious way to do it, but one of the usage scenarios
-	// involves moving data in the buffer to a location further into the
-	// buffer, which would overwrite the data if the offset is shorter
-	// than the message:
-	//
-	// for (int index = 0; index < length; index++)
-	// {
-	//   MessageBuffer[offset + index] = start[index];
-	// }
-	//
-	// So instead we copy from back to front:
-	for (int index = length - 1; index >= 0; index--)
+	unsigned end = 10 + payloadLength;
+	if ((unsigned)receiveLength == end + 2)
+	{
+		unsigned short checksum = receiveSum;
+		for (unsigned index = 0; index < 4; index++)
+		{
+			checksum -= MessageBuffer[index];
+		}
+
+		return checksum - MessageBuffer[end] - MessageBuffer[end + 1];
+	}
+
+	unsigned short checksum = 0;
+	for (unsigned index = 4; index < end; index++)
 	{
-		MessageBuffer[index + offset] = start[index];
-		if (index % 512 == 0)
+		if (index % 1024 == 0)
 		{
 			ScratchWatchdog();
 		}
+		checksum += MessageBuffer[index];
 	}
+
+	return checksum;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -370,6 +1218,7 @@ void Reboot(unsigned int value)
 	WriteMessage(MessageBuffer, 8, Complete);
 
 	LongSleepWithWatchdog();
+	StopWatchdogTimer();
 
 #if defined P12
 	asm("reset");
@@ -431,40 +1280,6 @@ unsigned short StartChecksum()
 	return checksum;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Copy the payload for a read request, while updating the checksum.
-///////////////////////////////////////////////////////////////////////////////
-unsigned short AddReadPayloadChecksum(unsigned char *start, unsigned int length)
-{
-	ScratchWatchdog();
-
-	unsigned short checksum = 0;
-
-	for (int index = 0; index < length; index++)
-	{
-		unsigned char value = start[index];
-		checksum += value;
-
-		if (index % 100 == 0)
-		{
-			ScratchWatchdog();
-		}
-	}
-
-	ScratchWatchdog();
-
-	return checksum;
-}
-
-///////////////////////////////////////////////////////////////////////////////
-// Set the checksum for a data block.
-///////////////////////////////////////////////////////////////////////////////
-void SetBlockChecksum(unsigned int length, unsigned short checksum)
-{
-	MessageBuffer[10 + length] = (unsigned char)((checksum & 0xFF00) >> 8);
-	MessageBuffer[11 + length] = (unsigned char)(checksum & 0xFF);
-}
-
 ///////////////////////////////////////////////////////////////////////////////
 // Get the version of the kernel. (Mode 3D, submode 00)
 ///////////////////////////////////////////////////////////////////////////////
@@ -477,7 +1292,7 @@ void HandleVersionQuery()
 	MessageBuffer[4] = 0x00;
 	MessageBuffer[5] = 0x01; // major
 	MessageBuffer[6] = 0x03; // minor
-	MessageBuffer[7] = 0x05; // patch
+	MessageBuffer[7] = 0x0F; // patch
 #if defined P12
 	MessageBuffer[8] = 0x0C;
 #elif defined P10
@@ -491,3 +1306,21 @@ void HandleVersionQuery()
 
 	WriteMessage(MessageBuffer, 9, Complete);
 }
+
+///////////////////////////////////////////////////////////////////////////////
+// Request: 3D 0F.
+// Reply:   7D 0F, then the KERNEL_FEATURES bits (2 bytes, see common.h).
+///////////////////////////////////////////////////////////////////////////////
+void HandleFeatureQuery()
+{
+	MessageBuffer[0] = 0x6C;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x7D;
+	MessageBuffer[4] = 0x0F;
+	MessageBuffer[5] = (KERNEL_FEATURES) >> 8;
+	MessageBuffer[6] = (KERNEL_FEATURES) & 0xFF;
+
+	ElmSleep();
+	WriteMessage(MessageBuffer, 7, Complete);
+}
@@ -14,6 +14,10 @@ typedef unsigned short uint16_t;
 typedef unsigned       uint32_t;
 typedef int            int32_t;
 
+#if defined HOST
+	#include "host.h"
+#endif
+
 #ifndef DLC_CONFIGURATION
 	#if defined P01 || defined P10 || defined P12
 		#define DLC_CONFIGURATION			(*(unsigned char *)0x00FFF600)
@@ -53,15 +57,102 @@ typedef int            int32_t;
 	#endif
 #endif
 
+// Clock synthesizer control register, used to calibrate the sleep functions.
+// The P12's system integration module is laid out differently, so it uses the
+// default clock speed instead.
+#ifndef SIM_SYNCR
+	#if defined P01 || defined P10
+		#define SIM_SYNCR					(*(unsigned short *)0x00FFFA04)
+	#endif
+#endif
+
+// The 68332's periodic interrupt timer, used by the watchdog interrupt below.
+#ifndef SIM_PICR
+	#define SIM_PICR						(*(unsigned short *)0x00FFFA22)
+	#define SIM_PITR						(*(unsigned short *)0x00FFFA24)
+#endif
+
+// Convert a PCM address into a pointer to PCM memory. On the PCM that's just a
+// cast, but the host build (see host.h) maps it to simulated flash and RAM.
+#ifndef PCM_POINTER
+	#define PCM_POINTER(address) ((unsigned char*)(address))
+#endif
+
+// Read a 32-bit value from PCM memory. The pointer must be long-aligned.
+#ifndef PCM_LONG
+	#define PCM_LONG(pointer) (*(uint32_t*)(pointer))
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Optional features. The P01 and P10 kernels don't have room for them (see the
+// RAM layout below), so build with -DKERNEL_FEATURES=<bits> to choose which
+// ones to include. The P12 and host builds get all of them by default, the
+// others get none. The tool asks for the kernel's features with mode 3D
+// submode 0F, and doesn't use the missing ones. A mode 35 or 3D request for a
+// missing feature gets the same reply as any request the kernel doesn't know,
+// and a mode 36 write that needs one is refused.
+///////////////////////////////////////////////////////////////////////////////
+#define FeaturePipelinedWrite   0x0001 // Mode 36 command bit 20.
+#define FeatureCompressedRead   0x0002 // Mode 35 submode 02.
+#define FeatureCompressedWrite  0x0004 // Mode 36 command bit 10.
+#define FeatureBlankScan        0x0008 // Mode 3D submode 09.
+#define FeatureBackgroundErase  0x0010 // Mode 3D submodes 0A and 0B.
+#define FeatureBatchErase       0x0020 // Mode 3D submode 0C.
+#define FeatureStreamingRead    0x0040 // Mode 35 submodes 03, 04 and 05.
+#define FeaturePatchWrite       0x0080 // Mode 36 command 0E.
+#define FeatureSectorRewrite    0x0100 // Mode 36 command 0F.
+#define FeatureFullErase        0x0200 // Mode 3D submode 06.
+#define FeatureProgressFrames   0x0400 // Mode 3D submode 0D.
+#define FeatureCrcBatch         0x0800 // Mode 3D submode 07.
+#define FeatureStatistics       0x1000 // Mode 3D submode 08.
+#define FeatureBackgroundCrc    0x2000 // CRC queries are worked on while idle.
+#define FeatureAll              0x3FFF
+
+#ifndef KERNEL_FEATURES
+	#if defined P12 || defined HOST
+		#define KERNEL_FEATURES FeatureAll
+	#else
+		#define KERNEL_FEATURES 0
+	#endif
+#endif
+
+// The background erase replies before the erase is done, so the blocks that
+// follow have to be pipelined. Batch and chip erases run in the background.
+#if (KERNEL_FEATURES & FeatureBackgroundErase) && !(KERNEL_FEATURES & FeaturePipelinedWrite)
+	#error FeatureBackgroundErase needs FeaturePipelinedWrite.
+#endif
+
+#if (KERNEL_FEATURES & (FeatureBatchErase | FeatureFullErase)) && !(KERNEL_FEATURES & FeatureBackgroundErase)
+	#error FeatureBatchErase and FeatureFullErase need FeatureBackgroundErase.
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // The linker needs to put these buffers after the kernel code, but before the
 // system registers that are at the top of the RAM space.
 //
-// Usable RAM is four 4k blocks starting at FF8000.
-// We reserve 10kb for the kernel, and start global variables at FFA800,
-// leaving room for 6kb of globals. That's a little over 4k for the message
-// buffer, 1k for the CRC table, and a bit less than 1k left over.
+// The P01 kernel loads at FF8000, and the tool is not allowed to write RAM
+// above FFCDFF, so code and globals together get 19,968 bytes. The P10 loads
+// at FFB800 and has to end below the DLC registers at FFF600, which leaves
+// 15,872. The P12 loads at FF2000 and has over 50k.
+//
+// Measured with clang's m68k target at -O0 (sizes in bytes):
+//
+//                          code   globals     total
+//   P01/P10, no features  14,276    5,308    19,584
+//   P12, all features     33,616   10,014    43,630
+//
+// The globals are a little over 4k for the message buffer, 1k for the CRC
+// table, and the rest is small stuff. Pipelined, compressed and sector
+// rewrite writes need a second 4k buffer (see common-readwrite.c), and every
+// optional feature on its own takes the P01 past its limit by that measure,
+// which is why they're off by default.
+//
+// By the same measure the P10 is about 3.7k over even without features, and
+// the kernel this one replaced (15,522 bytes) only just fit. GCC's 68332 code
+// is smaller than clang's, but that has to be checked with a real build. The
+// linker script (see makefile) stops the P01 at FFCE00 and the P10 at FFF600,
+// but that's a last resort, not a budget.
 //
 // If necessary we could probably overlay the CRC buffer atop the message
 // buffer, since we don't need to start computing the CRC until after we
@@ -86,8 +177,32 @@ EXTERN unsigned __attribute((section(".kerneldata"))) breadcrumbs;
 
 ///////////////////////////////////////////////////////////////////////////////
 // This needs to be called periodically to prevent the PCM from rebooting.
+//
+// Build with -DWATCHDOG_INTERRUPT to have the periodic interrupt timer call
+// ServiceWatchdog instead, so that ScratchWatchdog costs nothing in the data
+// path loops. That has only been worked out for the P01 (and P59), so the
+// other PCMs keep scratching the watchdog from their loops either way.
 ///////////////////////////////////////////////////////////////////////////////
-void ScratchWatchdog();
+#if defined WATCHDOG_INTERRUPT && defined P01
+	#define WATCHDOG_TIMER
+#endif
+
+void ServiceWatchdog();
+
+#if defined WATCHDOG_TIMER
+	#define ScratchWatchdog()
+#else
+	#define ScratchWatchdog() ServiceWatchdog()
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Start and stop the watchdog interrupt. These do nothing unless the kernel
+// was built with WATCHDOG_INTERRUPT. The interrupt must be stopped before
+// rebooting, since the reboot relies on the watchdog, and before jumping to
+// code that might overwrite the handler.
+///////////////////////////////////////////////////////////////////////////////
+void StartWatchdogTimer();
+void StopWatchdogTimer();
 
 ///////////////////////////////////////////////////////////////////////////////
 // Does what it says.
@@ -95,20 +210,30 @@ void ScratchWatchdog();
 void WasteTime();
 
 ///////////////////////////////////////////////////////////////////////////////
-// All uses of this should be replaced with ElmSleep or VariableSleep.
+// Work out how fast the delay loop runs on this PCM. Call this at startup,
+// before any of the sleep functions.
+///////////////////////////////////////////////////////////////////////////////
+void InitializeSleep();
+extern unsigned __attribute((section(".kerneldata"))) sleepIterationsPerMillisecond;
+
+///////////////////////////////////////////////////////////////////////////////
+// Sleep for the given time, scratching the watchdog every millisecond.
+///////////////////////////////////////////////////////////////////////////////
+void SleepMicroseconds(unsigned microseconds);
+
+///////////////////////////////////////////////////////////////////////////////
+// All uses of this should be replaced with ElmSleep or SleepMicroseconds.
 ///////////////////////////////////////////////////////////////////////////////
 void LongSleepWithWatchdog();
 
 ///////////////////////////////////////////////////////////////////////////////
 // ELM-based devices need a short pause between transmit and receive, otherwise
-// they will miss the responses from the PCM. This function should be tuned to
-// provide the right delay with AllPro and Scantool devices.
+// they will miss the responses from the PCM.
 ///////////////////////////////////////////////////////////////////////////////
 void ElmSleep();
 
 ///////////////////////////////////////////////////////////////////////////////
-// Sleep for a variable amount of time. This should be close to Dimented24x7's
-// assembly-language implementation.
+// Sleep for a multiple of 2.5ms. New code should use SleepMicroseconds.
 ///////////////////////////////////////////////////////////////////////////////
 void VariableSleep(unsigned int iterations);
 
@@ -124,12 +249,94 @@ void ClearMessageBuffer();
 ///////////////////////////////////////////////////////////////////////////////
 void ClearBreadcrumbBuffer();
 
+///////////////////////////////////////////////////////////////////////////////
+// Background jobs run while ReadMessage is waiting for data from the tool,
+// including the gaps between bytes of a message. Each call to a job should do
+// a small amount of work (well under a millisecond) so incoming messages don't
+// overflow the DLC receive FIFO. The job returns nonzero while it has more work
+// to do, and zero when it's done. Only the features in BackgroundJobFeatures
+// start jobs, so without them the job list isn't built.
+///////////////////////////////////////////////////////////////////////////////
+#define BackgroundJobFeatures (FeatureBackgroundCrc | FeaturePipelinedWrite | FeatureStreamingRead | FeatureBackgroundErase)
+
+typedef int (*BackgroundJob)();
+
+#if KERNEL_FEATURES & BackgroundJobFeatures
+#define BackgroundJobCount 4
+EXTERN BackgroundJob __attribute((section(".kerneldata"))) backgroundJobs[BackgroundJobCount];
+
+void ClearBackgroundJobs();
+void StartBackgroundJob(BackgroundJob job);
+void RunBackgroundJob();
+#else
+#define ClearBackgroundJobs()
+#define RunBackgroundJob()
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Progress frames during long flash operations (mode 3D, submode 0D turns
+// them on). See common.c. Without FeatureProgressFrames these cost nothing.
+///////////////////////////////////////////////////////////////////////////////
+#if KERNEL_FEATURES & FeatureProgressFrames
+void SetProgressInterval(uint32_t interval);
+void StartProgress(unsigned char operation);
+void StopProgress();
+int ProgressDue();
+void SendProgress(uint16_t status);
+#else
+#define SetProgressInterval(interval)
+#define StartProgress(operation)
+#define StopProgress()
+#define ProgressDue() 0
+#define SendProgress(status)
+#endif
+
+// The tool gives the interval in units of this many status polls.
+#define ProgressIntervalUnit 256
+
+///////////////////////////////////////////////////////////////////////////////
+// Counters that help explain why a session was slow. The app reads them with
+// mode 3D submode 08. The code that counts things uses CountStatistic and
+// PeakStatistic, which cost nothing without FeatureStatistics.
+///////////////////////////////////////////////////////////////////////////////
+#if KERNEL_FEATURES & FeatureStatistics
+typedef struct
+{
+	uint32_t bytesTransmitted;
+	uint32_t bytesReceived;
+	uint32_t transmitStalls;     // Times the transmit FIFO was too full to write.
+	uint32_t readTimeouts;       // ReadMessage calls that gave up waiting.
+	uint32_t checksumFailures;   // Mode 36 blocks with a bad block sum.
+	uint32_t programBusyPolls;   // Status reads that found a flash word still programming.
+	uint32_t maxEraseIterations; // Longest wait for a block erase, in status reads.
+	uint32_t idleSpins;          // ReadMessage loops with no data to read.
+} KernelStatistics;
+
+#define KernelStatisticsCount (sizeof(KernelStatistics) / sizeof(uint32_t))
+
+extern KernelStatistics __attribute((section(".kerneldata"))) kernelStatistics;
+
+void ClearKernelStatistics();
+
+#define CountStatistic(counter, amount) (kernelStatistics.counter += (amount))
+#define PeakStatistic(counter, value) do { if ((value) > kernelStatistics.counter) kernelStatistics.counter = (value); } while (0)
+#else
+#define ClearKernelStatistics()
+#define CountStatistic(counter, amount) ((void)(amount))
+#define PeakStatistic(counter, value)
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 // Message handlers
 ///////////////////////////////////////////////////////////////////////////////
 void HandleReadMode35();
+void HandleReadStream();
+void HandleReadStreamAcknowledge();
+void StopReadStream();
 void HandleWriteRequestMode34();
 void HandleWriteMode36();
+void HandlePatchList(unsigned char *data, unsigned length);
+void HandleSectorRewrite(unsigned start, unsigned char *data, unsigned length);
 void SendWriteSuccess(unsigned char code);
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -154,16 +361,55 @@ typedef enum
 ///////////////////////////////////////////////////////////////////////////////
 void WriteMessage(unsigned char* start, unsigned short length, Segment segment);
 
+///////////////////////////////////////////////////////////////////////////////
+// Send a block of PCM memory followed by its 16-bit sum, and end the message.
+// Much faster than WriteMessage for large blocks. The checksum argument should
+// come from StartChecksum().
+///////////////////////////////////////////////////////////////////////////////
+unsigned WaitForTransmitRoom();
+void WriteBlock(unsigned char *data, unsigned length, unsigned short checksum);
+
+///////////////////////////////////////////////////////////////////////////////
+// Run-length encoded version of WriteBlock, for compressed mode-35 replies.
+// RunLengthSize says how many bytes it would send, so the caller can fall
+// back to WriteBlock when the data doesn't compress.
+///////////////////////////////////////////////////////////////////////////////
+unsigned RunLengthSize(unsigned char *data, unsigned length);
+void WriteRunLengthBlock(unsigned char *data, unsigned length, unsigned short checksum);
+
+///////////////////////////////////////////////////////////////////////////////
+// Decode a run-length encoded mode-36 payload. Returns zero if it's malformed.
+///////////////////////////////////////////////////////////////////////////////
+unsigned ExpandRunLength(unsigned char *encoded, unsigned length, unsigned char *result, unsigned size);
+
 ///////////////////////////////////////////////////////////////////////////////
 // Read a VPW message into the 'MessageBuffer' buffer.
 ///////////////////////////////////////////////////////////////////////////////
 int ReadMessage(unsigned char *completionCode, unsigned char *readState);
 
 ///////////////////////////////////////////////////////////////////////////////
-// TODO: REMOVE.
-// Copy the given buffer into the message buffer.
+// Receive engine. While ReadMessage is waiting, incoming bytes go straight
+// from the DLC's receive FIFO into MessageBuffer, and the message is handled
+// where it landed. DrainReceiveFifo can be called from long-running work, or
+// from an interrupt, to keep the 12-byte FIFO from overflowing. It does
+// nothing outside of ReadMessage, so MessageBuffer is never written while a
+// message is being processed.
+//
+// MessageWaiting drains the FIFO, and returns nonzero if there's a complete
+// message for ReadMessage to return, or data that can't be drained yet.
+// ResetReceive must be called at startup, before the watchdog interrupt.
+///////////////////////////////////////////////////////////////////////////////
+int DrainReceiveFifo();
+int MessageWaiting();
+void ResetReceive();
+
+///////////////////////////////////////////////////////////////////////////////
+// The block sum of the message that ReadMessage just returned: bytes 4 up to
+// the end of a payload of the given length. The receive engine keeps a running
+// sum, so this only has to look at the message again if its length doesn't
+// match.
 ///////////////////////////////////////////////////////////////////////////////
-void CopyToMessageBuffer(unsigned char* start, unsigned int length, unsigned int offset);
+unsigned short ReceivedBlockSum(unsigned payloadLength);
 
 ///////////////////////////////////////////////////////////////////////////////
 // Send a message to explain why we're rebooting, then reboot.
@@ -192,16 +438,6 @@ void SendBreadcrumbsReboot(unsigned char code, unsigned int breadcrumbs);
 ///////////////////////////////////////////////////////////////////////////////
 unsigned short StartChecksum();
 
-///////////////////////////////////////////////////////////////////////////////
-// Copy the payload for a read request, while updating the checksum.
-///////////////////////////////////////////////////////////////////////////////
-unsigned short AddReadPayloadChecksum(unsigned char* start, unsigned int length);
-
-///////////////////////////////////////////////////////////////////////////////
-// Set the checksum for a data block.
-///////////////////////////////////////////////////////////////////////////////
-void SetBlockChecksum(unsigned int length, unsigned short checksum);
-
 ///////////////////////////////////////////////////////////////////////////////
 // Get the version of the kernel. (Mode 3D, submode 00)
 // Kernel Types:
@@ -211,6 +447,12 @@ void SetBlockChecksum(unsigned int length, unsigned short checksum);
 ///////////////////////////////////////////////////////////////////////////////
 void HandleVersionQuery();
 
+///////////////////////////////////////////////////////////////////////////////
+// Tell the tool which optional features this kernel was built with. (Mode 3D,
+// submode 0F)
+///////////////////////////////////////////////////////////////////////////////
+void HandleFeatureQuery();
+
 ///////////////////////////////////////////////////////////////////////////////
 // Utility functions to compute CRC for memory ranges.
 // TODO: move this into a new crc.h file.
@@ -228,12 +470,107 @@ int crcIsStarted(uint8_t *message, int nBytes);
 int crcIsDone(uint8_t *message, int nBytes);
 void crcStart(uint8_t *message, int nBytes);
 uint32_t crcGetResult();
+uint32_t crcContinue(uint32_t remainder, uint8_t *message, int nBytes);
+uint32_t crcRepeat(uint32_t remainder, uint8_t *word, int count);
 void crcProcessSlice();
+int crcBackgroundJob();
+
+// Most ranges that one CRC batch query (mode 3D, submode 07) can ask for.
+#define CrcBatchMaxRanges 32
+
+// Most blocks that one batch erase (mode 3D, submode 0C) can ask for.
+#define EraseBatchMaxSectors 32
+
+// Flags for a whole-chip erase (mode 3D, submode 06). Without them, the boot
+// and parameter blocks are left alone.
+#define EraseChipBoot 0x01
+#define EraseChipParameters 0x02
+
+// Blank scans (mode 3D, submode 09) report on chunks of this size, and can
+// cover up to 8 MB in one query.
+#define BlankScanChunkSize 4096
+#define BlankScanMaxChunks 2048
 
 ///////////////////////////////////////////////////////////////////////////////
 // Write data to flash memory.
 //
 // Return value is 0 on success, or the value of the flash status register if
 // there is a flash error.
+//
+// With differential set, words that already match the flash contents are not
+// programmed. Either way, flashWordsProgrammed is set to the number of words
+// that were.
+///////////////////////////////////////////////////////////////////////////////
+unsigned char WriteToFlash(const unsigned start, const unsigned length, unsigned char *data, int testWrite, int differential);
+extern unsigned __attribute((section(".kerneldata"))) flashWordsProgrammed;
+
+///////////////////////////////////////////////////////////////////////////////
+// Erase the flash block that starts at the given address, and wait for it.
+// Returns zero on success, or an error code.
+///////////////////////////////////////////////////////////////////////////////
+unsigned char EraseFlashBlock(unsigned address);
+
+///////////////////////////////////////////////////////////////////////////////
+// Size of the erase block that starts at the given address, or zero if no
+// block starts there or the chip isn't known.
+///////////////////////////////////////////////////////////////////////////////
+uint32_t EraseBlockSize(uint32_t address);
+
+///////////////////////////////////////////////////////////////////////////////
+// Keep the flash chip unlocked between calls to WriteToFlash. The Intel chips
+// need a slow voltage ramp to unlock, which costs more than writing a small
+// slice of a block, so pipelined writes hold the chip unlocked until the last
+// slice of the block has been programmed.
+///////////////////////////////////////////////////////////////////////////////
+void HoldFlashUnlocked(int hold);
+extern int __attribute((section(".kerneldata"))) flashHoldUnlocked;
+
+///////////////////////////////////////////////////////////////////////////////
+// Pipelined flash writes. When this bit is set in the mode-36 command byte,
+// the block is programmed by a background job, and the reply is sent as soon
+// as the block has been accepted, so the tool can send the next block while
+// this one is being programmed.
+///////////////////////////////////////////////////////////////////////////////
+#define PipelinedWrite 0x20
+
+///////////////////////////////////////////////////////////////////////////////
+// Compressed writes. When this bit is set in the mode-36 command byte, the
+// payload is run-length encoded and the length in the header is the encoded
+// length. The block sum covers the header and the decoded data. Kernels older
+// than 1.3.6 would write the encoded bytes as-is, so the tool checks the
+// kernel version before using it.
+///////////////////////////////////////////////////////////////////////////////
+#define RunLengthWrite 0x10
+
+///////////////////////////////////////////////////////////////////////////////
+// Patch lists. With this mode-36 command, the payload is a list of patches
+// rather than one block, and the address in the header is ignored. Kernels
+// older than 1.3.11 would write the list itself to address zero, so the tool
+// checks the kernel version before using it.
+///////////////////////////////////////////////////////////////////////////////
+#define PatchListWrite 0x0E
+#define PatchListMaxPatches 255
+
+///////////////////////////////////////////////////////////////////////////////
+// Sector rewrites. With this mode-36 command, the kernel copies the block at
+// the header's address to RAM, applies the patches in the payload, erases the
+// block and programs it again, so only the patches cross the bus. The payload
+// is
+//
+//   [block size, 3 bytes] [CRC before, 4 bytes] [CRC after, 4 bytes] [patches]
+//
+// with patches in the same format as a patch list. Kernels older than 1.3.12
+// would write the payload to the start of the block, so the tool checks the
+// kernel version before using it.
+///////////////////////////////////////////////////////////////////////////////
+#define SectorRewrite 0x0F
+#define SectorRewriteMaxSize 0x20000
+
+void ResetPipelinedWrite();
+void FinishPipelinedWrite();
+
+///////////////////////////////////////////////////////////////////////////////
+// Background erase (mode 3D, submodes 0A, 0B, 0C and 06). Returns nonzero while an
+// erase is still running. Pipelined writes wait for it before programming.
 ///////////////////////////////////////////////////////////////////////////////
-unsigned char WriteToFlash(const unsigned start, const unsigned length, unsigned char *data, int testWrite);
+int PollErase();
@@ -12,7 +12,28 @@ typedef unsigned char uint8_t;
 #define TOPBIT (1 << (WIDTH - 1))
 #define POLYNOMIAL 0x04C11DB7
 
+// Each lookup table costs 1 KB of .kerneldata. With one table, crcProcessSlice
+// folds in a 32-bit word per memory read and then does four table lookups.
+// With two tables it does two lookups per 16 bits (slice-by-2), which is
+// faster but needs more RAM than the P01 layout in common.h has to spare.
+#ifndef CRC_TABLE_COUNT
+#define CRC_TABLE_COUNT 1
+#endif
+
+// Bytes processed per call to crcProcessSlice, i.e. per CRC query from the app.
+#ifndef CRC_SLICE_SIZE
+#define CRC_SLICE_SIZE 8192
+#endif
+
+// Bytes processed per turn as a background job, while waiting for messages.
+#define CRC_BACKGROUND_SIZE 256
+
 crc __attribute((section(".kerneldata"))) crcTable[256];
+#if CRC_TABLE_COUNT == 2
+crc __attribute((section(".kerneldata"))) crcTable2[256];
+#elif CRC_TABLE_COUNT != 1
+#error CRC_TABLE_COUNT must be 1 or 2.
+#endif
 
 // These are not from the original code, they're used to support background CRC computation.
 uint8_t __attribute((section(".kerneldata"))) *crcStartAddress;
@@ -65,6 +86,17 @@ void crcInit(void)
         crcTable[dividend] = remainder;
     }
 
+#if CRC_TABLE_COUNT == 2
+    /*
+     * The second table is the first one advanced by another zero byte.
+     */
+    for (int dividend = 0; dividend < 256; ++dividend)
+    {
+        remainder = crcTable[dividend];
+        crcTable2[dividend] = crcTable[remainder >> (WIDTH - 8)] ^ (remainder << 8);
+    }
+#endif
+
 }   /* crcInit() */
 
 // Used by the erase function to destory any previously calculated CRC
@@ -103,6 +135,41 @@ crc crcFast(unsigned char *message, int nBytes)
 
 }   /* crcFast() */
 
+#if KERNEL_FEATURES & FeatureSectorRewrite
+///////////////////////////////////////////////////////////////////////////////
+// Continue a CRC over more data, for data that isn't all in one place, like a
+// block that's staged in RAM. The caller scratches the watchdog.
+///////////////////////////////////////////////////////////////////////////////
+crc crcContinue(crc remainder, unsigned char *message, int nBytes)
+{
+    for (int byte = 0; byte < nBytes; ++byte)
+    {
+        remainder = crcTable[message[byte] ^ (remainder >> (WIDTH - 8))] ^ (remainder << 8);
+    }
+
+    return (remainder);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Continue a CRC over count copies of the given 16-bit word.
+///////////////////////////////////////////////////////////////////////////////
+crc crcRepeat(crc remainder, unsigned char *word, int count)
+{
+    for (int index = 0; index < count; ++index)
+    {
+        if (index % 256 == 255)
+        {
+            ScratchWatchdog();
+        }
+
+        remainder = crcTable[word[0] ^ (remainder >> (WIDTH - 8))] ^ (remainder << 8);
+        remainder = crcTable[word[1] ^ (remainder >> (WIDTH - 8))] ^ (remainder << 8);
+    }
+
+    return (remainder);
+}
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 
 int crcIsStarted(unsigned char *message, int nBytes)
@@ -141,6 +208,10 @@ void crcStart(unsigned char *message, int nBytes)
     crcLength = nBytes;
     crcIndex = 0;
     crcRemainder = 0;
+
+#if KERNEL_FEATURES & FeatureBackgroundCrc
+    StartBackgroundJob(crcBackgroundJob);
+#endif
 }
 
 crc crcGetResult()
@@ -148,7 +219,7 @@ crc crcGetResult()
     return crcRemainder;
 }
 
-void crcProcessSlice()
+static void crcProcess(int nBytes)
 {
     if (crcLength == 0)
     {
@@ -156,20 +227,76 @@ void crcProcessSlice()
     }
 
     int limit = crcLength;
-    int chunkSize = 8192;
-    if ((crcIndex + chunkSize) < limit)
+    if ((crcIndex + nBytes) < limit)
     {
-        limit = crcIndex + chunkSize;
+        limit = crcIndex + nBytes;
     }
 
-    uint8_t data;
-    for( ; crcIndex < limit; crcIndex++)
+    crc remainder = crcRemainder;
+    uint8_t *data = crcStartAddress + crcIndex;
+    uint8_t *end = crcStartAddress + limit;
+
+    /*
+     * A byte at a time until the data is long-aligned.
+     */
+    while ((data < end) && ((uint32_t)data & 3))
+    {
+        remainder = crcTable[*data++ ^ (remainder >> (WIDTH - 8))] ^ (remainder << 8);
+    }
+
+    /*
+     * Then a long at a time, scratching the watchdog every 256 bytes. XORing
+     * four message bytes into the remainder up front is equivalent to feeding
+     * them in one at a time, because each one only meets the top byte.
+     */
+    while (end - data >= 4)
     {
-        if (crcIndex % 256 == 0)
+        uint8_t *stop = data + ((end - data) & ~3);
+        if (stop - data > 256)
         {
-            ScratchWatchdog();
+            stop = data + 256;
+        }
+
+        for ( ; data < stop; data += 4)
+        {
+            remainder ^= PCM_LONG(data);
+#if CRC_TABLE_COUNT == 2
+            remainder = crcTable2[remainder >> 24] ^ crcTable[(remainder >> 16) & 0xFF] ^ (remainder << 16);
+            remainder = crcTable2[remainder >> 24] ^ crcTable[(remainder >> 16) & 0xFF] ^ (remainder << 16);
+#else
+            remainder = crcTable[remainder >> 24] ^ (remainder << 8);
+            remainder = crcTable[remainder >> 24] ^ (remainder << 8);
+            remainder = crcTable[remainder >> 24] ^ (remainder << 8);
+            remainder = crcTable[remainder >> 24] ^ (remainder << 8);
+#endif
         }
-        data = crcStartAddress[crcIndex] ^ (crcRemainder >> (WIDTH - 8));
-        crcRemainder = crcTable[data] ^ (crcRemainder << 8);
+
+        ScratchWatchdog();
+    }
+
+    /*
+     * And any bytes left over.
+     */
+    while (data < end)
+    {
+        remainder = crcTable[*data++ ^ (remainder >> (WIDTH - 8))] ^ (remainder << 8);
     }
+
+    crcRemainder = remainder;
+    crcIndex = limit;
+}
+
+void crcProcessSlice()
+{
+    crcProcess(CRC_SLICE_SIZE);
+}
+
+#if KERNEL_FEATURES & FeatureBackgroundCrc
+// Runs from ReadMessage's idle loop, so the CRC can be finished before the
+// app asks for it again.
+int crcBackgroundJob()
+{
+    crcProcess(CRC_BACKGROUND_SIZE);
+    return crcIndex < crcLength;
 }
+#endif
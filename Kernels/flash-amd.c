@@ -5,8 +5,10 @@
 #include "common.h"
 #include "flash.h"
 
+#ifndef COMMAND_REG_AAA
 #define COMMAND_REG_AAA (*((volatile uint16_t*)0xAAA))
 #define COMMAND_REG_554 (*((volatile uint16_t*)0x554))
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 // Unlock the flash chip
@@ -75,16 +77,19 @@ uint32_t Amd_GetFlashId()
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Erase the given block.
+// Start erasing the given blocks, and return without waiting for them.
+//
+// After the first sector erase command the chip waits about 50 microseconds
+// for more sector addresses, and then erases them all in one operation. DQ3
+// goes high when that window closes, after which further addresses would be
+// ignored. Returns the number of blocks that the chip accepted, which is at
+// least one.
 ///////////////////////////////////////////////////////////////////////////////
-uint8_t Amd_EraseBlock(uint32_t address)
+int Amd_EraseStartSectors(uint32_t *addresses, int count)
 {
-	// Return zero if successful, anything else is an error code.
-	unsigned short status = 0;
+	uint16_t volatile * flashBase = (uint16_t*)addresses[0];
 
-	uint16_t volatile * flashBase = (uint16_t*)address;
-
-	// Tell the chip to erase the given block.
+	// Tell the chip to erase the given blocks.
 #if defined P12
 	Amd_ChipUnlock(0);
 #else
@@ -96,39 +101,92 @@ uint8_t Amd_EraseBlock(uint32_t address)
 	COMMAND_REG_AAA = 0xAAAA;
 	COMMAND_REG_554 = 0x5555;
 
-	*flashBase = 0x3030;
+	FLASH_WRITE(flashBase, 0x3030);
 
-	uint16_t read1 = 0;
-	uint16_t read2 = 0;
-
-	for (int iterations = 0; iterations < 0x1280000; iterations++)
+	int accepted;
+	for (accepted = 1; accepted < count; accepted++)
 	{
-		read1 = *flashBase & 0x40;
-
-		ScratchWatchdog();
-
-		read2 = *flashBase & 0x40;
-
-		if (read1 == read2)
+		if (FLASH_READ(flashBase) & 0x08)
 		{
-			// Success!
 			break;
 		}
 
-		uint16_t read3 = *flashBase & 0x20;
-		if (read3 == 0)
-		{
-			continue;
-		}
+		FLASH_WRITE((uint16_t*)addresses[accepted], 0x3030);
+	}
+
+	return accepted;
+}
 
-		status = 0xA0;
-		break;
+#if KERNEL_FEATURES & FeatureFullErase
+///////////////////////////////////////////////////////////////////////////////
+// Start erasing every block on the chip, and return without waiting. Poll
+// with Amd_EraseDone, using any address on the chip.
+///////////////////////////////////////////////////////////////////////////////
+void Amd_EraseStartChip()
+{
+#if defined P12
+	Amd_ChipUnlock(0);
+#else
+	SIM_CSOR0 = 0x7060;
+#endif
+	COMMAND_REG_AAA = 0xAAAA;
+	COMMAND_REG_554 = 0x5555;
+	COMMAND_REG_AAA = 0x8080;
+	COMMAND_REG_AAA = 0xAAAA;
+	COMMAND_REG_554 = 0x5555;
+	COMMAND_REG_AAA = 0x1010;
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Start erasing the given block, and return without waiting for it.
+///////////////////////////////////////////////////////////////////////////////
+void Amd_EraseStart(uint32_t address)
+{
+	Amd_EraseStartSectors(&address, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Check on an erase. Returns nonzero once DQ6 stops toggling, or if DQ5 says
+// the chip has exceeded its time limit, in which case status is set to 0xA0.
+///////////////////////////////////////////////////////////////////////////////
+int Amd_EraseDone(uint32_t address, uint16_t *status)
+{
+	uint16_t volatile * flashBase = (uint16_t*)address;
+
+	uint16_t read1 = FLASH_READ(flashBase) & 0x40;
+
+	ScratchWatchdog();
+
+	uint16_t read2 = FLASH_READ(flashBase) & 0x40;
+
+	if (read1 == read2)
+	{
+		// Success!
+		return 1;
 	}
 
+	uint16_t read3 = FLASH_READ(flashBase) & 0x20;
+	if (read3 == 0)
+	{
+		return 0;
+	}
+
+	*status = 0xA0;
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Return the chip to read-array mode after an erase, and lock it.
+///////////////////////////////////////////////////////////////////////////////
+uint8_t Amd_EraseFinish(uint32_t address, uint16_t status)
+{
+	uint16_t volatile * flashBase = (uint16_t*)address;
+
 	if (status == 0xA0)
 	{
-		read1 = *flashBase & 0x40;
-		read2 = *flashBase & 0x40;
+		uint16_t read1 = FLASH_READ(flashBase) & 0x40;
+		uint16_t read2 = FLASH_READ(flashBase) & 0x40;
 		if (read1 != read2)
 		{
 			status = 0xB0;
@@ -141,8 +199,8 @@ uint8_t Amd_EraseBlock(uint32_t address)
 	}
 
 	// Return to array mode.
-	*flashBase = 0xF0F0;
-	*flashBase = 0xF0F0;
+	FLASH_WRITE(flashBase, 0xF0F0);
+	FLASH_WRITE(flashBase, 0xF0F0);
 #if defined P12
 	Amd_ChipLock();
 #else
@@ -152,82 +210,155 @@ uint8_t Amd_EraseBlock(uint32_t address)
 	return status;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Erase the given block.
+///////////////////////////////////////////////////////////////////////////////
+uint8_t Amd_EraseBlock(uint32_t address)
+{
+	// Return zero if successful, anything else is an error code.
+	uint16_t status = 0;
+
+	Amd_EraseStart(address);
+
+	uint32_t iterations;
+	for (iterations = 0; iterations < AmdErasePollLimit; iterations++)
+	{
+		if (Amd_EraseDone(address, &status))
+		{
+			break;
+		}
+
+		// The AMD chips don't have a status register, but the toggle and
+		// timeout bits read back in place of the data while they're busy.
+		if (ProgressDue())
+		{
+			SendProgress(FLASH_READ((uint16_t*)address));
+		}
+	}
+
+	PeakStatistic(maxEraseIterations, iterations);
+
+	return Amd_EraseFinish(address, status);
+}
+
+// Set while the chip is in unlock-bypass mode between calls to
+// Amd_WriteToFlash, because HoldFlashUnlocked asked for it.
+int __attribute((section(".kerneldata"))) amdBypass;
+
+///////////////////////////////////////////////////////////////////////////////
+// Leave unlock-bypass mode, return to read-array mode, and lock the chip.
+///////////////////////////////////////////////////////////////////////////////
+static void Amd_EndWrite(unsigned short *address)
+{
+	FLASH_WRITE(address, 0x9090);
+	FLASH_WRITE(address, 0x0000);
+	FLASH_WRITE(address, 0xF0F0);
+	FLASH_WRITE(address, 0xF0F0);
+#if defined P12
+	Amd_ChipLock();
+#else
+	SIM_CSOR0 = 0x1060;
+#endif
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Write data to flash memory.
 // This is invoked by HandleWriteMode36 in common-readwrite.c
+//
+// The chip select is set up, and the chip is put into unlock-bypass mode, at
+// the start of the call. After that each word takes two bus cycles to start
+// programming, rather than four. While HoldFlashUnlocked is on, the chip stays
+// in unlock-bypass mode when the call returns, so pipelined writes only pay
+// for that once per block rather than once per slice, and Amd_EndBypass
+// leaves it. In differential mode, words that already match the flash
+// contents are skipped.
 ///////////////////////////////////////////////////////////////////////////////
-uint8_t Amd_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int testWrite)
+uint8_t Amd_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int testWrite, int differential)
 {
 	char errorCode = 0;
-	unsigned short status;
+
+	flashWordsProgrammed = 0;
 
 	unsigned short* payloadArray = (unsigned short*) payloadBytes;
 	unsigned short* flashArray = (unsigned short*) startAddress;
 
+	if (!testWrite && !(flashHoldUnlocked && amdBypass))
+	{
+#if defined P12
+		Amd_ChipUnlock(1);
+#else
+		SIM_CSOR0 = 0x7060;
+#endif
+		COMMAND_REG_AAA = 0xAAAA;
+		COMMAND_REG_554 = 0x5555;
+		COMMAND_REG_AAA = 0x2020;
+		amdBypass = 1;
+	}
+
 	for (unsigned index = 0; index < payloadLengthInBytes / 2; index++)
 	{
 		unsigned short volatile  *address = &(flashArray[index]);
 		unsigned short value = payloadArray[index];
 
+		if (differential && (FLASH_READ(address) == value))
+		{
+			continue;
+		}
+
+		flashWordsProgrammed++;
+
 		if (!testWrite)
 		{
-#if defined P12
-			Amd_ChipUnlock(1);
-#else
-			SIM_CSOR0 = 0x7060;
-#endif
-			COMMAND_REG_AAA = 0xAAAA;
-			COMMAND_REG_554 = 0x5555;
-			COMMAND_REG_AAA = 0xA0A0;
-			*address = value;
+			FLASH_WRITE(address, 0xA0A0);
+			FLASH_WRITE(address, value);
 		}
 
 		char success = 0;
-		for(int iterations = 0; iterations < 0x1000; iterations++)
+		int iterations;
+		for (iterations = 0; iterations < 0x1000; iterations++)
 		{
 			ScratchWatchdog();
 
-			uint16_t read = testWrite ? value : *address;
+			uint16_t read = testWrite ? value : FLASH_READ(address);
 
 			if (read == value)
 			{
 				success = 1;
 				break;
 			}
+
+			if (ProgressDue())
+			{
+				SendProgress(read);
+			}
 		}
 
+		CountStatistic(programBusyPolls, iterations);
+
 		if (!success)
 		{
-			// Return flash to normal mode and return the error code.
 			errorCode = 0xAA;
-
-			if (!testWrite)
-			{
-				*address = 0xF0F0;
-				*address = 0xF0F0;
-#if defined P12
-				Amd_ChipLock();
-#else
-				SIM_CSOR0 = 0x1060;
-#endif
-			}
-
-			return errorCode;
+			break;
 		}
 	}
 
-	if (!testWrite)
+	if (!testWrite && (!flashHoldUnlocked || errorCode))
 	{
 		// Return flash to normal mode.
-		unsigned short* address = (unsigned short*)startAddress;
-		*address = 0xF0F0;
-		*address = 0xF0F0;
-#if defined P12
-		Amd_ChipLock();
-#else
-		SIM_CSOR0 = 0x1060;
-#endif
+		Amd_EndBypass();
 	}
 
-	return 0;
+	return errorCode;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Leave unlock-bypass mode, if Amd_WriteToFlash left the chip in it.
+///////////////////////////////////////////////////////////////////////////////
+void Amd_EndBypass()
+{
+	if (amdBypass)
+	{
+		Amd_EndWrite((unsigned short*)0);
+		amdBypass = 0;
+	}
 }
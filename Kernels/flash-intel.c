@@ -6,9 +6,9 @@
 #include "flash.h"
 
 ///////////////////////////////////////////////////////////////////////////////
-// Unlock / Lock Intel flash memory.
+// Unlock / Lock Intel flash memory, without waiting for the supply to settle.
 ///////////////////////////////////////////////////////////////////////////////
-void FlashUnlock(bool unlock)
+void FlashSwitchVoltage(bool unlock)
 {
 	SIM_CSBARBT = 0x0007;
 	SIM_CSORBT = 0x6820;
@@ -26,8 +26,17 @@ void FlashUnlock(bool unlock)
 		SIM_CSOR0 = 0x1060;
 		HARDWARE_IO &= 0xFFFE;
 	}
-	// P01 Critical
-	VariableSleep(0x50);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Unlock / Lock Intel flash memory.
+///////////////////////////////////////////////////////////////////////////////
+void FlashUnlock(bool unlock)
+{
+	FlashSwitchVoltage(unlock);
+
+	// P01 Critical. Give the +12v supply time to settle.
+	SleepMicroseconds(FlashSettleMilliseconds * 1000);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -56,36 +65,49 @@ uint32_t Intel_GetFlashId()
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Erase the given block.
+// Start erasing the given block, and return without waiting for it.
 ///////////////////////////////////////////////////////////////////////////////
-uint8_t Intel_EraseBlock(uint32_t address)
+void Intel_EraseStart(uint32_t address)
 {
-	unsigned short status = 0;
-
-	FlashUnlock(true);
+	if (!flashHoldUnlocked)
+	{
+		FlashUnlock(true);
+	}
 
 	uint16_t *flashBase = (uint16_t*)address;
-	*flashBase = 0x5050; // TODO: Move these commands to defines
-	*flashBase = 0x2020;
-	*flashBase = 0xD0D0;
-	*flashBase = 0x7070;
+	FLASH_WRITE(flashBase, 0x5050); // TODO: Move these commands to defines
+	FLASH_WRITE(flashBase, 0x2020);
+	FLASH_WRITE(flashBase, 0xD0D0);
+	FLASH_WRITE(flashBase, 0x7070);
+}
 
-	for (int iterations = 0; iterations < 0x640000; iterations++)
-	{
-		ScratchWatchdog();
-		status = *flashBase;
-		if ((status & 0x80) != 0)
-		{
-			break;
-		}
-	}
+///////////////////////////////////////////////////////////////////////////////
+// Check on an erase. Returns nonzero once the chip is ready. The status
+// register value goes to Intel_EraseFinish.
+///////////////////////////////////////////////////////////////////////////////
+int Intel_EraseDone(uint32_t address, uint16_t *status)
+{
+	*status = FLASH_READ((uint16_t*)address);
+	return (*status & 0x80) != 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Return the chip to read-array mode after an erase, and lock it unless a
+// pipelined write is holding it unlocked.
+///////////////////////////////////////////////////////////////////////////////
+uint8_t Intel_EraseFinish(uint32_t address, uint16_t status)
+{
+	uint16_t *flashBase = (uint16_t*)address;
 
 	status &= 0x00E8;
 
-	*flashBase = READ_ARRAY_COMMAND;
-	*flashBase = READ_ARRAY_COMMAND;
+	FLASH_WRITE(flashBase, READ_ARRAY_COMMAND);
+	FLASH_WRITE(flashBase, READ_ARRAY_COMMAND);
 
-	FlashUnlock(false);
+	if (!flashHoldUnlocked)
+	{
+		FlashUnlock(false);
+	}
 
 	// Return zero if successful, anything else is an error code.
 	if (status == 0x80)
@@ -96,17 +118,54 @@ uint8_t Intel_EraseBlock(uint32_t address)
 	return status;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Erase the given block.
+///////////////////////////////////////////////////////////////////////////////
+uint8_t Intel_EraseBlock(uint32_t address)
+{
+	uint16_t status = 0;
+
+	Intel_EraseStart(address);
+
+	uint32_t iterations;
+	for (iterations = 0; iterations < IntelErasePollLimit; iterations++)
+	{
+		ScratchWatchdog();
+		if (Intel_EraseDone(address, &status))
+		{
+			break;
+		}
+
+		if (ProgressDue())
+		{
+			SendProgress(status);
+		}
+	}
+
+	PeakStatistic(maxEraseIterations, iterations);
+
+	return Intel_EraseFinish(address, status);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Write data to flash memory.
 // This is invoked by HandleWriteMode36 in common-readwrite.c
 // read-kernel.c has a stub to keep the compiler happy until this is released.
+//
+// In differential mode, each word is compared with the flash contents first,
+// and only programmed if it differs. The chip is returned to read-array mode
+// after each word that is programmed, so that the next comparison is valid.
+//
+// The programming voltage is left on if HoldFlashUnlocked has been called.
 ///////////////////////////////////////////////////////////////////////////////
-uint8_t Intel_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int testWrite)
+uint8_t Intel_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int testWrite, int differential)
 {
 	char errorCode = 0;
-	unsigned short status;
+	unsigned short status = 0x80;
 
-	if (!testWrite)
+	flashWordsProgrammed = 0;
+
+	if (!testWrite && !flashHoldUnlocked)
 	{
 		FlashUnlock(true);
 	}
@@ -119,16 +178,24 @@ uint8_t Intel_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int start
 		unsigned short *address = &(flashArray[index]);
 		unsigned short value = payloadArray[index];
 
+		if (differential && (FLASH_READ(address) == value))
+		{
+			continue;
+		}
+
+		flashWordsProgrammed++;
+
 		if (!testWrite)
 		{
-			*address = 0x5050; // Clear status register TODO: use #define
-			*address = 0x4040; // Program setup
-			*address = value;  // Program
-			*address = 0x7070; // Prepare to read status register
+			FLASH_WRITE(address, 0x5050); // Clear status register TODO: use #define
+			FLASH_WRITE(address, 0x4040); // Program setup
+			FLASH_WRITE(address, value);  // Program
+			FLASH_WRITE(address, 0x7070); // Prepare to read status register
 		}
 
 		char success = 0;
-		for(int iterations = 0; iterations < 0x1000; iterations++)
+		int iterations;
+		for (iterations = 0; iterations < 0x1000; iterations++)
 		{
 			if  (testWrite)
 			{
@@ -136,7 +203,7 @@ uint8_t Intel_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int start
 			}
 			else
 			{
-				status = *address;
+				status = FLASH_READ(address);
 			}
 
 			ScratchWatchdog();
@@ -146,8 +213,15 @@ uint8_t Intel_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int start
 				success = 1;
 				break;
 			}
+
+			if (ProgressDue())
+			{
+				SendProgress(status);
+			}
 		}
 
+		CountStatistic(programBusyPolls, iterations);
+
 		if (!success)
 		{
 			// Return flash to normal mode and return the error code.
@@ -155,22 +229,33 @@ uint8_t Intel_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int start
 
 			if (!testWrite)
 			{
-				*address = 0xFFFF;
-				*address = 0xFFFF;
-				FlashUnlock(false);
+				FLASH_WRITE(address, 0xFFFF);
+				FLASH_WRITE(address, 0xFFFF);
+				if (!flashHoldUnlocked)
+				{
+					FlashUnlock(false);
+				}
 			}
 
 			return errorCode;
 		}
+
+		if (differential && !testWrite)
+		{
+			FLASH_WRITE(address, READ_ARRAY_COMMAND);
+		}
 	}
 
 	if (!testWrite)
 	{
 		// Return flash to normal mode.
 		unsigned short* address = (unsigned short*)startAddress;
-		*address = 0xFFFF;
-		*address = 0xFFFF;
-		FlashUnlock(false);
+		FLASH_WRITE(address, 0xFFFF);
+		FLASH_WRITE(address, 0xFFFF);
+		if (!flashHoldUnlocked)
+		{
+			FlashUnlock(false);
+		}
 	}
 
 	// Check the last value we got from the status register.
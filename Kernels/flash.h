@@ -1,6 +1,7 @@
 ///////////////////////////////////////////////////////////////////////////////
 // Functions for erasing and writing flash
 ///////////////////////////////////////////////////////////////////////////////
+#if !defined HOST
 #if defined P12
 	#define SIM_BASE        0x00FFFA30
 	#define SIM_20          (*(unsigned short *)(SIM_BASE + 0x20)) // Lock functions
@@ -19,6 +20,12 @@
 #define FLASH_MANUFACTURER (*(uint16_t *)(0x00000000))
 #define FLASH_DEVICE       (*(uint16_t *)(0x00000002))
 
+// Reads and writes of individual flash words go through these, so that the
+// host build can route them to the simulated flash chip.
+#define FLASH_READ(address)         (*(volatile uint16_t *)(address))
+#define FLASH_WRITE(address, value) (*(volatile uint16_t *)(address) = (value))
+#endif
+
 #define SIGNATURE_COMMAND  0x9090
 #define READ_ARRAY_COMMAND 0xFFFF
 
@@ -47,8 +54,18 @@ char volatile * const  SIM_CSBAR6   =   SIM_BASE + 0x64;
 char volatile * const  SIM_CSOR6    =   SIM_BASE + 0x66;*/
 
 // Lock and unlock refers to the internal +12v supply to the flash chip, needed for erasing and writing.
-// true to unlock, false to lock.
+// true to unlock, false to lock. FlashSwitchVoltage leaves the caller to wait
+// FlashSettleMilliseconds before using the chip.
 void FlashUnlock(bool unlock);
+void FlashSwitchVoltage(bool unlock);
+#define FlashSettleMilliseconds 200
+
+// Status polls before an erase is given up on, for one block.
+#define IntelErasePollLimit 0x640000
+#define AmdErasePollLimit 0x1280000
+
+// Erase result when the chip was still busy after the poll limit.
+#define EraseTimedOut 0x7F
 
 // Functions prefixed with Intel work with this chip ID
 #define FLASH_ID_INTEL_28F400B 0x00894471 // 512k
@@ -56,7 +73,10 @@ void FlashUnlock(bool unlock);
 
 uint32_t Intel_GetFlashId();
 uint8_t Intel_EraseBlock(uint32_t address);
-uint8_t Intel_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int testWrite);
+void Intel_EraseStart(uint32_t address);
+int Intel_EraseDone(uint32_t address, uint16_t *status);
+uint8_t Intel_EraseFinish(uint32_t address, uint16_t status);
+uint8_t Intel_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int testWrite, int differential);
 
 // Functions prefixed with Amd work with this chip ID
 #define FLASH_ID_AMD_AM29F800BB 0x00012258 // 1m
@@ -65,4 +85,11 @@ uint8_t Intel_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int start
 
 uint32_t Amd_GetFlashId();
 uint8_t Amd_EraseBlock(uint32_t address);
-uint8_t Amd_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int testWrite);
+void Amd_EraseStart(uint32_t address);
+int Amd_EraseStartSectors(uint32_t *addresses, int count);
+void Amd_EraseStartChip();
+int Amd_EraseDone(uint32_t address, uint16_t *status);
+uint8_t Amd_EraseFinish(uint32_t address, uint16_t status);
+uint8_t Amd_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int testWrite, int differential);
+void Amd_EndBypass();
+extern int __attribute((section(".kerneldata"))) amdBypass;
@@ -0,0 +1,1718 @@
+///////////////////////////////////////////////////////////////////////////////
+// Runs the P01 C kernel against the simulated PCM in host.c, checks that the
+// read, write, erase and CRC paths produce the right results, and reports how
+// much bus activity each data path needs per byte.
+//
+// Usage: host-benchmark [-w ticks-per-wire-byte]
+//
+// By default the wire is infinitely fast, so the numbers show only the work
+// done by the kernel. Use -w to see how the kernel behaves when it has to wait
+// for the DLC transmit FIFO to drain.
+///////////////////////////////////////////////////////////////////////////////
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+#include "flash.h"
+
+void ProcessMessage(int iterations);
+
+#define BLOCK_SIZE 4096
+#define TEST_ADDRESS 0x20000
+
+// The pipelined write test streams this many blocks into an erase block here.
+#define STREAM_BLOCKS 4
+#define STREAM_ADDRESS 0x40000
+
+// Compressed reads start with blank flash here.
+#define COMPRESS_ADDRESS 0x70000
+
+// The background erase test uses the erase block here.
+#define ERASE_ADDRESS 0x60000
+
+// Uploads to RAM go here.
+#define RAM_ADDRESS 0xFFA000
+#define RAM_UPLOAD_SIZE 1024
+
+// Wire speed for the streaming test, unless -w says otherwise. Pipelining
+// only helps when the wire is slow enough to overlap with programming.
+#define STREAM_TICKS_PER_BYTE 100
+
+static int failures;
+
+///////////////////////////////////////////////////////////////////////////////
+// Timing and reporting.
+///////////////////////////////////////////////////////////////////////////////
+static struct timespec started;
+
+static void StartMeasurement(void)
+{
+	HostResetCounters();
+	clock_gettime(CLOCK_MONOTONIC, &started);
+}
+
+static double Elapsed(void)
+{
+	struct timespec stopped;
+	HostFlush();
+	clock_gettime(CLOCK_MONOTONIC, &stopped);
+	return (stopped.tv_sec - started.tv_sec) * 1e9 + (stopped.tv_nsec - started.tv_nsec);
+}
+
+static void Report(const char *name, unsigned bytes)
+{
+	double nanoseconds = Elapsed();
+
+	printf(
+		"  %-22s %6u bytes  %8.2f cycles/byte  %6.3f watchdog/byte  %5.2f status/byte  %8.2f ns/byte\n",
+		name,
+		bytes,
+		(double)hostCounters.busCycles / bytes,
+		(double)hostCounters.watchdogWrites / bytes,
+		(double)hostCounters.dlcStatusReads / bytes,
+		nanoseconds / bytes);
+}
+
+static void Fail(const char *format, unsigned value)
+{
+	printf("  FAILED: ");
+	printf(format, value);
+	printf("\n");
+	failures++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Message helpers.
+///////////////////////////////////////////////////////////////////////////////
+static unsigned char request[MessageBufferSize];
+static unsigned char reply[MessageBufferSize];
+
+// Receive one message from the simulated tool. Returns the message length.
+static int Receive(const unsigned char *message, int length)
+{
+	unsigned char completionCode = 0xFF;
+	unsigned char readState = 0xFF;
+
+	HostReceive(message, length);
+	int received = ReadMessage(&completionCode, &readState);
+	if ((received != length) || (readState != 1))
+	{
+		Fail("ReadMessage returned readState %02X", readState);
+		return 0;
+	}
+
+	return received;
+}
+
+// Send a request to the kernel and return the length of the first reply.
+static int Exchange(const unsigned char *message, int length)
+{
+	if (Receive(message, length) == 0)
+	{
+		return -1;
+	}
+
+	ProcessMessage(0);
+
+	int replyLength = HostTransmitted(reply, sizeof(reply));
+
+	// Discard anything else the kernel sent.
+	unsigned char discard[16];
+	while (HostTransmitted(discard, sizeof(discard)) >= 0)
+	{
+	}
+
+	return replyLength;
+}
+
+static int BuildMode36(unsigned char command, unsigned address, const unsigned char *data, unsigned length)
+{
+	request[0] = 0x6D;
+	request[1] = 0x10;
+	request[2] = 0xF0;
+	request[3] = 0x36;
+	request[4] = command;
+	request[5] = length >> 8;
+	request[6] = length;
+	request[7] = address >> 16;
+	request[8] = address >> 8;
+	request[9] = address;
+	memcpy(&request[10], data, length);
+
+	unsigned short sum = 0;
+	for (unsigned index = 4; index < length + 10; index++)
+	{
+		sum += request[index];
+	}
+
+	request[10 + length] = sum >> 8;
+	request[11 + length] = sum;
+	return length + 12;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A simple bitwise implementation of the CRC used by Crc.cs, to check the
+// table-driven one in the kernel.
+///////////////////////////////////////////////////////////////////////////////
+static unsigned ReferenceCrc(const unsigned char *data, unsigned length)
+{
+	unsigned remainder = 0;
+	for (unsigned index = 0; index < length; index++)
+	{
+		remainder ^= (unsigned)data[index] << 24;
+		for (int bit = 0; bit < 8; bit++)
+		{
+			remainder = (remainder & 0x80000000) ? (remainder << 1) ^ 0x04C11DB7 : (remainder << 1);
+		}
+	}
+
+	return remainder;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Get the CRC of a range of flash, polling the way the app does. If idle is
+// set, the kernel waits for a message between polls, like it would while the
+// app is busy, and the timing covers only the time spent handling queries.
+///////////////////////////////////////////////////////////////////////////////
+static void Crc(unsigned crcLength, unsigned address, const char *name, int idle)
+{
+	unsigned char crcQuery[] =
+	{
+		0x6C, 0x10, 0xF0, 0x3D, 0x02,
+		crcLength >> 16, (crcLength >> 8) & 0xFF, crcLength & 0xFF,
+		address >> 16, (address >> 8) & 0xFF, address & 0xFF
+	};
+
+	unsigned cycles = 0;
+	double nanoseconds = 0;
+	int polls;
+	for (polls = 0; polls < 100; polls++)
+	{
+		Receive(crcQuery, sizeof(crcQuery));
+		StartMeasurement();
+		ProcessMessage(0);
+		nanoseconds += Elapsed();
+		cycles += hostCounters.busCycles;
+		if ((HostTransmitted(reply, sizeof(reply)) == 15) && (reply[4] == 0x02))
+		{
+			break;
+		}
+
+		if (idle)
+		{
+			unsigned char completionCode = 0xFF;
+			unsigned char readState = 0xFF;
+			ReadMessage(&completionCode, &readState);
+		}
+	}
+
+	unsigned crc = (reply[11] << 24) | (reply[12] << 16) | (reply[13] << 8) | reply[14];
+	printf(
+		"  %-22s %6u bytes  %8.2f cycles/byte  %6d queries                      %8.2f ns/byte\n",
+		name,
+		crcLength,
+		(double)cycles / crcLength,
+		polls + 1,
+		nanoseconds / crcLength);
+
+	if (crc != ReferenceCrc(&HostFlash()[address], crcLength))
+	{
+		Fail("CRC, got %08X", crc);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Expand a run-length encoded mode-35 payload, as the app does. Returns the
+// decoded length, or -1 if the encoding is malformed.
+///////////////////////////////////////////////////////////////////////////////
+static int DecodeRunLength(const unsigned char *encoded, int length, unsigned char *decoded, int size)
+{
+	int out = 0;
+	int index = 0;
+	while (index < length)
+	{
+		unsigned char control = encoded[index++];
+		if (control < 0x80)
+		{
+			int count = control + 1;
+			if ((index + count > length) || (out + count > size))
+			{
+				return -1;
+			}
+
+			memcpy(&decoded[out], &encoded[index], count);
+			index += count;
+			out += count;
+			continue;
+		}
+
+		int words = (control & 0x40) != 0;
+		if (index + (words ? 3 : 2) > length)
+		{
+			return -1;
+		}
+
+		int count = ((control & 0x3F) << 8) | encoded[index++];
+		for (int run = 0; run < count; run++)
+		{
+			if (out + (words ? 2 : 1) > size)
+			{
+				return -1;
+			}
+
+			decoded[out++] = encoded[index];
+			if (words)
+			{
+				decoded[out++] = encoded[index + 1];
+			}
+		}
+
+		index += words ? 2 : 1;
+	}
+
+	return out;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Decode the payload of a mode-36 read reply into the given buffer. Returns
+// the decoded length, or -1 if the sum doesn't match. The sum covers the
+// header and the decoded data.
+///////////////////////////////////////////////////////////////////////////////
+static int DecodeReadReply(int replyLength, unsigned char *decoded, int size)
+{
+	int decodedLength = (reply[4] == 0x02) ?
+		DecodeRunLength(&reply[10], replyLength - 12, decoded, size) :
+		(memcpy(decoded, &reply[10], replyLength - 12), replyLength - 12);
+
+	unsigned short sum = 0;
+	for (int index = 4; index < 10; index++)
+	{
+		sum += reply[index];
+	}
+
+	for (int index = 0; index < decodedLength; index++)
+	{
+		sum += decoded[index];
+	}
+
+	if (((reply[replyLength - 2] << 8) | reply[replyLength - 1]) != sum)
+	{
+		return -1;
+	}
+
+	return decodedLength;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Read a block with compression allowed, and check that it expands to the
+// flash contents with a sum that covers the decoded data.
+///////////////////////////////////////////////////////////////////////////////
+static void CompressedRead(unsigned address, unsigned length, unsigned char expectedSubmode, const char *name)
+{
+	static unsigned char decoded[BLOCK_SIZE];
+	unsigned char read[] = { 0x6C, 0x10, 0xF0, 0x35, 0x02, length >> 8, length & 0xFF, address >> 16, (address >> 8) & 0xFF, address & 0xFF };
+	Receive(read, sizeof(read));
+	StartMeasurement();
+	ProcessMessage(0);
+	int replyLength = HostTransmitted(reply, sizeof(reply));
+	Report(name, length);
+
+	if ((replyLength < 12) || (reply[3] != 0x36) || (reply[4] != expectedSubmode))
+	{
+		Fail("compressed read, reply length %d", replyLength);
+		return;
+	}
+
+	int decodedLength = DecodeReadReply(replyLength, decoded, sizeof(decoded));
+	if ((decodedLength != length) || memcmp(decoded, &HostFlash()[address], length))
+	{
+		Fail("compressed read, decoded %d bytes", decodedLength);
+	}
+
+	printf("  %-22s %6d bytes on the wire\n", "", replyLength);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Streaming read of a range that ends part way into its last block. The
+// simulated tool acknowledges what it has, and pretends that one block was
+// lost so that it has to ask for it again.
+///////////////////////////////////////////////////////////////////////////////
+#define READ_STREAM_BLOCK_SIZE 1024
+#define READ_STREAM_BLOCKS 8
+#define READ_STREAM_WINDOW 3
+#define READ_STREAM_LOST_BLOCK 1
+
+static void SendStreamAcknowledge(unsigned char submode, unsigned sequence)
+{
+	unsigned char message[] = { 0x6C, 0x10, 0xF0, 0x35, submode, sequence >> 8, sequence & 0xFF };
+	if (Receive(message, sizeof(message)))
+	{
+		ProcessMessage(0);
+	}
+}
+
+static void StreamRead(unsigned address)
+{
+	static unsigned char decoded[READ_STREAM_BLOCK_SIZE];
+	unsigned length = (READ_STREAM_BLOCKS * READ_STREAM_BLOCK_SIZE) - 3;
+	unsigned char start[] =
+	{
+		0x6C, 0x10, 0xF0, 0x35, 0x03,
+		READ_STREAM_BLOCK_SIZE >> 8, READ_STREAM_BLOCK_SIZE & 0xFF,
+		address >> 16, (address >> 8) & 0xFF, address & 0xFF,
+		length >> 16, (length >> 8) & 0xFF, length & 0xFF,
+		READ_STREAM_WINDOW,
+	};
+
+	Receive(start, sizeof(start));
+	StartMeasurement();
+	ProcessMessage(0);
+
+	unsigned received = 0;
+	unsigned acknowledged = 0;
+	int frames = 0;
+	int lost = 0;
+	for (int turn = 0; (turn < 100) && (acknowledged < READ_STREAM_BLOCKS); turn++)
+	{
+		int replyLength;
+		while ((replyLength = HostTransmitted(reply, sizeof(reply))) >= 0)
+		{
+			unsigned offset = ((reply[7] << 16) | (reply[8] << 8) | reply[9]) - address;
+			unsigned sequence = offset / READ_STREAM_BLOCK_SIZE;
+			unsigned expected = (length - offset < READ_STREAM_BLOCK_SIZE) ? length - offset : READ_STREAM_BLOCK_SIZE;
+			if ((replyLength < 12) ||
+				(reply[3] != 0x36) ||
+				(offset % READ_STREAM_BLOCK_SIZE) ||
+				(sequence >= acknowledged + READ_STREAM_WINDOW) ||
+				(DecodeReadReply(replyLength, decoded, sizeof(decoded)) != expected) ||
+				memcmp(decoded, &HostFlash()[address + offset], expected))
+			{
+				Fail("streaming read, bad frame at offset %06X", offset);
+				return;
+			}
+
+			frames++;
+			received |= 1 << sequence;
+		}
+
+		if (!lost && (received & (1 << READ_STREAM_LOST_BLOCK)))
+		{
+			received &= ~(1 << READ_STREAM_LOST_BLOCK);
+			SendStreamAcknowledge(0x05, READ_STREAM_LOST_BLOCK);
+			lost = 1;
+		}
+
+		while ((acknowledged < READ_STREAM_BLOCKS) && (received & (1 << acknowledged)))
+		{
+			acknowledged++;
+		}
+
+		SendStreamAcknowledge(0x04, acknowledged);
+		for (int job = 0; job < READ_STREAM_WINDOW; job++)
+		{
+			RunBackgroundJob();
+		}
+	}
+
+	Report("Mode 35 stream", length);
+
+	if ((acknowledged != READ_STREAM_BLOCKS) || (frames != READ_STREAM_BLOCKS + 1))
+	{
+		Fail("streaming read, %d frames", frames);
+	}
+
+	if (HostTransmitted(reply, sizeof(reply)) >= 0)
+	{
+		Fail("streaming read, frame sent after the last acknowledgement", 0);
+	}
+
+	// Any other request ends the stream.
+	Receive(start, sizeof(start));
+	ProcessMessage(0);
+	unsigned char versionQuery[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x00 };
+	Exchange(versionQuery, sizeof(versionQuery));
+	RunBackgroundJob();
+	if (HostTransmitted(reply, sizeof(reply)) >= 0)
+	{
+		Fail("streaming read, frame sent after another request", 0);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Have the kernel compress a block for a mode-35 read, then send that back as
+// a compressed mode-36 write, and check that the destination matches.
+///////////////////////////////////////////////////////////////////////////////
+static void CompressedWrite(unsigned char command, unsigned source, unsigned destination, const char *name)
+{
+	static unsigned char encoded[MessageBufferSize];
+	unsigned char *flash = HostFlash();
+	unsigned char read[] = { 0x6C, 0x10, 0xF0, 0x35, 0x02, BLOCK_SIZE >> 8, BLOCK_SIZE & 0xFF, source >> 16, (source >> 8) & 0xFF, source & 0xFF };
+	int replyLength = Exchange(read, sizeof(read));
+	if ((replyLength < 12) || (reply[4] != 0x02))
+	{
+		Fail("compressed write, read reply length %d", replyLength);
+		return;
+	}
+
+	unsigned encodedLength = replyLength - 12;
+	memcpy(encoded, &reply[10], encodedLength);
+
+	// The sum covers the decoded data, not the encoding.
+	int length = BuildMode36(command, destination, encoded, encodedLength);
+	unsigned short sum = 0;
+	for (int index = 4; index < 10; index++)
+	{
+		sum += request[index];
+	}
+
+	for (int index = 0; index < BLOCK_SIZE; index++)
+	{
+		sum += flash[source + index];
+	}
+
+	request[length - 2] = sum >> 8;
+	request[length - 1] = sum;
+
+	Receive(request, length);
+	StartMeasurement();
+	ProcessMessage(0);
+	FinishPipelinedWrite();
+	Report(name, BLOCK_SIZE);
+	printf("  %-22s %6d bytes on the wire\n", "", length);
+
+	if ((HostTransmitted(reply, sizeof(reply)) < 5) ||
+		(reply[3] != 0x76) ||
+		memcmp(&flash[destination], &flash[source], BLOCK_SIZE))
+	{
+		Fail("compressed write, reply %02X", reply[3]);
+	}
+
+	// A truncated encoding must be rejected.
+	length = BuildMode36(command, destination, encoded, encodedLength - 1);
+	request[length - 2] = sum >> 8;
+	request[length - 1] = sum;
+	if ((Exchange(request, length) < 5) || (reply[3] != 0x7F))
+	{
+		Fail("truncated compressed write, reply %02X", reply[3]);
+	}
+
+	FinishPipelinedWrite();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// An upload to RAM is only copied there once its sum has been checked, so a
+// damaged upload leaves RAM alone.
+///////////////////////////////////////////////////////////////////////////////
+static void RamUpload(const unsigned char *data)
+{
+	unsigned char *ram = HostPointer(RAM_ADDRESS);
+	memset(ram, 0, RAM_UPLOAD_SIZE);
+
+	int length = BuildMode36(0x00, RAM_ADDRESS, data, RAM_UPLOAD_SIZE);
+	HostReceive(request, length);
+	unsigned char completionCode = 0xFF;
+	unsigned char readState = 0xFF;
+	StartMeasurement();
+	ReadMessage(&completionCode, &readState);
+	ProcessMessage(0);
+	Report("Mode 36 RAM", RAM_UPLOAD_SIZE);
+
+	if ((HostTransmitted(reply, sizeof(reply)) != 5) || (reply[3] != 0x76))
+	{
+		Fail("RAM upload, reply %02X", reply[3]);
+	}
+
+	if (memcmp(ram, data, RAM_UPLOAD_SIZE))
+	{
+		Fail("RAM upload, contents differ at %06X", RAM_ADDRESS);
+	}
+
+	// A damaged upload isn't acknowledged, and doesn't reach RAM.
+	memset(ram, 0, RAM_UPLOAD_SIZE);
+	length = BuildMode36(0x00, RAM_ADDRESS, data, RAM_UPLOAD_SIZE);
+	request[10 + 7] ^= 0x80;
+	if ((Exchange(request, length) != 11) || (reply[3] != 0x7F))
+	{
+		Fail("damaged RAM upload, reply %02X", reply[3]);
+	}
+
+	for (unsigned index = 0; index < RAM_UPLOAD_SIZE; index++)
+	{
+		if (ram[index])
+		{
+			Fail("damaged RAM upload, RAM changed at %06X", RAM_ADDRESS + index);
+			break;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Patch lists: patches that only clear bits are programmed without an erase,
+// and the rest are listed in the reply.
+///////////////////////////////////////////////////////////////////////////////
+#define PATCH_ADDRESS (TEST_ADDRESS + 0x100)
+
+static int AddPatch(unsigned char *list, int offset, unsigned address, const unsigned char *data, unsigned length)
+{
+	list[offset] = address >> 16;
+	list[offset + 1] = address >> 8;
+	list[offset + 2] = address;
+	list[offset + 3] = length >> 8;
+	list[offset + 4] = length;
+	memcpy(&list[offset + 5], data, length);
+	return offset + 5 + length;
+}
+
+static void PatchList(void)
+{
+	unsigned char *flash = HostFlash();
+	unsigned char cleared[16];
+	unsigned char set[4];
+	unsigned char list[128];
+	for (int index = 0; index < sizeof(cleared); index++)
+	{
+		cleared[index] = flash[PATCH_ADDRESS + index] & 0xF0;
+	}
+
+	// The first word of the pattern that isn't all ones, with its low bits set.
+	unsigned setAddress = PATCH_ADDRESS + 0x40;
+	while ((flash[setAddress] & flash[setAddress + 1]) == 0xFF)
+	{
+		setAddress += 2;
+	}
+
+	memcpy(set, &flash[setAddress], sizeof(set));
+	set[0] |= 0x0F;
+	set[1] |= 0x0F;
+
+	int length = AddPatch(list, 0, PATCH_ADDRESS, cleared, sizeof(cleared));
+	length = AddPatch(list, length, setAddress, set, sizeof(set));
+	length = AddPatch(list, length, PATCH_ADDRESS + 0x21, cleared, 1);
+	length = AddPatch(list, length, PATCH_ADDRESS + 0x60, &flash[PATCH_ADDRESS + 0x60], 8);
+
+	unsigned char original[sizeof(set)];
+	memcpy(original, &flash[setAddress], sizeof(set));
+
+	unsigned changed = 0;
+	for (int index = 0; index < sizeof(cleared); index += 2)
+	{
+		changed += (cleared[index] != flash[PATCH_ADDRESS + index]) || (cleared[index + 1] != flash[PATCH_ADDRESS + index + 1]);
+	}
+
+	int requestLength = BuildMode36(0x0E, 0, list, length);
+	Receive(request, requestLength);
+	StartMeasurement();
+	ProcessMessage(0);
+	Report("Patch list", sizeof(cleared));
+
+	int replyLength = HostTransmitted(reply, sizeof(reply));
+	if ((replyLength != 10) ||
+		(reply[3] != 0x76) ||
+		(reply[4] != 0x0E) ||
+		(((reply[5] << 8) | reply[6]) != changed) ||
+		(reply[7] != 2) ||
+		(reply[8] != 1) ||
+		(reply[9] != 2))
+	{
+		Fail("patch list, reply length %d", replyLength);
+	}
+
+	if (memcmp(&flash[PATCH_ADDRESS], cleared, sizeof(cleared)) ||
+		memcmp(&flash[setAddress], original, sizeof(set)))
+	{
+		Fail("patch list, flash contents differ at %06X", PATCH_ADDRESS);
+	}
+
+	// A list that runs past the end of the payload is rejected outright.
+	requestLength = BuildMode36(0x0E, 0, list, length - 1);
+	if ((Exchange(request, requestLength) != 7) || (reply[3] != 0x7F) || (reply[5] != 0xBE))
+	{
+		Fail("truncated patch list, reply %02X", reply[3]);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sector rewrites: the kernel stages a block in RAM, applies the patches, and
+// erases and reprograms the block, so only the patches are sent.
+///////////////////////////////////////////////////////////////////////////////
+#define REWRITE_ADDRESS 0x08000
+#define REWRITE_SIZE 0x18000
+#define REWRITE_FULL_ADDRESS 0x06000
+#define REWRITE_FULL_SIZE 0x2000
+
+static int BuildSectorRewrite(unsigned address, unsigned size, unsigned crcBefore, unsigned crcAfter, const unsigned char *list, int length)
+{
+	unsigned char payload[11 + 256];
+	payload[0] = size >> 16;
+	payload[1] = size >> 8;
+	payload[2] = size;
+	payload[3] = crcBefore >> 24;
+	payload[4] = crcBefore >> 16;
+	payload[5] = crcBefore >> 8;
+	payload[6] = crcBefore;
+	payload[7] = crcAfter >> 24;
+	payload[8] = crcAfter >> 16;
+	payload[9] = crcAfter >> 8;
+	payload[10] = crcAfter;
+	memcpy(&payload[11], list, length);
+	return BuildMode36(SectorRewrite, address, payload, 11 + length);
+}
+
+static void RewriteRefused(int requestLength, unsigned char code, const char *name)
+{
+	if ((Exchange(request, requestLength) != 7) || (reply[3] != 0x7F) || (reply[5] != code))
+	{
+		Fail(name, reply[5]);
+	}
+}
+
+static void SectorRewriteBlock(const unsigned char *data)
+{
+	static unsigned char expected[REWRITE_SIZE];
+	unsigned char *flash = HostFlash();
+
+	// A large block that's mostly blank, with some code, a long run of
+	// padding words, and a few words near the end.
+	memset(&flash[REWRITE_ADDRESS], 0xFF, REWRITE_SIZE);
+	memcpy(&flash[REWRITE_ADDRESS + 0x100], data, 1024);
+	for (unsigned index = 0x2000; index < 0x6000; index += 2)
+	{
+		flash[REWRITE_ADDRESS + index] = 0x4E;
+		flash[REWRITE_ADDRESS + index + 1] = 0x71;
+	}
+	flash[REWRITE_ADDRESS + 0x10000] = 0x12;
+	flash[REWRITE_ADDRESS + 0x10001] = 0x34;
+	flash[REWRITE_ADDRESS + REWRITE_SIZE - 2] = 0x00;
+	flash[REWRITE_ADDRESS + REWRITE_SIZE - 1] = 0x00;
+
+	memcpy(expected, &flash[REWRITE_ADDRESS], REWRITE_SIZE);
+	unsigned crcBefore = ReferenceCrc(expected, REWRITE_SIZE);
+
+	// Patches that set bits, so they need an erase: new code over old, data
+	// in blank space, and padding erased back to blank.
+	unsigned char erased[8];
+	unsigned char list[256];
+	memset(erased, 0xFF, sizeof(erased));
+	int length = AddPatch(list, 0, REWRITE_ADDRESS + 0x140, &data[2048], 64);
+	length = AddPatch(list, length, REWRITE_ADDRESS + 0x3000, erased, sizeof(erased));
+	length = AddPatch(list, length, REWRITE_ADDRESS + 0x12000, &data[4096], 16);
+	memcpy(&expected[0x140], &data[2048], 64);
+	memcpy(&expected[0x3000], erased, sizeof(erased));
+	memcpy(&expected[0x12000], &data[4096], 16);
+	unsigned crcAfter = ReferenceCrc(expected, REWRITE_SIZE);
+
+	// Nothing is erased unless both CRCs check out.
+	RewriteRefused(BuildSectorRewrite(REWRITE_ADDRESS, REWRITE_SIZE, crcBefore ^ 1, crcAfter, list, length), 0xBD, "sector rewrite with wrong CRC before, code %02X");
+	RewriteRefused(BuildSectorRewrite(REWRITE_ADDRESS, REWRITE_SIZE, crcBefore, crcAfter ^ 1, list, length), 0xBA, "sector rewrite with wrong CRC after, code %02X");
+	RewriteRefused(BuildSectorRewrite(REWRITE_FULL_ADDRESS, REWRITE_FULL_SIZE, crcBefore, crcAfter, list, length), 0xBE, "sector rewrite with patch outside block, code %02X");
+
+	// Nor unless the range is exactly one erase block.
+	RewriteRefused(BuildSectorRewrite(REWRITE_ADDRESS, REWRITE_SIZE / 2, crcBefore, crcAfter, list, length), 0xBE, "sector rewrite of half a block, code %02X");
+	RewriteRefused(BuildSectorRewrite(0x4000, 0x4000, crcBefore, crcAfter, list, 0), 0xBE, "sector rewrite of two blocks, code %02X");
+	RewriteRefused(BuildSectorRewrite(REWRITE_ADDRESS + 0x8000, 0x8000, crcBefore, crcAfter, list, 0), 0xBE, "sector rewrite inside a block, code %02X");
+	if (ReferenceCrc(&flash[REWRITE_ADDRESS], REWRITE_SIZE) != crcBefore)
+	{
+		Fail("refused sector rewrite changed block %06X", REWRITE_ADDRESS);
+	}
+
+	int requestLength = BuildSectorRewrite(REWRITE_ADDRESS, REWRITE_SIZE, crcBefore, crcAfter, list, length);
+	Receive(request, requestLength);
+	StartMeasurement();
+	ProcessMessage(0);
+	Report("Sector rewrite", REWRITE_SIZE);
+
+	int replyLength = HostTransmitted(reply, sizeof(reply));
+	unsigned staged = (reply[5] << 8) | reply[6];
+	if ((replyLength != 7) || (reply[3] != 0x76) || (reply[4] != SectorRewrite) || (staged == 0) || (staged > 4096))
+	{
+		Fail("sector rewrite, reply %02X", reply[3]);
+	}
+
+	printf("  %-22s %6u bytes staged, %d bytes sent\n", "", staged, requestLength);
+
+	if (memcmp(&flash[REWRITE_ADDRESS], expected, REWRITE_SIZE))
+	{
+		Fail("sector rewrite, flash contents differ at %06X", REWRITE_ADDRESS);
+	}
+
+	// A block that's full of data doesn't fit in RAM, and is left alone.
+	memcpy(&flash[REWRITE_FULL_ADDRESS], data, REWRITE_FULL_SIZE);
+	unsigned crc = ReferenceCrc(&flash[REWRITE_FULL_ADDRESS], REWRITE_FULL_SIZE);
+	RewriteRefused(BuildSectorRewrite(REWRITE_FULL_ADDRESS, REWRITE_FULL_SIZE, crc, crc, list, 0), 0xBC, "sector rewrite of full block, code %02X");
+	if (memcmp(&flash[REWRITE_FULL_ADDRESS], data, REWRITE_FULL_SIZE))
+	{
+		Fail("refused sector rewrite changed block %06X", REWRITE_FULL_ADDRESS);
+	}
+}
+
+#if KERNEL_FEATURES & FeatureStatistics
+///////////////////////////////////////////////////////////////////////////////
+// Read the kernel's performance counters, print them, and clear them.
+///////////////////////////////////////////////////////////////////////////////
+static const char *statisticNames[] =
+{
+	"bytes transmitted",
+	"bytes received",
+	"transmit stalls",
+	"read timeouts",
+	"checksum failures",
+	"program busy polls",
+	"max erase iterations",
+	"idle spins",
+};
+
+static void Statistics(void)
+{
+	unsigned char query[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x08, 0x01 };
+	int length = Exchange(query, sizeof(query));
+	if ((length != 5 + (KernelStatisticsCount * 4)) || (reply[3] != 0x7D) || (reply[4] != 0x08))
+	{
+		Fail("statistics query, reply length %d", length);
+		return;
+	}
+
+	printf("  Statistics:");
+	unsigned counters[KernelStatisticsCount];
+	for (int index = 0; index < KernelStatisticsCount; index++)
+	{
+		unsigned char *value = &reply[5 + (index * 4)];
+		counters[index] = (value[0] << 24) | (value[1] << 16) | (value[2] << 8) | value[3];
+		printf("%s %s %u", index ? "," : "", statisticNames[index], counters[index]);
+	}
+	printf("\n");
+
+	// The only bad sums came from the damaged writes and the truncated
+	// compressed writes.
+	unsigned badSums = 2;
+#if (KERNEL_FEATURES & FeatureCompressedRead) && (KERNEL_FEATURES & FeatureCompressedWrite)
+	badSums += 2;
+#endif
+	if ((counters[0] == 0) || (counters[1] == 0) || (counters[4] != badSums) || (counters[6] == 0))
+	{
+		Fail("statistics, %u bytes transmitted", counters[0]);
+	}
+
+	// The first query cleared the counters, so now they only cover its reply.
+	length = Exchange(query, sizeof(query));
+	unsigned transmitted = (reply[5] << 24) | (reply[6] << 16) | (reply[7] << 8) | reply[8];
+	if ((length < 9) || (transmitted != 5 + (KernelStatisticsCount * 4)))
+	{
+		Fail("statistics after clearing, %u bytes transmitted", transmitted);
+	}
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Ask which 4 KB chunks of the whole chip are blank, and check the bitmap.
+///////////////////////////////////////////////////////////////////////////////
+static void BlankScan(void)
+{
+	unsigned char *flash = HostFlash();
+	unsigned count = HostFlashSize() / BlankScanChunkSize;
+	unsigned char query[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x09, 0x00, 0x00, 0x00, count >> 8, count & 0xFF };
+	Receive(query, sizeof(query));
+	StartMeasurement();
+	ProcessMessage(0);
+	Report("Blank scan", HostFlashSize());
+	int length = HostTransmitted(reply, sizeof(reply));
+	if ((length != 10 + ((count + 7) / 8)) || (reply[3] != 0x7D) || (reply[4] != 0x09))
+	{
+		Fail("blank scan, reply length %d", length);
+		return;
+	}
+
+	unsigned blank = 0;
+	for (unsigned chunk = 0; chunk < count; chunk++)
+	{
+		int expected = 1;
+		for (unsigned index = 0; index < BlankScanChunkSize; index++)
+		{
+			if (flash[(chunk * BlankScanChunkSize) + index] != 0xFF)
+			{
+				expected = 0;
+				break;
+			}
+		}
+
+		if (((reply[10 + (chunk / 8)] >> (7 - (chunk % 8))) & 1) != expected)
+		{
+			Fail("blank scan, wrong bit for chunk at %06X", chunk * BlankScanChunkSize);
+			return;
+		}
+
+		blank += expected;
+	}
+
+	printf("  %-22s %6u of %u chunks blank\n", "", blank, count);
+
+	// A scan that runs off the end of the chip stops there.
+	unsigned last = HostFlashSize() - BlankScanChunkSize;
+	unsigned char past[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x09, last >> 16, (last >> 8) & 0xFF, last & 0xFF, 0x00, 0x10 };
+	if ((Exchange(past, sizeof(past)) != 11) || (reply[8] != 0x00) || (reply[9] != 0x01))
+	{
+		Fail("blank scan past the end, %d chunks", (reply[8] << 8) | reply[9]);
+	}
+
+	unsigned end = HostFlashSize();
+	unsigned char outside[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x09, end >> 16, (end >> 8) & 0xFF, end & 0xFF, 0x00, 0x01 };
+	if ((Exchange(outside, sizeof(outside)) < 5) || (reply[3] != 0x7F))
+	{
+		Fail("blank scan outside the chip, reply %02X", reply[3]);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Start a background erase, send a pipelined block while the chip is busy,
+// then poll until the erase is done and check that the block was written to
+// freshly erased flash.
+///////////////////////////////////////////////////////////////////////////////
+static void BackgroundErase(const unsigned char *data)
+{
+	unsigned char *flash = HostFlash();
+	memset(&flash[ERASE_ADDRESS], 0, 2 * BLOCK_SIZE);
+
+	// Leave a CRC half done, as if the tool had gone on to something else.
+	unsigned char crcQuery[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x02, 0x02, 0x00, 0x00, ERASE_ADDRESS >> 16, (ERASE_ADDRESS >> 8) & 0xFF, ERASE_ADDRESS & 0xFF };
+	Exchange(crcQuery, sizeof(crcQuery));
+
+	unsigned char start[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x0A, ERASE_ADDRESS >> 16, (ERASE_ADDRESS >> 8) & 0xFF, ERASE_ADDRESS & 0xFF };
+	StartMeasurement();
+	if ((Exchange(start, sizeof(start)) != 7) || (reply[3] != 0x7D) || (reply[4] != 0x0A))
+	{
+		Fail("erase start, reply %02X", reply[3]);
+		return;
+	}
+
+	if (crcLength != 0)
+	{
+		Fail("background CRC still running during erase, %u bytes", crcLength);
+	}
+
+	int length = BuildMode36(PipelinedWrite | 0x0D, ERASE_ADDRESS, data, BLOCK_SIZE);
+	if ((Exchange(request, length) != 5) || (reply[3] != 0x76))
+	{
+		Fail("write during erase, reply %02X", reply[3]);
+	}
+
+	unsigned char status[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x0B };
+	unsigned polls = 0;
+	do
+	{
+		polls++;
+		if ((Exchange(status, sizeof(status)) != 9) || (reply[3] != 0x7D) || (reply[4] != 0x0B))
+		{
+			Fail("erase status, reply %02X", reply[3]);
+			return;
+		}
+	} while (reply[6] && (polls < 100000));
+
+	FinishPipelinedWrite();
+	Report("Erase + write (async)", BLOCK_SIZE);
+	printf("  %-22s %6u status queries\n", "", polls);
+
+	if (reply[6] || (reply[5] != 0))
+	{
+		Fail("background erase, result %02X", reply[5]);
+	}
+
+	if (memcmp(&flash[ERASE_ADDRESS], data, BLOCK_SIZE))
+	{
+		Fail("write during erase, flash contents differ at %06X", ERASE_ADDRESS);
+	}
+
+	for (unsigned index = BLOCK_SIZE; index < 2 * BLOCK_SIZE; index++)
+	{
+		if (flash[ERASE_ADDRESS + index] != 0xFF)
+		{
+			Fail("background erase left data at %06X", ERASE_ADDRESS + index);
+			break;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Start an erase that never finishes. A repeat of the start request gets the
+// same reply, a different erase is refused, and the kernel gives up on the
+// chip once the poll limit is reached.
+///////////////////////////////////////////////////////////////////////////////
+static void EraseTimeout(void)
+{
+	hostStuckErases = 1;
+	unsigned char start[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x0A, ERASE_ADDRESS >> 16, (ERASE_ADDRESS >> 8) & 0xFF, ERASE_ADDRESS & 0xFF };
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		if ((Exchange(start, sizeof(start)) != 7) || (reply[3] != 0x7D) || (reply[5] != 1))
+		{
+			Fail("stuck erase start, reply %02X", reply[3]);
+			hostStuckErases = 0;
+			return;
+		}
+	}
+
+	unsigned char other[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x0A, 0x00, 0x80, 0x00 };
+	if ((Exchange(other, sizeof(other)) != 8) || (reply[3] != 0x7F) || (reply[6] != 0x02))
+	{
+		Fail("erase start while busy, reply %02X", reply[3]);
+	}
+
+	// Querying the status would take millions of round trips, so wait the
+	// way the next flash write would.
+	StartMeasurement();
+	FinishPipelinedWrite();
+	printf("  %-22s %6.0f ms\n", "Erase (timed out)", Elapsed() / 1e6);
+
+	hostStuckErases = 0;
+	unsigned char status[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x0B };
+	if ((Exchange(status, sizeof(status)) != 9) || reply[6] || (reply[5] != EraseTimedOut) || (reply[7] != 0))
+	{
+		Fail("stuck erase, result %02X", reply[5]);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Erase a few blocks one request at a time, and then with one batch erase.
+///////////////////////////////////////////////////////////////////////////////
+static void BatchErase(void)
+{
+	static const unsigned sectors[] = { 0x20000, 0x40000, 0x60000 };
+	const int count = sizeof(sectors) / sizeof(sectors[0]);
+	unsigned char *flash = HostFlash();
+
+	memset(&flash[sectors[0]], 0, sectors[count - 1] + 0x20000 - sectors[0]);
+	StartMeasurement();
+	for (int index = 0; index < count; index++)
+	{
+		unsigned char erase[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x05, sectors[index] >> 16, (sectors[index] >> 8) & 0xFF, sectors[index] & 0xFF };
+		if ((Exchange(erase, sizeof(erase)) != 7) || (reply[4] != 0x05) || (reply[5] != 0))
+		{
+			Fail("erase, block %06X", sectors[index]);
+		}
+	}
+
+	printf("  %-22s %6d blocks %9u cycles\n", "Erase (one by one)", count, hostCounters.busCycles);
+
+	memset(&flash[sectors[0]], 0, sectors[count - 1] + 0x20000 - sectors[0]);
+	request[0] = 0x6C;
+	request[1] = 0x10;
+	request[2] = 0xF0;
+	request[3] = 0x3D;
+	request[4] = 0x0C;
+	request[5] = count;
+	for (int index = 0; index < count; index++)
+	{
+		request[6 + (index * 3)] = sectors[index] >> 16;
+		request[7 + (index * 3)] = sectors[index] >> 8;
+		request[8 + (index * 3)] = sectors[index];
+	}
+
+	StartMeasurement();
+	if ((Exchange(request, 6 + (count * 3)) != 7) || (reply[3] != 0x7D) || (reply[4] != 0x0C) || (reply[5] != count))
+	{
+		Fail("batch erase start, reply %02X", reply[3]);
+		return;
+	}
+
+	unsigned char status[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x0B };
+	unsigned polls = 0;
+	do
+	{
+		polls++;
+		if ((Exchange(status, sizeof(status)) != 9) || (reply[4] != 0x0B))
+		{
+			Fail("batch erase status, reply %02X", reply[3]);
+			return;
+		}
+	} while (reply[6] && (polls < 100000));
+
+	printf("  %-22s %6d blocks %9u cycles  %6u status queries\n", "Erase (batch)", count, hostCounters.busCycles, polls);
+
+	if (reply[6] || (reply[5] != 0))
+	{
+		Fail("batch erase, result %02X", reply[5]);
+	}
+
+	for (unsigned address = sectors[0]; address < sectors[count - 1] + 0x20000; address++)
+	{
+		if (flash[address] != 0xFF)
+		{
+			Fail("batch erase left data at %06X", address);
+			break;
+		}
+	}
+
+	unsigned char tooMany[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x0C, EraseBatchMaxSectors + 1 };
+	if ((Exchange(tooMany, sizeof(tooMany)) != 8) || (reply[3] != 0x7F))
+	{
+		Fail("batch erase of too many blocks, reply %02X", reply[3]);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Start a whole-chip erase with the given flags, and poll until it's done,
+// checking that the progress counts only go up. Returns the block count, or
+// zero if something failed.
+///////////////////////////////////////////////////////////////////////////////
+static int EraseChip(unsigned char flags, unsigned char expected, const char *name)
+{
+	unsigned char start[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x06, flags, flags ^ 0xFF, expected };
+	StartMeasurement();
+	if ((Exchange(start, sizeof(start)) != 7) || (reply[3] != 0x7D) || (reply[4] != 0x06) || (reply[5] != expected))
+	{
+		Fail("chip erase start, reply %02X", reply[3]);
+		return 0;
+	}
+
+	int count = reply[5];
+	int done = 0;
+	unsigned char status[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x0B };
+	unsigned polls = 0;
+	do
+	{
+		polls++;
+		if ((Exchange(status, sizeof(status)) != 9) || (reply[4] != 0x0B))
+		{
+			Fail("chip erase status, reply %02X", reply[3]);
+			return 0;
+		}
+
+		if ((reply[7] < done) || (reply[7] > count) || (reply[8] != count))
+		{
+			Fail("chip erase progress, %d blocks finished", reply[7]);
+			return 0;
+		}
+
+		done = reply[7];
+	} while (reply[6] && (polls < 1000000));
+
+	printf("  %-22s %6d blocks %9u cycles  %6u status queries\n", name, count, hostCounters.busCycles, polls);
+
+	if (reply[6] || (reply[5] != 0) || (done != count))
+	{
+		Fail("chip erase, result %02X", reply[5]);
+		return 0;
+	}
+
+	return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Erase the whole chip, first leaving the boot and parameter blocks alone,
+// and then with everything. Also check that a request without the second
+// copy of the flags, or with the wrong block count, is refused.
+///////////////////////////////////////////////////////////////////////////////
+static void ChipErase(void)
+{
+	unsigned char *flash = HostFlash();
+	unsigned size = HostFlashSize();
+	unsigned char blocks = HostFlashBlocks();
+
+	unsigned char unchecked[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x06, EraseChipBoot, EraseChipBoot, blocks };
+	if ((Exchange(unchecked, sizeof(unchecked)) != 8) || (reply[3] != 0x7F))
+	{
+		Fail("chip erase without the flag check, reply %02X", reply[3]);
+	}
+
+	memset(flash, 0, size);
+	unsigned char miscounted[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x06, 0x00, 0xFF, blocks };
+	if ((Exchange(miscounted, sizeof(miscounted)) != 8) || (reply[3] != 0x7F) || (reply[6] != 0x03) || (reply[7] != blocks - 3))
+	{
+		Fail("chip erase with the wrong block count, reply %02X", reply[3]);
+	}
+
+	for (unsigned address = 0; address < size; address++)
+	{
+		if (flash[address] != 0x00)
+		{
+			Fail("refused chip erase changed data at %06X", address);
+			break;
+		}
+	}
+
+	if (EraseChip(0, blocks - 3, "Erase (chip, no boot)"))
+	{
+		for (unsigned address = 0; address < size; address++)
+		{
+			if (flash[address] != ((address < 0x8000) ? 0x00 : 0xFF))
+			{
+				Fail("chip erase without boot, wrong data at %06X", address);
+				break;
+			}
+		}
+	}
+
+	memset(flash, 0, size);
+	if (EraseChip(EraseChipBoot | EraseChipParameters, blocks, "Erase (chip, all)"))
+	{
+		for (unsigned address = 0; address < size; address++)
+		{
+			if (flash[address] != 0xFF)
+			{
+				Fail("chip erase left data at %06X", address);
+				break;
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Turn on progress frames, and check that a blocking erase sends some before
+// its reply, with the poll count going up by the interval each time. Then
+// turn them off again, and check that the erase only sends its reply.
+///////////////////////////////////////////////////////////////////////////////
+static void ProgressFrames(void)
+{
+	unsigned char on[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x0D, 0x00, 0x02 };
+	if ((Exchange(on, sizeof(on)) != 7) || (reply[3] != 0x7D) || (reply[4] != 0x0D) || (reply[6] != 0x02))
+	{
+		Fail("progress frames on, reply %02X", reply[3]);
+		return;
+	}
+
+	unsigned char erase[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x05, ERASE_ADDRESS >> 16, (ERASE_ADDRESS >> 8) & 0xFF, ERASE_ADDRESS & 0xFF };
+	unsigned frames = 0;
+	int length;
+	Receive(erase, sizeof(erase));
+	StartMeasurement();
+	ProcessMessage(0);
+	while (((length = HostTransmitted(reply, sizeof(reply))) == 11) && (reply[4] == 0x0E))
+	{
+		frames++;
+		unsigned polls = (reply[6] << 24) | (reply[7] << 16) | (reply[8] << 8) | reply[9];
+		if ((reply[5] != 0x05) || (polls != frames * 2 * ProgressIntervalUnit))
+		{
+			Fail("progress frame, %u polls", polls);
+		}
+	}
+
+	printf("  %-22s %6u frames %10u cycles\n", "Erase (with progress)", frames, hostCounters.busCycles);
+
+	if ((frames == 0) || (length != 7) || (reply[4] != 0x05) || (reply[5] != 0))
+	{
+		Fail("erase with progress frames, %u frames", frames);
+	}
+
+	unsigned char off[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x0D, 0x00, 0x00 };
+	if ((Exchange(off, sizeof(off)) != 7) || (reply[4] != 0x0D))
+	{
+		Fail("progress frames off, reply %02X", reply[3]);
+	}
+
+	Receive(erase, sizeof(erase));
+	ProcessMessage(0);
+	if ((HostTransmitted(reply, sizeof(reply)) != 7) || (reply[4] != 0x05) || (HostTransmitted(reply, sizeof(reply)) >= 0))
+	{
+		Fail("erase without progress frames, reply %02X", reply[4]);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Erase a block and write to it, and report how well the watchdog was kept
+// happy. With WATCHDOG_INTERRUPT, that's all down to the periodic interrupt.
+///////////////////////////////////////////////////////////////////////////////
+static void Watchdog(const unsigned char *data)
+{
+	unsigned char erase[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x05, ERASE_ADDRESS >> 16, (ERASE_ADDRESS >> 8) & 0xFF, ERASE_ADDRESS & 0xFF };
+
+	StartMeasurement();
+	if ((Exchange(erase, sizeof(erase)) != 7) || (reply[5] != 0))
+	{
+		Fail("erase for watchdog check, reply %02X", reply[3]);
+	}
+
+	int length = BuildMode36(0x0D, ERASE_ADDRESS, data, BLOCK_SIZE);
+	if ((Exchange(request, length) < 5) || (reply[3] != 0x76))
+	{
+		Fail("write for watchdog check, reply %02X", reply[3]);
+	}
+
+	HostFlush();
+	printf(
+		"  %-22s %6u writes  %6u interrupts  longest gap %u cycles\n",
+		"Watchdog",
+		hostCounters.watchdogWrites,
+		hostCounters.periodicInterrupts,
+		hostCounters.longestWatchdogGap);
+
+#if defined WATCHDOG_TIMER
+	if (hostCounters.periodicInterrupts == 0)
+	{
+		Fail("watchdog interrupt, %u interrupts", 0);
+	}
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Get the CRCs of several ranges with one batch query.
+///////////////////////////////////////////////////////////////////////////////
+static void CrcBatch(const unsigned *ranges, int count)
+{
+	request[0] = 0x6C;
+	request[1] = 0x10;
+	request[2] = 0xF0;
+	request[3] = 0x3D;
+	request[4] = 0x07;
+	request[5] = count;
+
+	unsigned total = 0;
+	for (int index = 0; index < count; index++)
+	{
+		unsigned address = ranges[index * 2];
+		unsigned length = ranges[(index * 2) + 1];
+		unsigned char *entry = &request[6 + (index * 6)];
+		entry[0] = length >> 16;
+		entry[1] = length >> 8;
+		entry[2] = length;
+		entry[3] = address >> 16;
+		entry[4] = address >> 8;
+		entry[5] = address;
+		total += length;
+	}
+
+	Receive(request, 6 + (count * 6));
+	StartMeasurement();
+	ProcessMessage(0);
+	double nanoseconds = Elapsed();
+	unsigned cycles = hostCounters.busCycles;
+	int length = HostTransmitted(reply, sizeof(reply));
+
+	printf(
+		"  %-22s %6u bytes  %8.2f cycles/byte  %6d ranges                       %8.2f ns/byte\n",
+		"CRC (batch)",
+		total,
+		(double)cycles / total,
+		count,
+		nanoseconds / total);
+
+	if ((length != 6 + (count * 10)) || (reply[3] != 0x7D) || (reply[4] != 0x07) || (reply[5] != count))
+	{
+		Fail("CRC batch, reply length %d", length);
+		return;
+	}
+
+	for (int index = 0; index < count; index++)
+	{
+		unsigned address = ranges[index * 2];
+		unsigned length = ranges[(index * 2) + 1];
+		unsigned char *entry = &reply[6 + (index * 10)];
+		unsigned crc = (entry[6] << 24) | (entry[7] << 16) | (entry[8] << 8) | entry[9];
+		if ((((entry[0] << 16) | (entry[1] << 8) | entry[2]) != length) ||
+			(((entry[3] << 16) | (entry[4] << 8) | entry[5]) != address) ||
+			(crc != ReferenceCrc(&HostFlash()[address], length)))
+		{
+			Fail("CRC batch, range %d", index);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Erase the streaming area, then send it several blocks the way the app does,
+// waiting for each reply before sending the next block.
+///////////////////////////////////////////////////////////////////////////////
+static void StreamBlocks(unsigned char command, const unsigned char *data, const char *name)
+{
+	unsigned char erase[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x05, STREAM_ADDRESS >> 16, (STREAM_ADDRESS >> 8) & 0xFF, STREAM_ADDRESS & 0xFF };
+	if ((Exchange(erase, sizeof(erase)) != 7) || (reply[5] != 0))
+	{
+		Fail("erase before streaming, status %02X", reply[5]);
+		return;
+	}
+
+	unsigned ticksPerByte = hostTicksPerByte;
+	if (hostTicksPerByte == 0)
+	{
+		hostTicksPerByte = STREAM_TICKS_PER_BYTE;
+	}
+
+	StartMeasurement();
+	for (int block = 0; block < STREAM_BLOCKS; block++)
+	{
+		int length = BuildMode36(command, STREAM_ADDRESS + (block * BLOCK_SIZE), &data[block * BLOCK_SIZE], BLOCK_SIZE);
+		if ((Exchange(request, length) < 5) || (reply[3] != 0x76))
+		{
+			Fail("streaming write, block %d", block);
+		}
+	}
+
+	// The next message that isn't a write would make the kernel finish up.
+	FinishPipelinedWrite();
+	Report(name, STREAM_BLOCKS * BLOCK_SIZE);
+	hostTicksPerByte = ticksPerByte;
+
+	if (hostCounters.receiveOverruns != 0)
+	{
+		Fail("streaming write, %u bytes lost from the receive FIFO", hostCounters.receiveOverruns);
+	}
+
+	// Pipelined slices shouldn't each pay for entering unlock-bypass mode.
+	if ((command & PipelinedWrite) && (hostCounters.amdBypassEntries > 1))
+	{
+		Fail("pipelined write entered unlock-bypass mode %u times", hostCounters.amdBypassEntries);
+	}
+
+	if (memcmp(&HostFlash()[STREAM_ADDRESS], data, STREAM_BLOCKS * BLOCK_SIZE))
+	{
+		Fail("streaming write, flash contents differ at %06X", STREAM_ADDRESS);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// When a pipelined block fails, the error is reported by the last block of
+// the range, which the tool sends without the pipeline flag. The range has
+// been programmed by StreamBlocks already, so sending it again is harmless.
+///////////////////////////////////////////////////////////////////////////////
+static void PipelineError(const unsigned char *data)
+{
+	static unsigned char changed[BLOCK_SIZE];
+	memcpy(changed, data, BLOCK_SIZE);
+	changed[0] = ~changed[0];
+
+	hostFailPrograms = 1;
+	int length = BuildMode36(PipelinedWrite | 0x0D, STREAM_ADDRESS, changed, BLOCK_SIZE);
+	if ((Exchange(request, length) < 5) || (reply[3] != 0x76))
+	{
+		Fail("pipelined write before a failure, reply %02X", reply[3]);
+	}
+
+	length = BuildMode36(0x0D, STREAM_ADDRESS + BLOCK_SIZE, &data[BLOCK_SIZE], BLOCK_SIZE);
+	if ((Exchange(request, length) != 7) || (reply[3] != 0x7F) || (reply[5] != 0xBF))
+	{
+		Fail("last block after a pipeline failure, reply %02X", reply[3]);
+	}
+
+	// Once reported, the error is gone.
+	if ((Exchange(request, length) < 5) || (reply[3] != 0x76))
+	{
+		Fail("last block sent again, reply %02X", reply[3]);
+	}
+
+	hostFailPrograms = 0;
+	FinishPipelinedWrite();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Exercise one flash chip.
+///////////////////////////////////////////////////////////////////////////////
+static void RunChip(unsigned flashId, const char *name)
+{
+	static unsigned char pattern[2 * BLOCK_SIZE];
+	static unsigned char stream[STREAM_BLOCKS * BLOCK_SIZE];
+	unsigned char *flash = HostFlash();
+
+	printf("%s\n", name);
+	HostReset(flashId);
+	InitializeSleep();
+	ResetReceive();
+	StartWatchdogTimer();
+	ClearKernelStatistics();
+	ClearBackgroundJobs();
+	SetProgressInterval(0);
+	ResetPipelinedWrite();
+#if KERNEL_FEATURES & FeatureStreamingRead
+	StopReadStream();
+#endif
+	crcInit();
+
+	// 20.97 MHz from the simulated SYNCR, at 8 clocks per delay loop.
+	if (sleepIterationsPerMillisecond != 2621)
+	{
+		Fail("sleep calibration, %u iterations/ms", sleepIterationsPerMillisecond);
+	}
+
+	for (unsigned index = 0; index < sizeof(pattern); index++)
+	{
+		pattern[index] = (unsigned char)((index * 7) ^ (index >> 5));
+	}
+
+	for (unsigned index = 0; index < sizeof(stream); index++)
+	{
+		stream[index] = (unsigned char)((index * 13) ^ (index >> 7));
+	}
+
+	// Flash chip query.
+	unsigned char idQuery[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x01 };
+	if ((Exchange(idQuery, sizeof(idQuery)) != 9) ||
+		(reply[3] != 0x7D) ||
+		((unsigned)((reply[5] << 24) | (reply[6] << 16) | (reply[7] << 8) | reply[8]) != flashId))
+	{
+		Fail("flash ID query, expected %08X", flashId);
+		return;
+	}
+
+	// The optional features this kernel was built with.
+	unsigned char featureQuery[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x0F };
+	if ((Exchange(featureQuery, sizeof(featureQuery)) != 7) ||
+		(reply[3] != 0x7D) ||
+		(((reply[5] << 8) | reply[6]) != KERNEL_FEATURES))
+	{
+		Fail("feature query, features %04X", (reply[5] << 8) | reply[6]);
+	}
+
+	// Erase a block that isn't blank.
+	memset(&flash[TEST_ADDRESS], 0, 2 * BLOCK_SIZE);
+	unsigned char erase[] = { 0x6C, 0x10, 0xF0, 0x3D, 0x05, TEST_ADDRESS >> 16, (TEST_ADDRESS >> 8) & 0xFF, TEST_ADDRESS & 0xFF };
+	if ((Exchange(erase, sizeof(erase)) != 7) || (reply[3] != 0x7D) || (reply[5] != 0))
+	{
+		Fail("erase, status %02X", reply[5]);
+	}
+
+	for (unsigned index = 0; index < 2 * BLOCK_SIZE; index++)
+	{
+		if (flash[TEST_ADDRESS + index] != 0xFF)
+		{
+			Fail("erase left data at %06X", TEST_ADDRESS + index);
+			break;
+		}
+	}
+
+	// Program a block directly.
+	memcpy(&MessageBuffer[10], pattern, BLOCK_SIZE);
+	StartMeasurement();
+	unsigned char result = WriteToFlash(BLOCK_SIZE, TEST_ADDRESS, &MessageBuffer[10], 0, 0);
+	Report("WriteToFlash", BLOCK_SIZE);
+	if ((result != 0) || memcmp(&flash[TEST_ADDRESS], pattern, BLOCK_SIZE))
+	{
+		Fail("WriteToFlash, result %02X", result);
+	}
+
+	// Receive a mode-36 write, then program it.
+	int length = BuildMode36(0x00, TEST_ADDRESS + BLOCK_SIZE, &pattern[BLOCK_SIZE], BLOCK_SIZE);
+	HostReceive(request, length);
+	unsigned char completionCode = 0xFF;
+	unsigned char readState = 0xFF;
+	StartMeasurement();
+	int received = ReadMessage(&completionCode, &readState);
+	Report("ReadMessage", length);
+	if ((received != length) || (readState != 1) || memcmp(MessageBuffer, request, length))
+	{
+		Fail("ReadMessage, readState %02X", readState);
+	}
+
+	ProcessMessage(0);
+	if ((HostTransmitted(reply, sizeof(reply)) != 5) || (reply[3] != 0x76))
+	{
+		Fail("mode 36 write, reply %02X", reply[3]);
+	}
+
+	if (memcmp(&flash[TEST_ADDRESS + BLOCK_SIZE], &pattern[BLOCK_SIZE], BLOCK_SIZE))
+	{
+		Fail("mode 36 write, flash contents differ at %06X", TEST_ADDRESS + BLOCK_SIZE);
+	}
+
+	// The block sum comes from the receive engine. A damaged payload must
+	// still be caught, and a frame with a stray byte on the end must still
+	// be summed correctly.
+	length = BuildMode36(0x44, TEST_ADDRESS, pattern, BLOCK_SIZE);
+	unsigned short expectedSum = (request[length - 2] << 8) | request[length - 1];
+	request[10 + 100] ^= 0x01;
+	if ((Exchange(request, length) != 11) ||
+		(reply[3] != 0x7F) ||
+		(((reply[5] << 8) | reply[6]) != (unsigned short)(expectedSum + ((pattern[100] ^ 0x01) - pattern[100]))))
+	{
+		Fail("damaged mode 36 write, reply %02X", reply[3]);
+	}
+
+	length = BuildMode36(0x44, TEST_ADDRESS, pattern, BLOCK_SIZE);
+	request[length++] = 0x55;
+	if ((Exchange(request, length) != 5) || (reply[3] != 0x76))
+	{
+		Fail("padded mode 36 write, reply %02X", reply[3]);
+	}
+
+	RamUpload(pattern);
+#if KERNEL_FEATURES & FeaturePatchWrite
+	PatchList();
+#endif
+	memcpy(pattern, &flash[TEST_ADDRESS], BLOCK_SIZE);
+#if KERNEL_FEATURES & FeatureSectorRewrite
+	SectorRewriteBlock(stream);
+#else
+	// Older kernels wrote a rewrite's patch list to flash as it was.
+	RewriteRefused(BuildSectorRewrite(TEST_ADDRESS, 0x20000, 0, 0, stream, 16), 0xB8, "sector rewrite without the feature, code %02X");
+#endif
+
+	// Rewrite the first block with a few bits cleared, as a differential write.
+	unsigned changed = 0;
+	for (unsigned index = 0; index < BLOCK_SIZE; index += 2)
+	{
+		if ((index % 40) == 0)
+		{
+			pattern[index] &= 0x5A;
+			pattern[index + 1] &= 0xA5;
+			changed++;
+		}
+	}
+
+	length = BuildMode36(0x0D, TEST_ADDRESS, pattern, BLOCK_SIZE);
+	Receive(request, length);
+	StartMeasurement();
+	ProcessMessage(0);
+	Report("Differential write", BLOCK_SIZE);
+	if ((HostTransmitted(reply, sizeof(reply)) != 7) ||
+		(reply[3] != 0x76) ||
+		(reply[4] != 0x0D) ||
+		(((reply[5] << 8) | reply[6]) > changed))
+	{
+		Fail("differential write, programmed %u words", (reply[5] << 8) | reply[6]);
+	}
+
+	if (memcmp(&flash[TEST_ADDRESS], pattern, BLOCK_SIZE))
+	{
+		Fail("differential write, flash contents differ at %06X", TEST_ADDRESS);
+	}
+
+	// Several blocks, one at a time and then pipelined.
+	StreamBlocks(0x0D, stream, "Mode 36 stream");
+#if KERNEL_FEATURES & FeaturePipelinedWrite
+	StreamBlocks(PipelinedWrite | 0x0D, stream, "Mode 36 stream (pipe)");
+	if ((flashId >> 16) == 0x0089)
+	{
+		PipelineError(stream);
+	}
+#endif
+
+	// Read a block with mode 35.
+	unsigned char read[] = { 0x6C, 0x10, 0xF0, 0x35, 0x01, BLOCK_SIZE >> 8, BLOCK_SIZE & 0xFF, TEST_ADDRESS >> 16, (TEST_ADDRESS >> 8) & 0xFF, TEST_ADDRESS & 0xFF };
+	Receive(read, sizeof(read));
+	StartMeasurement();
+	ProcessMessage(0);
+	Report("WriteMessage (mode 35)", BLOCK_SIZE + 12);
+	length = HostTransmitted(reply, sizeof(reply));
+	unsigned short sum = 0;
+	for (int index = 4; index < BLOCK_SIZE + 10; index++)
+	{
+		sum += reply[index];
+	}
+
+	if ((length != BLOCK_SIZE + 12) ||
+		memcmp(&reply[10], pattern, BLOCK_SIZE) ||
+		(((reply[BLOCK_SIZE + 10] << 8) | reply[BLOCK_SIZE + 11]) != sum))
+	{
+		Fail("mode 35 read, reply length %d", length);
+	}
+
+	if (hostCounters.transmitOverruns)
+	{
+		Fail("mode 35 read, %u transmit overruns", hostCounters.transmitOverruns);
+	}
+
+	// And a range that doesn't start or end on a long boundary.
+	unsigned char unaligned[] = { 0x6C, 0x10, 0xF0, 0x35, 0x01, 0x01, 0x03, TEST_ADDRESS >> 16, (TEST_ADDRESS >> 8) & 0xFF, (TEST_ADDRESS & 0xFF) + 1 };
+	Receive(unaligned, sizeof(unaligned));
+	ProcessMessage(0);
+	length = HostTransmitted(reply, sizeof(reply));
+	sum = 0;
+	for (int index = 4; index < 0x103 + 10; index++)
+	{
+		sum += reply[index];
+	}
+
+	if ((length != 0x103 + 12) ||
+		memcmp(&reply[10], &pattern[1], 0x103) ||
+		(((reply[0x103 + 10] << 8) | reply[0x103 + 11]) != sum))
+	{
+		Fail("unaligned mode 35 read, reply length %d", length);
+	}
+
+#if KERNEL_FEATURES & FeatureStreamingRead
+	StreamRead(TEST_ADDRESS);
+#endif
+
+#if KERNEL_FEATURES & FeatureCompressedRead
+	// Compressed reads of blank flash, of a mix of blank space, code and
+	// padding words, and of data that doesn't compress.
+	CompressedRead(COMPRESS_ADDRESS, BLOCK_SIZE, 0x02, "Mode 35 RLE (blank)");
+
+	memcpy(&flash[COMPRESS_ADDRESS + 1001], pattern, 999);
+	for (int index = 2000; index < 3000; index += 2)
+	{
+		flash[COMPRESS_ADDRESS + index] = 0x4E;
+		flash[COMPRESS_ADDRESS + index + 1] = 0x71;
+	}
+	flash[COMPRESS_ADDRESS + 3500] = 0x00;
+	flash[COMPRESS_ADDRESS + 3501] = 0x00;
+	flash[COMPRESS_ADDRESS + BLOCK_SIZE - 1] = 0x12;
+	CompressedRead(COMPRESS_ADDRESS, BLOCK_SIZE, 0x02, "Mode 35 RLE (mixed)");
+	CompressedRead(COMPRESS_ADDRESS + 1003, 5, 0x01, "Mode 35 RLE (short)");
+	CompressedRead(TEST_ADDRESS, BLOCK_SIZE, 0x01, "Mode 35 RLE (random)");
+#endif
+
+#if (KERNEL_FEATURES & FeatureCompressedRead) && (KERNEL_FEATURES & FeatureCompressedWrite)
+	// Copy the mixed block to blank flash with compressed writes.
+	CompressedWrite(RunLengthWrite | 0x0D, COMPRESS_ADDRESS, COMPRESS_ADDRESS + BLOCK_SIZE, "Mode 36 RLE");
+	CompressedWrite(RunLengthWrite | PipelinedWrite | 0x0D, COMPRESS_ADDRESS, COMPRESS_ADDRESS + (2 * BLOCK_SIZE), "Mode 36 RLE (pipe)");
+#endif
+
+	// CRC of the whole erase block, computed only while handling queries.
+	Crc(0x20000, TEST_ADDRESS, "CRC", 0);
+
+	// And a range that doesn't start or end on a long boundary.
+	Crc(0x1001, TEST_ADDRESS + 3, "CRC (unaligned)", 0);
+
+	// The same block, but giving the kernel idle time between queries.
+	Crc(0x20000, TEST_ADDRESS + 0x20000, "CRC (background)", 1);
+
+#if KERNEL_FEATURES & FeatureCrcBatch
+	// Every block of a 512 KB layout, plus a couple of odd ranges, in one query.
+	static const unsigned ranges[] =
+	{
+		0x00000, 0x04000,
+		0x04000, 0x02000,
+		0x06000, 0x02000,
+		0x08000, 0x18000,
+		0x20000, 0x20000,
+		0x40000, 0x20000,
+		0x60000, 0x20000,
+		TEST_ADDRESS + 1, 0x1003,
+		TEST_ADDRESS, 0,
+	};
+	CrcBatch(ranges, sizeof(ranges) / sizeof(ranges[0]) / 2);
+#endif
+
+#if KERNEL_FEATURES & FeatureBlankScan
+	BlankScan();
+#endif
+#if KERNEL_FEATURES & FeatureBackgroundErase
+	BackgroundErase(stream);
+	EraseTimeout();
+#endif
+#if KERNEL_FEATURES & FeatureBatchErase
+	BatchErase();
+#endif
+#if KERNEL_FEATURES & FeatureFullErase
+	ChipErase();
+#endif
+#if KERNEL_FEATURES & FeatureProgressFrames
+	ProgressFrames();
+#endif
+	Watchdog(stream);
+
+	if (hostInterruptTransmitCommands != 0)
+	{
+		Fail("transmit command written by the interrupt %u times", hostInterruptTransmitCommands);
+	}
+
+#if KERNEL_FEATURES & FeatureStatistics
+	Statistics();
+#endif
+	StopWatchdogTimer();
+}
+
+int main(int argc, char **argv)
+{
+	if ((argc == 3) && !strcmp(argv[1], "-w"))
+	{
+		hostTicksPerByte = atoi(argv[2]);
+	}
+	else if (argc != 1)
+	{
+		printf("Usage: %s [-w ticks-per-wire-byte]\n", argv[0]);
+		return 2;
+	}
+
+	RunChip(FLASH_ID_INTEL_28F400B, "Intel 28F400B");
+	RunChip(FLASH_ID_AMD_AM29BL802C, "AMD AM29BL802C");
+
+	printf(failures ? "%d failures.\n" : "All checks passed.\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,1011 @@
+///////////////////////////////////////////////////////////////////////////////
+// Simulated PCM for host builds of the kernel: the J1850 DLC FIFOs, the SIM
+// chip-select registers, the watchdogs, RAM, and Intel and AMD flash chips.
+//
+// Time is measured in bus cycles. Every register access and every flash
+// command or status cycle is one bus cycle, and the wire and the flash chips
+// are modeled in those units. Plain memory reads and writes (through
+// PCM_POINTER) are free, so CPU-bound code like the CRC is better compared
+// using the host time that host-benchmark.c also reports. That is only an
+// approximation of a 68332, but it is deterministic, and it is the bus
+// traffic in the hot loops that we are trying to reduce.
+///////////////////////////////////////////////////////////////////////////////
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host.h"
+
+HostCounters hostCounters;
+unsigned hostTicksPerByte = 0;
+unsigned hostFailPrograms = 0;
+unsigned hostStuckErases = 0;
+unsigned hostInterruptTransmitCommands = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Flash chip descriptions. Block tables match Apps/PcmLibrary/Misc/FlashChip.cs.
+///////////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+	unsigned id;
+	int amd;
+	unsigned size;
+	unsigned blocks[20];
+} ChipInfo;
+
+static const ChipInfo chips[] =
+{
+	{ 0x00894471, 0, 0x080000, { 0x00000, 0x04000, 0x06000, 0x08000, 0x20000, 0x40000, 0x60000, 0 } },
+	{ 0x0089889D, 0, 0x100000, { 0x00000, 0x04000, 0x06000, 0x08000, 0x20000, 0x40000, 0x60000, 0x80000, 0xA0000, 0xC0000, 0xE0000, 0 } },
+	{ 0x00012281, 1, 0x100000, { 0x00000, 0x04000, 0x06000, 0x08000, 0x20000, 0x40000, 0x60000, 0x80000, 0xC0000, 0 } },
+	{ 0x00012258, 1, 0x100000, { 0x00000, 0x04000, 0x06000, 0x08000, 0x10000, 0x20000, 0x30000, 0x40000, 0x50000, 0x60000, 0x70000, 0x80000, 0x90000, 0xA0000, 0xB0000, 0xC0000, 0xD0000, 0xE0000, 0xF0000, 0 } },
+	{ 0x00012203, 1, 0x200000, { 0x00000, 0x04000, 0x06000, 0x08000, 0x40000, 0x80000, 0xC0000, 0x100000, 0x140000, 0x180000, 0x1C0000, 0 } },
+};
+
+// Rough chip timings, in bus cycles.
+#define PROGRAM_TICKS 20
+#define ERASE_TICKS 5000
+
+// Bus cycles per count of the periodic interrupt timer, which counts four
+// cycles of the 32.768 kHz crystal. That's about 2560 CPU clocks on a P01, so
+// this is only a rough guess at the number of bus cycles.
+#define PIT_TICKS 500
+
+// How long an AMD chip waits for more sector addresses after a sector erase
+// command. The data sheets give 50 microseconds.
+#define AMD_ERASE_WINDOW_TICKS 50
+
+// The DLC transmit FIFO is close to this size, per the data sheet.
+#define TRANSMIT_FIFO_SIZE 12
+#define TRANSMIT_FIFO_ALMOST_FULL 8
+
+// The receive FIFO holds this many data bytes.
+#define RECEIVE_FIFO_SIZE 12
+
+// Clock synthesizer setting for W=1, X=0, Y=39: 32768 * 640 = 20.97 MHz, like a P01.
+#define HOST_SYNCR 0xA708
+
+#define RAM_BASE 0xFF8000
+#define RAM_SIZE 0x8000
+
+#define MAX_FRAME 4200
+#define MAX_FRAMES 16
+
+///////////////////////////////////////////////////////////////////////////////
+// Simulator state.
+///////////////////////////////////////////////////////////////////////////////
+static const ChipInfo *chip;
+static unsigned char flash[0x200000];
+static unsigned char ram[RAM_SIZE];
+
+typedef enum
+{
+	ReadArray,
+	ReadStatus,
+	ReadId,
+	ProgramSetup,
+	EraseSetup,
+} FlashMode;
+
+static FlashMode flashMode;
+static unsigned flashBusyUntil;
+static unsigned short flashStatus;
+static unsigned short flashProgramValue;
+static int flashErasing;
+static int amdUnlockStep;
+static int amdErasePrefix;
+static unsigned amdEraseWindowUntil;
+
+static HostInterruptHandler pcmVectors[256];
+static HostInterruptHandler *vectorBase;
+static unsigned nextPeriodicInterrupt;
+static int inInterrupt;
+static unsigned lastWatchdogWrite;
+static int amdBypass;
+static int amdBypassReset;
+static unsigned short amdToggle;
+
+typedef struct
+{
+	unsigned address;
+	unsigned value;
+} Register;
+
+static Register registers[16];
+static int registerCount;
+
+static unsigned char transmitCommand;
+static unsigned transmitFifoCount;
+static unsigned transmitLastDrain;
+static unsigned char transmitFrame[MAX_FRAME];
+static int transmitLength;
+static unsigned char transmitted[MAX_FRAMES][MAX_FRAME];
+static int transmittedLength[MAX_FRAMES];
+static int transmittedCount;
+
+// Receive FIFO entries. Bit 8 marks a completion code. Entries before
+// receiveArrived have come off the wire; the rest arrive at the bus cycle
+// in receiveArrival.
+static unsigned short receiveQueue[MAX_FRAMES * MAX_FRAME];
+static unsigned receiveArrival[MAX_FRAMES * MAX_FRAME];
+static int receiveHead;
+static int receiveArrived;
+static int receiveTail;
+
+static struct
+{
+	int size;
+	unsigned address;
+} pending;
+
+static unsigned char pending8;
+static unsigned short pending16;
+static unsigned char cells8[8];
+static unsigned short cells16[8];
+static unsigned cells32[8];
+static int nextCell;
+
+///////////////////////////////////////////////////////////////////////////////
+// Register file for everything that just needs to remember its value.
+///////////////////////////////////////////////////////////////////////////////
+static Register *FindRegister(unsigned address)
+{
+	for (int index = 0; index < registerCount; index++)
+	{
+		if (registers[index].address == address)
+		{
+			return &registers[index];
+		}
+	}
+
+	if (registerCount == sizeof(registers) / sizeof(registers[0]))
+	{
+		fprintf(stderr, "Too many registers, adding %08X.\n", address);
+		exit(2);
+	}
+
+	registers[registerCount].address = address;
+	registers[registerCount].value = 0;
+	return &registers[registerCount++];
+}
+
+static unsigned GetRegister(unsigned address)
+{
+	return FindRegister(address)->value;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Advance time by one bus cycle, and let the wire drain the transmit FIFO and
+// fill the receive FIFO.
+///////////////////////////////////////////////////////////////////////////////
+static void PeriodicInterrupt(void);
+
+static void Tick(void)
+{
+	hostCounters.busCycles++;
+	PeriodicInterrupt();
+
+	// Bytes that the kernel hasn't read by the time the FIFO is full are lost.
+	while ((receiveArrived < receiveTail) && (receiveArrival[receiveArrived] <= hostCounters.busCycles))
+	{
+		receiveArrived++;
+		if ((hostTicksPerByte != 0) && (receiveArrived - receiveHead > RECEIVE_FIFO_SIZE))
+		{
+			hostCounters.receiveOverruns++;
+		}
+	}
+
+	if (hostTicksPerByte == 0)
+	{
+		transmitFifoCount = 0;
+		transmitLastDrain = hostCounters.busCycles;
+		return;
+	}
+
+	while ((transmitFifoCount > 0) && (hostCounters.busCycles - transmitLastDrain >= hostTicksPerByte))
+	{
+		transmitFifoCount--;
+		transmitLastDrain += hostTicksPerByte;
+	}
+
+	if (transmitFifoCount == 0)
+	{
+		transmitLastDrain = hostCounters.busCycles;
+	}
+}
+
+static int FlashBusy(void)
+{
+	return (hostStuckErases && flashErasing) || (hostCounters.busCycles < flashBusyUntil);
+}
+
+static int IsFlash(unsigned address)
+{
+	return (chip != 0) && (address < chip->size);
+}
+
+static unsigned short *FlashWord(unsigned address)
+{
+	return (unsigned short*)&flash[address & ~1];
+}
+
+static int WritesEnabled(void)
+{
+	return GetRegister(0x00FFFA4E) == 0x7060;
+}
+
+static void EraseBlock(unsigned address)
+{
+	unsigned start = 0;
+	unsigned end = chip->size;
+	for (int index = 0; index == 0 || chip->blocks[index] != 0; index++)
+	{
+		if (chip->blocks[index] <= address)
+		{
+			start = chip->blocks[index];
+		}
+		else
+		{
+			end = chip->blocks[index];
+			break;
+		}
+	}
+
+	memset(&flash[start], 0xFF, end - start);
+	flashErasing = 1;
+	flashBusyUntil = hostCounters.busCycles + ERASE_TICKS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Intel 28F400B / 28F800B command state machine.
+///////////////////////////////////////////////////////////////////////////////
+static void IntelWrite(unsigned address, unsigned short value)
+{
+	int vpp = GetRegister(0xFFFFE2FA) & 1;
+	unsigned char command = value & 0xFF;
+
+	if (flashMode == ProgramSetup)
+	{
+		flashMode = ReadStatus;
+		if (!vpp)
+		{
+			flashStatus |= 0x18;
+			return;
+		}
+
+		if (hostFailPrograms != 0)
+		{
+			hostFailPrograms--;
+			flashStatus |= 0x10;
+			return;
+		}
+
+		*FlashWord(address) &= value;
+		flashErasing = 0;
+		flashBusyUntil = hostCounters.busCycles + PROGRAM_TICKS;
+		return;
+	}
+
+	if (flashMode == EraseSetup)
+	{
+		flashMode = ReadStatus;
+		if (command != 0xD0)
+		{
+			flashStatus |= 0x30;
+		}
+		else if (!vpp)
+		{
+			flashStatus |= 0x28;
+		}
+		else
+		{
+			EraseBlock(address);
+		}
+		return;
+	}
+
+	// Only the read-status command is accepted while the chip is busy.
+	if (FlashBusy() && (command != 0x70))
+	{
+		hostCounters.flashIgnoredWrites++;
+		return;
+	}
+
+	switch (command)
+	{
+	case 0xFF:
+		flashMode = ReadArray;
+		break;
+
+	case 0x70:
+		flashMode = ReadStatus;
+		break;
+
+	case 0x50:
+		flashStatus = 0;
+		break;
+
+	case 0x90:
+		flashMode = ReadId;
+		break;
+
+	case 0x40:
+	case 0x10:
+		flashMode = ProgramSetup;
+		break;
+
+	case 0x20:
+		flashMode = EraseSetup;
+		break;
+
+	default:
+		hostCounters.flashIgnoredWrites++;
+		break;
+	}
+}
+
+static unsigned short IntelRead(unsigned address)
+{
+	switch (flashMode)
+	{
+	case ReadStatus:
+		return FlashBusy() ? flashStatus : (flashStatus | 0x80);
+
+	case ReadId:
+		if ((address & ~1) == 0)
+		{
+			return chip->id >> 16;
+		}
+		return (address & ~1) == 2 ? (chip->id & 0xFFFF) : 0;
+
+	default:
+		return *FlashWord(address);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AMD AM29BL802C / AM29F800BB / AM29BL162C command state machine.
+///////////////////////////////////////////////////////////////////////////////
+static void AmdWrite(unsigned address, unsigned short value)
+{
+	unsigned char command = value & 0xFF;
+	address &= ~1;
+
+	// More sectors can join an erase until the window closes, and each one
+	// restarts the window.
+	if (flashErasing && (command == 0x30) && (hostCounters.busCycles < amdEraseWindowUntil))
+	{
+		EraseBlock(address);
+		amdEraseWindowUntil = hostCounters.busCycles + AMD_ERASE_WINDOW_TICKS;
+		return;
+	}
+
+	if (FlashBusy())
+	{
+		hostCounters.flashIgnoredWrites++;
+		return;
+	}
+
+	if (flashMode == ProgramSetup)
+	{
+		flashMode = ReadArray;
+		flashProgramValue = value;
+		*FlashWord(address) &= value;
+		flashErasing = 0;
+		flashBusyUntil = hostCounters.busCycles + PROGRAM_TICKS;
+		return;
+	}
+
+	// In unlock-bypass mode, programming needs only A0 and the data, and the
+	// mode ends with 90 then 00. Nothing else is accepted.
+	if (amdBypass)
+	{
+		if (amdBypassReset)
+		{
+			amdBypassReset = 0;
+			if (command == 0x00)
+			{
+				amdBypass = 0;
+				return;
+			}
+		}
+		else if (command == 0xA0)
+		{
+			flashMode = ProgramSetup;
+			return;
+		}
+		else if (command == 0x90)
+		{
+			amdBypassReset = 1;
+			return;
+		}
+
+		hostCounters.flashIgnoredWrites++;
+		return;
+	}
+
+	if (command == 0xF0)
+	{
+		flashMode = ReadArray;
+		amdUnlockStep = 0;
+		amdErasePrefix = 0;
+		return;
+	}
+
+	if ((amdUnlockStep == 0) && (address == 0xAAA) && (command == 0xAA))
+	{
+		amdUnlockStep = 1;
+		return;
+	}
+
+	if ((amdUnlockStep == 1) && (address == 0x554) && (command == 0x55))
+	{
+		amdUnlockStep = 2;
+		return;
+	}
+
+	if (amdUnlockStep != 2)
+	{
+		amdUnlockStep = 0;
+		hostCounters.flashIgnoredWrites++;
+		return;
+	}
+
+	amdUnlockStep = 0;
+
+	if (amdErasePrefix)
+	{
+		amdErasePrefix = 0;
+		if (command == 0x30)
+		{
+			EraseBlock(address);
+			amdEraseWindowUntil = hostCounters.busCycles + AMD_ERASE_WINDOW_TICKS;
+			return;
+		}
+
+		if ((command == 0x10) && (address == 0xAAA))
+		{
+			memset(flash, 0xFF, chip->size);
+			flashErasing = 1;
+			amdEraseWindowUntil = 0;
+			flashBusyUntil = hostCounters.busCycles + ERASE_TICKS * 4;
+			return;
+		}
+	}
+	else if (address == 0xAAA)
+	{
+		switch (command)
+		{
+		case 0xA0:
+			flashMode = ProgramSetup;
+			return;
+
+		case 0x90:
+			flashMode = ReadId;
+			return;
+
+		case 0x80:
+			amdErasePrefix = 1;
+			return;
+
+		case 0x20:
+			amdBypass = 1;
+			amdBypassReset = 0;
+			hostCounters.amdBypassEntries++;
+			return;
+		}
+	}
+
+	hostCounters.flashIgnoredWrites++;
+}
+
+static unsigned short AmdRead(unsigned address)
+{
+	if (FlashBusy())
+	{
+		// DQ7 is the complement of the data being programmed (zero during
+		// erase) and DQ6 toggles on every read until the operation is done.
+		// DQ3 goes high once an erase stops accepting more sectors.
+		amdToggle ^= 0x40;
+		unsigned short dq7 = flashErasing ? 0 : (~flashProgramValue & 0x80);
+		unsigned short dq3 = (flashErasing && (hostCounters.busCycles >= amdEraseWindowUntil)) ? 0x08 : 0;
+		return dq7 | amdToggle | dq3;
+	}
+
+	if (flashMode == ReadId)
+	{
+		if ((address & ~1) == 0)
+		{
+			return chip->id >> 16;
+		}
+		return (address & ~1) == 2 ? (chip->id & 0xFFFF) : 0;
+	}
+
+	return *FlashWord(address);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The J1850 DLC.
+///////////////////////////////////////////////////////////////////////////////
+static unsigned char DlcStatus(void)
+{
+	unsigned char receive = 0;
+	if (receiveHead != receiveArrived)
+	{
+		if (receiveQueue[receiveHead] & 0x100)
+		{
+			// Completion code at the head of the FIFO.
+			receive = 7;
+		}
+		else
+		{
+			int dataBytes = 0;
+			int index = receiveHead;
+			while ((index != receiveArrived) && !(receiveQueue[index] & 0x100) && (dataBytes < RECEIVE_FIFO_SIZE))
+			{
+				dataBytes++;
+				index++;
+			}
+
+			if ((index != receiveArrived) && (receiveQueue[index] & 0x100))
+			{
+				receive = 2;
+			}
+			else
+			{
+				receive = dataBytes == 1 ? 4 : 1;
+			}
+		}
+	}
+
+	unsigned char transmit;
+	if (transmitFifoCount == 0)
+	{
+		transmit = 0;
+	}
+	else if (transmitFifoCount < TRANSMIT_FIFO_ALMOST_FULL)
+	{
+		transmit = 1;
+	}
+	else if (transmitFifoCount < TRANSMIT_FIFO_SIZE)
+	{
+		transmit = 2;
+	}
+	else
+	{
+		transmit = 3;
+	}
+
+	if (transmit >= 2)
+	{
+		hostCounters.transmitStallReads++;
+	}
+
+	hostCounters.dlcStatusReads++;
+	return (receive << 5) | transmit;
+}
+
+static void DlcTransmit(unsigned char value)
+{
+	unsigned char command = transmitCommand;
+	transmitCommand = 0;
+
+	// 0x03 tells the DLC to finish (or flush) the frame; the data is ignored.
+	if (command == 0x03)
+	{
+		return;
+	}
+
+	if (command == 0x14)
+	{
+		transmitLength = 0;
+	}
+
+	if (transmitFifoCount >= TRANSMIT_FIFO_SIZE)
+	{
+		hostCounters.transmitOverruns++;
+		return;
+	}
+
+	transmitFifoCount++;
+	hostCounters.bytesTransmitted++;
+	if (transmitLength < MAX_FRAME)
+	{
+		transmitFrame[transmitLength++] = value;
+	}
+
+	if (command == 0x0C)
+	{
+		if (transmittedCount < MAX_FRAMES)
+		{
+			memcpy(transmitted[transmittedCount], transmitFrame, transmitLength);
+			transmittedLength[transmittedCount++] = transmitLength;
+		}
+		transmitLength = 0;
+	}
+}
+
+static unsigned char DlcReceive(void)
+{
+	if (receiveHead == receiveArrived)
+	{
+		return 0;
+	}
+
+	unsigned short entry = receiveQueue[receiveHead++];
+	if (receiveHead == receiveTail)
+	{
+		receiveHead = receiveArrived = receiveTail = 0;
+	}
+
+	if (!(entry & 0x100))
+	{
+		hostCounters.bytesReceived++;
+	}
+
+	return (unsigned char)entry;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The periodic interrupt timer. The handler runs between bus cycles, after
+// the kernel's last write has been passed to the simulator, and its own last
+// write is flushed before the kernel carries on.
+///////////////////////////////////////////////////////////////////////////////
+static void PeriodicInterrupt(void)
+{
+	unsigned picr = GetRegister(0x00FFFA22);
+	unsigned pitr = GetRegister(0x00FFFA24);
+	if (inInterrupt || (((picr >> 8) & 7) != 7) || ((pitr & 0xFF) == 0))
+	{
+		nextPeriodicInterrupt = 0;
+		return;
+	}
+
+	unsigned period = (pitr & 0xFF) * ((pitr & 0x100) ? 512 : 1) * PIT_TICKS;
+	if (nextPeriodicInterrupt == 0)
+	{
+		nextPeriodicInterrupt = hostCounters.busCycles + period;
+		return;
+	}
+
+	if (hostCounters.busCycles < nextPeriodicInterrupt)
+	{
+		return;
+	}
+
+	nextPeriodicInterrupt += period;
+	hostCounters.periodicInterrupts++;
+
+	HostInterruptHandler handler = vectorBase[picr & 0xFF];
+	if (handler == 0)
+	{
+		fprintf(stderr, "No handler for vector %u.\n", picr & 0xFF);
+		exit(2);
+	}
+
+	inInterrupt = 1;
+	handler();
+	HostFlush();
+	inInterrupt = 0;
+}
+
+HostInterruptHandler *HostGetVbr(void)
+{
+	return vectorBase;
+}
+
+void HostSetVbr(HostInterruptHandler *table)
+{
+	vectorBase = table;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Bus dispatch.
+///////////////////////////////////////////////////////////////////////////////
+static unsigned BusRead(unsigned address, int size)
+{
+	if (IsFlash(address))
+	{
+		hostCounters.flashReads++;
+		unsigned short word = chip->amd ? AmdRead(address) : IntelRead(address);
+		return (size == 8) ? ((address & 1) ? (word >> 8) : (word & 0xFF)) : word;
+	}
+
+	switch (address)
+	{
+	case 0x00FFF60E:
+		return DlcStatus();
+
+	case 0x00FFF60F:
+		return DlcReceive();
+
+	case 0x00FFFA04:
+		return HOST_SYNCR;
+	}
+
+	if ((address >= RAM_BASE) && (address < RAM_BASE + RAM_SIZE))
+	{
+		return (size == 8) ? ram[address - RAM_BASE] : *(unsigned short*)&ram[address - RAM_BASE];
+	}
+
+	return GetRegister(address);
+}
+
+static void BusWrite(unsigned address, unsigned value, int size)
+{
+	if (IsFlash(address))
+	{
+		if (!WritesEnabled())
+		{
+			hostCounters.flashIgnoredWrites++;
+			return;
+		}
+
+		hostCounters.flashWrites++;
+		if (chip->amd)
+		{
+			AmdWrite(address, value);
+		}
+		else
+		{
+			IntelWrite(address, value);
+		}
+		return;
+	}
+
+	switch (address)
+	{
+	case 0x00FFF60C:
+		if (inInterrupt)
+		{
+			hostInterruptTransmitCommands++;
+		}
+
+		transmitCommand = value;
+		return;
+
+	case 0x00FFF60D:
+		DlcTransmit(value);
+		return;
+
+	case 0x00FFFA27:
+	case 0x00FFD006:
+		hostCounters.watchdogWrites++;
+		if (hostCounters.busCycles - lastWatchdogWrite > hostCounters.longestWatchdogGap)
+		{
+			hostCounters.longestWatchdogGap = hostCounters.busCycles - lastWatchdogWrite;
+		}
+		lastWatchdogWrite = hostCounters.busCycles;
+		break;
+	}
+
+	FindRegister(address)->value = value;
+}
+
+void HostFlush(void)
+{
+	if (pending.size == 8)
+	{
+		pending.size = 0;
+		BusWrite(pending.address, pending8, 8);
+	}
+	else if (pending.size == 16)
+	{
+		pending.size = 0;
+		BusWrite(pending.address, pending16, 16);
+	}
+}
+
+unsigned char *HostRead8(unsigned address)
+{
+	HostFlush();
+	Tick();
+	unsigned char *cell = &cells8[nextCell++ & 7];
+	*cell = BusRead(address, 8);
+	return cell;
+}
+
+unsigned char *HostWrite8(unsigned address)
+{
+	HostFlush();
+	Tick();
+	pending.size = 8;
+	pending.address = address;
+	pending8 = 0;
+	return &pending8;
+}
+
+unsigned char *HostModify8(unsigned address)
+{
+	HostFlush();
+	Tick();
+	pending.size = 8;
+	pending.address = address;
+	pending8 = GetRegister(address);
+	return &pending8;
+}
+
+unsigned short *HostRead16(unsigned address)
+{
+	HostFlush();
+	Tick();
+	unsigned short *cell = &cells16[nextCell++ & 7];
+	*cell = BusRead(address, 16);
+	return cell;
+}
+
+unsigned short *HostWrite16(unsigned address)
+{
+	HostFlush();
+	Tick();
+	pending.size = 16;
+	pending.address = address;
+	pending16 = 0;
+	return &pending16;
+}
+
+unsigned short *HostModify16(unsigned address)
+{
+	HostFlush();
+	Tick();
+	pending.size = 16;
+	pending.address = address;
+	pending16 = GetRegister(address);
+	return &pending16;
+}
+
+unsigned *HostRead32(unsigned address)
+{
+	unsigned high = *HostRead16(address);
+	unsigned low = *HostRead16(address + 2);
+	unsigned *cell = &cells32[nextCell++ & 7];
+	*cell = (high << 16) | low;
+	return cell;
+}
+
+unsigned char *HostPointer(unsigned address)
+{
+	if (IsFlash(address))
+	{
+		return &flash[address];
+	}
+
+	if ((address >= RAM_BASE) && (address < RAM_BASE + RAM_SIZE))
+	{
+		return &ram[address - RAM_BASE];
+	}
+
+	fprintf(stderr, "Kernel accessed unmapped address %08X.\n", address);
+	exit(2);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Simulator control.
+///////////////////////////////////////////////////////////////////////////////
+int HostReset(unsigned flashId)
+{
+	chip = 0;
+	for (int index = 0; index < sizeof(chips) / sizeof(chips[0]); index++)
+	{
+		if (chips[index].id == flashId)
+		{
+			chip = &chips[index];
+		}
+	}
+
+	if (chip == 0)
+	{
+		return 0;
+	}
+
+	memset(flash, 0xFF, sizeof(flash));
+	memset(ram, 0, sizeof(ram));
+	memset(&pending, 0, sizeof(pending));
+	registerCount = 0;
+	flashMode = ReadArray;
+	flashBusyUntil = 0;
+	flashStatus = 0;
+	amdUnlockStep = 0;
+	amdErasePrefix = 0;
+	amdEraseWindowUntil = 0;
+	hostFailPrograms = 0;
+	hostStuckErases = 0;
+	hostInterruptTransmitCommands = 0;
+	amdBypass = 0;
+	amdBypassReset = 0;
+	vectorBase = pcmVectors;
+	nextPeriodicInterrupt = 0;
+	inInterrupt = 0;
+	transmitCommand = 0;
+	transmitFifoCount = 0;
+	transmitLength = 0;
+	transmittedCount = 0;
+	receiveHead = receiveArrived = receiveTail = 0;
+	HostResetCounters();
+	return 1;
+}
+
+void HostResetCounters(void)
+{
+	HostFlush();
+	unsigned now = hostCounters.busCycles;
+	memset(&hostCounters, 0, sizeof(hostCounters));
+
+	// Keep time moving forward relative to the chip and the wire.
+	flashBusyUntil = (flashBusyUntil > now) ? flashBusyUntil - now : 0;
+	amdEraseWindowUntil = (amdEraseWindowUntil > now) ? amdEraseWindowUntil - now : 0;
+	nextPeriodicInterrupt = (nextPeriodicInterrupt > now) ? nextPeriodicInterrupt - now : 0;
+	lastWatchdogWrite = 0;
+	transmitLastDrain = 0;
+	for (int index = receiveArrived; index < receiveTail; index++)
+	{
+		receiveArrival[index] = (receiveArrival[index] > now) ? receiveArrival[index] - now : 0;
+	}
+}
+
+unsigned char *HostFlash(void)
+{
+	return flash;
+}
+
+unsigned HostFlashSize(void)
+{
+	return chip ? chip->size : 0;
+}
+
+unsigned HostFlashBlocks(void)
+{
+	unsigned count = 0;
+	while (chip && ((count == 0) || (chip->blocks[count] != 0)))
+	{
+		count++;
+	}
+
+	return count;
+}
+
+void HostReceive(const unsigned char *frame, int length)
+{
+	if (receiveTail + length + 1 > sizeof(receiveQueue) / sizeof(receiveQueue[0]))
+	{
+		fprintf(stderr, "Receive queue overflow.\n");
+		exit(2);
+	}
+
+	// The frame starts after anything still on the wire, and then arrives
+	// one byte at a time. With no wire delay, it's all there immediately.
+	HostFlush();
+	unsigned arrival = hostCounters.busCycles + (transmitFifoCount * hostTicksPerByte);
+	if ((receiveTail > receiveArrived) && (receiveArrival[receiveTail - 1] > arrival))
+	{
+		arrival = receiveArrival[receiveTail - 1];
+	}
+
+	for (int index = 0; index <= length; index++)
+	{
+		arrival += hostTicksPerByte;
+		receiveArrival[receiveTail] = arrival;
+		receiveQueue[receiveTail++] = (index < length) ? frame[index] : 0x100;
+	}
+
+	if (hostTicksPerByte == 0)
+	{
+		receiveArrived = receiveTail;
+	}
+}
+
+int HostTransmitted(unsigned char *buffer, int size)
+{
+	HostFlush();
+	if (transmittedCount == 0)
+	{
+		return -1;
+	}
+
+	int length = transmittedLength[0];
+	memcpy(buffer, transmitted[0], length < size ? length : size);
+
+	transmittedCount--;
+	memmove(transmitted[0], transmitted[1], sizeof(transmitted[0]) * transmittedCount);
+	memmove(transmittedLength, transmittedLength + 1, sizeof(transmittedLength[0]) * transmittedCount);
+	return length;
+}
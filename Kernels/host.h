@@ -0,0 +1,135 @@
+///////////////////////////////////////////////////////////////////////////////
+// Host build support.
+//
+// When the kernel is compiled with -DHOST (see makefile-host) every hardware
+// register, and every flash bus cycle, is routed to the simulated PCM in
+// host.c. That lets the C kernel run as a native executable, so we can check
+// its behavior and count how much bus traffic each data path generates,
+// without a bench PCM and a scope.
+//
+// This file must not depend on the typedefs in common.h, because host.c and
+// the benchmark code include standard headers that define the same names.
+///////////////////////////////////////////////////////////////////////////////
+#ifndef HOST_H
+#define HOST_H
+
+///////////////////////////////////////////////////////////////////////////////
+// Bus cycles. Each use of a register macro calls one of these functions, and
+// counts as one bus cycle. Reads are answered immediately. Writes are handed
+// to the simulator at the start of the next bus cycle (or HostFlush), which
+// is after the kernel has stored the value into the returned cell.
+///////////////////////////////////////////////////////////////////////////////
+unsigned char *HostRead8(unsigned address);
+unsigned char *HostWrite8(unsigned address);
+unsigned char *HostModify8(unsigned address);
+unsigned short *HostRead16(unsigned address);
+unsigned short *HostWrite16(unsigned address);
+unsigned short *HostModify16(unsigned address);
+unsigned *HostRead32(unsigned address);
+void HostFlush(void);
+
+///////////////////////////////////////////////////////////////////////////////
+// Convert a PCM address into a pointer to simulated flash or RAM.
+///////////////////////////////////////////////////////////////////////////////
+unsigned char *HostPointer(unsigned address);
+
+///////////////////////////////////////////////////////////////////////////////
+// P01 registers, as used by common.h, flash.h and flash-amd.c.
+///////////////////////////////////////////////////////////////////////////////
+#define DLC_CONFIGURATION			(*HostModify8(0x00FFF600))
+#define DLC_INTERRUPTCONFIGURATION	(*HostModify8(0x00FFF606))
+#define DLC_TRANSMIT_COMMAND		(*HostWrite8(0x00FFF60C))
+#define DLC_TRANSMIT_FIFO			(*HostWrite8(0x00FFF60D))
+#define DLC_STATUS					(*HostRead8(0x00FFF60E))
+#define DLC_RECEIVE_FIFO			(*HostRead8(0x00FFF60F))
+#define WATCHDOG1					(*HostWrite8(0x00FFFA27))
+#define WATCHDOG2					(*HostModify8(0x00FFD006))
+
+#define SIM_SYNCR					(*HostRead16(0x00FFFA04))
+#define SIM_PICR					(*HostModify16(0x00FFFA22))
+#define SIM_PITR					(*HostModify16(0x00FFFA24))
+#define SIM_CSBARBT					(*HostModify16(0x00FFFA48))
+#define SIM_CSORBT					(*HostModify16(0x00FFFA4A))
+#define SIM_CSBAR0					(*HostModify16(0x00FFFA4C))
+#define SIM_CSOR0					(*HostModify16(0x00FFFA4E))
+#define HARDWARE_IO					(*HostModify16(0xFFFFE2FA))
+
+#define FLASH_BASE					(*HostWrite16(0x00000000))
+#define FLASH_IDENTIFIER			(*HostRead32(0x00000000))
+#define FLASH_MANUFACTURER			(*HostRead16(0x00000000))
+#define FLASH_DEVICE				(*HostRead16(0x00000002))
+#define COMMAND_REG_AAA				(*HostWrite16(0x00000AAA))
+#define COMMAND_REG_554				(*HostWrite16(0x00000554))
+
+#define FLASH_READ(address)			(*HostRead16((unsigned)(unsigned long)(address)))
+#define FLASH_WRITE(address, value)	(*HostWrite16((unsigned)(unsigned long)(address)) = (value))
+
+#define PCM_POINTER(address)		HostPointer((unsigned)(address))
+#define PCM_LONG(pointer)			(((unsigned)(pointer)[0] << 24) | ((pointer)[1] << 16) | ((pointer)[2] << 8) | (pointer)[3])
+
+///////////////////////////////////////////////////////////////////////////////
+// The vector base register, which the kernel would use movec for. The
+// simulated periodic interrupt timer calls the handler that the table gives
+// for the vector in PICR, if PICR selects level 7 and PITR is not zero.
+///////////////////////////////////////////////////////////////////////////////
+typedef void (*HostInterruptHandler)(void);
+HostInterruptHandler *HostGetVbr(void);
+void HostSetVbr(HostInterruptHandler *table);
+
+///////////////////////////////////////////////////////////////////////////////
+// Simulator control, used by host-benchmark.c.
+///////////////////////////////////////////////////////////////////////////////
+
+// Bus activity since the last HostReset or HostResetCounters.
+typedef struct
+{
+	unsigned busCycles;
+	unsigned watchdogWrites;
+	unsigned dlcStatusReads;
+	unsigned bytesTransmitted;
+	unsigned bytesReceived;
+	unsigned transmitStallReads;
+	unsigned transmitOverruns;
+	unsigned receiveOverruns;
+	unsigned flashReads;
+	unsigned flashWrites;
+	unsigned flashIgnoredWrites;
+	unsigned periodicInterrupts;
+	unsigned longestWatchdogGap;
+	unsigned amdBypassEntries;
+} HostCounters;
+
+extern HostCounters hostCounters;
+
+// How many bus cycles the VPW wire needs to send or receive one byte. Zero
+// means the wire is infinitely fast, so only the kernel's own work is measured.
+extern unsigned hostTicksPerByte;
+
+// The next this many word programs on an Intel chip fail with a program
+// error in the status register, and leave the word unchanged.
+extern unsigned hostFailPrograms;
+
+// While this is nonzero, an erase never finishes.
+extern unsigned hostStuckErases;
+
+// Writes to the transmit command register from the periodic interrupt since
+// the last HostReset. The interrupt could land in the middle of a message
+// being sent, so there shouldn't be any.
+extern unsigned hostInterruptTransmitCommands;
+
+// Select the flash chip to simulate and erase it. Returns 0 if the chip ID
+// is not one that the simulator knows about.
+int HostReset(unsigned flashId);
+void HostResetCounters(void);
+
+unsigned char *HostFlash(void);
+unsigned HostFlashSize(void);
+unsigned HostFlashBlocks(void);
+
+// Queue a frame from the tool, followed by a good completion code.
+void HostReceive(const unsigned char *frame, int length);
+
+// Dequeue the next frame sent by the kernel. Returns the length, or -1.
+int HostTransmitted(unsigned char *buffer, int size);
+
+#endif